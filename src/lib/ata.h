@@ -7,6 +7,8 @@
 extern "C" {
 #endif
 
+#include <stdint.h>
+
 /** Command Block registers */
 enum
 {
@@ -94,6 +96,47 @@ enum
     ATA_WRITE_BUFFER = 0xe8,
 };
 
+/** Protocols */
+enum
+{
+    ATA_PROTOCOL_NON_DATA,
+    ATA_PROTOCOL_PIO_DATA_IN,
+    ATA_PROTOCOL_PIO_DATA_OUT,
+    ATA_PROTOCOL_DMA_IN,
+    ATA_PROTOCOL_DMA_OUT,
+};
+
+/** Taskfile registers to be written */
+enum
+{
+    ATA_TASKFILE_FEATURES = (1 << 0),
+    ATA_TASKFILE_SECTOR_COUNT = (1 << 1),
+    ATA_TASKFILE_LBA_LOW = (1 << 2),
+    ATA_TASKFILE_LBA_MID = (1 << 3),
+    ATA_TASKFILE_LBA_HIGH = (1 << 4),
+    ATA_TASKFILE_DEVICE = (1 << 5),
+    /* Also write the previous contents (i.e., for the 48-bit address feature
+       set) of the Features, Sector Count, and LBA registers. */
+    ATA_TASKFILE_HOB = (1 << 6),
+};
+
+/** Taskfile */
+typedef struct ata_taskfile {
+    uint8_t registers; /**< Registers to be written (i.e., ATA_TASKFILE_*). */
+    uint8_t features;
+    uint8_t features_hob;
+    uint8_t sector_count;
+    uint8_t sector_count_hob;
+    uint8_t lba_low;
+    uint8_t lba_low_hob;
+    uint8_t lba_mid;
+    uint8_t lba_mid_hob;
+    uint8_t lba_high;
+    uint8_t lba_high_hob;
+    uint8_t device;
+    uint8_t command;
+} ata_taskfile_t;
+
 #ifdef __cplusplus
 }
 #endif
@@ -5,7 +5,9 @@
 #include "ata.h"
 #include "ata_device.h"
 #include "bus_master.h"
+#include "deadline.h"
 #include "dma_buffer.h"
+#include "io_stats.h"
 #include "pci_device.h"
 
 #include <errno.h>
@@ -17,26 +19,170 @@
 
 #include <sys/mman.h>
 
+/* Each PRDT template has a fixed-size slot in the PRDT buffer, so it never
+   crosses a 64K boundary. The scatter-gather PRDT takes the end of the PRDT
+   buffer. */
+#define PRDT_TEMPLATE_NUM_PRDS 16
+#define MAX_PRDT_TEMPLATES ((BM_IDE_MAX_NUM_PRDS - ATA_CONTROLLER_MAX_SG_PRDS) / PRDT_TEMPLATE_NUM_PRDS)
+#define SG_PRDT_INDEX (MAX_PRDT_TEMPLATES * PRDT_TEMPLATE_NUM_PRDS)
+/* The DMA commands alternate between the DMA contexts, so the next payload
+   can be prepared in one while the other may still be in flight. */
+#define NUM_DMA_CONTEXTS 2
+
 struct _ata_controller {
-    int bus;
-    int device;
-    int function;
+    pci_backend_t *pci_backend;
+    io_stats_t *io_stats;
+    irq_t *irq;
+    latency_t *latency;
+    int bus_num;
+    int region_num;
+    /* Offset of the Bus Master IDE registers of the channel */
+    int bm_offset;
+    int timeout;
+    bool is_device_shadowed;
+    bool is_bm_command_shadowed;
     bool is_dma_enabled;
     pci_device_t *pci_device;
     ata_device_t *ata_device;
     ata_device_t *ata_device0;
     ata_device_t *ata_device1;
     dma_buffer_t *dma_buffer0;
+    /* DMA buffer of the current DMA context */
     dma_buffer_t *dma_buffer1;
     struct prd *prdt;
+    /* Mapped DMA buffer of the current DMA context */
     void *buffer;
+    dma_buffer_t *context_dma_buffers[NUM_DMA_CONTEXTS];
+    void *context_buffers[NUM_DMA_CONTEXTS];
+    int context_num;
+    ata_controller_idle_handler_t *idle_handler;
+    void *idle_arg;
+    /* Pool of DMA buffers for the scatter-gather layouts, starting with
+       those of the DMA contexts */
+    dma_buffer_t *sg_dma_buffers[ATA_CONTROLLER_MAX_SG_BUFFERS];
+    size_t num_sg_buffers;
+    /* Whether the scatter-gather PRDT is used by the next DMA command */
+    bool is_sg_layout_set;
+    /* Whether the scatter-gather PRDT is used by the current DMA command */
+    bool is_sg_transfer;
+    /* First overrun of the canary of a DMA buffer by the last DMA command */
+    bool is_dma_overrun;
+    uint8_t overrun_command;
+    size_t overrun_buffer_num;
+    ptrdiff_t overrun_offset;
+    /* DMA context and transfer length of each PRDT template, or -1 if the
+       slot is empty */
+    int64_t prdt_templates[MAX_PRDT_TEMPLATES];
+    /* What was last written to the PRDT Pointer register */
+    uint32_t prdt_pointer;
 };
 
 static ata_controller_error_handler_t *error_handler = NULL;
 
+void ata_controller_check_dma_canaries(ata_controller_t *restrict ata_controller, uint8_t command, uint32_t count);
 void ata_controller_error(
         ata_controller_t *restrict ata_controller, int status, int error, const char *restrict format, ...);
-void ata_controller_prepare_prdt(ata_controller_t *restrict ata_controller, uint32_t count);
+void ata_controller_fini(ata_controller_t *restrict ata_controller);
+int ata_controller_init(ata_controller_t *restrict ata_controller);
+void ata_controller_prepare_dma(ata_controller_t *restrict ata_controller, bool is_write, uint32_t count);
+uint32_t ata_controller_prepare_prdt(ata_controller_t *restrict ata_controller, uint32_t count);
+void ata_controller_switch_dma_context(ata_controller_t *restrict ata_controller);
+
+void
+ata_controller_bus_master_stop(ata_controller_t *restrict ata_controller)
+{
+    if (pci_device_region_get_size(ata_controller->pci_device, 4) == 0) {
+        return;
+    }
+
+    /* Stop the bus master, and acknowledge its interrupt and error (i.e.,
+       write one to clear) */
+    io_stats_set_phase(ata_controller->io_stats, IO_STATS_PHASE_RESET);
+    pci_device_region_write8(ata_controller->pci_device, 4, ata_controller->bm_offset + BM_IDE_COMMAND0,
+            pci_device_region_read8(ata_controller->pci_device, 4, ata_controller->bm_offset + BM_IDE_COMMAND0)
+                    & ~BM_IDE_START);
+    uint8_t status = pci_device_region_read8(ata_controller->pci_device, 4, ata_controller->bm_offset + BM_IDE_STATUS0);
+    pci_device_region_write8(ata_controller->pci_device, 4, ata_controller->bm_offset + BM_IDE_STATUS0,
+            (status & (BM_IDE_DRIVE0_DMA | BM_IDE_DRIVE1_DMA)) | BM_IDE_INTERRUPT | BM_IDE_ERROR);
+}
+
+void
+ata_controller_check_dma_canaries(ata_controller_t *restrict ata_controller, uint8_t command, uint32_t count)
+{
+    /* A scatter-gather transfer may land anywhere in the payloads of the pool,
+       so only the canary zones of its DMA buffers are checked */
+    for (size_t i = 0; i < ata_controller->num_sg_buffers; ++i) {
+        dma_buffer_t *dma_buffer = ata_controller->sg_dma_buffers[i];
+        if (!ata_controller->is_sg_transfer && dma_buffer != ata_controller->dma_buffer1) {
+            continue;
+        }
+
+        size_t offset
+                = ata_controller->is_sg_transfer ? dma_buffer_get_size(dma_buffer) : ata_controller_get_dma_size(count);
+        ptrdiff_t corrupted_offset;
+        if (!dma_buffer_check_canary(dma_buffer, offset, &corrupted_offset) && !ata_controller->is_dma_overrun) {
+            ata_controller->is_dma_overrun = true;
+            ata_controller->overrun_command = command;
+            ata_controller->overrun_buffer_num = i;
+            ata_controller->overrun_offset = corrupted_offset;
+        }
+    }
+}
+
+int
+ata_controller_command(ata_controller_t *restrict ata_controller, const ata_taskfile_t *restrict taskfile,
+        int protocol, uint16_t *data, uint32_t count)
+{
+    /* Does the data fit in the DMA buffer? */
+    if ((protocol == ATA_PROTOCOL_DMA_IN || protocol == ATA_PROTOCOL_DMA_OUT) && count > ATA_CONTROLLER_MAX_DMA_SIZE) {
+        errno = EINVAL;
+        ata_controller_error(ata_controller, 0, errno, __func__);
+        return -1;
+    }
+
+    switch (protocol) {
+    case ATA_PROTOCOL_DMA_IN: {
+        if (!ata_controller->is_dma_enabled) {
+            errno = ENOTSUP;
+            ata_controller_error(ata_controller, 0, errno, __func__);
+            return -1;
+        }
+
+        ata_controller_prepare_dma(ata_controller, true, count);
+        int result = ata_device_command(ata_controller->ata_device, taskfile, protocol, data, count);
+        /* Copy data from the DMA buffer, unless it's a view of the DMA
+           buffer */
+        if (data != ata_controller->buffer) {
+            memcpy(data, ata_controller->buffer, count);
+        }
+
+        ata_controller_check_dma_canaries(ata_controller, taskfile->command, count);
+        ata_controller_switch_dma_context(ata_controller);
+        return result;
+    }
+
+    case ATA_PROTOCOL_DMA_OUT: {
+        if (!ata_controller->is_dma_enabled) {
+            errno = ENOTSUP;
+            ata_controller_error(ata_controller, 0, errno, __func__);
+            return -1;
+        }
+
+        /* Copy data to the DMA buffer, unless it's a view of the DMA buffer */
+        if (data != ata_controller->buffer) {
+            memcpy(ata_controller->buffer, data, count);
+        }
+
+        ata_controller_prepare_dma(ata_controller, false, count);
+        int result = ata_device_command(ata_controller->ata_device, taskfile, protocol, data, count);
+        ata_controller_switch_dma_context(ata_controller);
+        return result;
+    }
+
+    default:
+        return ata_device_command(ata_controller->ata_device, taskfile, protocol, data, count);
+    }
+}
 
 int
 ata_controller_command_execute_device_diagnostic(ata_controller_t *restrict ata_controller)
@@ -66,32 +212,34 @@ int
 ata_controller_command_read_dma(
         ata_controller_t *restrict ata_controller, uint8_t sectors, uint32_t lba, uint16_t *data, uint32_t count)
 {
-    /* Prepare the Physical Region Descriptor Table (PRDT) */
-    ata_controller_prepare_prdt(ata_controller, count);
-    /* Set the PRDT Pointer to the PRDT address */
-    pci_device_region_write32(
-            ata_controller->pci_device, 4, BM_IDE_PRDT0, dma_buffer_get_phys_addr(ata_controller->dma_buffer0));
-    /* Set the direction of the bus master transfer */
-    pci_device_region_write8(ata_controller->pci_device, 4, BM_IDE_COMMAND0,
-            pci_device_region_read8(ata_controller->pci_device, 4, BM_IDE_COMMAND0) | BM_IDE_WRITE);
+    ata_controller_prepare_dma(ata_controller, true, count);
     /* Send the DMA transfer command to the device */
-    return ata_device_command_read_dma(ata_controller->ata_device, sectors, lba);
+    int result = ata_device_command_read_dma(ata_controller->ata_device, sectors, lba);
+    /* Copy data from the DMA buffer, unless it's a view of the DMA buffer */
+    if (data != ata_controller->buffer) {
+        memcpy(data, ata_controller->buffer, count);
+    }
+
+    ata_controller_check_dma_canaries(ata_controller, ATA_READ_DMA, count);
+    ata_controller_switch_dma_context(ata_controller);
+    return result;
 }
 
 int
 ata_controller_command_read_dma_ext(
         ata_controller_t *restrict ata_controller, uint16_t sectors, uint64_t lba, uint16_t *data, uint32_t count)
 {
-    /* Prepare the Physical Region Descriptor Table (PRDT) */
-    ata_controller_prepare_prdt(ata_controller, count);
-    /* Set the PRDT Pointer to the PRDT address */
-    pci_device_region_write32(
-            ata_controller->pci_device, 4, BM_IDE_PRDT0, dma_buffer_get_phys_addr(ata_controller->dma_buffer0));
-    /* Set the direction of the bus master transfer */
-    pci_device_region_write8(ata_controller->pci_device, 4, BM_IDE_COMMAND0,
-            pci_device_region_read8(ata_controller->pci_device, 4, BM_IDE_COMMAND0) | BM_IDE_WRITE);
+    ata_controller_prepare_dma(ata_controller, true, count);
     /* Send the DMA transfer command to the device */
-    return ata_device_command_read_dma_ext(ata_controller->ata_device, sectors, lba);
+    int result = ata_device_command_read_dma_ext(ata_controller->ata_device, sectors, lba);
+    /* Copy data from the DMA buffer, unless it's a view of the DMA buffer */
+    if (data != ata_controller->buffer) {
+        memcpy(data, ata_controller->buffer, count);
+    }
+
+    ata_controller_check_dma_canaries(ata_controller, ATA_READ_DMA_EXT, count);
+    ata_controller_switch_dma_context(ata_controller);
+    return result;
 }
 
 int
@@ -157,36 +305,32 @@ int
 ata_controller_command_write_dma(
         ata_controller_t *restrict ata_controller, uint8_t sectors, uint32_t lba, const uint16_t *data, uint32_t count)
 {
-    /* Copy data to the DMA buffer */
-    memcpy(ata_controller->buffer, data, count);
-    /* Prepare the Physical Region Descriptor Table (PRDT) */
-    ata_controller_prepare_prdt(ata_controller, count);
-    /* Set the PRDT Pointer to the PRDT address */
-    pci_device_region_write32(
-            ata_controller->pci_device, 4, BM_IDE_PRDT0, dma_buffer_get_phys_addr(ata_controller->dma_buffer0));
-    /* Set the direction of the bus master transfer */
-    pci_device_region_write8(ata_controller->pci_device, 4, BM_IDE_COMMAND0,
-            pci_device_region_read8(ata_controller->pci_device, 4, BM_IDE_COMMAND0) & ~BM_IDE_WRITE);
+    /* Copy data to the DMA buffer, unless it's a view of the DMA buffer */
+    if (data != ata_controller->buffer) {
+        memcpy(ata_controller->buffer, data, count);
+    }
+
+    ata_controller_prepare_dma(ata_controller, false, count);
     /* Send the DMA transfer command to the device */
-    return ata_device_command_write_dma(ata_controller->ata_device, sectors, lba);
+    int result = ata_device_command_write_dma(ata_controller->ata_device, sectors, lba);
+    ata_controller_switch_dma_context(ata_controller);
+    return result;
 }
 
 int
 ata_controller_command_write_dma_ext(
         ata_controller_t *restrict ata_controller, uint16_t sectors, uint64_t lba, const uint16_t *data, uint32_t count)
 {
-    /* Copy data to the DMA buffer */
-    memcpy(ata_controller->buffer, data, count);
-    /* Prepare the Physical Region Descriptor Table (PRDT) */
-    ata_controller_prepare_prdt(ata_controller, count);
-    /* Set the PRDT Pointer to the PRDT address */
-    pci_device_region_write32(
-            ata_controller->pci_device, 4, BM_IDE_PRDT0, dma_buffer_get_phys_addr(ata_controller->dma_buffer0));
-    /* Set the direction of the bus master transfer */
-    pci_device_region_write8(ata_controller->pci_device, 4, BM_IDE_COMMAND0,
-            pci_device_region_read8(ata_controller->pci_device, 4, BM_IDE_COMMAND0) & ~BM_IDE_WRITE);
+    /* Copy data to the DMA buffer, unless it's a view of the DMA buffer */
+    if (data != ata_controller->buffer) {
+        memcpy(ata_controller->buffer, data, count);
+    }
+
+    ata_controller_prepare_dma(ata_controller, false, count);
     /* Send the DMA transfer command to the device */
-    return ata_device_command_write_dma_ext(ata_controller->ata_device, sectors, lba);
+    int result = ata_device_command_write_dma_ext(ata_controller->ata_device, sectors, lba);
+    ata_controller_switch_dma_context(ata_controller);
+    return result;
 }
 
 int
@@ -243,7 +387,7 @@ ata_controller_command_write_buffer(ata_controller_t *restrict ata_controller, c
 }
 
 ata_controller_t *
-ata_controller_create(int bus, int device, int function, int bus_num, int timeout)
+ata_controller_create(pci_backend_t *pci_backend, int bus_num, int timeout)
 {
     ata_controller_t *ata_controller = (ata_controller_t *)calloc(1, sizeof(*ata_controller));
     if (ata_controller == NULL) {
@@ -257,81 +401,21 @@ ata_controller_create(int bus, int device, int function, int bus_num, int timeou
         goto err;
     }
 
-    ata_controller->bus = bus;
-    ata_controller->device = device;
-    ata_controller->function = function;
-    ata_controller->pci_device
-            = pci_device_create(ata_controller->bus, ata_controller->device, ata_controller->function);
-    if (ata_controller->pci_device == NULL) {
-        ata_controller_error(ata_controller, 0, errno, __func__);
-        goto err;
-    }
-
-    /* Is the PCI device an ATA/IDE controller? */
-    if (!pci_device_is_ata_controller(ata_controller->pci_device)) {
-        ata_controller_error(ata_controller, 0, 0, "%s: Not an ATA/IDE controller.\n", __func__);
+    ata_controller->pci_backend = pci_backend;
+    ata_controller->bus_num = bus_num;
+    ata_controller->region_num = (bus_num ? 2 : 0);
+    ata_controller->bm_offset = BM_IDE_CHANNEL_OFFSET(bus_num);
+    ata_controller->timeout = timeout;
+    ata_controller->is_device_shadowed = true;
+    ata_controller->is_bm_command_shadowed = true;
+    if (ata_controller_init(ata_controller) == -1) {
         goto err;
     }
 
-    ata_controller_device_select(ata_controller, 0);
-    ata_controller->ata_device0 = ata_device_create(ata_controller->pci_device, bus_num, timeout);
-    if (ata_controller->ata_device0 == NULL) {
-        ata_controller_error(ata_controller, 0, errno, __func__);
-        goto err;
-    }
-
-    ata_controller_device_select(ata_controller, 1);
-    ata_controller->ata_device1 = ata_device_create(ata_controller->pci_device, bus_num, timeout);
-    if (ata_controller->ata_device1 == NULL) {
-        ata_controller_error(ata_controller, 0, errno, __func__);
-        goto err;
-    }
-
-    if (ata_controller->ata_device0 == NULL && ata_controller->ata_device1 == NULL) {
-        ata_controller_error(ata_controller, 0, 0, "%s: No ATA device.\n", __func__);
-        goto err;
-    }
-
-    ata_controller->ata_device = ata_controller->ata_device0;
-    ata_controller_device_select(ata_controller, 0);
-    if (ata_controller->ata_device0 == NULL) {
-        ata_controller->ata_device = ata_controller->ata_device1;
-        ata_controller_device_select(ata_controller, 1);
-    }
-
-    if (dma_buffer_is_enabled()) {
-        ata_controller->is_dma_enabled = true;
-
-        ata_controller->dma_buffer0 = dma_buffer_create(BM_IDE_MAX_PRDT_SIZE);
-        if (ata_controller->dma_buffer0 == NULL) {
-            ata_controller_error(ata_controller, 0, errno, __func__);
-            goto err;
-        }
-
-        ata_controller->prdt = dma_buffer_map(ata_controller->dma_buffer0, PROT_READ | PROT_WRITE);
-        if (ata_controller->prdt == NULL) {
-            ata_controller_error(ata_controller, 0, errno, __func__);
-            goto err;
-        }
-
-        ata_controller->dma_buffer1 = dma_buffer_create(0x10000);
-        if (ata_controller->dma_buffer1 == NULL) {
-            ata_controller_error(ata_controller, 0, errno, __func__);
-            goto err;
-        }
-
-        ata_controller->buffer = dma_buffer_map(ata_controller->dma_buffer1, PROT_READ | PROT_WRITE);
-        if (ata_controller->buffer == NULL) {
-            ata_controller_error(ata_controller, 0, errno, __func__);
-            goto err;
-        }
-    }
-
     return ata_controller;
 
 err:
     ata_controller_destroy(ata_controller);
-    free(ata_controller);
     return NULL;
 }
 
@@ -342,61 +426,85 @@ ata_controller_destroy(ata_controller_t *restrict ata_controller)
         return;
     }
 
-    dma_buffer_unmap(ata_controller->dma_buffer1, ata_controller->buffer);
-    dma_buffer_unmap(ata_controller->dma_buffer0, ata_controller->prdt);
-    dma_buffer_destroy(ata_controller->dma_buffer1);
-    dma_buffer_destroy(ata_controller->dma_buffer0);
-    ata_device_destroy(ata_controller->ata_device1);
-    ata_device_destroy(ata_controller->ata_device0);
-    pci_device_destroy(ata_controller->pci_device);
+    ata_controller_fini(ata_controller);
     free(ata_controller);
 }
 
-void
+int
 ata_controller_device_reset(ata_controller_t *restrict ata_controller)
 {
     /* Request the devices to perform the software reset */
-    pci_device_region_write8(ata_controller->pci_device, 1, ATA_DEVICE_CONTROL, ATA_nIEN | ATA_SRST);
-    /* Reset Device Control SRST bit to zero after software reset */
-    pci_device_region_write8(ata_controller->pci_device, 1, ATA_DEVICE_CONTROL, ATA_nIEN);
+    io_stats_set_phase(ata_controller->io_stats, IO_STATS_PHASE_RESET);
+    pci_device_region_write8(
+            ata_controller->pci_device, ata_controller->region_num + 1, ATA_DEVICE_CONTROL, ATA_nIEN | ATA_SRST);
+    /* Reset Device Control SRST bit to zero after software reset, and leave
+       the nIEN bit as the devices expect it (i.e., they don't write the
+       Device Control register again until the interrupt request changes) */
+    pci_device_region_write8(ata_controller->pci_device, ata_controller->region_num + 1, ATA_DEVICE_CONTROL,
+            (ata_controller->irq != NULL) ? 0 : ATA_nIEN);
+    /* The software reset also resets the Command Block registers */
+    pci_device_region_invalidate(ata_controller->pci_device, ata_controller->region_num);
+    if (ata_controller->ata_device0 != NULL) {
+        ata_device_invalidate(ata_controller->ata_device0);
+    }
+
+    if (ata_controller->ata_device1 != NULL) {
+        ata_device_invalidate(ata_controller->ata_device1);
+    }
+
     /* Wait until the software reset has been completed */
+    deadline_t deadline;
+    deadline_start(&deadline, ata_controller->timeout * DEADLINE_NS_PER_SEC);
     for (;;) {
         /* Is the device busy? */
-        uint16_t status = pci_device_region_read8(ata_controller->pci_device, 0, ATA_STATUS);
+        uint16_t status = pci_device_region_read8(ata_controller->pci_device, ata_controller->region_num, ATA_STATUS);
         if ((status & ATA_BSY) == 0) {
-            break;
+            return 0;
+        }
+
+        /* Has the software reset timed out? */
+        if (!deadline_wait(&deadline)) {
+            errno = ETIMEDOUT;
+            return -1;
         }
     }
 }
 
-void
+int
 ata_controller_device_select(ata_controller_t *restrict ata_controller, int device_num)
 {
     if (device_num < 0 || device_num > 1) {
         errno = EINVAL;
         ata_controller_error(ata_controller, 0, errno, __func__);
-        return;
+        return -1;
     }
 
     if (ata_controller->ata_device0 == NULL || ata_controller->ata_device1 == NULL) {
-        return;
+        return 0;
     }
 
+    io_stats_set_phase(ata_controller->io_stats, IO_STATS_PHASE_RESET);
     ata_controller->ata_device = (device_num ? ata_controller->ata_device1 : ata_controller->ata_device0);
-    if (device_num == 1) {
-        pci_device_region_write8(ata_controller->pci_device, 0, ATA_DEVICE,
-                pci_device_region_read8(ata_controller->pci_device, 0, ATA_DEVICE) | ATA_DEV);
-    } else {
-        pci_device_region_write8(ata_controller->pci_device, 0, ATA_DEVICE,
-                pci_device_region_read8(ata_controller->pci_device, 0, ATA_DEVICE) & ~ATA_DEV);
-    }
-
+    /* The Command Block registers are shared by the devices, so what was last
+       written to them through the other device is unknown to this device. */
+    ata_device_invalidate(ata_controller->ata_device);
+    uint8_t device = pci_device_region_read8(ata_controller->pci_device, ata_controller->region_num, ATA_DEVICE);
+    pci_device_region_write8(ata_controller->pci_device, ata_controller->region_num, ATA_DEVICE,
+            (device_num == 1) ? (device | ATA_DEV) : (device & ~ATA_DEV));
     /* Wait until the device select has been completed */
+    deadline_t deadline;
+    deadline_start(&deadline, ata_controller->timeout * DEADLINE_NS_PER_SEC);
     for (;;) {
         /* Is the device busy? */
-        uint16_t status = pci_device_region_read8(ata_controller->pci_device, 0, ATA_STATUS);
+        uint16_t status = pci_device_region_read8(ata_controller->pci_device, ata_controller->region_num, ATA_STATUS);
         if ((status & ATA_BSY) == 0) {
-            break;
+            return 0;
+        }
+
+        /* Has the device select timed out? */
+        if (!deadline_wait(&deadline)) {
+            errno = ETIMEDOUT;
+            return -1;
         }
     }
 }
@@ -414,6 +522,229 @@ ata_controller_error(ata_controller_t *restrict ata_controller, int status, int
     va_end(ap);
 }
 
+void
+ata_controller_fini(ata_controller_t *restrict ata_controller)
+{
+    ata_controller_fini_dma(ata_controller);
+    ata_device_destroy(ata_controller->ata_device1);
+    ata_device_destroy(ata_controller->ata_device0);
+    pci_device_destroy(ata_controller->pci_device);
+    ata_controller->pci_device = NULL;
+    ata_controller->ata_device = NULL;
+    ata_controller->ata_device0 = NULL;
+    ata_controller->ata_device1 = NULL;
+}
+
+void
+ata_controller_fini_dma(ata_controller_t *restrict ata_controller)
+{
+    /* The DMA buffers are destroyed in the reverse order of their creation */
+    for (size_t i = ata_controller->num_sg_buffers; i > NUM_DMA_CONTEXTS; --i) {
+        dma_buffer_destroy(ata_controller->sg_dma_buffers[i - 1]);
+        ata_controller->sg_dma_buffers[i - 1] = NULL;
+    }
+
+    for (int context_num = NUM_DMA_CONTEXTS - 1; context_num >= 0; --context_num) {
+        dma_buffer_unmap(
+                ata_controller->context_dma_buffers[context_num], ata_controller->context_buffers[context_num]);
+        dma_buffer_destroy(ata_controller->context_dma_buffers[context_num]);
+        ata_controller->context_dma_buffers[context_num] = NULL;
+        ata_controller->context_buffers[context_num] = NULL;
+    }
+
+    dma_buffer_unmap(ata_controller->dma_buffer0, ata_controller->prdt);
+    dma_buffer_destroy(ata_controller->dma_buffer0);
+    ata_controller->is_dma_enabled = false;
+    ata_controller->dma_buffer0 = NULL;
+    ata_controller->dma_buffer1 = NULL;
+    ata_controller->prdt = NULL;
+    ata_controller->buffer = NULL;
+    for (int context_num = 0; context_num < NUM_DMA_CONTEXTS; ++context_num) {
+        ata_controller->sg_dma_buffers[context_num] = NULL;
+    }
+
+    ata_controller->num_sg_buffers = 0;
+    ata_controller->is_sg_layout_set = false;
+}
+
+uint8_t
+ata_controller_get_bm_status(ata_controller_t *restrict ata_controller)
+{
+    return ata_device_get_bm_status(ata_controller->ata_device);
+}
+
+int
+ata_controller_init(ata_controller_t *restrict ata_controller)
+{
+    ata_controller->pci_device = pci_device_create(ata_controller->pci_backend);
+    if (ata_controller->pci_device == NULL) {
+        ata_controller_error(ata_controller, 0, errno, __func__);
+        return -1;
+    }
+
+    /* Is the PCI device an ATA/IDE controller? */
+    if (!pci_device_is_ata_controller(ata_controller->pci_device)) {
+        ata_controller_error(ata_controller, 0, 0, "%s: Not an ATA/IDE controller.\n", __func__);
+        return -1;
+    }
+
+    /* Read-modify-writes of the Bus Master IDE Command registers are served
+       from the shadow. */
+    if (pci_device_region_get_size(ata_controller->pci_device, 4) > 0) {
+        pci_device_region_set_shadowed(
+                ata_controller->pci_device, 4, BM_IDE_COMMAND0, ata_controller->is_bm_command_shadowed);
+        pci_device_region_set_shadowed(
+                ata_controller->pci_device, 4, BM_IDE_COMMAND1, ata_controller->is_bm_command_shadowed);
+    }
+
+    ata_controller_device_select(ata_controller, 0);
+    ata_controller->ata_device0
+            = ata_device_create(ata_controller->pci_device, ata_controller->bus_num, ata_controller->timeout);
+    if (ata_controller->ata_device0 == NULL) {
+        ata_controller_error(ata_controller, 0, errno, __func__);
+        return -1;
+    }
+
+    ata_controller_device_select(ata_controller, 1);
+    ata_controller->ata_device1
+            = ata_device_create(ata_controller->pci_device, ata_controller->bus_num, ata_controller->timeout);
+    if (ata_controller->ata_device1 == NULL) {
+        ata_controller_error(ata_controller, 0, errno, __func__);
+        return -1;
+    }
+
+    if (ata_controller->ata_device0 == NULL && ata_controller->ata_device1 == NULL) {
+        ata_controller_error(ata_controller, 0, 0, "%s: No ATA device.\n", __func__);
+        return -1;
+    }
+
+    ata_controller->ata_device = ata_controller->ata_device0;
+    ata_controller_device_select(ata_controller, 0);
+    if (ata_controller->ata_device0 == NULL) {
+        ata_controller->ata_device = ata_controller->ata_device1;
+        ata_controller_device_select(ata_controller, 1);
+    }
+
+    /* Do without DMA if its memory can't be set up (e.g., the physical
+       addresses of the hugepages can't be resolved without CAP_SYS_ADMIN) */
+    if (dma_buffer_is_enabled() && ata_controller_init_dma(ata_controller) == -1) {
+        ata_controller_fini_dma(ata_controller);
+    }
+
+    /* Restore the settings of a previous initialization */
+    ata_controller_set_register_shadowed(
+            ata_controller, ATA_CONTROLLER_REGISTER_DEVICE, ata_controller->is_device_shadowed);
+    ata_controller_set_io_stats(ata_controller, ata_controller->io_stats);
+    ata_controller_set_irq(ata_controller, ata_controller->irq);
+    ata_controller_set_latency(ata_controller, ata_controller->latency);
+    ata_controller_set_idle_handler(ata_controller, ata_controller->idle_handler, ata_controller->idle_arg);
+    return 0;
+}
+
+int
+ata_controller_init_dma(ata_controller_t *restrict ata_controller)
+{
+    ata_controller->dma_buffer0 = dma_buffer_create(BM_IDE_MAX_PRDT_SIZE);
+    if (ata_controller->dma_buffer0 == NULL) {
+        return -1;
+    }
+
+    ata_controller->prdt = dma_buffer_map(ata_controller->dma_buffer0, PROT_READ | PROT_WRITE);
+    if (ata_controller->prdt == NULL) {
+        return -1;
+    }
+
+    for (int context_num = 0; context_num < NUM_DMA_CONTEXTS; ++context_num) {
+        ata_controller->context_dma_buffers[context_num]
+                = dma_buffer_create_with_canary(ATA_CONTROLLER_MAX_DMA_SIZE);
+        if (ata_controller->context_dma_buffers[context_num] == NULL) {
+            return -1;
+        }
+
+        ata_controller->context_buffers[context_num]
+                = dma_buffer_map(ata_controller->context_dma_buffers[context_num], PROT_READ | PROT_WRITE);
+        if (ata_controller->context_buffers[context_num] == NULL) {
+            return -1;
+        }
+
+        ata_controller->sg_dma_buffers[context_num] = ata_controller->context_dma_buffers[context_num];
+        ata_controller->num_sg_buffers = context_num + 1;
+    }
+
+    ata_controller->context_num = NUM_DMA_CONTEXTS - 1;
+    ata_controller_switch_dma_context(ata_controller);
+    /* Pool more DMA buffers for the scatter-gather layouts, as long as
+       the DMA memory lasts */
+    while (ata_controller->num_sg_buffers < ATA_CONTROLLER_MAX_SG_BUFFERS
+            && dma_buffer_get_max_free_size() >= ATA_CONTROLLER_MAX_DMA_SIZE) {
+        dma_buffer_t *dma_buffer = dma_buffer_create_with_canary(ATA_CONTROLLER_MAX_DMA_SIZE);
+        if (dma_buffer == NULL) {
+            return -1;
+        }
+
+        ata_controller->sg_dma_buffers[ata_controller->num_sg_buffers++] = dma_buffer;
+    }
+
+    /* No PRDT template has been built, and the PRDT Pointer is unknown */
+    for (size_t i = 0; i < MAX_PRDT_TEMPLATES; ++i) {
+        ata_controller->prdt_templates[i] = -1;
+    }
+
+    ata_controller->prdt_pointer = 0;
+    ata_controller->is_dma_enabled = true;
+    return 0;
+}
+
+void *
+ata_controller_get_dma_buffer(ata_controller_t *restrict ata_controller)
+{
+    return ata_controller->buffer;
+}
+
+bool
+ata_controller_get_dma_overrun(ata_controller_t *restrict ata_controller, uint8_t *restrict command,
+        size_t *restrict buffer_num, ptrdiff_t *restrict offset)
+{
+    if (!ata_controller->is_dma_overrun) {
+        return false;
+    }
+
+    *command = ata_controller->overrun_command;
+    *buffer_num = ata_controller->overrun_buffer_num;
+    *offset = ata_controller->overrun_offset;
+    return true;
+}
+
+uint32_t
+ata_controller_get_dma_size(uint32_t count)
+{
+    return (count & ~(uint32_t)1) ? (count & ~(uint32_t)1) : 0x10000;
+}
+
+uint8_t
+ata_controller_get_error(ata_controller_t *restrict ata_controller)
+{
+    return ata_device_get_error(ata_controller->ata_device);
+}
+
+const uint16_t *
+ata_controller_get_identify_data(ata_controller_t *restrict ata_controller)
+{
+    return ata_device_get_identify_data(ata_controller->ata_device);
+}
+
+size_t
+ata_controller_get_num_sg_buffers(ata_controller_t *restrict ata_controller)
+{
+    return ata_controller->num_sg_buffers;
+}
+
+uint8_t
+ata_controller_get_status(ata_controller_t *restrict ata_controller)
+{
+    return ata_device_get_status(ata_controller->ata_device);
+}
+
 bool
 ata_controller_is_dma_enabled(ata_controller_t *restrict ata_controller)
 {
@@ -421,26 +752,187 @@ ata_controller_is_dma_enabled(ata_controller_t *restrict ata_controller)
 }
 
 void
+ata_controller_prepare_dma(ata_controller_t *restrict ata_controller, bool is_write, uint32_t count)
+{
+    /* Switch in the Physical Region Descriptor Table (PRDT) of the transfer
+       length by setting the PRDT Pointer */
+    io_stats_set_phase(ata_controller->io_stats, IO_STATS_PHASE_SETUP);
+    uint32_t prdt_pointer;
+    ata_controller->is_sg_transfer = ata_controller->is_sg_layout_set;
+    ata_controller->is_dma_overrun = false;
+    if (ata_controller->is_sg_layout_set) {
+        /* The scatter-gather PRDT is used only once */
+        prdt_pointer = dma_buffer_get_phys_addr(ata_controller->dma_buffer0) + SG_PRDT_INDEX * sizeof(struct prd);
+        ata_controller->is_sg_layout_set = false;
+    } else {
+        prdt_pointer = ata_controller_prepare_prdt(ata_controller, count);
+    }
+
+    if (prdt_pointer != ata_controller->prdt_pointer) {
+        pci_device_region_write32(
+                ata_controller->pci_device, 4, ata_controller->bm_offset + BM_IDE_PRDT0, prdt_pointer);
+        ata_controller->prdt_pointer = prdt_pointer;
+    }
+
+    /* Plant the canary after the transfer into the DMA buffer, where an
+       overrun lands first */
+    if (is_write && !ata_controller->is_sg_transfer) {
+        dma_buffer_plant_canary(ata_controller->dma_buffer1, ata_controller_get_dma_size(count));
+    }
+
+    /* Set the direction of the bus master transfer (i.e., whether the bus
+       master writes to memory) */
+    uint8_t command
+            = pci_device_region_read8(ata_controller->pci_device, 4, ata_controller->bm_offset + BM_IDE_COMMAND0);
+    pci_device_region_write8(ata_controller->pci_device, 4, ata_controller->bm_offset + BM_IDE_COMMAND0,
+            is_write ? (command | BM_IDE_WRITE) : (command & ~BM_IDE_WRITE));
+}
+
+uint32_t
 ata_controller_prepare_prdt(ata_controller_t *restrict ata_controller, uint32_t count)
 {
-    uint32_t prdt_address = dma_buffer_get_phys_addr(ata_controller->dma_buffer1);
-    uint32_t prdt_count = count;
-    for (size_t i = 0; i < BM_IDE_MAX_NUM_PRDS; ++i) {
-        /* Calculate the maximum number of bytes that can be transferred */
-        uint32_t max = 0x10000 - (prdt_address & 0xffff);
-        uint32_t count = (prdt_count > max) ? max : prdt_count;
-        ata_controller->prdt[i].address = prdt_address;
-        ata_controller->prdt[i].count = count;
-        prdt_address += count;
-        prdt_count -= count;
+    /* Is the PRDT template of the transfer length already built for the DMA
+       buffer of the current DMA context? */
+    int64_t key = ((int64_t)ata_controller->context_num << 32) | count;
+    size_t template_num = ((uint32_t)(count * 2654435761u) + ata_controller->context_num) % MAX_PRDT_TEMPLATES;
+    struct prd *prdt = &ata_controller->prdt[template_num * PRDT_TEMPLATE_NUM_PRDS];
+    uint32_t prdt_pointer = dma_buffer_get_phys_addr(ata_controller->dma_buffer0)
+                            + template_num * PRDT_TEMPLATE_NUM_PRDS * sizeof(*prdt);
+    if (ata_controller->prdt_templates[template_num] == key) {
+        return prdt_pointer;
+    }
+
+    /* Build the PRDT template from scratch so no reserved or EOT bits of an
+       evicted template are left over */
+    memset(prdt, 0, PRDT_TEMPLATE_NUM_PRDS * sizeof(*prdt));
+    uint32_t prd_address = dma_buffer_get_phys_addr(ata_controller->dma_buffer1);
+    uint32_t prd_count = count;
+    for (size_t i = 0; i < PRDT_TEMPLATE_NUM_PRDS; ++i) {
+        /* Calculate the maximum number of bytes that can be transferred
+           without crossing a 64K boundary (a count of zero is 64K) */
+        uint32_t max = 0x10000 - (prd_address & 0xffff);
+        uint32_t size = (prd_count > max) ? max : prd_count;
+        /* Don't leave a last PRD of one byte, which is 64K if bit 0 of the
+           count is ignored (as by QEMU) */
+        if (prd_count - size == 1 && size > 2) {
+            size -= 2;
+        }
+
+        prdt[i].address = prd_address;
+        prdt[i].count = size;
+        prd_address += size;
+        prd_count -= size;
         /* Is the last PRD? */
-        if (prdt_count > 0) {
-            ata_controller->prdt[i].reserved = 0;
-        } else {
-            ata_controller->prdt[i].reserved |= 1 << 16;
+        if (prd_count == 0) {
+            prdt[i].reserved = BM_IDE_PRD_EOT;
             break;
         }
     }
+
+    /* Does the PRDT template fit in its slot? */
+    if (prd_count > 0) {
+        errno = E2BIG;
+        ata_controller_error(ata_controller, 0, errno, __func__);
+    }
+
+    ata_controller->prdt_templates[template_num] = key;
+    return prdt_pointer;
+}
+
+bool
+ata_controller_is_native(ata_controller_t *restrict ata_controller)
+{
+    return pci_device_is_ata_channel_native(ata_controller->pci_device, ata_controller->region_num / 2);
+}
+
+bool
+ata_controller_is_timed_out(ata_controller_t *restrict ata_controller)
+{
+    return ata_device_is_timed_out(ata_controller->ata_device);
+}
+
+int
+ata_controller_probe(ata_controller_t *restrict ata_controller)
+{
+    /* Does the PCI device still respond to configuration accesses? */
+    if (pci_backend_config_read16(ata_controller->pci_backend, 0) == 0xffff) {
+        errno = ENODEV;
+        return -1;
+    }
+
+    /* Enable the I/O space, memory space, and bus master decoding again */
+    uint16_t command = pci_backend_config_read16(ata_controller->pci_backend, 4);
+    pci_backend_config_write16(ata_controller->pci_backend, 4, command | 0x07);
+    return 0;
+}
+
+int
+ata_controller_reinitialize(ata_controller_t *restrict ata_controller)
+{
+    ata_controller_fini(ata_controller);
+    if (ata_controller_init(ata_controller) == -1) {
+        ata_controller_error(ata_controller, 0, errno, __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+void
+ata_controller_set_register_shadowed(ata_controller_t *restrict ata_controller, int reg, bool shadowed)
+{
+    switch (reg) {
+    case ATA_CONTROLLER_REGISTER_DEVICE:
+        ata_controller->is_device_shadowed = shadowed;
+        pci_device_region_set_shadowed(ata_controller->pci_device, 0, ATA_DEVICE, shadowed);
+        pci_device_region_set_shadowed(ata_controller->pci_device, 2, ATA_DEVICE, shadowed);
+        break;
+
+    case ATA_CONTROLLER_REGISTER_BM_IDE_COMMAND:
+        ata_controller->is_bm_command_shadowed = shadowed;
+        pci_device_region_set_shadowed(ata_controller->pci_device, 4, BM_IDE_COMMAND0, shadowed);
+        pci_device_region_set_shadowed(ata_controller->pci_device, 4, BM_IDE_COMMAND1, shadowed);
+        break;
+
+    default:
+        errno = EINVAL;
+        ata_controller_error(ata_controller, 0, errno, __func__);
+        break;
+    }
+}
+
+int
+ata_controller_set_sg_layout(
+        ata_controller_t *restrict ata_controller, const ata_controller_prd_t *prds, size_t num_prds)
+{
+    if (num_prds > ATA_CONTROLLER_MAX_SG_PRDS || (num_prds > 0 && !ata_controller->is_dma_enabled)) {
+        errno = EINVAL;
+        ata_controller_error(ata_controller, 0, errno, __func__);
+        return -1;
+    }
+
+    ata_controller->is_sg_layout_set = (num_prds > 0);
+    struct prd *prdt = &ata_controller->prdt[SG_PRDT_INDEX];
+    for (size_t i = 0; i < num_prds; ++i) {
+        /* Clamp the region to its DMA buffer, so the bus master never
+           transfers outside of the pool */
+        dma_buffer_t *dma_buffer = ata_controller->sg_dma_buffers[prds[i].buffer_num % ata_controller->num_sg_buffers];
+        size_t buffer_size = dma_buffer_get_size(dma_buffer);
+        size_t size = prds[i].count ? prds[i].count : 0x10000;
+        if (size > buffer_size) {
+            size = buffer_size;
+        }
+
+        /* The payload isn't aligned on a 64K boundary, and a region can't
+           cross one */
+        uint32_t address = dma_buffer_get_phys_addr(dma_buffer) + prds[i].offset % (buffer_size - size + 1);
+        uint32_t max = 0x10000 - (address & 0xffff);
+        prdt[i].address = address;
+        prdt[i].count = (size > max) ? max : size;
+        prdt[i].reserved = (i == num_prds - 1) ? BM_IDE_PRD_EOT : 0;
+    }
+
+    return 0;
 }
 
 ata_controller_error_handler_t *
@@ -450,3 +942,66 @@ ata_controller_set_error_handler(ata_controller_error_handler_t *handler)
     error_handler = handler;
     return previous_handler;
 }
+
+void
+ata_controller_set_idle_handler(
+        ata_controller_t *restrict ata_controller, ata_controller_idle_handler_t *handler, void *arg)
+{
+    ata_controller->idle_handler = handler;
+    ata_controller->idle_arg = arg;
+    if (ata_controller->ata_device0 != NULL) {
+        ata_device_set_idle_handler(ata_controller->ata_device0, handler, arg);
+    }
+
+    if (ata_controller->ata_device1 != NULL) {
+        ata_device_set_idle_handler(ata_controller->ata_device1, handler, arg);
+    }
+}
+
+void
+ata_controller_set_io_stats(ata_controller_t *restrict ata_controller, io_stats_t *io_stats)
+{
+    ata_controller->io_stats = io_stats;
+    pci_device_set_io_stats(ata_controller->pci_device, io_stats);
+    if (ata_controller->ata_device0 != NULL) {
+        ata_device_set_io_stats(ata_controller->ata_device0, io_stats);
+    }
+
+    if (ata_controller->ata_device1 != NULL) {
+        ata_device_set_io_stats(ata_controller->ata_device1, io_stats);
+    }
+}
+
+void
+ata_controller_set_irq(ata_controller_t *restrict ata_controller, irq_t *irq)
+{
+    ata_controller->irq = irq;
+    if (ata_controller->ata_device0 != NULL) {
+        ata_device_set_irq(ata_controller->ata_device0, irq);
+    }
+
+    if (ata_controller->ata_device1 != NULL) {
+        ata_device_set_irq(ata_controller->ata_device1, irq);
+    }
+}
+
+void
+ata_controller_set_latency(ata_controller_t *restrict ata_controller, latency_t *latency)
+{
+    ata_controller->latency = latency;
+    if (ata_controller->ata_device0 != NULL) {
+        ata_device_set_latency(ata_controller->ata_device0, latency);
+    }
+
+    if (ata_controller->ata_device1 != NULL) {
+        ata_device_set_latency(ata_controller->ata_device1, latency);
+    }
+}
+
+void
+ata_controller_switch_dma_context(ata_controller_t *restrict ata_controller)
+{
+    ata_controller->context_num = (ata_controller->context_num + 1) % NUM_DMA_CONTEXTS;
+    ata_controller->dma_buffer1 = ata_controller->context_dma_buffers[ata_controller->context_num];
+    ata_controller->buffer = ata_controller->context_buffers[ata_controller->context_num];
+}
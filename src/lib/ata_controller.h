@@ -7,13 +7,63 @@
 extern "C" {
 #endif
 
+#include "ata.h"
+#include "io_stats.h"
+#include "irq.h"
+#include "latency.h"
+#include "pci_backend.h"
+
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
+#define ATA_CONTROLLER_MAX_DMA_SIZE 0x10000 /**< Size of the DMA buffer, in bytes */
+#define ATA_CONTROLLER_MAX_SG_BUFFERS 4 /**< Maximum number of DMA buffers in the scatter-gather pool */
+#define ATA_CONTROLLER_MAX_SG_PRDS 256 /**< Maximum number of PRDs in a scatter-gather layout */
+
 typedef struct _ata_controller ata_controller_t; /**< ATA controller. */
 
+/** Registers whose reads can be served from the shadow */
+enum
+{
+    ATA_CONTROLLER_REGISTER_DEVICE,
+    ATA_CONTROLLER_REGISTER_BM_IDE_COMMAND,
+};
+
+/** Physical Region Descriptor (PRD) of a scatter-gather layout */
+typedef struct {
+    uint8_t buffer_num; /**< DMA buffer in the pool, modulo the number of DMA buffers. */
+    uint32_t offset;    /**< Offset into the DMA buffer, modulo the room left for the region. */
+    uint16_t count;     /**< Byte count. A value of zero specifies 64K bytes. */
+} ata_controller_prd_t;
+
 typedef void ata_controller_error_handler_t(int status, int error, const char *restrict format, va_list ap);
+typedef void ata_controller_idle_handler_t(void *arg);
+
+/**
+ * Stops the bus master, and acknowledges its interrupt and error (e.g., to
+ * recover from a DMA transfer that never completes).
+ *
+ * @param [in] ata_controller ATA controller.
+ */
+void ata_controller_bus_master_stop(ata_controller_t *restrict ata_controller);
+
+/**
+ * Sends a command to the selected device.
+ *
+ * @param [in] ata_controller ATA controller.
+ * @param [in] taskfile Taskfile. Any command code can be sent.
+ * @param [in] protocol Protocol (i.e., ATA_PROTOCOL_*).
+ * @param [in,out] data Data to be transferred. For the DMA protocols, may be
+ *   the view returned by ata_controller_get_dma_buffer, in which case no copy
+ *   is made.
+ * @param [in] count Number of 16-bit values to be transferred for the PIO
+ *   protocols, or number of bytes to be transferred for the DMA protocols.
+ * @return Returns zero on success; otherwise, returns -1 on failure.
+ */
+int ata_controller_command(ata_controller_t *restrict ata_controller, const ata_taskfile_t *restrict taskfile,
+        int protocol, uint16_t *data, uint32_t count);
 
 /**
  * Requests the devices to perform the internal diagnostic tests.
@@ -54,7 +104,8 @@ int ata_controller_command_identify_device(ata_controller_t *restrict ata_contro
  * @param [in] sectors Number of sectors to be transferred. A value of zero
  *   specifies that 256 sectors are to be transferred.
  * @param [in] lba Logical block address (LBA).
- * @param [out] data Data.
+ * @param [out] data Data. May be the view returned by
+ *   ata_controller_get_dma_buffer, in which case no copy is made.
  * @param [in] count Number of bytes to be transferred.
  * @return Returns zero on success; otherwise, returns -1 on failure.
  */
@@ -68,7 +119,8 @@ int ata_controller_command_read_dma(
  * @param [in] sectors Number of sectors to be transferred. A value of zero
  *   specifies that 65,536 sectors are to be transferred.
  * @param [in] lba 48-bit logical block address (LBA).
- * @param [out] data Data.
+ * @param [out] data Data. May be the view returned by
+ *   ata_controller_get_dma_buffer, in which case no copy is made.
  * @param [in] count Number of bytes to be transferred.
  * @return Returns zero on success; otherwise, returns -1 on failure.
  */
@@ -196,7 +248,8 @@ int ata_controller_command_set_multiple_mode(ata_controller_t *restrict ata_cont
  * @param [in] sectors Number of sectors to be transferred. A value of zero
  *   specifies that 256 sectors are to be transferred.
  * @param [in] lba Logical block address (LBA).
- * @param [in] data Data.
+ * @param [in] data Data. May be the view returned by
+ *   ata_controller_get_dma_buffer, in which case no copy is made.
  * @param [in] count Number of bytes to be transferred.
  * @return Returns zero on success; otherwise, returns -1 on failure.
  */
@@ -210,7 +263,8 @@ int ata_controller_command_write_dma(
  * @param [in] sectors Number of sectors to be transferred. A value of zero
  *   specifies that 65,536 sectors are to be transferred.
  * @param [in] lba 48-bit logical block address (LBA).
- * @param [in] data Data.
+ * @param [in] data Data. May be the view returned by
+ *   ata_controller_get_dma_buffer, in which case no copy is made.
  * @param [in] count Number of bytes to be transferred.
  * @return Returns zero on success; otherwise, returns -1 on failure.
  */
@@ -324,14 +378,12 @@ int ata_controller_command_write_buffer(
 /**
  * Creates an ATA controller.
  *
- * @param [in] bus PCI bus number.
- * @param [in] device PCI device number.
- * @param [in] function PCI function number.
+ * @param [in] pci_backend PCI backend used to access the ATA controller.
  * @param [in] bus_num ATA bus number. Use 0 for primary, or 1 for secondary.
  * @param [in] timeout Timeout, in seconds, for each command.
  * @return An ATA controller.
  */
-ata_controller_t *ata_controller_create(int bus, int device, int function, int bus_num, int timeout);
+ata_controller_t *ata_controller_create(pci_backend_t *pci_backend, int bus_num, int timeout);
 
 /**
  * Destroys the ATA controller.
@@ -344,9 +396,12 @@ void ata_controller_destroy(ata_controller_t *restrict ata_controller);
  * Resets the devices.
  *
  * @param [in] ata_controller ATA controller.
+ * @return Returns zero on success; otherwise, returns -1 on failure (e.g.,
+ *   ETIMEDOUT if the devices are still busy after the timeout). A timeout isn't
+ *   reported to the error handler.
  * @note After the devices are reset, Device 0 is selected.
  */
-void ata_controller_device_reset(ata_controller_t *restrict ata_controller);
+int ata_controller_device_reset(ata_controller_t *restrict ata_controller);
 
 /**
  * Selects an ATA device.
@@ -354,8 +409,96 @@ void ata_controller_device_reset(ata_controller_t *restrict ata_controller);
  * @param [in] ata_controller ATA controller.
  * @param [in] device_num ATA device number. Use 0 for Device 0, or 1 for Device
  *   1.
+ * @return Returns zero on success; otherwise, returns -1 on failure (e.g.,
+ *   ETIMEDOUT if the device is still busy after the timeout). A timeout isn't
+ *   reported to the error handler.
+ */
+int ata_controller_device_select(ata_controller_t *restrict ata_controller, int device_num);
+
+/**
+ * Returns the Bus Master IDE Status register at the completion of the last DMA
+ * command of the selected device.
+ *
+ * @param [in] ata_controller ATA controller.
+ * @return Bus Master IDE Status register.
  */
-void ata_controller_device_select(ata_controller_t *restrict ata_controller, int device_num);
+uint8_t ata_controller_get_bm_status(ata_controller_t *restrict ata_controller);
+
+/**
+ * Returns a view of the mapped DMA buffer, so that payloads can be generated
+ * in place and read results inspected without copying. The DMA commands
+ * alternate between two DMA buffers: the one returned is that of the next DMA
+ * command, and stays valid until the DMA command after it.
+ *
+ * @param [in] ata_controller ATA controller.
+ * @return Returns the DMA buffer, ATA_CONTROLLER_MAX_DMA_SIZE bytes long, if
+ *   DMA is enabled; otherwise, returns NULL.
+ */
+void *ata_controller_get_dma_buffer(ata_controller_t *restrict ata_controller);
+
+/**
+ * Returns the first overrun of the canary zones around the DMA buffers by the
+ * last DMA command, i.e., bytes written by the device outside of the
+ * transfer. After a contiguous transfer, the stretch of the DMA buffer after
+ * the transfer is checked, too.
+ *
+ * @param [in] ata_controller ATA controller.
+ * @param [out] command Command code of the DMA command.
+ * @param [out] buffer_num Number of the overrun DMA buffer in the
+ *   scatter-gather pool.
+ * @param [out] offset Offset of the first overwritten byte, relative to the
+ *   DMA buffer (i.e., negative before it).
+ * @return Returns true if a DMA buffer was overrun; otherwise, returns false.
+ */
+bool ata_controller_get_dma_overrun(ata_controller_t *restrict ata_controller, uint8_t *restrict command,
+        size_t *restrict buffer_num, ptrdiff_t *restrict offset);
+
+/**
+ * Returns the number of bytes that the contiguous PRDT of a DMA command
+ * transfers: a byte count of zero is 64K, and bit 0 of a byte count is ignored
+ * (as by QEMU), so that a count of one is 64K, too.
+ *
+ * @param [in] count Byte count of the DMA command.
+ * @return Number of bytes transferred.
+ */
+uint32_t ata_controller_get_dma_size(uint32_t count);
+
+/**
+ * Returns the Error register of the selected device at the completion of the
+ * last command that failed with an error (i.e., ATA_ERR in the Status
+ * register).
+ *
+ * @param [in] ata_controller ATA controller.
+ * @return Error register.
+ */
+uint8_t ata_controller_get_error(ata_controller_t *restrict ata_controller);
+
+/**
+ * Returns the data transferred by the last IDENTIFY DEVICE command of the
+ * selected device.
+ *
+ * @param [in] ata_controller ATA controller.
+ * @return IDENTIFY DEVICE data, 256 words long.
+ */
+const uint16_t *ata_controller_get_identify_data(ata_controller_t *restrict ata_controller);
+
+/**
+ * Returns the number of DMA buffers in the scatter-gather pool. The first ones
+ * are the DMA buffers that ata_controller_get_dma_buffer alternates between.
+ *
+ * @param [in] ata_controller ATA controller.
+ * @return Number of DMA buffers, or zero if DMA is not enabled.
+ */
+size_t ata_controller_get_num_sg_buffers(ata_controller_t *restrict ata_controller);
+
+/**
+ * Returns the Status register of the selected device at the completion of the
+ * last command.
+ *
+ * @param [in] ata_controller ATA controller.
+ * @return Status register.
+ */
+uint8_t ata_controller_get_status(ata_controller_t *restrict ata_controller);
 
 /**
  * Returns whether DMA is enabled for the ATA controller.
@@ -365,6 +508,76 @@ void ata_controller_device_select(ata_controller_t *restrict ata_controller, int
  */
 bool ata_controller_is_dma_enabled(ata_controller_t *restrict ata_controller);
 
+/**
+ * Returns whether the channel of the ATA controller is in native-PCI mode,
+ * which is required to wait for its interrupts (see ata_controller_set_irq).
+ *
+ * @param [in] ata_controller ATA controller.
+ * @return Returns true if the channel is in native-PCI mode; otherwise,
+ *   returns false if the channel is in compatibility mode.
+ */
+bool ata_controller_is_native(ata_controller_t *restrict ata_controller);
+
+/**
+ * Returns whether the last command of the selected device has timed out.
+ *
+ * @param [in] ata_controller ATA controller.
+ * @return Whether the last command has timed out.
+ */
+bool ata_controller_is_timed_out(ata_controller_t *restrict ata_controller);
+
+/**
+ * Probes the PCI device again: checks that it still responds to configuration
+ * accesses, and enables its I/O space, memory space, and bus master decoding
+ * again.
+ *
+ * @param [in] ata_controller ATA controller.
+ * @return Returns zero on success; otherwise, returns -1 on failure (e.g.,
+ *   ENODEV if the PCI device doesn't respond). A failure isn't reported to the
+ *   error handler.
+ */
+int ata_controller_probe(ata_controller_t *restrict ata_controller);
+
+/**
+ * Recreates the PCI device, the ATA devices, and the DMA buffers of the ATA
+ * controller, as if the ATA controller had been destroyed and created again.
+ * The settings (e.g., the shadowed registers, I/O statistics, and interrupt)
+ * are kept.
+ *
+ * @param [in] ata_controller ATA controller.
+ * @return Returns zero on success; otherwise, returns -1 on failure. The ATA
+ *   controller can only be destroyed after a failure.
+ */
+int ata_controller_reinitialize(ata_controller_t *restrict ata_controller);
+
+/**
+ * Sets whether the register is shadowed. Reads of a shadowed register are
+ * served from what was last written to it instead of from the device.
+ * Registers are shadowed by default.
+ *
+ * @param [in] ata_controller ATA controller.
+ * @param [in] reg Register (i.e., ATA_CONTROLLER_REGISTER_DEVICE or
+ *   ATA_CONTROLLER_REGISTER_BM_IDE_COMMAND).
+ * @param [in] shadowed Whether the register is shadowed.
+ */
+void ata_controller_set_register_shadowed(ata_controller_t *restrict ata_controller, int reg, bool shadowed);
+
+/**
+ * Sets the scatter-gather layout of the Physical Region Descriptor Table
+ * (PRDT) for the next DMA command, instead of a contiguous PRDT over the DMA
+ * buffer. The regions are clamped to their DMA buffers and to the next 64K
+ * boundary, but may be of any length (e.g., odd or zero) and need not match the sector count of the
+ * command. The last PRD ends the table.
+ *
+ * @param [in] ata_controller ATA controller.
+ * @param [in] prds PRDs.
+ * @param [in] num_prds Number of PRDs, up to ATA_CONTROLLER_MAX_SG_PRDS. A
+ *   value of zero restores the contiguous PRDT.
+ * @return Returns zero on success; otherwise, returns -1 on failure.
+ */
+int ata_controller_set_sg_layout(
+        ata_controller_t *restrict ata_controller, const ata_controller_prd_t *prds, size_t num_prds);
+
 /**
  * Sets the error handler for the ATA controller.
  *
@@ -373,6 +586,49 @@ bool ata_controller_is_dma_enabled(ata_controller_t *restrict ata_controller);
  */
 ata_controller_error_handler_t *ata_controller_set_error_handler(ata_controller_error_handler_t *handler);
 
+/**
+ * Sets the latency model that learns the timeout of each command of both
+ * devices.
+ *
+ * @param [in] ata_controller ATA controller.
+ * @param [in] latency Latency model, or NULL to use the timeout of the ATA
+ *   controller.
+ */
+void ata_controller_set_latency(ata_controller_t *restrict ata_controller, latency_t *latency);
+
+/**
+ * Sets the idle handler, which does other work (e.g., prepares the next
+ * command) while a command of either device is in flight. It's called at most
+ * once per command, and the time it spends doesn't count toward the timeout of
+ * the command.
+ *
+ * @param [in] ata_controller ATA controller.
+ * @param [in] handler Idle handler, or NULL.
+ * @param [in] arg Argument of the idle handler.
+ */
+void ata_controller_set_idle_handler(
+        ata_controller_t *restrict ata_controller, ata_controller_idle_handler_t *handler, void *arg);
+
+/**
+ * Sets the I/O statistics that count the register accesses of each phase of
+ * the commands.
+ *
+ * @param [in] ata_controller ATA controller.
+ * @param [in] io_stats I/O statistics, or NULL.
+ */
+void ata_controller_set_io_stats(ata_controller_t *restrict ata_controller, io_stats_t *io_stats);
+
+/**
+ * Sets the interrupt that signals the completion of the commands of both
+ * devices. The channel must be in native-PCI mode: a UIO driver delivers only
+ * the PCI interrupt (INTx), not the ISA IRQ of a channel in compatibility
+ * mode.
+ *
+ * @param [in] ata_controller ATA controller.
+ * @param [in] irq Interrupt, or NULL to poll the status.
+ */
+void ata_controller_set_irq(ata_controller_t *restrict ata_controller, irq_t *irq);
+
 #ifdef __cplusplus
 }
 #endif
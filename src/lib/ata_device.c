@@ -4,18 +4,36 @@
 
 #include "ata.h"
 #include "bus_master.h"
+#include "deadline.h"
+#include "guard_buffer.h"
+#include "io_stats.h"
+#include "irq.h"
+#include "latency.h"
 #include "pci_device.h"
 
 #include <errno.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
-#include <time.h>
+
+/* Time for the status to become valid after the command is written */
+#define STATUS_SETTLE_NS 400
 
 struct _ata_device {
     pci_device_t *pci_device;
+    io_stats_t *io_stats;
+    irq_t *irq;
+    latency_t *latency;
+    ata_device_idle_handler_t *idle_handler;
+    void *idle_arg;
+    /* Whether the idle handler has been called for the current command */
+    bool is_idle_handled;
     int region_num;
+    /* Offset of the Bus Master IDE registers of the channel */
+    int bm_offset;
     int timeout;
+    bool is_timed_out;
     uint8_t error;
     uint8_t features[2];
     uint8_t sector_count[2];
@@ -23,41 +41,156 @@ struct _ata_device {
     uint8_t lba_mid[2];
     uint8_t lba_high[2];
     uint8_t device[2];
+    /* Registers whose current (index 0) and previous (index 1) contents are
+       known (i.e., ATA_TASKFILE_*) */
+    uint8_t valid[2];
+    /* Whether the nIEN bit of the Device Control register matches the
+       completion mode */
+    bool is_device_control_valid;
     uint8_t status;
+    /* Bus Master IDE Status register at the completion of the last DMA
+       command */
+    uint8_t bm_status;
+    /* The PIO data-in loop writes for as long as the device requests it, so
+       the data is followed by a guard page */
+    guard_buffer_t *identify_buffer;
     uint16_t *identify_data;
 };
 
 static ata_device_error_handler_t *error_handler = NULL;
 
-int ata_device_command_dma(ata_device_t *restrict ata_device, uint16_t command);
-int ata_device_command_non_data(ata_device_t *restrict ata_device, uint16_t command);
+int ata_device_command_dma(ata_device_t *restrict ata_device, uint16_t command, uint32_t sectors);
+int ata_device_command_non_data(ata_device_t *restrict ata_device, uint16_t command, uint32_t sectors);
 int ata_device_command_pio_data_in(ata_device_t *restrict ata_device, uint16_t command, uint16_t *data, uint32_t count);
 int ata_device_command_pio_data_out(
         ata_device_t *restrict ata_device, uint16_t command, const uint16_t *data, uint32_t count);
 void ata_device_error(ata_device_t *restrict ata_device, int status, int error, const char *restrict format, ...);
+uint64_t ata_device_get_timeout(ata_device_t *restrict ata_device, uint16_t command, uint32_t sectors);
+void ata_device_set_device(ata_device_t *restrict ata_device, uint8_t device);
+void ata_device_set_device_control(ata_device_t *restrict ata_device);
 void ata_device_set_features(ata_device_t *restrict ata_device, uint8_t features);
 void ata_device_set_lba(ata_device_t *restrict ata_device, uint32_t lba);
 void ata_device_set_lba48(ata_device_t *restrict ata_device, uint64_t lba);
+void ata_device_set_register(ata_device_t *restrict ata_device, size_t offset, uint8_t reg[2], int mask, uint8_t value);
+void ata_device_set_register16(
+        ata_device_t *restrict ata_device, size_t offset, uint8_t reg[2], int mask, uint8_t previous, uint8_t current);
 void ata_device_set_sector_count(ata_device_t *restrict ata_device, uint8_t sectors);
 void ata_device_set_sector_count16(ata_device_t *restrict ata_device, uint16_t sectors);
 void ata_device_software_reset(ata_device_t *restrict ata_device);
+bool ata_device_wait(ata_device_t *restrict ata_device, deadline_t *restrict deadline, bool is_interrupt);
+void ata_device_write_register(
+        ata_device_t *restrict ata_device, size_t offset, uint8_t reg[2], int mask, uint8_t value);
+
+int
+ata_device_command(ata_device_t *restrict ata_device, const ata_taskfile_t *restrict taskfile, int protocol,
+        uint16_t *data, uint32_t count)
+{
+    if (taskfile->registers & ATA_TASKFILE_HOB) {
+        if (taskfile->registers & ATA_TASKFILE_FEATURES) {
+            ata_device_set_register16(ata_device, ATA_FEATURES, ata_device->features, ATA_TASKFILE_FEATURES,
+                    taskfile->features_hob, taskfile->features);
+        }
+
+        if (taskfile->registers & ATA_TASKFILE_SECTOR_COUNT) {
+            ata_device_set_register16(ata_device, ATA_SECTOR_COUNT, ata_device->sector_count, ATA_TASKFILE_SECTOR_COUNT,
+                    taskfile->sector_count_hob, taskfile->sector_count);
+        }
+
+        if (taskfile->registers & ATA_TASKFILE_LBA_LOW) {
+            ata_device_set_register16(ata_device, ATA_LBA_LOW, ata_device->lba_low, ATA_TASKFILE_LBA_LOW,
+                    taskfile->lba_low_hob, taskfile->lba_low);
+        }
+
+        if (taskfile->registers & ATA_TASKFILE_LBA_MID) {
+            ata_device_set_register16(ata_device, ATA_LBA_MID, ata_device->lba_mid, ATA_TASKFILE_LBA_MID,
+                    taskfile->lba_mid_hob, taskfile->lba_mid);
+        }
+
+        if (taskfile->registers & ATA_TASKFILE_LBA_HIGH) {
+            ata_device_set_register16(ata_device, ATA_LBA_HIGH, ata_device->lba_high, ATA_TASKFILE_LBA_HIGH,
+                    taskfile->lba_high_hob, taskfile->lba_high);
+        }
+    } else {
+        if (taskfile->registers & ATA_TASKFILE_FEATURES) {
+            ata_device_set_register(
+                    ata_device, ATA_FEATURES, ata_device->features, ATA_TASKFILE_FEATURES, taskfile->features);
+        }
+
+        if (taskfile->registers & ATA_TASKFILE_SECTOR_COUNT) {
+            ata_device_set_register(ata_device, ATA_SECTOR_COUNT, ata_device->sector_count, ATA_TASKFILE_SECTOR_COUNT,
+                    taskfile->sector_count);
+        }
+
+        if (taskfile->registers & ATA_TASKFILE_LBA_LOW) {
+            ata_device_set_register(
+                    ata_device, ATA_LBA_LOW, ata_device->lba_low, ATA_TASKFILE_LBA_LOW, taskfile->lba_low);
+        }
+
+        if (taskfile->registers & ATA_TASKFILE_LBA_MID) {
+            ata_device_set_register(
+                    ata_device, ATA_LBA_MID, ata_device->lba_mid, ATA_TASKFILE_LBA_MID, taskfile->lba_mid);
+        }
+
+        if (taskfile->registers & ATA_TASKFILE_LBA_HIGH) {
+            ata_device_set_register(
+                    ata_device, ATA_LBA_HIGH, ata_device->lba_high, ATA_TASKFILE_LBA_HIGH, taskfile->lba_high);
+        }
+    }
+
+    if (taskfile->registers & ATA_TASKFILE_DEVICE) {
+        /* Preserve the DEV bit so the command is sent to this device */
+        ata_device_set_device(ata_device,
+                (taskfile->device & ~ATA_DEV)
+                        | (pci_device_region_read8(ata_device->pci_device, ata_device->region_num, ATA_DEVICE)
+                                & ATA_DEV));
+    }
+
+    uint32_t sectors = taskfile->sector_count;
+    if (taskfile->registers & ATA_TASKFILE_HOB) {
+        sectors |= taskfile->sector_count_hob << 8;
+    }
+
+    switch (protocol) {
+    case ATA_PROTOCOL_NON_DATA:
+        return ata_device_command_non_data(ata_device, taskfile->command, sectors);
+
+    case ATA_PROTOCOL_PIO_DATA_IN:
+        return ata_device_command_pio_data_in(ata_device, taskfile->command, data, count);
+
+    case ATA_PROTOCOL_PIO_DATA_OUT:
+        return ata_device_command_pio_data_out(ata_device, taskfile->command, data, count);
+
+    case ATA_PROTOCOL_DMA_IN:
+    case ATA_PROTOCOL_DMA_OUT:
+        return ata_device_command_dma(ata_device, taskfile->command, sectors);
+
+    default:
+        errno = EINVAL;
+        ata_device_error(ata_device, 0, errno, __func__);
+        return -1;
+    }
+}
 
 int
 ata_device_command_execute_device_diagnostic(ata_device_t *restrict ata_device)
 {
-    return ata_device_command_non_data(ata_device, ATA_EXECUTE_DEVICE_DIAGNOSTIC);
+    int result = ata_device_command_non_data(ata_device, ATA_EXECUTE_DEVICE_DIAGNOSTIC, 0);
+    /* The devices reset the Command Block registers after the diagnostic */
+    pci_device_region_invalidate(ata_device->pci_device, ata_device->region_num);
+    ata_device_invalidate(ata_device);
+    return result;
 }
 
 int
 ata_device_command_flush_cache(ata_device_t *restrict ata_device)
 {
-    return ata_device_command_non_data(ata_device, ATA_FLUSH_CACHE);
+    return ata_device_command_non_data(ata_device, ATA_FLUSH_CACHE, 0);
 }
 
 int
 ata_device_command_flush_cache_ext(ata_device_t *restrict ata_device)
 {
-    return ata_device_command_non_data(ata_device, ATA_FLUSH_CACHE_EXT);
+    return ata_device_command_non_data(ata_device, ATA_FLUSH_CACHE_EXT, 0);
 }
 
 int
@@ -71,7 +204,7 @@ ata_device_command_read_dma(ata_device_t *restrict ata_device, uint8_t sectors,
 {
     ata_device_set_sector_count(ata_device, sectors);
     ata_device_set_lba(ata_device, lba);
-    return ata_device_command_dma(ata_device, ATA_READ_DMA);
+    return ata_device_command_dma(ata_device, ATA_READ_DMA, sectors ? sectors : 256);
 }
 
 int
@@ -79,7 +212,7 @@ ata_device_command_read_dma_ext(ata_device_t *restrict ata_device, uint16_t sect
 {
     ata_device_set_sector_count16(ata_device, sectors);
     ata_device_set_lba48(ata_device, lba);
-    return ata_device_command_dma(ata_device, ATA_READ_DMA_EXT);
+    return ata_device_command_dma(ata_device, ATA_READ_DMA_EXT, sectors ? sectors : 0x10000);
 }
 
 int
@@ -123,7 +256,7 @@ ata_device_command_read_verify_sectors(ata_device_t *restrict ata_device, uint8_
 {
     ata_device_set_sector_count(ata_device, sectors);
     ata_device_set_lba(ata_device, lba);
-    return ata_device_command_non_data(ata_device, ATA_READ_VERIFY_SECTORS);
+    return ata_device_command_non_data(ata_device, ATA_READ_VERIFY_SECTORS, sectors ? sectors : 256);
 }
 
 int
@@ -131,14 +264,14 @@ ata_device_command_read_verify_sectors_ext(ata_device_t *restrict ata_device, ui
 {
     ata_device_set_sector_count16(ata_device, sectors);
     ata_device_set_lba48(ata_device, lba);
-    return ata_device_command_non_data(ata_device, ATA_READ_VERIFY_SECTORS_EXT);
+    return ata_device_command_non_data(ata_device, ATA_READ_VERIFY_SECTORS_EXT, sectors ? sectors : 0x10000);
 }
 
 int
 ata_device_command_seek(ata_device_t *restrict ata_device, uint32_t lba)
 {
     ata_device_set_lba(ata_device, lba);
-    return ata_device_command_non_data(ata_device, ATA_SEEK);
+    return ata_device_command_non_data(ata_device, ATA_SEEK, 0);
 }
 
 int
@@ -147,14 +280,14 @@ ata_device_command_set_features(ata_device_t *restrict ata_device, uint8_t code,
     ata_device_set_features(ata_device, code);
     ata_device_set_sector_count(ata_device, specific[0]);
     ata_device_set_lba(ata_device, (specific[3] << 16) | (specific[2] << 8) | specific[1]);
-    return ata_device_command_non_data(ata_device, ATA_SET_FEATURES);
+    return ata_device_command_non_data(ata_device, ATA_SET_FEATURES, 0);
 }
 
 int
 ata_device_command_set_multiple_mode(ata_device_t *restrict ata_device, uint8_t sectors)
 {
     ata_device_set_sector_count(ata_device, sectors);
-    return ata_device_command_non_data(ata_device, ATA_SET_MULTIPLE_MODE);
+    return ata_device_command_non_data(ata_device, ATA_SET_MULTIPLE_MODE, 0);
 }
 
 int
@@ -162,7 +295,7 @@ ata_device_command_write_dma(ata_device_t *restrict ata_device, uint8_t sectors,
 {
     ata_device_set_sector_count(ata_device, sectors);
     ata_device_set_lba(ata_device, lba);
-    return ata_device_command_dma(ata_device, ATA_WRITE_DMA);
+    return ata_device_command_dma(ata_device, ATA_WRITE_DMA, sectors ? sectors : 256);
 }
 
 int
@@ -170,7 +303,7 @@ ata_device_command_write_dma_ext(ata_device_t *restrict ata_device, uint16_t sec
 {
     ata_device_set_sector_count16(ata_device, sectors);
     ata_device_set_lba48(ata_device, lba);
-    return ata_device_command_dma(ata_device, ATA_WRITE_DMA_EXT);
+    return ata_device_command_dma(ata_device, ATA_WRITE_DMA_EXT, sectors ? sectors : 0x10000);
 }
 
 int
@@ -223,7 +356,7 @@ int
 ata_device_command_nop(ata_device_t *restrict ata_device, uint8_t code)
 {
     ata_device_set_features(ata_device, code);
-    return ata_device_command_non_data(ata_device, ATA_NOP);
+    return ata_device_command_non_data(ata_device, ATA_NOP, 0);
 }
 
 int
@@ -239,32 +372,80 @@ ata_device_command_write_buffer(ata_device_t *restrict ata_device, const uint16_
 }
 
 int
-ata_device_command_dma(ata_device_t *restrict ata_device, uint16_t command)
-{
-    /* Disable interrupts */
-    pci_device_region_write8(ata_device->pci_device, ata_device->region_num + 1, ATA_DEVICE_CONTROL, ATA_nIEN);
+ata_device_command_dma(ata_device_t *restrict ata_device, uint16_t command, uint32_t sectors)
+{
+    /* Disable interrupts, unless the completion is interrupt-driven */
+    io_stats_set_phase(ata_device->io_stats, IO_STATS_PHASE_COMMAND);
+    io_stats_set_command(ata_device->io_stats, command);
+    ata_device_set_device_control(ata_device);
+    /* Clear the interrupt and error bits of the Bus Master IDE Status register
+       (i.e., write one to clear) before the device can raise the interrupt */
+    ata_device->bm_status = pci_device_region_read8(ata_device->pci_device, 4, ata_device->bm_offset + BM_IDE_STATUS0);
+    pci_device_region_write8(ata_device->pci_device, 4, ata_device->bm_offset + BM_IDE_STATUS0,
+            (ata_device->bm_status & (BM_IDE_DRIVE0_DMA | BM_IDE_DRIVE1_DMA)) | BM_IDE_INTERRUPT | BM_IDE_ERROR);
     /* Write the command code to the Command register */
     pci_device_region_write8(ata_device->pci_device, ata_device->region_num, ATA_COMMAND, command);
+    /* The device may update the Sector Count, LBA, and Device registers, but
+       not the Features register. */
+    ata_device->valid[0] &= ATA_TASKFILE_FEATURES;
+    ata_device->valid[1] &= ATA_TASKFILE_FEATURES;
     /* Enable the bus master operation of the controller */
-    pci_device_region_write8(ata_device->pci_device, 4, BM_IDE_COMMAND0,
-            pci_device_region_read8(ata_device->pci_device, 4, BM_IDE_COMMAND0) | BM_IDE_START);
-    /* Poll the device status/clear the interrupt pending */
-    clock_t start = clock();
+    pci_device_region_write8(ata_device->pci_device, 4, ata_device->bm_offset + BM_IDE_COMMAND0,
+            pci_device_region_read8(ata_device->pci_device, 4, ata_device->bm_offset + BM_IDE_COMMAND0) | BM_IDE_START);
+    /* Poll the bus master status. Don't read the Status register, which
+       clears the interrupt pending, until the command has been completed. */
+    io_stats_set_phase(ata_device->io_stats, IO_STATS_PHASE_POLL);
+    deadline_t deadline;
+    deadline_start(&deadline, ata_device_get_timeout(ata_device, command, sectors));
+    ata_device->is_idle_handled = false;
+    /* Wait for the interrupt instead of polling while the device is busy */
+    ata_device->is_timed_out = (ata_device->irq != NULL && !ata_device_wait(ata_device, &deadline, true));
     for (;;) {
-        /* Has the command been completed? */
-        ata_device->status = pci_device_region_read8(ata_device->pci_device, ata_device->region_num, ATA_STATUS);
-        if ((ata_device->status & (ATA_BSY | ATA_DRQ)) == 0) {
+        /* Has the device raised the interrupt, or has the bus master failed? */
+        ata_device->bm_status
+                = pci_device_region_read8(ata_device->pci_device, 4, ata_device->bm_offset + BM_IDE_STATUS0);
+        io_stats_count(ata_device->io_stats, IO_STATS_POLLS, 1);
+        if (ata_device->bm_status & (BM_IDE_INTERRUPT | BM_IDE_ERROR)) {
             break;
         }
 
+        /* The device doesn't raise the interrupt while nIEN is set, and a
+           device that aborts the command may never start the transfer, so
+           check the Alternate Status register whether or not the transfer is
+           active, once the status has settled. */
+        if (deadline_get_elapsed(&deadline) >= STATUS_SETTLE_NS) {
+            uint8_t status = pci_device_region_read8(
+                    ata_device->pci_device, ata_device->region_num + 1, ATA_ALTERNATE_STATUS);
+            if ((status & (ATA_BSY | ATA_DRQ)) == 0) {
+                break;
+            }
+        }
+
         /* Has the command timed out? */
-        clock_t end = clock();
-        if ((((double)(end - start)) / CLOCKS_PER_SEC) > ata_device->timeout) {
-            ata_device_software_reset(ata_device);
+        if (ata_device->is_timed_out || !ata_device_wait(ata_device, &deadline, true)) {
+            ata_device->is_timed_out = true;
             break;
         }
     }
 
+    /* Reset the direction of the bus master transfer, and disable the bus
+       master operation of the controller. */
+    io_stats_set_phase(ata_device->io_stats, IO_STATS_PHASE_COMPLETION);
+    pci_device_region_write8(ata_device->pci_device, 4, ata_device->bm_offset + BM_IDE_COMMAND0,
+            pci_device_region_read8(ata_device->pci_device, 4, ata_device->bm_offset + BM_IDE_COMMAND0)
+                    & ~BM_IDE_START);
+    /* Read the status once to clear the interrupt pending, and then
+       acknowledge the interrupt and error of the bus master */
+    ata_device->status = pci_device_region_read8(ata_device->pci_device, ata_device->region_num, ATA_STATUS);
+    pci_device_region_write8(ata_device->pci_device, 4, ata_device->bm_offset + BM_IDE_STATUS0,
+            (ata_device->bm_status & (BM_IDE_DRIVE0_DMA | BM_IDE_DRIVE1_DMA)) | BM_IDE_INTERRUPT | BM_IDE_ERROR);
+    /* Has the command timed out? */
+    if (ata_device->is_timed_out) {
+        errno = ETIMEDOUT;
+        goto err;
+    }
+
+    latency_add(ata_device->latency, command, sectors, deadline_get_elapsed(&deadline));
     /* Has a device fault occurred? */
     if (ata_device->status & ATA_DF) {
         goto err;
@@ -276,45 +457,61 @@ ata_device_command_dma(ata_device_t *restrict ata_device, uint16_t command)
         goto err;
     }
 
-    /* Reset the direction of the bus master transfer, and disable the bus
-       master operation of the controller. */
-    pci_device_region_write8(ata_device->pci_device, 4, BM_IDE_COMMAND0,
-            pci_device_region_read8(ata_device->pci_device, 4, BM_IDE_COMMAND0) & ~BM_IDE_START);
+    /* Has the bus master failed (e.g., a PRD pointed outside the memory)? */
+    if (ata_device->bm_status & BM_IDE_ERROR) {
+        goto err;
+    }
+
     return 0;
 
 err:
-    /* Reset the direction of the bus master transfer, and disable the bus
-       master operation of the controller. */
-    pci_device_region_write8(ata_device->pci_device, 4, BM_IDE_COMMAND0,
-            pci_device_region_read8(ata_device->pci_device, 4, BM_IDE_COMMAND0) & ~BM_IDE_START);
     ata_device_software_reset(ata_device);
     return -1;
 }
 
 int
-ata_device_command_non_data(ata_device_t *restrict ata_device, uint16_t command)
+ata_device_command_non_data(ata_device_t *restrict ata_device, uint16_t command, uint32_t sectors)
 {
-    /* Disable interrupts */
-    pci_device_region_write8(ata_device->pci_device, ata_device->region_num + 1, ATA_DEVICE_CONTROL, ATA_nIEN);
+    /* Disable interrupts, unless the completion is interrupt-driven */
+    io_stats_set_phase(ata_device->io_stats, IO_STATS_PHASE_COMMAND);
+    io_stats_set_command(ata_device->io_stats, command);
+    ata_device_set_device_control(ata_device);
     /* Write the command code to the Command register */
     pci_device_region_write8(ata_device->pci_device, ata_device->region_num, ATA_COMMAND, command);
+    /* The device may update the Sector Count, LBA, and Device registers, but
+       not the Features register. */
+    ata_device->valid[0] &= ATA_TASKFILE_FEATURES;
+    ata_device->valid[1] &= ATA_TASKFILE_FEATURES;
     /* Poll the device status/clear the interrupt pending */
-    clock_t start = clock();
+    io_stats_set_phase(ata_device->io_stats, IO_STATS_PHASE_POLL);
+    deadline_t deadline;
+    deadline_start(&deadline, ata_device_get_timeout(ata_device, command, sectors));
+    ata_device->is_idle_handled = false;
+    /* Wait for the interrupt instead of polling while the device is busy */
+    ata_device->is_timed_out = (ata_device->irq != NULL && !ata_device_wait(ata_device, &deadline, true));
     for (;;) {
         /* Has the command been completed? */
         ata_device->status = pci_device_region_read8(ata_device->pci_device, ata_device->region_num, ATA_STATUS);
+        io_stats_count(ata_device->io_stats, IO_STATS_POLLS, 1);
         if ((ata_device->status & (ATA_BSY | ATA_DRQ)) == 0) {
             break;
         }
 
         /* Has the command timed out? */
-        clock_t end = clock();
-        if ((((double)(end - start)) / CLOCKS_PER_SEC) > ata_device->timeout) {
-            ata_device_software_reset(ata_device);
+        if (ata_device->is_timed_out || !ata_device_wait(ata_device, &deadline, true)) {
+            ata_device->is_timed_out = true;
             break;
         }
     }
 
+    /* Has the command timed out? */
+    io_stats_set_phase(ata_device->io_stats, IO_STATS_PHASE_COMPLETION);
+    if (ata_device->is_timed_out) {
+        errno = ETIMEDOUT;
+        goto err;
+    }
+
+    latency_add(ata_device->latency, command, sectors, deadline_get_elapsed(&deadline));
     /* Has a device fault occurred? */
     if (ata_device->status & ATA_DF) {
         goto err;
@@ -336,23 +533,41 @@ err:
 int
 ata_device_command_pio_data_in(ata_device_t *restrict ata_device, uint16_t command, uint16_t *data, uint32_t count)
 {
-    /* Disable interrupts */
-    pci_device_region_write8(ata_device->pci_device, ata_device->region_num + 1, ATA_DEVICE_CONTROL, ATA_nIEN);
+    /* Disable interrupts, unless the completion is interrupt-driven */
+    io_stats_set_phase(ata_device->io_stats, IO_STATS_PHASE_COMMAND);
+    io_stats_set_command(ata_device->io_stats, command);
+    ata_device_set_device_control(ata_device);
     /* Write the command code to the Command register */
     pci_device_region_write8(ata_device->pci_device, ata_device->region_num, ATA_COMMAND, command);
+    /* The device may update the Sector Count, LBA, and Device registers, but
+       not the Features register. */
+    ata_device->valid[0] &= ATA_TASKFILE_FEATURES;
+    ata_device->valid[1] &= ATA_TASKFILE_FEATURES;
     /* Poll the device status/clear the interrupt pending */
-    clock_t start = clock();
+    io_stats_set_phase(ata_device->io_stats, IO_STATS_PHASE_POLL);
+    deadline_t deadline;
+    deadline_start(&deadline, ata_device_get_timeout(ata_device, command, count / 256));
+    ata_device->is_idle_handled = false;
+    /* Wait for the interrupt instead of polling while the device is busy */
+    ata_device->is_timed_out = (ata_device->irq != NULL && !ata_device_wait(ata_device, &deadline, true));
     /* Don't use the Sector Count to try to discover any out-of-bounds reads and
        writes. Read until the device clears the DRQ bit. */
     for (size_t i = 0;;) {
         /* Is the device ready to transfer data? */
         ata_device->status = pci_device_region_read8(ata_device->pci_device, ata_device->region_num, ATA_STATUS);
+        io_stats_count(ata_device->io_stats, IO_STATS_POLLS, 1);
+        bool is_transferred = false;
         if ((ata_device->status & (ATA_BSY | ATA_DRQ)) == ATA_DRQ) {
             /* Transfer data */
             /* @todo Investigate why Hyper-V isn't happy with REP INS/OUTS */
+            io_stats_set_phase(ata_device->io_stats, IO_STATS_PHASE_DATA);
             for (size_t j = 0; j < 256; ++i, ++j) {
                 data[i] = pci_device_region_read16(ata_device->pci_device, ata_device->region_num, ATA_DATA);
             }
+
+            io_stats_count(ata_device->io_stats, IO_STATS_DATA, 256);
+            is_transferred = true;
+            io_stats_set_phase(ata_device->io_stats, IO_STATS_PHASE_POLL);
         }
         /* Has the command been completed? */
         if ((ata_device->status & (ATA_BSY | ATA_DRQ)) == 0) {
@@ -360,13 +575,20 @@ ata_device_command_pio_data_in(ata_device_t *restrict ata_device, uint16_t comma
         }
 
         /* Has the command timed out? */
-        clock_t end = clock();
-        if ((((double)(end - start)) / CLOCKS_PER_SEC) > ata_device->timeout) {
-            ata_device_software_reset(ata_device);
+        if (ata_device->is_timed_out || !ata_device_wait(ata_device, &deadline, !is_transferred)) {
+            ata_device->is_timed_out = true;
             break;
         }
     }
 
+    /* Has the command timed out? */
+    io_stats_set_phase(ata_device->io_stats, IO_STATS_PHASE_COMPLETION);
+    if (ata_device->is_timed_out) {
+        errno = ETIMEDOUT;
+        goto err;
+    }
+
+    latency_add(ata_device->latency, command, count / 256, deadline_get_elapsed(&deadline));
     /* Has a device fault occurred? */
     if (ata_device->status & ATA_DF) {
         goto err;
@@ -389,22 +611,39 @@ int
 ata_device_command_pio_data_out(
         ata_device_t *restrict ata_device, uint16_t command, const uint16_t *data, uint32_t count)
 {
-    /* Disable interrupts */
-    pci_device_region_write8(ata_device->pci_device, ata_device->region_num + 1, ATA_DEVICE_CONTROL, ATA_nIEN);
+    /* Disable interrupts, unless the completion is interrupt-driven */
+    io_stats_set_phase(ata_device->io_stats, IO_STATS_PHASE_COMMAND);
+    io_stats_set_command(ata_device->io_stats, command);
+    ata_device_set_device_control(ata_device);
     /* Write the command code to the Command register */
     pci_device_region_write8(ata_device->pci_device, ata_device->region_num, ATA_COMMAND, command);
+    /* The device may update the Sector Count, LBA, and Device registers, but
+       not the Features register. */
+    ata_device->valid[0] &= ATA_TASKFILE_FEATURES;
+    ata_device->valid[1] &= ATA_TASKFILE_FEATURES;
     /* Poll the device status/clear the interrupt pending */
-    clock_t start = clock();
+    io_stats_set_phase(ata_device->io_stats, IO_STATS_PHASE_POLL);
+    deadline_t deadline;
+    deadline_start(&deadline, ata_device_get_timeout(ata_device, command, count / 256));
+    ata_device->is_idle_handled = false;
+    ata_device->is_timed_out = false;
     /* Don't use the Sector Count to try to discover any out-of-bounds reads and
        writes. Write until the device clears the DRQ bit. */
     for (size_t i = 0;;) {
         /* Is the device ready to transfer data? */
         ata_device->status = pci_device_region_read8(ata_device->pci_device, ata_device->region_num, ATA_STATUS);
+        io_stats_count(ata_device->io_stats, IO_STATS_POLLS, 1);
+        bool is_transferred = false;
         if ((ata_device->status & (ATA_BSY | ATA_DRQ)) == ATA_DRQ) {
             /* Transfer data */
+            io_stats_set_phase(ata_device->io_stats, IO_STATS_PHASE_DATA);
             for (size_t j = 0; j < 256; ++i, ++j) {
                 pci_device_region_write16(ata_device->pci_device, ata_device->region_num, ATA_DATA, data[i]);
             }
+
+            io_stats_count(ata_device->io_stats, IO_STATS_DATA, 256);
+            is_transferred = true;
+            io_stats_set_phase(ata_device->io_stats, IO_STATS_PHASE_POLL);
         }
 
         /* Has the command been completed? */
@@ -413,13 +652,20 @@ ata_device_command_pio_data_out(
         }
 
         /* Has the command timed out? */
-        clock_t end = clock();
-        if ((((double)(end - start)) / CLOCKS_PER_SEC) > ata_device->timeout) {
-            ata_device_software_reset(ata_device);
+        if (!ata_device_wait(ata_device, &deadline, is_transferred)) {
+            ata_device->is_timed_out = true;
             break;
         }
     }
 
+    /* Has the command timed out? */
+    io_stats_set_phase(ata_device->io_stats, IO_STATS_PHASE_COMPLETION);
+    if (ata_device->is_timed_out) {
+        errno = ETIMEDOUT;
+        goto err;
+    }
+
+    latency_add(ata_device->latency, command, count / 256, deadline_get_elapsed(&deadline));
     /* Has a device fault occurred? */
     if (ata_device->status & ATA_DF) {
         goto err;
@@ -461,13 +707,18 @@ ata_device_create(pci_device_t *pci_device, int bus_num, int timeout)
 
     ata_device->pci_device = pci_device;
     ata_device->region_num = (bus_num ? 2 : 0);
+    ata_device->bm_offset = BM_IDE_CHANNEL_OFFSET(bus_num);
     ata_device->timeout = timeout;
-    ata_device->identify_data = (uint16_t *)calloc(256, sizeof(*ata_device->identify_data));
-    if (ata_device->identify_data == NULL) {
+    /* Read-modify-writes of the Device register are served from the shadow */
+    pci_device_region_set_shadowed(ata_device->pci_device, ata_device->region_num, ATA_DEVICE, true);
+    ata_device->identify_buffer = guard_buffer_create(256 * sizeof(*ata_device->identify_data));
+    if (ata_device->identify_buffer == NULL) {
         ata_device_error(ata_device, 0, errno, __func__);
         goto err;
     }
 
+    ata_device->identify_data = (uint16_t *)guard_buffer_get_data(ata_device->identify_buffer);
+
     /* Is an ATA device? */
     if (ata_device_command_identify_device(ata_device) == -1) {
         ata_device_error(ata_device, 0, errno, __func__);
@@ -488,7 +739,7 @@ ata_device_destroy(ata_device_t *restrict ata_device)
         return;
     }
 
-    free(ata_device->identify_data);
+    guard_buffer_destroy(ata_device->identify_buffer);
     free(ata_device);
 }
 
@@ -505,6 +756,53 @@ ata_device_error(ata_device_t *restrict ata_device, int status, int error, const
     va_end(ap);
 }
 
+uint8_t
+ata_device_get_bm_status(ata_device_t *restrict ata_device)
+{
+    return ata_device->bm_status;
+}
+
+uint8_t
+ata_device_get_error(ata_device_t *restrict ata_device)
+{
+    return ata_device->error;
+}
+
+const uint16_t *
+ata_device_get_identify_data(ata_device_t *restrict ata_device)
+{
+    return ata_device->identify_data;
+}
+
+uint8_t
+ata_device_get_status(ata_device_t *restrict ata_device)
+{
+    return ata_device->status;
+}
+
+uint64_t
+ata_device_get_timeout(ata_device_t *restrict ata_device, uint16_t command, uint32_t sectors)
+{
+    if (ata_device->latency == NULL) {
+        return ata_device->timeout * DEADLINE_NS_PER_SEC;
+    }
+
+    return latency_get_timeout(ata_device->latency, command, sectors);
+}
+
+void
+ata_device_invalidate(ata_device_t *restrict ata_device)
+{
+    ata_device->valid[0] = 0;
+    ata_device->valid[1] = 0;
+}
+
+bool
+ata_device_is_timed_out(ata_device_t *restrict ata_device)
+{
+    return ata_device->is_timed_out;
+}
+
 ata_device_error_handler_t *
 ata_device_set_error_handler(ata_device_error_handler_t *handler)
 {
@@ -513,96 +811,162 @@ ata_device_set_error_handler(ata_device_error_handler_t *handler)
     return previous_handler;
 }
 
+void
+ata_device_set_device(ata_device_t *restrict ata_device, uint8_t device)
+{
+    /* Has the Device register already the contents? */
+    io_stats_set_phase(ata_device->io_stats, IO_STATS_PHASE_SETUP);
+    if ((ata_device->valid[0] & ATA_TASKFILE_DEVICE) && ata_device->device[0] == device) {
+        return;
+    }
+
+    ata_device->device[1] = ata_device->device[0];
+    ata_device->device[0] = device;
+    ata_device->valid[0] |= ATA_TASKFILE_DEVICE;
+    pci_device_region_write8(ata_device->pci_device, ata_device->region_num, ATA_DEVICE, ata_device->device[0]);
+}
+
+void
+ata_device_set_device_control(ata_device_t *restrict ata_device)
+{
+    /* Has the Device Control register already the contents? */
+    if (ata_device->is_device_control_valid) {
+        return;
+    }
+
+    pci_device_region_write8(ata_device->pci_device, ata_device->region_num + 1, ATA_DEVICE_CONTROL,
+            (ata_device->irq != NULL) ? 0 : ATA_nIEN);
+    ata_device->is_device_control_valid = true;
+}
+
 void
 ata_device_set_features(ata_device_t *restrict ata_device, uint8_t features)
 {
-    ata_device->features[1] = ata_device->features[0];
-    ata_device->features[0] = features;
-    pci_device_region_write8(ata_device->pci_device, ata_device->region_num, ATA_SECTOR_COUNT, ata_device->features[0]);
+    ata_device_set_register(ata_device, ATA_FEATURES, ata_device->features, ATA_TASKFILE_FEATURES, features);
+}
+
+void
+ata_device_set_io_stats(ata_device_t *restrict ata_device, io_stats_t *io_stats)
+{
+    ata_device->io_stats = io_stats;
+}
+
+void
+ata_device_set_idle_handler(ata_device_t *restrict ata_device, ata_device_idle_handler_t *handler, void *arg)
+{
+    ata_device->idle_handler = handler;
+    ata_device->idle_arg = arg;
+}
+
+void
+ata_device_set_irq(ata_device_t *restrict ata_device, irq_t *irq)
+{
+    ata_device->irq = irq;
+    /* Set or clear the nIEN bit before the next command */
+    ata_device->is_device_control_valid = false;
+}
+
+void
+ata_device_set_latency(ata_device_t *restrict ata_device, latency_t *latency)
+{
+    ata_device->latency = latency;
 }
 
 void
 ata_device_set_lba(ata_device_t *restrict ata_device, uint32_t lba)
 {
     /* Set LBA Low to LBA bits 0 to 7 */
-    ata_device->lba_low[1] = ata_device->lba_low[0];
-    ata_device->lba_low[0] = lba & 0xff;
-    pci_device_region_write8(ata_device->pci_device, ata_device->region_num, ATA_LBA_LOW, ata_device->lba_low[0]);
+    ata_device_set_register(ata_device, ATA_LBA_LOW, ata_device->lba_low, ATA_TASKFILE_LBA_LOW, lba & 0xff);
     /* Set LBA Mid to LBA bits 8 to 15 */
-    ata_device->lba_mid[1] = ata_device->lba_mid[0];
-    ata_device->lba_mid[0] = (lba >> 8) & 0xff;
-    pci_device_region_write8(ata_device->pci_device, ata_device->region_num, ATA_LBA_MID, ata_device->lba_mid[0]);
+    ata_device_set_register(ata_device, ATA_LBA_MID, ata_device->lba_mid, ATA_TASKFILE_LBA_MID, (lba >> 8) & 0xff);
     /* Set LBA High to LBA bits 16 to 23 */
-    ata_device->lba_high[1] = ata_device->lba_high[0];
-    ata_device->lba_high[0] = (lba >> 16) & 0xff;
-    pci_device_region_write8(ata_device->pci_device, ata_device->region_num, ATA_LBA_HIGH, ata_device->lba_high[0]);
+    ata_device_set_register(
+            ata_device, ATA_LBA_HIGH, ata_device->lba_high, ATA_TASKFILE_LBA_HIGH, (lba >> 16) & 0xff);
     /* Set Device LBA bit to one to specify the address is an LBA, and set the
        bits 0 to 3 to LBA bits 24 to 27 */
-    ata_device->device[1] = ata_device->device[0];
-    ata_device->device[0] = (pci_device_region_read8(ata_device->pci_device, ata_device->region_num, ATA_DEVICE) & 0xf0)
-                            | ATA_LBA | ((lba >> 24) & 0x0f);
-    pci_device_region_write8(ata_device->pci_device, ata_device->region_num, ATA_DEVICE, ata_device->device[0]);
+    ata_device_set_device(ata_device,
+            (pci_device_region_read8(ata_device->pci_device, ata_device->region_num, ATA_DEVICE) & 0xf0) | ATA_LBA
+                    | ((lba >> 24) & 0x0f));
 }
 
 void
 ata_device_set_lba48(ata_device_t *restrict ata_device, uint64_t lba)
 {
-    /* Set LBA Low Previous to LBA bits 24 to 31 */
-    ata_device->lba_low[1] = (lba >> 24) & 0xff;
-    pci_device_region_write8(ata_device->pci_device, ata_device->region_num, ATA_LBA_LOW, ata_device->lba_low[1]);
-    /* Set LBA Mid Previous to LBA bits 32 to 39 */
-    ata_device->lba_mid[1] = (lba >> 32) & 0xff;
-    pci_device_region_write8(ata_device->pci_device, ata_device->region_num, ATA_LBA_MID, ata_device->lba_mid[1]);
-    /* Set LBA High Previous to LBA bits 40 to 47 */
-    ata_device->lba_high[1] = (lba >> 40) & 0xff;
-    pci_device_region_write8(ata_device->pci_device, ata_device->region_num, ATA_LBA_HIGH, ata_device->lba_high[1]);
-    /* Set LBA Low Current to LBA bits 0 to 7 */
-    ata_device->lba_low[0] = lba & 0xff;
-    pci_device_region_write8(ata_device->pci_device, ata_device->region_num, ATA_LBA_LOW, ata_device->lba_low[0]);
-    /* Set LBA Mid Current to LBA bits 8 to 15 */
-    ata_device->lba_mid[0] = (lba >> 8) & 0xff;
-    pci_device_region_write8(ata_device->pci_device, ata_device->region_num, ATA_LBA_MID, ata_device->lba_mid[0]);
-    /* Set LBA High Current to LBA bits 16 to 23 */
-    ata_device->lba_high[0] = (lba >> 16) & 0xff;
-    pci_device_region_write8(ata_device->pci_device, ata_device->region_num, ATA_LBA_HIGH, ata_device->lba_high[0]);
+    /* Set LBA Low Previous/Current to LBA bits 24 to 31/0 to 7 */
+    ata_device_set_register16(
+            ata_device, ATA_LBA_LOW, ata_device->lba_low, ATA_TASKFILE_LBA_LOW, (lba >> 24) & 0xff, lba & 0xff);
+    /* Set LBA Mid Previous/Current to LBA bits 32 to 39/8 to 15 */
+    ata_device_set_register16(ata_device, ATA_LBA_MID, ata_device->lba_mid, ATA_TASKFILE_LBA_MID, (lba >> 32) & 0xff,
+            (lba >> 8) & 0xff);
+    /* Set LBA High Previous/Current to LBA bits 40 to 47/16 to 23 */
+    ata_device_set_register16(ata_device, ATA_LBA_HIGH, ata_device->lba_high, ATA_TASKFILE_LBA_HIGH,
+            (lba >> 40) & 0xff, (lba >> 16) & 0xff);
     /* Set Device LBA bit to one to specify the address is an LBA */
-    ata_device->device[1] = ata_device->device[0];
-    ata_device->device[0]
-            = (pci_device_region_read8(ata_device->pci_device, ata_device->region_num, ATA_DEVICE) & 0xf0) | ATA_LBA;
-    pci_device_region_write8(ata_device->pci_device, ata_device->region_num, ATA_DEVICE, ata_device->device[0]);
+    ata_device_set_device(ata_device,
+            (pci_device_region_read8(ata_device->pci_device, ata_device->region_num, ATA_DEVICE) & 0xf0) | ATA_LBA);
+}
+
+void
+ata_device_set_register(ata_device_t *restrict ata_device, size_t offset, uint8_t reg[2], int mask, uint8_t value)
+{
+    /* Has the register already the contents? */
+    io_stats_set_phase(ata_device->io_stats, IO_STATS_PHASE_SETUP);
+    if ((ata_device->valid[0] & mask) && reg[0] == value) {
+        return;
+    }
+
+    ata_device_write_register(ata_device, offset, reg, mask, value);
+}
+
+void
+ata_device_set_register16(
+        ata_device_t *restrict ata_device, size_t offset, uint8_t reg[2], int mask, uint8_t previous, uint8_t current)
+{
+    /* Has the register already the previous and current contents? */
+    io_stats_set_phase(ata_device->io_stats, IO_STATS_PHASE_SETUP);
+    if ((ata_device->valid[0] & mask) && (ata_device->valid[1] & mask) && reg[1] == previous && reg[0] == current) {
+        return;
+    }
+
+    /* Writing the current contents only also moves the contents of the
+       register to the previous contents. */
+    if (!(ata_device->valid[0] & mask) || reg[0] != previous) {
+        ata_device_write_register(ata_device, offset, reg, mask, previous);
+    }
+
+    ata_device_write_register(ata_device, offset, reg, mask, current);
 }
 
 void
 ata_device_set_sector_count(ata_device_t *restrict ata_device, uint8_t sectors)
 {
-    ata_device->sector_count[1] = ata_device->sector_count[0];
-    ata_device->sector_count[0] = sectors;
-    pci_device_region_write8(
-            ata_device->pci_device, ata_device->region_num, ATA_SECTOR_COUNT, ata_device->sector_count[0]);
+    ata_device_set_register(ata_device, ATA_SECTOR_COUNT, ata_device->sector_count, ATA_TASKFILE_SECTOR_COUNT, sectors);
 }
 
 void
 ata_device_set_sector_count16(ata_device_t *restrict ata_device, uint16_t sectors)
 {
-    /* Set Sector Count Previous to Sector Count bits 8 to 15 */
-    ata_device->sector_count[1] = (sectors >> 8) & 0xff;
-    pci_device_region_write8(
-            ata_device->pci_device, ata_device->region_num, ATA_SECTOR_COUNT, ata_device->sector_count[1]);
-    /* Set Sector Count Current to Sector Count bits 0 to 7 */
-    ata_device->sector_count[0] = sectors & 0xff;
-    pci_device_region_write8(
-            ata_device->pci_device, ata_device->region_num, ATA_SECTOR_COUNT, ata_device->sector_count[0]);
+    /* Set Sector Count Previous/Current to Sector Count bits 8 to 15/0 to 7 */
+    ata_device_set_register16(ata_device, ATA_SECTOR_COUNT, ata_device->sector_count, ATA_TASKFILE_SECTOR_COUNT,
+            (sectors >> 8) & 0xff, sectors & 0xff);
 }
 
 void
 ata_device_software_reset(ata_device_t *restrict ata_device)
 {
+    io_stats_set_phase(ata_device->io_stats, IO_STATS_PHASE_RESET);
     /* Request the devices to perform the software reset */
     pci_device_region_write8(
             ata_device->pci_device, ata_device->region_num + 1, ATA_DEVICE_CONTROL, ATA_nIEN | ATA_SRST);
     /* Reset Device Control SRST bit to zero after software reset */
     pci_device_region_write8(ata_device->pci_device, ata_device->region_num + 1, ATA_DEVICE_CONTROL, ATA_nIEN);
+    ata_device->is_device_control_valid = (ata_device->irq == NULL);
+    /* The software reset also resets the Command Block registers */
+    pci_device_region_invalidate(ata_device->pci_device, ata_device->region_num);
+    ata_device_invalidate(ata_device);
     /* Wait until the software reset has been completed */
+    deadline_t deadline;
+    deadline_start(&deadline, ata_device->timeout * DEADLINE_NS_PER_SEC);
     for (;;) {
         /* Is the device busy? */
         /* Don't use ata_device->status so the user can get the status after a
@@ -611,5 +975,42 @@ ata_device_software_reset(ata_device_t *restrict ata_device)
         if ((status & ATA_BSY) == 0) {
             break;
         }
+
+        /* Has the software reset timed out? */
+        if (!deadline_wait(&deadline)) {
+            break;
+        }
     }
 }
+
+bool
+ata_device_wait(ata_device_t *restrict ata_device, deadline_t *restrict deadline, bool is_interrupt)
+{
+    /* Let the idle handler work while the device is busy, without letting it
+       time out the command */
+    if (ata_device->idle_handler != NULL && !ata_device->is_idle_handled) {
+        ata_device->is_idle_handled = true;
+        uint64_t start = deadline_get_elapsed(deadline);
+        (*ata_device->idle_handler)(ata_device->idle_arg);
+        deadline_extend(deadline, deadline_get_elapsed(deadline) - start);
+    }
+
+    /* Does the device raise an interrupt when the status is updated? */
+    if (ata_device->irq != NULL && is_interrupt) {
+        return irq_wait(ata_device->irq, deadline_get_remaining(deadline)) == 0;
+    }
+
+    return deadline_wait(deadline);
+}
+
+void
+ata_device_write_register(ata_device_t *restrict ata_device, size_t offset, uint8_t reg[2], int mask, uint8_t value)
+{
+    /* The register is a two-byte FIFO: the current contents become the
+       previous contents. */
+    reg[1] = reg[0];
+    reg[0] = value;
+    ata_device->valid[1] = (ata_device->valid[1] & ~mask) | (ata_device->valid[0] & mask);
+    ata_device->valid[0] |= mask;
+    pci_device_region_write8(ata_device->pci_device, ata_device->region_num, offset, value);
+}
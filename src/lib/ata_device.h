@@ -7,14 +7,38 @@
 extern "C" {
 #endif
 
+#include "ata.h"
+#include "irq.h"
+#include "latency.h"
 #include "pci_device.h"
 
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdint.h>
 
 typedef struct _ata_device ata_device_t; /**< ATA device. */
 
 typedef void ata_device_error_handler_t(int status, int error, const char *restrict format, va_list ap);
+typedef void ata_device_idle_handler_t(void *arg);
+
+/**
+ * Sends a command to the device.
+ *
+ * Only the taskfile registers selected by the taskfile, and whose contents
+ * differ from what was last written to them, are written. The DEV bit of the
+ * Device register is preserved.
+ *
+ * @param [in] ata_device ATA device.
+ * @param [in] taskfile Taskfile. Any command code can be sent.
+ * @param [in] protocol Protocol (i.e., ATA_PROTOCOL_*). For the DMA protocols,
+ *   the bus master transfer must have been prepared by the controller.
+ * @param [in,out] data Data to be transferred, for the PIO protocols.
+ * @param [in] count Number of 16-bit values to be transferred, for the PIO
+ *   protocols.
+ * @return Returns zero on success; otherwise, returns -1 on failure.
+ */
+int ata_device_command(ata_device_t *restrict ata_device, const ata_taskfile_t *restrict taskfile, int protocol,
+        uint16_t *data, uint32_t count);
 
 /**
  * Requests the devices to perform the internal diagnostic tests.
@@ -322,6 +346,57 @@ ata_device_t *ata_device_create(pci_device_t *pci_device, int bus_num, int timeo
  */
 void ata_device_destroy(ata_device_t *restrict ata_device);
 
+/**
+ * Returns the Bus Master IDE Status register at the completion of the last DMA
+ * command (e.g., BM_IDE_ERROR if the bus master has failed).
+ *
+ * @param [in] ata_device ATA device.
+ * @return Bus Master IDE Status register.
+ */
+uint8_t ata_device_get_bm_status(ata_device_t *restrict ata_device);
+
+/**
+ * Returns the Error register at the completion of the last command that
+ * failed with an error (i.e., ATA_ERR in the Status register).
+ *
+ * @param [in] ata_device ATA device.
+ * @return Error register.
+ */
+uint8_t ata_device_get_error(ata_device_t *restrict ata_device);
+
+/**
+ * Returns the data transferred by the last IDENTIFY DEVICE command.
+ *
+ * @param [in] ata_device ATA device.
+ * @return IDENTIFY DEVICE data, 256 words long.
+ */
+const uint16_t *ata_device_get_identify_data(ata_device_t *restrict ata_device);
+
+/**
+ * Returns the Status register at the completion of the last command.
+ *
+ * @param [in] ata_device ATA device.
+ * @return Status register.
+ */
+uint8_t ata_device_get_status(ata_device_t *restrict ata_device);
+
+/**
+ * Forgets the contents last written to the taskfile registers (e.g., after the
+ * devices have been reset, or another device has been selected).
+ *
+ * @param [in] ata_device ATA device.
+ */
+void ata_device_invalidate(ata_device_t *restrict ata_device);
+
+/**
+ * Returns whether the last command has timed out. The devices have been reset
+ * after the timeout.
+ *
+ * @param [in] ata_device ATA device.
+ * @return Whether the last command has timed out.
+ */
+bool ata_device_is_timed_out(ata_device_t *restrict ata_device);
+
 /**
  * Sets the error handler for the ATA device.
  *
@@ -330,6 +405,46 @@ void ata_device_destroy(ata_device_t *restrict ata_device);
  */
 ata_device_error_handler_t *ata_device_set_error_handler(ata_device_error_handler_t *handler);
 
+/**
+ * Sets the idle handler, which does other work (e.g., prepares the next
+ * command) while the device is busy. It's called at most once per command,
+ * and the time it spends doesn't count toward the timeout of the command.
+ *
+ * @param [in] ata_device ATA device.
+ * @param [in] handler Idle handler, or NULL.
+ * @param [in] arg Argument of the idle handler.
+ */
+void ata_device_set_idle_handler(ata_device_t *restrict ata_device, ata_device_idle_handler_t *handler, void *arg);
+
+/**
+ * Sets the interrupt that signals the completion of the commands. If it's set,
+ * the interrupts of the device are enabled, and each command waits for the
+ * interrupt instead of polling the status; otherwise, the interrupts are
+ * disabled.
+ *
+ * @param [in] ata_device ATA device.
+ * @param [in] irq Interrupt, or NULL.
+ */
+void ata_device_set_irq(ata_device_t *restrict ata_device, irq_t *irq);
+
+/**
+ * Sets the latency model that learns the timeout of each command. If it's not
+ * set, every command times out after the timeout of the ATA device.
+ *
+ * @param [in] ata_device ATA device.
+ * @param [in] latency Latency model, or NULL.
+ */
+void ata_device_set_latency(ata_device_t *restrict ata_device, latency_t *latency);
+
+/**
+ * Sets the I/O statistics that count the register accesses of each phase of
+ * the commands.
+ *
+ * @param [in] ata_device ATA device.
+ * @param [in] io_stats I/O statistics, or NULL.
+ */
+void ata_device_set_io_stats(ata_device_t *restrict ata_device, io_stats_t *io_stats);
+
 #ifdef __cplusplus
 }
 #endif
@@ -3,27 +3,62 @@
 #include "ata_fuzzer.h"
 
 #include "ata_controller.h"
+#include "bus_master.h"
+#include "guard_buffer.h"
 #include "input.h"
+#include "leak_scanner.h"
+#include "shadow_disk.h"
 
 #include <errno.h>
+#include <setjmp.h>
 #include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #define MAX_DATA (sizeof(uint16_t) * UINT16_MAX)
+/* Hits of a scan that are logged */
+#define MAX_LEAK_HITS 8
+/* Addresses and sector counts as the device sees them (i.e., zero sectors is
+   256 or 65536) */
+#define LBA28(lba) ((lba) & 0x0fffffff)
+#define LBA48(lba) ((lba) & 0xffffffffffffULL)
+#define SECTORS28(sectors) ((sectors) ? (uint32_t)(sectors) : 0x100)
+#define SECTORS48(sectors) ((sectors) ? (uint32_t)(sectors) : 0x10000)
 
 struct _ata_fuzzer {
     ata_controller_t *ata_controller;
     int device_num;
+    ata_fuzzer_commit_handler_t *commit_handler;
     ata_fuzzer_log_handler_t *log_handler;
     FILE *log_stream;
+    blob_store_t *blob_store;
+    shadow_disk_t *shadow_disk;
+    leak_scanner_t *leak_scanner;
+    /* Transfer buffer, between guard pages that catch a device transferring
+       past it */
+    guard_buffer_t *data_buffer;
+    sigjmp_buf recovery;
 };
 
 static ata_fuzzer_error_handler_t *error_handler = NULL;
 
+void ata_fuzzer_check_sectors(
+        ata_fuzzer_t *restrict ata_fuzzer, uint64_t lba, uint32_t sectors, const void *data, size_t size);
+bool ata_fuzzer_derive_sg_layout(ata_fuzzer_t *restrict ata_fuzzer, FILE *restrict stream);
 void ata_fuzzer_error(ata_fuzzer_t *restrict ata_fuzzer, int status, int error, const char *restrict format, ...);
+bool ata_fuzzer_execute(ata_fuzzer_t *restrict ata_fuzzer, FILE *restrict stream);
 void ata_fuzzer_log(ata_fuzzer_t *restrict ata_fuzzer, const char *restrict format, ...);
+void ata_fuzzer_log_dma_status(ata_fuzzer_t *restrict ata_fuzzer);
+void ata_fuzzer_plant_canary(ata_fuzzer_t *restrict ata_fuzzer, void *data, size_t size);
+void ata_fuzzer_record_sectors(ata_fuzzer_t *restrict ata_fuzzer, bool is_written, uint64_t lba, uint32_t sectors,
+        const void *data, size_t size, uint8_t writer);
+int ata_fuzzer_reset(ata_fuzzer_t *restrict ata_fuzzer);
+void ata_fuzzer_scan_data(ata_fuzzer_t *restrict ata_fuzzer, const void *data, size_t size, int checks);
+uint64_t ata_fuzzer_store_dma_payload(ata_fuzzer_t *restrict ata_fuzzer, const void *data, uint32_t count, bool is_sg);
+uint64_t ata_fuzzer_store_payload(ata_fuzzer_t *restrict ata_fuzzer, const void *data, size_t size);
 
 ata_fuzzer_t *
 ata_fuzzer_create(ata_controller_t *restrict ata_controller, int device_num)
@@ -40,6 +75,13 @@ ata_fuzzer_create(ata_controller_t *restrict ata_controller, int device_num)
         return NULL;
     }
 
+    ata_fuzzer->data_buffer = guard_buffer_create(MAX_DATA * sizeof(uint16_t));
+    if (ata_fuzzer->data_buffer == NULL) {
+        ata_fuzzer_error(ata_fuzzer, 0, errno, __func__);
+        free(ata_fuzzer);
+        return NULL;
+    }
+
     ata_fuzzer->ata_controller = ata_controller;
     ata_fuzzer->device_num = device_num;
     return ata_fuzzer;
@@ -52,9 +94,62 @@ ata_fuzzer_destroy(ata_fuzzer_t *restrict ata_fuzzer)
         return;
     }
 
+    guard_buffer_destroy(ata_fuzzer->data_buffer);
     free(ata_fuzzer);
 }
 
+void
+ata_fuzzer_check_sectors(
+        ata_fuzzer_t *restrict ata_fuzzer, uint64_t lba, uint32_t sectors, const void *data, size_t size)
+{
+    /* Has the device left any of the canary in the sectors transferred? */
+    size_t sectors_size = (size_t)sectors * SHADOW_DISK_SECTOR_SIZE;
+    ata_fuzzer_scan_data(ata_fuzzer, data, (size < sectors_size) ? size : sectors_size, LEAK_SCANNER_CANARY);
+    /* Has the device transferred all the sectors into the data? */
+    if (ata_fuzzer->shadow_disk == NULL || size < sectors_size) {
+        return;
+    }
+
+    uint64_t mismatch_lba;
+    uint8_t writer;
+    if (!shadow_disk_check(ata_fuzzer->shadow_disk, lba, data, sectors, &mismatch_lba, &writer)) {
+        ata_fuzzer_log(ata_fuzzer, "squ", "finding", "MISMATCH", "lba", mismatch_lba, "writer", writer);
+    }
+}
+
+void
+ata_fuzzer_commit_log(ata_fuzzer_t *restrict ata_fuzzer)
+{
+    if (ata_fuzzer->commit_handler == NULL) {
+        return;
+    }
+
+    (*ata_fuzzer->commit_handler)(ata_fuzzer->log_stream);
+}
+
+bool
+ata_fuzzer_derive_sg_layout(ata_fuzzer_t *restrict ata_fuzzer, FILE *restrict stream)
+{
+    /* Keep the contiguous PRDT for half of the DMA commands */
+    if (input_derive_range(stream, 0, 1) == 0) {
+        return false;
+    }
+
+    /* The PRDs may be short, odd, zero (i.e., 64K), spread over the pool of
+       DMA buffers, and end before or after the sector count */
+    ata_controller_prd_t prds[ATA_CONTROLLER_MAX_SG_PRDS];
+    size_t num_prds = ((size_t)input_read8(stream) % ATA_CONTROLLER_MAX_SG_PRDS) + 1;
+    for (size_t i = 0; i < num_prds; ++i) {
+        prds[i].buffer_num = input_read8(stream);
+        prds[i].offset = input_read32(stream);
+        prds[i].count = input_read16(stream);
+        ata_fuzzer_log(ata_fuzzer, "zuuu", "prd", i, "buffer", prds[i].buffer_num, "offset", prds[i].offset, "count",
+                prds[i].count);
+    }
+
+    return ata_controller_set_sg_layout(ata_fuzzer->ata_controller, prds, num_prds) == 0;
+}
+
 void
 ata_fuzzer_error(ata_fuzzer_t *restrict ata_fuzzer, int status, int error, const char *restrict format, ...)
 {
@@ -68,13 +163,11 @@ ata_fuzzer_error(ata_fuzzer_t *restrict ata_fuzzer, int status, int error, const
     va_end(ap);
 }
 
-void
-ata_fuzzer_iterate(ata_fuzzer_t *restrict ata_fuzzer, FILE *restrict stream)
+bool
+ata_fuzzer_execute(ata_fuzzer_t *restrict ata_fuzzer, FILE *restrict stream)
 {
-    uint16_t data[MAX_DATA];
-    ata_controller_device_reset(ata_fuzzer->ata_controller);
-    ata_controller_device_select(ata_fuzzer->ata_controller, ata_fuzzer->device_num);
-    switch (input_derive_range(stream, 0, 24)) {
+    uint16_t *data = (uint16_t *)guard_buffer_get_data(ata_fuzzer->data_buffer);
+    switch (input_derive_range(stream, 0, 25)) {
     case 0: {
         ata_fuzzer_log(ata_fuzzer, "s", "command", "EXECUTE DEVICE DIAGNOSTIC");
         ata_controller_command_execute_device_diagnostic(ata_fuzzer->ata_controller);
@@ -95,35 +188,62 @@ ata_fuzzer_iterate(ata_fuzzer_t *restrict ata_fuzzer, FILE *restrict stream)
 
     case 3: {
         ata_fuzzer_log(ata_fuzzer, "s", "command", "IDENTIFY DEVICE");
-        ata_controller_command_identify_device(ata_fuzzer->ata_controller);
+        if (ata_controller_command_identify_device(ata_fuzzer->ata_controller) == 0) {
+            ata_fuzzer_scan_data(ata_fuzzer, ata_controller_get_identify_data(ata_fuzzer->ata_controller),
+                    256 * sizeof(uint16_t), LEAK_SCANNER_POINTERS | LEAK_SCANNER_ENTROPY);
+        }
         break;
     }
 
     case 4: {
         if (!ata_controller_is_dma_enabled(ata_fuzzer->ata_controller)) {
-            return;
+            return false;
         }
 
         uint8_t sectors = input_derive_range(stream, 0, 128);
         uint32_t lba = input_read32(stream);
         uint16_t count = input_read16(stream);
-        ata_fuzzer_log(ata_fuzzer, "suupu", "command", "READ DMA", "sectors", sectors, "lba", lba, "data", data,
+        uint8_t *buffer = ata_controller_get_dma_buffer(ata_fuzzer->ata_controller);
+        bool is_sg = ata_fuzzer_derive_sg_layout(ata_fuzzer, stream);
+        ata_fuzzer_log(ata_fuzzer, "suupu", "command", "READ DMA", "sectors", sectors, "lba", lba, "data", buffer,
                 "count", count);
-        ata_controller_command_read_dma(ata_fuzzer->ata_controller, sectors, lba, data, count);
+        if (is_sg) {
+            ata_fuzzer_commit_log(ata_fuzzer);
+        }
+
+        ata_fuzzer_plant_canary(ata_fuzzer, buffer, count);
+        int result = ata_controller_command_read_dma(
+                ata_fuzzer->ata_controller, sectors, lba, (uint16_t *)buffer, count);
+        ata_fuzzer_log_dma_status(ata_fuzzer);
+        if (result == 0 && !is_sg) {
+            ata_fuzzer_check_sectors(ata_fuzzer, LBA28(lba), SECTORS28(sectors), buffer, count);
+        }
         break;
     }
 
     case 5: {
         if (!ata_controller_is_dma_enabled(ata_fuzzer->ata_controller)) {
-            return;
+            return false;
         }
 
         uint16_t sectors = input_derive_range(stream, 0, 128);
         uint64_t lba = input_read64(stream);
         uint16_t count = input_read16(stream);
-        ata_fuzzer_log(ata_fuzzer, "suqpu", "command", "READ DMA EXT", "sectors", sectors, "lba", lba, "data", data,
+        uint8_t *buffer = ata_controller_get_dma_buffer(ata_fuzzer->ata_controller);
+        bool is_sg = ata_fuzzer_derive_sg_layout(ata_fuzzer, stream);
+        ata_fuzzer_log(ata_fuzzer, "suqpu", "command", "READ DMA EXT", "sectors", sectors, "lba", lba, "data", buffer,
                 "count", count);
-        ata_controller_command_read_dma_ext(ata_fuzzer->ata_controller, sectors, lba, data, count);
+        if (is_sg) {
+            ata_fuzzer_commit_log(ata_fuzzer);
+        }
+
+        ata_fuzzer_plant_canary(ata_fuzzer, buffer, count);
+        int result = ata_controller_command_read_dma_ext(
+                ata_fuzzer->ata_controller, sectors, lba, (uint16_t *)buffer, count);
+        ata_fuzzer_log_dma_status(ata_fuzzer);
+        if (result == 0 && !is_sg) {
+            ata_fuzzer_check_sectors(ata_fuzzer, LBA48(lba), SECTORS48(sectors), buffer, count);
+        }
         break;
     }
 
@@ -133,7 +253,11 @@ ata_fuzzer_iterate(ata_fuzzer_t *restrict ata_fuzzer, FILE *restrict stream)
         uint16_t count = input_read16(stream);
         ata_fuzzer_log(ata_fuzzer, "suupu", "command", "READ MULTIPLE", "sectors", sectors, "lba", lba, "data", data,
                 "count", count);
-        ata_controller_command_read_multiple(ata_fuzzer->ata_controller, sectors, lba, data, count);
+        ata_fuzzer_plant_canary(ata_fuzzer, data, (size_t)count * 2);
+        int result = ata_controller_command_read_multiple(ata_fuzzer->ata_controller, sectors, lba, data, count);
+        if (result == 0) {
+            ata_fuzzer_check_sectors(ata_fuzzer, LBA28(lba), SECTORS28(sectors), data, (size_t)count * 2);
+        }
         break;
     }
 
@@ -143,7 +267,11 @@ ata_fuzzer_iterate(ata_fuzzer_t *restrict ata_fuzzer, FILE *restrict stream)
         uint16_t count = input_read16(stream);
         ata_fuzzer_log(ata_fuzzer, "suqpu", "command", "READ MULTIPLE EXT", "sectors", sectors, "lba", lba, "data",
                 data, "count", count);
-        ata_controller_command_read_multiple_ext(ata_fuzzer->ata_controller, sectors, lba, data, count);
+        ata_fuzzer_plant_canary(ata_fuzzer, data, (size_t)count * 2);
+        int result = ata_controller_command_read_multiple_ext(ata_fuzzer->ata_controller, sectors, lba, data, count);
+        if (result == 0) {
+            ata_fuzzer_check_sectors(ata_fuzzer, LBA48(lba), SECTORS48(sectors), data, (size_t)count * 2);
+        }
         break;
     }
 
@@ -153,7 +281,11 @@ ata_fuzzer_iterate(ata_fuzzer_t *restrict ata_fuzzer, FILE *restrict stream)
         uint16_t count = input_read16(stream);
         ata_fuzzer_log(ata_fuzzer, "suupu", "command", "READ SECTOR(S)", "sectors", sectors, "lba", lba, "data", data,
                 "count", count);
-        ata_controller_command_read_sectors(ata_fuzzer->ata_controller, sectors, lba, data, count);
+        ata_fuzzer_plant_canary(ata_fuzzer, data, (size_t)count * 2);
+        int result = ata_controller_command_read_sectors(ata_fuzzer->ata_controller, sectors, lba, data, count);
+        if (result == 0) {
+            ata_fuzzer_check_sectors(ata_fuzzer, LBA28(lba), SECTORS28(sectors), data, (size_t)count * 2);
+        }
         break;
     }
 
@@ -163,7 +295,11 @@ ata_fuzzer_iterate(ata_fuzzer_t *restrict ata_fuzzer, FILE *restrict stream)
         uint16_t count = input_read16(stream);
         ata_fuzzer_log(ata_fuzzer, "suqpu", "command", "READ SECTOR(S) EXT", "sectors", sectors, "lba", lba, "data",
                 data, "count", count);
-        ata_controller_command_read_sectors_ext(ata_fuzzer->ata_controller, sectors, lba, data, count);
+        ata_fuzzer_plant_canary(ata_fuzzer, data, (size_t)count * 2);
+        int result = ata_controller_command_read_sectors_ext(ata_fuzzer->ata_controller, sectors, lba, data, count);
+        if (result == 0) {
+            ata_fuzzer_check_sectors(ata_fuzzer, LBA48(lba), SECTORS48(sectors), data, (size_t)count * 2);
+        }
         break;
     }
 
@@ -208,29 +344,57 @@ ata_fuzzer_iterate(ata_fuzzer_t *restrict ata_fuzzer, FILE *restrict stream)
 
     case 15: {
         if (!ata_controller_is_dma_enabled(ata_fuzzer->ata_controller)) {
-            return;
+            return false;
         }
 
         uint8_t sectors = input_derive_range(stream, 0, 128);
         uint32_t lba = input_read32(stream);
         uint16_t count = input_read16(stream);
-        ata_fuzzer_log(ata_fuzzer, "suupu", "command", "WRITE DMA", "sectors", sectors, "lba", lba, "data", data,
-                "count", count);
-        ata_controller_command_write_dma(ata_fuzzer->ata_controller, sectors, lba, data, count);
+        uint8_t *buffer = ata_controller_get_dma_buffer(ata_fuzzer->ata_controller);
+        /* Generate the payload in place in the DMA buffer */
+        input_read_string8(stream, buffer, count);
+        bool is_sg = ata_fuzzer_derive_sg_layout(ata_fuzzer, stream);
+        uint64_t blob = ata_fuzzer_store_dma_payload(ata_fuzzer, buffer, count, is_sg);
+        ata_fuzzer_log(ata_fuzzer, "suupuh", "command", "WRITE DMA", "sectors", sectors, "lba", lba, "data", buffer,
+                "count", count, "blob", blob);
+        if (is_sg) {
+            ata_fuzzer_commit_log(ata_fuzzer);
+        }
+
+        int result = ata_controller_command_write_dma(
+                ata_fuzzer->ata_controller, sectors, lba, (uint16_t *)buffer, count);
+        ata_fuzzer_log_dma_status(ata_fuzzer);
+        /* The scatter-gather layout may not write the buffer as it is */
+        ata_fuzzer_record_sectors(
+                ata_fuzzer, result == 0 && !is_sg, LBA28(lba), SECTORS28(sectors), buffer, count, ATA_WRITE_DMA);
         break;
     }
 
     case 16: {
         if (!ata_controller_is_dma_enabled(ata_fuzzer->ata_controller)) {
-            return;
+            return false;
         }
 
         uint16_t sectors = input_derive_range(stream, 0, 128);
         uint64_t lba = input_read64(stream);
         uint16_t count = input_read16(stream);
-        ata_fuzzer_log(ata_fuzzer, "suqpu", "command", "WRITE DMA EXT", "sectors", sectors, "lba", lba, "data", data,
-                "count", count);
-        ata_controller_command_write_dma_ext(ata_fuzzer->ata_controller, sectors, lba, data, count);
+        uint8_t *buffer = ata_controller_get_dma_buffer(ata_fuzzer->ata_controller);
+        /* Generate the payload in place in the DMA buffer */
+        input_read_string8(stream, buffer, count);
+        bool is_sg = ata_fuzzer_derive_sg_layout(ata_fuzzer, stream);
+        uint64_t blob = ata_fuzzer_store_dma_payload(ata_fuzzer, buffer, count, is_sg);
+        ata_fuzzer_log(ata_fuzzer, "suqpuh", "command", "WRITE DMA EXT", "sectors", sectors, "lba", lba, "data", buffer,
+                "count", count, "blob", blob);
+        if (is_sg) {
+            ata_fuzzer_commit_log(ata_fuzzer);
+        }
+
+        int result = ata_controller_command_write_dma_ext(
+                ata_fuzzer->ata_controller, sectors, lba, (uint16_t *)buffer, count);
+        ata_fuzzer_log_dma_status(ata_fuzzer);
+        /* The scatter-gather layout may not write the buffer as it is */
+        ata_fuzzer_record_sectors(
+                ata_fuzzer, result == 0 && !is_sg, LBA48(lba), SECTORS48(sectors), buffer, count, ATA_WRITE_DMA_EXT);
         break;
     }
 
@@ -239,9 +403,12 @@ ata_fuzzer_iterate(ata_fuzzer_t *restrict ata_fuzzer, FILE *restrict stream)
         uint32_t lba = input_read32(stream);
         uint16_t count = input_read16(stream);
         input_read_string16(stream, data, count);
-        ata_fuzzer_log(ata_fuzzer, "suupu", "command", "WRITE MULTIPLE", "sectors", sectors, "lba", lba, "data", data,
-                "count", count);
-        ata_controller_command_write_multiple(ata_fuzzer->ata_controller, sectors, lba, data, count);
+        uint64_t blob = ata_fuzzer_store_payload(ata_fuzzer, data, (size_t)count * 2);
+        ata_fuzzer_log(ata_fuzzer, "suupuh", "command", "WRITE MULTIPLE", "sectors", sectors, "lba", lba, "data", data,
+                "count", count, "blob", blob);
+        int result = ata_controller_command_write_multiple(ata_fuzzer->ata_controller, sectors, lba, data, count);
+        ata_fuzzer_record_sectors(
+                ata_fuzzer, result == 0, LBA28(lba), SECTORS28(sectors), data, (size_t)count * 2, ATA_WRITE_MULTIPLE);
         break;
     }
 
@@ -250,9 +417,12 @@ ata_fuzzer_iterate(ata_fuzzer_t *restrict ata_fuzzer, FILE *restrict stream)
         uint64_t lba = input_read64(stream);
         uint16_t count = input_read16(stream);
         input_read_string16(stream, data, count);
-        ata_fuzzer_log(ata_fuzzer, "suqpu", "command", "WRITE MULTIPLE EXT", "sectors", sectors, "lba", lba, "data",
-                data, "count", count);
-        ata_controller_command_write_multiple_ext(ata_fuzzer->ata_controller, sectors, lba, data, count);
+        uint64_t blob = ata_fuzzer_store_payload(ata_fuzzer, data, (size_t)count * 2);
+        ata_fuzzer_log(ata_fuzzer, "suqpuh", "command", "WRITE MULTIPLE EXT", "sectors", sectors, "lba", lba, "data",
+                data, "count", count, "blob", blob);
+        int result = ata_controller_command_write_multiple_ext(ata_fuzzer->ata_controller, sectors, lba, data, count);
+        ata_fuzzer_record_sectors(ata_fuzzer, result == 0, LBA48(lba), SECTORS48(sectors), data, (size_t)count * 2,
+                ATA_WRITE_MULTIPLE_EXT);
         break;
     }
 
@@ -261,9 +431,12 @@ ata_fuzzer_iterate(ata_fuzzer_t *restrict ata_fuzzer, FILE *restrict stream)
         uint32_t lba = input_read32(stream);
         uint16_t count = input_read16(stream);
         input_read_string16(stream, data, count);
-        ata_fuzzer_log(ata_fuzzer, "suupu", "command", "WRITE SECTOR(S)", "sectors", sectors, "lba", lba, "data", data,
-                "count", count);
-        ata_controller_command_write_sectors(ata_fuzzer->ata_controller, sectors, lba, data, count);
+        uint64_t blob = ata_fuzzer_store_payload(ata_fuzzer, data, (size_t)count * 2);
+        ata_fuzzer_log(ata_fuzzer, "suupuh", "command", "WRITE SECTOR(S)", "sectors", sectors, "lba", lba, "data", data,
+                "count", count, "blob", blob);
+        int result = ata_controller_command_write_sectors(ata_fuzzer->ata_controller, sectors, lba, data, count);
+        ata_fuzzer_record_sectors(
+                ata_fuzzer, result == 0, LBA28(lba), SECTORS28(sectors), data, (size_t)count * 2, ATA_WRITE_SECTORS);
         break;
     }
 
@@ -272,9 +445,12 @@ ata_fuzzer_iterate(ata_fuzzer_t *restrict ata_fuzzer, FILE *restrict stream)
         uint64_t lba = input_read64(stream);
         uint16_t count = input_read16(stream);
         input_read_string16(stream, data, count);
-        ata_fuzzer_log(ata_fuzzer, "suqpu", "command", "WRITE SECTOR(S) EXT", "sectors", sectors, "lba", lba, "data",
-                data, "count", count);
-        ata_controller_command_write_sectors_ext(ata_fuzzer->ata_controller, sectors, lba, data, count);
+        uint64_t blob = ata_fuzzer_store_payload(ata_fuzzer, data, (size_t)count * 2);
+        ata_fuzzer_log(ata_fuzzer, "suqpuh", "command", "WRITE SECTOR(S) EXT", "sectors", sectors, "lba", lba, "data",
+                data, "count", count, "blob", blob);
+        int result = ata_controller_command_write_sectors_ext(ata_fuzzer->ata_controller, sectors, lba, data, count);
+        ata_fuzzer_record_sectors(ata_fuzzer, result == 0, LBA48(lba), SECTORS48(sectors), data, (size_t)count * 2,
+                ATA_WRITE_SECTORS_EXT);
         break;
     }
 
@@ -283,8 +459,10 @@ ata_fuzzer_iterate(ata_fuzzer_t *restrict ata_fuzzer, FILE *restrict stream)
         uint8_t sectors = input_derive_range(stream, 0, 128);
         uint16_t count = input_read16(stream);
         input_read_string16(stream, data, count);
-        ata_fuzzer_log(ata_fuzzer, "suupu", "command", "DOWNLOAD MICROCODE", "code", code, "sectors", sectors, "data",
-                data, "count", count);
+        uint64_t blob = ata_fuzzer_store_payload(ata_fuzzer, data, (size_t)count * 2);
+        ata_fuzzer_log(ata_fuzzer, "suupuh", "command", "DOWNLOAD MICROCODE", "code", code, "sectors", sectors, "data",
+                data, "count", count, "blob", blob);
+        ata_fuzzer_commit_log(ata_fuzzer);
         ata_controller_command_download_microcode(ata_fuzzer->ata_controller, code, sectors, data, count);
         break;
     }
@@ -299,21 +477,137 @@ ata_fuzzer_iterate(ata_fuzzer_t *restrict ata_fuzzer, FILE *restrict stream)
     case 23: {
         uint16_t count = input_read16(stream);
         ata_fuzzer_log(ata_fuzzer, "spu", "command", "READ BUFFER", "data", data, "count", count);
-        ata_controller_command_read_buffer(ata_fuzzer->ata_controller, data, count);
+        ata_fuzzer_plant_canary(ata_fuzzer, data, (size_t)count * 2);
+        if (ata_controller_command_read_buffer(ata_fuzzer->ata_controller, data, count) == 0) {
+            ata_fuzzer_scan_data(ata_fuzzer, data, (size_t)count * 2, LEAK_SCANNER_POINTERS);
+        }
         break;
     }
 
     case 24: {
         uint16_t count = input_read16(stream);
         input_read_string16(stream, data, count);
-        ata_fuzzer_log(ata_fuzzer, "spu", "command", "WRITE BUFFER", "data", data, "count", count);
+        uint64_t blob = ata_fuzzer_store_payload(ata_fuzzer, data, (size_t)count * 2);
+        ata_fuzzer_log(ata_fuzzer, "spuh", "command", "WRITE BUFFER", "data", data, "count", count, "blob", blob);
         ata_controller_command_write_buffer(ata_fuzzer->ata_controller, data, count);
         break;
     }
 
+    case 25: {
+        ata_taskfile_t taskfile;
+        taskfile.command = input_read8(stream);
+        int protocol = input_derive_range(stream, ATA_PROTOCOL_NON_DATA, ATA_PROTOCOL_DMA_OUT);
+        taskfile.registers = input_read8(stream);
+        taskfile.features = input_read8(stream);
+        taskfile.features_hob = input_read8(stream);
+        taskfile.sector_count = input_read8(stream);
+        taskfile.sector_count_hob = input_read8(stream);
+        taskfile.lba_low = input_read8(stream);
+        taskfile.lba_low_hob = input_read8(stream);
+        taskfile.lba_mid = input_read8(stream);
+        taskfile.lba_mid_hob = input_read8(stream);
+        taskfile.lba_high = input_read8(stream);
+        taskfile.lba_high_hob = input_read8(stream);
+        taskfile.device = input_read8(stream);
+        if ((protocol == ATA_PROTOCOL_DMA_IN || protocol == ATA_PROTOCOL_DMA_OUT)
+                && !ata_controller_is_dma_enabled(ata_fuzzer->ata_controller)) {
+            return false;
+        }
+
+        uint16_t count = input_read16(stream);
+        uint16_t *buffer = data;
+        bool is_sg = false;
+        if (protocol == ATA_PROTOCOL_PIO_DATA_OUT) {
+            input_read_string16(stream, buffer, count);
+        } else if (protocol == ATA_PROTOCOL_DMA_IN || protocol == ATA_PROTOCOL_DMA_OUT) {
+            /* Transfer in place in the DMA buffer, where the count is in
+               bytes */
+            buffer = ata_controller_get_dma_buffer(ata_fuzzer->ata_controller);
+            if (protocol == ATA_PROTOCOL_DMA_OUT) {
+                input_read_string8(stream, (uint8_t *)buffer, count);
+            }
+
+            is_sg = ata_fuzzer_derive_sg_layout(ata_fuzzer, stream);
+        }
+
+        uint64_t lba = ((uint64_t)taskfile.lba_high_hob << 40) | ((uint64_t)taskfile.lba_mid_hob << 32)
+                       | ((uint64_t)taskfile.lba_low_hob << 24) | ((uint64_t)taskfile.lba_high << 16)
+                       | ((uint64_t)taskfile.lba_mid << 8) | taskfile.lba_low;
+        uint64_t blob = 0;
+        if (protocol == ATA_PROTOCOL_PIO_DATA_OUT) {
+            blob = ata_fuzzer_store_payload(ata_fuzzer, buffer, (size_t)count * 2);
+        } else if (protocol == ATA_PROTOCOL_DMA_OUT) {
+            blob = ata_fuzzer_store_dma_payload(ata_fuzzer, buffer, count, is_sg);
+        }
+
+        ata_fuzzer_log(ata_fuzzer, "suuuuuqupuh", "command", "COMMAND", "code", taskfile.command, "protocol", protocol,
+                "registers", taskfile.registers, "features", (taskfile.features_hob << 8) | taskfile.features,
+                "sectors", (taskfile.sector_count_hob << 8) | taskfile.sector_count, "lba", lba, "device",
+                taskfile.device, "data", buffer, "count", count, "blob", blob);
+        ata_fuzzer_commit_log(ata_fuzzer);
+        /* The data in is scanned for pointers only, since how much the
+           command transfers is unknown */
+        if (protocol == ATA_PROTOCOL_PIO_DATA_IN) {
+            ata_fuzzer_plant_canary(ata_fuzzer, buffer, (size_t)count * 2);
+        } else if (protocol == ATA_PROTOCOL_DMA_IN) {
+            ata_fuzzer_plant_canary(ata_fuzzer, buffer, count);
+        }
+
+        int result = ata_controller_command(ata_fuzzer->ata_controller, &taskfile, protocol, buffer, count);
+        if (protocol == ATA_PROTOCOL_DMA_IN || protocol == ATA_PROTOCOL_DMA_OUT) {
+            ata_fuzzer_log_dma_status(ata_fuzzer);
+        }
+
+        if (result == 0 && protocol == ATA_PROTOCOL_PIO_DATA_IN) {
+            ata_fuzzer_scan_data(ata_fuzzer, buffer, (size_t)count * 2, LEAK_SCANNER_POINTERS);
+        } else if (result == 0 && protocol == ATA_PROTOCOL_DMA_IN) {
+            ata_fuzzer_scan_data(ata_fuzzer, buffer, count, LEAK_SCANNER_POINTERS);
+        }
+
+        /* The command may have written anywhere */
+        if (ata_fuzzer->shadow_disk != NULL) {
+            shadow_disk_clear(ata_fuzzer->shadow_disk);
+        }
+        break;
+    }
+
     default:
         abort();
     }
+
+    return true;
+}
+
+void
+ata_fuzzer_iterate(ata_fuzzer_t *restrict ata_fuzzer, FILE *restrict stream)
+{
+    if (ata_fuzzer_reset(ata_fuzzer) == -1) {
+        return;
+    }
+
+    /* Has the device transferred past the transfer buffer? */
+    if (sigsetjmp(ata_fuzzer->recovery, 1) != 0) {
+        guard_buffer_set_recovery(NULL);
+        ata_fuzzer_log(ata_fuzzer, "sp", "finding", "OVER-TRANSFER", "address", guard_buffer_get_fault_addr());
+        return;
+    }
+
+    guard_buffer_set_recovery(&ata_fuzzer->recovery);
+    bool is_executed = ata_fuzzer_execute(ata_fuzzer, stream);
+    guard_buffer_set_recovery(NULL);
+    if (!is_executed) {
+        return;
+    }
+
+    /* The Error register is valid only if the command has failed with an
+       error */
+    uint8_t status = ata_controller_get_status(ata_fuzzer->ata_controller);
+    uint8_t error = (status & ATA_ERR) ? ata_controller_get_error(ata_fuzzer->ata_controller) : 0;
+    ata_fuzzer_log(ata_fuzzer, "xx", "status", status, "error", error);
+    /* Has the command hung? */
+    if (ata_controller_is_timed_out(ata_fuzzer->ata_controller)) {
+        ata_fuzzer_log(ata_fuzzer, "s", "finding", "TIMEOUT");
+    }
 }
 
 void
@@ -329,6 +623,117 @@ ata_fuzzer_log(ata_fuzzer_t *restrict ata_fuzzer, const char *restrict format, .
     va_end(ap);
 }
 
+void
+ata_fuzzer_log_dma_status(ata_fuzzer_t *restrict ata_fuzzer)
+{
+    /* Has the bus master failed? */
+    uint8_t bm_status = ata_controller_get_bm_status(ata_fuzzer->ata_controller);
+    if (bm_status & BM_IDE_ERROR) {
+        ata_fuzzer_log(ata_fuzzer, "su", "finding", "BM ERROR", "bm_status", bm_status);
+    }
+
+    /* Has the device written outside of the transfer? */
+    uint8_t command;
+    size_t buffer_num;
+    ptrdiff_t offset;
+    if (ata_controller_get_dma_overrun(ata_fuzzer->ata_controller, &command, &buffer_num, &offset)) {
+        ata_fuzzer_log(ata_fuzzer, "sxzd", "finding", "DMA OVERRUN", "command", command, "buffer", buffer_num,
+                "offset", (int)offset);
+    }
+}
+
+void
+ata_fuzzer_plant_canary(ata_fuzzer_t *restrict ata_fuzzer, void *data, size_t size)
+{
+    if (ata_fuzzer->leak_scanner != NULL) {
+        leak_scanner_plant(ata_fuzzer->leak_scanner, data, size);
+    }
+}
+
+void
+ata_fuzzer_record_sectors(ata_fuzzer_t *restrict ata_fuzzer, bool is_written, uint64_t lba, uint32_t sectors,
+        const void *data, size_t size, uint8_t writer)
+{
+    if (ata_fuzzer->shadow_disk == NULL) {
+        return;
+    }
+
+    /* Forget the sectors, unless the device has written all of them with the
+       data */
+    if (!is_written || size < (size_t)sectors * SHADOW_DISK_SECTOR_SIZE
+            || shadow_disk_write(ata_fuzzer->shadow_disk, lba, data, sectors, writer) == -1) {
+        shadow_disk_forget(ata_fuzzer->shadow_disk, lba, sectors);
+    }
+}
+
+int
+ata_fuzzer_reset(ata_fuzzer_t *restrict ata_fuzzer)
+{
+    /* Escalate the recovery until the devices are no longer busy after the
+       software reset */
+    for (int level = 0;; ++level) {
+        if (ata_controller_device_reset(ata_fuzzer->ata_controller) == 0
+                && ata_controller_device_select(ata_fuzzer->ata_controller, ata_fuzzer->device_num) == 0) {
+            return 0;
+        }
+
+        switch (level) {
+        case 0:
+            ata_fuzzer_log(ata_fuzzer, "ss", "finding", "HANG", "recovery", "BUS MASTER STOP");
+            ata_controller_bus_master_stop(ata_fuzzer->ata_controller);
+            break;
+
+        case 1:
+            ata_fuzzer_log(ata_fuzzer, "ss", "finding", "HANG", "recovery", "PROBE");
+            ata_controller_probe(ata_fuzzer->ata_controller);
+            break;
+
+        case 2:
+            ata_fuzzer_log(ata_fuzzer, "ss", "finding", "HANG", "recovery", "REINITIALIZE");
+            if (ata_controller_reinitialize(ata_fuzzer->ata_controller) == -1) {
+                return -1;
+            }
+
+            break;
+
+        default:
+            ata_fuzzer_log(ata_fuzzer, "ss", "finding", "HANG", "recovery", "NONE");
+            return -1;
+        }
+    }
+}
+
+void
+ata_fuzzer_scan_data(ata_fuzzer_t *restrict ata_fuzzer, const void *data, size_t size, int checks)
+{
+    if (ata_fuzzer->leak_scanner == NULL) {
+        return;
+    }
+
+    leak_scanner_hit_t hits[MAX_LEAK_HITS];
+    size_t num_hits = leak_scanner_scan(ata_fuzzer->leak_scanner, data, size, checks, hits, MAX_LEAK_HITS);
+    for (size_t i = 0; i < num_hits && i < MAX_LEAK_HITS; ++i) {
+        ata_fuzzer_log(ata_fuzzer, "sszqz", "finding", "LEAK", "kind", leak_scanner_get_kind_name(hits[i].kind),
+                "offset", hits[i].offset, "value", hits[i].value, "hits", num_hits);
+    }
+}
+
+blob_store_t *
+ata_fuzzer_set_blob_store(ata_fuzzer_t *restrict ata_fuzzer, blob_store_t *blob_store)
+{
+    blob_store_t *previous_blob_store = ata_fuzzer->blob_store;
+    ata_fuzzer->blob_store = blob_store;
+    return previous_blob_store;
+}
+
+ata_fuzzer_commit_handler_t *
+ata_fuzzer_set_commit_handler(ata_fuzzer_t *restrict ata_fuzzer, ata_fuzzer_commit_handler_t *handler)
+{
+    ata_fuzzer_commit_handler_t *previous_handler = ata_fuzzer->commit_handler;
+    ata_fuzzer->commit_handler = handler;
+    return previous_handler;
+}
+
 ata_fuzzer_error_handler_t *
 ata_fuzzer_set_error_handler(ata_fuzzer_error_handler_t *handler)
 {
@@ -352,3 +757,42 @@ ata_fuzzer_set_log_stream(ata_fuzzer_t *restrict ata_fuzzer, FILE *stream)
     ata_fuzzer->log_stream = stream;
     return previous_stream;
 }
+
+leak_scanner_t *
+ata_fuzzer_set_leak_scanner(ata_fuzzer_t *restrict ata_fuzzer, leak_scanner_t *leak_scanner)
+{
+    leak_scanner_t *previous_leak_scanner = ata_fuzzer->leak_scanner;
+    ata_fuzzer->leak_scanner = leak_scanner;
+    return previous_leak_scanner;
+}
+
+shadow_disk_t *
+ata_fuzzer_set_shadow_disk(ata_fuzzer_t *restrict ata_fuzzer, shadow_disk_t *shadow_disk)
+{
+    shadow_disk_t *previous_shadow_disk = ata_fuzzer->shadow_disk;
+    ata_fuzzer->shadow_disk = shadow_disk;
+    return previous_shadow_disk;
+}
+
+uint64_t
+ata_fuzzer_store_dma_payload(ata_fuzzer_t *restrict ata_fuzzer, const void *data, uint32_t count, bool is_sg)
+{
+    /* The bus master reads a scatter-gather layout from anywhere in the pool
+       of DMA buffers, so the write can't be replayed. Otherwise, it reads as
+       many bytes as the PRDT transfers, which may be more than the count. */
+    if (is_sg) {
+        return 0;
+    }
+
+    return ata_fuzzer_store_payload(ata_fuzzer, data, ata_controller_get_dma_size(count));
+}
+
+uint64_t
+ata_fuzzer_store_payload(ata_fuzzer_t *restrict ata_fuzzer, const void *data, size_t size)
+{
+    if (ata_fuzzer->blob_store == NULL) {
+        return 0;
+    }
+
+    return blob_store_put(ata_fuzzer->blob_store, data, size);
+}
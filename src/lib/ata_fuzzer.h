@@ -8,14 +8,18 @@ extern "C" {
 #endif
 
 #include "ata_controller.h"
+#include "blob_store.h"
+#include "leak_scanner.h"
+#include "shadow_disk.h"
 
 #include <stdarg.h>
 #include <stdio.h>
 
-#define ATA_FUZZER_MAX_INPUT (26 + (sizeof(uint16_t) * UINT16_MAX))
+#define ATA_FUZZER_MAX_INPUT (31 + (sizeof(uint16_t) * UINT16_MAX))
 
 typedef struct _ata_fuzzer ata_fuzzer_t; /**< ATA fuzzer. */
 
+typedef void ata_fuzzer_commit_handler_t(FILE *restrict stream);
 typedef void ata_fuzzer_error_handler_t(int status, int error, const char *restrict format, va_list ap);
 typedef void ata_fuzzer_log_handler_t(FILE *restrict stream, const char *restrict format, va_list ap);
 
@@ -44,6 +48,34 @@ void ata_fuzzer_destroy(ata_fuzzer_t *restrict ata_fuzzer);
  */
 void ata_fuzzer_iterate(ata_fuzzer_t *restrict ata_fuzzer, FILE *restrict stream);
 
+/**
+ * Sets the blob store for the ATA fuzzer, which stores the payload of each
+ * command that writes data, so that the log refers to it by its hash (i.e.,
+ * the blob field) and the command can be replayed. The payload of a DMA
+ * write is the bytes that its PRDT transfers, and a scatter-gather DMA write,
+ * which reads from anywhere in the pool of DMA buffers, isn't stored (i.e.,
+ * its blob field is zero).
+ *
+ * @param [in] ata_fuzzer ATA fuzzer.
+ * @param [in] blob_store Blob store, or NULL to not store the payloads (the
+ *   blob field is then zero).
+ * @return Previous blob store.
+ */
+blob_store_t *ata_fuzzer_set_blob_store(ata_fuzzer_t *restrict ata_fuzzer, blob_store_t *blob_store);
+
+/**
+ * Sets the commit handler for the ATA fuzzer, which is called with the log
+ * stream before a dangerous command is issued (i.e., one that may bring down
+ * the host, such as a scatter-gather DMA, DOWNLOAD MICROCODE, or a raw
+ * command), so that the records logged so far are on the disk if it does.
+ *
+ * @param [in] ata_fuzzer ATA fuzzer.
+ * @param [in] handler Commit handler, or NULL to not commit the log.
+ * @return Previous commit handler.
+ */
+ata_fuzzer_commit_handler_t *ata_fuzzer_set_commit_handler(
+        ata_fuzzer_t *restrict ata_fuzzer, ata_fuzzer_commit_handler_t *handler);
+
 /**
  * Sets the error handler for the ATA fuzzer.
  *
@@ -52,6 +84,16 @@ void ata_fuzzer_iterate(ata_fuzzer_t *restrict ata_fuzzer, FILE *restrict stream
  */
 ata_fuzzer_error_handler_t *ata_fuzzer_set_error_handler(ata_fuzzer_error_handler_t *handler);
 
+/**
+ * Sets the leak scanner for the ATA fuzzer, which scans the data returned by
+ * the device for leaks of host memory and for data not transferred.
+ *
+ * @param [in] ata_fuzzer ATA fuzzer.
+ * @param [in] leak_scanner Leak scanner, or NULL to not scan the data.
+ * @return Previous leak scanner.
+ */
+leak_scanner_t *ata_fuzzer_set_leak_scanner(ata_fuzzer_t *restrict ata_fuzzer, leak_scanner_t *leak_scanner);
+
 /**
  * Sets the log handler for the ATA fuzzer.
  *
@@ -69,6 +111,16 @@ ata_fuzzer_log_handler_t *ata_fuzzer_set_log_handler(
  */
 FILE *ata_fuzzer_set_log_stream(ata_fuzzer_t *restrict ata_fuzzer, FILE *stream);
 
+/**
+ * Sets the shadow disk for the ATA fuzzer, which records the sectors written
+ * and checks the sectors read against them.
+ *
+ * @param [in] ata_fuzzer ATA fuzzer.
+ * @param [in] shadow_disk Shadow disk, or NULL to not check the sectors read.
+ * @return Previous shadow disk.
+ */
+shadow_disk_t *ata_fuzzer_set_shadow_disk(ata_fuzzer_t *restrict ata_fuzzer, shadow_disk_t *shadow_disk);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,658 @@
+/** @file */
+
+#define _GNU_SOURCE
+
+#include "binlog.h"
+
+#include "deadline.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* The records are buffered, so that a record costs a few stores instead of
+   formatted writes and a sync to the disk. A full buffer is handed to the
+   writer thread, while the records go on into the other one. */
+#define BUFFER_SIZE 0x100000
+#define NUM_BUFFERS 2
+/* The keys and the string values are interned by address in an
+   open-addressing table, which is cleared (and the IDs reused) before it is
+   half full */
+#define STRING_BITS 12
+#define MAX_STRINGS (1 << STRING_BITS)
+#define MAX_STRING_LENGTH (UINT16_MAX - sizeof(struct record_header) - sizeof(uint16_t))
+#define MAX_FIELDS UINT8_MAX
+/* A field is the ID of the key, the format character, and the value */
+#define FIELD_HEADER_SIZE (sizeof(uint16_t) + sizeof(uint8_t))
+#define MAX_FIELD_SIZE (FIELD_HEADER_SIZE + sizeof(uint64_t))
+/* "ATAFZLOG" */
+#define CLOCK_MAGIC 0x474f4c5a46415441ULL
+
+/* Types of records */
+enum
+{
+    RECORD_CLOCK = 1,
+    RECORD_STRING,
+    RECORD_LOG,
+};
+
+struct record_header {
+    uint8_t type;
+    uint8_t num_fields;
+    /* Size of the record, including its header */
+    uint16_t size;
+    uint32_t reserved;
+    uint64_t ticks;
+    uint64_t iteration;
+};
+
+/* Payload of a clock record, which anchors the ticks of the records after it
+   to the wall-clock time */
+struct clock {
+    uint64_t magic;
+    /* Ticks per second */
+    uint64_t frequency;
+    /* Wall-clock time at the ticks of the record, in nanoseconds since the
+       Epoch */
+    uint64_t time;
+};
+
+struct string {
+    const char *string;
+    uint16_t id;
+};
+
+struct _binlog {
+    int fd;
+    uint64_t iteration;
+    struct string strings[MAX_STRINGS];
+    size_t num_strings;
+    /* Buffer that the records go into */
+    int buffer_num;
+    size_t size;
+    uint8_t buffers[NUM_BUFFERS][BUFFER_SIZE];
+    /* Writer thread, which writes each buffer handed to it and syncs it in a
+       single system call (i.e., a group commit of its records) */
+    pthread_t writer;
+    pthread_mutex_t mutex;
+    pthread_cond_t submitted;
+    pthread_cond_t committed;
+    const uint8_t *pending;
+    size_t pending_size;
+    uint64_t num_submitted;
+    uint64_t num_committed;
+    bool is_stopped;
+    /* Whether the file supports RWF_DSYNC */
+    bool is_dsync;
+    /* First error of the writer thread since the last sync, or zero */
+    int error;
+};
+
+static binlog_error_handler_t *error_handler = NULL;
+
+void binlog_clear_strings(binlog_t *restrict binlog);
+int binlog_dump_log(FILE *restrict out, const struct record_header *restrict header, const uint8_t *payload,
+        size_t size, char *const *strings, uint64_t time);
+void binlog_error(binlog_t *restrict binlog, int status, int error, const char *restrict format, ...);
+void binlog_free_strings(char **strings);
+size_t binlog_get_value_size(char type);
+uint16_t binlog_intern(binlog_t *restrict binlog, const char *string);
+uint8_t *binlog_reserve(binlog_t *restrict binlog, size_t size);
+void *binlog_run_writer(void *arg);
+uint64_t binlog_submit(binlog_t *restrict binlog);
+int binlog_write_data(binlog_t *restrict binlog, const uint8_t *data, size_t size);
+void binlog_write_header(binlog_t *restrict binlog, uint8_t *record, uint8_t type, size_t num_fields, size_t size);
+
+void
+binlog_clear_strings(binlog_t *restrict binlog)
+{
+    memset(binlog->strings, 0, sizeof(binlog->strings));
+    binlog->num_strings = 0;
+}
+
+binlog_t *
+binlog_create(FILE *stream)
+{
+    binlog_t *binlog = (binlog_t *)calloc(1, sizeof(*binlog));
+    if (binlog == NULL) {
+        binlog_error(binlog, 0, errno, __func__);
+        return NULL;
+    }
+
+    binlog->fd = fileno(stream);
+    binlog->is_dsync = true;
+    pthread_mutex_init(&binlog->mutex, NULL);
+    pthread_cond_init(&binlog->submitted, NULL);
+    pthread_cond_init(&binlog->committed, NULL);
+    int error = pthread_create(&binlog->writer, NULL, binlog_run_writer, binlog);
+    if (error != 0) {
+        errno = error;
+        binlog_error(binlog, 0, errno, __func__);
+        pthread_cond_destroy(&binlog->committed);
+        pthread_cond_destroy(&binlog->submitted);
+        pthread_mutex_destroy(&binlog->mutex);
+        free(binlog);
+        return NULL;
+    }
+
+    /* Anchor the ticks to the wall-clock time */
+    deadline_calibrate();
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    struct clock clock = { CLOCK_MAGIC, deadline_get_frequency(),
+        (uint64_t)ts.tv_sec * DEADLINE_NS_PER_SEC + ts.tv_nsec };
+    size_t size = sizeof(struct record_header) + sizeof(clock);
+    uint8_t *record = binlog_reserve(binlog, size);
+    binlog_write_header(binlog, record, RECORD_CLOCK, 0, size);
+    memcpy(record + sizeof(struct record_header), &clock, sizeof(clock));
+    return binlog;
+}
+
+void
+binlog_destroy(binlog_t *restrict binlog)
+{
+    if (binlog == NULL) {
+        return;
+    }
+
+    /* Stop the writer thread once the records are on the disk */
+    binlog_sync(binlog);
+    pthread_mutex_lock(&binlog->mutex);
+    binlog->is_stopped = true;
+    pthread_cond_signal(&binlog->submitted);
+    pthread_mutex_unlock(&binlog->mutex);
+    pthread_join(binlog->writer, NULL);
+    pthread_cond_destroy(&binlog->committed);
+    pthread_cond_destroy(&binlog->submitted);
+    pthread_mutex_destroy(&binlog->mutex);
+    free(binlog);
+}
+
+int
+binlog_dump(FILE *restrict in, FILE *restrict out)
+{
+    char **strings = (char **)calloc(UINT16_MAX + 1, sizeof(*strings));
+    uint8_t *payload = (uint8_t *)malloc(UINT16_MAX);
+    if (strings == NULL || payload == NULL) {
+        binlog_error(NULL, 0, errno, __func__);
+        goto err;
+    }
+
+    struct clock clock = { 0 };
+    uint64_t clock_ticks = 0;
+    struct record_header header;
+    while (fread(&header, sizeof(header), 1, in) == 1) {
+        if (header.size < sizeof(header)) {
+            errno = EINVAL;
+            binlog_error(NULL, 0, errno, __func__);
+            goto err;
+        }
+
+        /* Is the record truncated (e.g., the run was brought down)? */
+        size_t size = header.size - sizeof(header);
+        if (fread(payload, 1, size, in) != size) {
+            break;
+        }
+
+        switch (header.type) {
+        case RECORD_CLOCK:
+            memcpy(&clock, payload, (size < sizeof(clock)) ? size : sizeof(clock));
+            if (size < sizeof(clock) || clock.magic != CLOCK_MAGIC || clock.frequency == 0) {
+                errno = EINVAL;
+                binlog_error(NULL, 0, errno, __func__);
+                goto err;
+            }
+
+            /* The strings of a previous binary log in the stream are gone */
+            clock_ticks = header.ticks;
+            binlog_free_strings(strings);
+            break;
+
+        case RECORD_STRING: {
+            if (size < sizeof(uint16_t)) {
+                errno = EINVAL;
+                binlog_error(NULL, 0, errno, __func__);
+                goto err;
+            }
+
+            uint16_t id;
+            memcpy(&id, payload, sizeof(id));
+            free(strings[id]);
+            strings[id] = strndup((const char *)payload + sizeof(id), size - sizeof(id));
+            if (strings[id] == NULL) {
+                binlog_error(NULL, 0, errno, __func__);
+                goto err;
+            }
+            break;
+        }
+
+        case RECORD_LOG: {
+            /* Convert the ticks to the wall-clock time of the last clock
+               record */
+            int64_t elapsed = (int64_t)(header.ticks - clock_ticks);
+            uint64_t time = clock.time + (int64_t)((double)elapsed * DEADLINE_NS_PER_SEC / clock.frequency);
+            if (clock.magic != CLOCK_MAGIC || binlog_dump_log(out, &header, payload, size, strings, time) == -1) {
+                errno = EINVAL;
+                binlog_error(NULL, 0, errno, __func__);
+                goto err;
+            }
+            break;
+        }
+
+        default:
+            /* Skip the records of unknown types */
+            break;
+        }
+    }
+
+    if (ferror(in)) {
+        binlog_error(NULL, 0, errno, __func__);
+        goto err;
+    }
+
+    binlog_free_strings(strings);
+    free(strings);
+    free(payload);
+    return 0;
+
+err:
+    if (strings != NULL) {
+        binlog_free_strings(strings);
+    }
+
+    free(strings);
+    free(payload);
+    return -1;
+}
+
+int
+binlog_dump_log(FILE *restrict out, const struct record_header *restrict header, const uint8_t *payload,
+        size_t size, char *const *strings, uint64_t time)
+{
+    uint64_t seconds = time / DEADLINE_NS_PER_SEC;
+    uint64_t ns = time % DEADLINE_NS_PER_SEC;
+    fprintf(out, "{ \"time\": %" PRIu64 ".%09" PRIu64 ", \"iteration\": %" PRIu64, seconds, ns, header->iteration);
+    size_t offset = 0;
+    for (size_t i = 0; i < header->num_fields; ++i) {
+        if (offset + FIELD_HEADER_SIZE > size) {
+            return -1;
+        }
+
+        uint16_t key_id;
+        memcpy(&key_id, payload + offset, sizeof(key_id));
+        char type = (char)payload[offset + sizeof(key_id)];
+        offset += FIELD_HEADER_SIZE;
+        size_t value_size = binlog_get_value_size(type);
+        if (value_size == 0 || offset + value_size > size || strings[key_id] == NULL) {
+            return -1;
+        }
+
+        /* The values are little-endian */
+        uint64_t value = 0;
+        memcpy(&value, payload + offset, value_size);
+        offset += value_size;
+        fprintf(out, ", \"%s\": ", strings[key_id]);
+        switch (type) {
+        case 'c':
+            fprintf(out, "\"%c\"", (int)(int32_t)value);
+            break;
+
+        case 'd':
+            fprintf(out, "%d", (int)(int32_t)value);
+            break;
+
+        case 'f': {
+            double number;
+            memcpy(&number, &value, sizeof(number));
+            fprintf(out, "%f", number);
+            break;
+        }
+
+        case 'h':
+            /* A hash is printed as the name of its blob */
+            fprintf(out, "\"%016llx\"", (unsigned long long int)value);
+            break;
+
+        case 'o':
+            fprintf(out, "%o", (unsigned int)value);
+            break;
+
+        case 'p':
+            fprintf(out, "%p", (void *)(uintptr_t)value);
+            break;
+
+        case 'q':
+            fprintf(out, "%llu", (unsigned long long int)value);
+            break;
+
+        case 's':
+            if (strings[value] == NULL) {
+                return -1;
+            }
+
+            fprintf(out, "\"%s\"", strings[value]);
+            break;
+
+        case 'u':
+            fprintf(out, "%u", (unsigned int)value);
+            break;
+
+        case 'x':
+            fprintf(out, "%x", (unsigned int)value);
+            break;
+
+        case 'z':
+            fprintf(out, "%zu", (size_t)value);
+            break;
+        }
+    }
+
+    fprintf(out, " }\n");
+    return 0;
+}
+
+void
+binlog_error(binlog_t *restrict binlog, int status, int error, const char *restrict format, ...)
+{
+    if (error_handler == NULL) {
+        return;
+    }
+
+    va_list ap;
+    va_start(ap, format);
+    (*error_handler)(status, error, format, ap);
+    va_end(ap);
+}
+
+void
+binlog_free_strings(char **strings)
+{
+    for (size_t i = 0; i <= UINT16_MAX; ++i) {
+        free(strings[i]);
+        strings[i] = NULL;
+    }
+}
+
+size_t
+binlog_get_value_size(char type)
+{
+    switch (type) {
+    case 'c':
+    case 'd':
+    case 'o':
+    case 'u':
+    case 'x':
+        return sizeof(uint32_t);
+
+    case 'f':
+    case 'h':
+    case 'p':
+    case 'q':
+    case 'z':
+        return sizeof(uint64_t);
+
+    case 's':
+        return sizeof(uint16_t);
+
+    default:
+        return 0;
+    }
+}
+
+uint16_t
+binlog_intern(binlog_t *restrict binlog, const char *string)
+{
+    size_t slot = (size_t)(((uintptr_t)string * 0x9e3779b97f4a7c15ULL) >> (64 - STRING_BITS));
+    for (; binlog->strings[slot].string != NULL; slot = (slot + 1) % MAX_STRINGS) {
+        if (binlog->strings[slot].string == string) {
+            return binlog->strings[slot].id;
+        }
+    }
+
+    /* Write the string record of a new ID (starting at one) */
+    uint16_t id = ++binlog->num_strings;
+    binlog->strings[slot].string = string;
+    binlog->strings[slot].id = id;
+    size_t length = strnlen(string, MAX_STRING_LENGTH);
+    size_t size = sizeof(struct record_header) + sizeof(id) + length;
+    uint8_t *record = binlog_reserve(binlog, size);
+    binlog_write_header(binlog, record, RECORD_STRING, 0, size);
+    memcpy(record + sizeof(struct record_header), &id, sizeof(id));
+    memcpy(record + sizeof(struct record_header) + sizeof(id), string, length);
+    return id;
+}
+
+uint8_t *
+binlog_reserve(binlog_t *restrict binlog, size_t size)
+{
+    if (binlog->size + size > BUFFER_SIZE) {
+        binlog_submit(binlog);
+    }
+
+    uint8_t *record = &binlog->buffers[binlog->buffer_num][binlog->size];
+    binlog->size += size;
+    return record;
+}
+
+void *
+binlog_run_writer(void *arg)
+{
+    binlog_t *binlog = (binlog_t *)arg;
+    pthread_mutex_lock(&binlog->mutex);
+    for (;;) {
+        while (binlog->num_committed == binlog->num_submitted && !binlog->is_stopped) {
+            pthread_cond_wait(&binlog->submitted, &binlog->mutex);
+        }
+
+        if (binlog->num_committed == binlog->num_submitted) {
+            break;
+        }
+
+        /* Write the buffer without holding the lock, so that the records go
+           on into the other buffer meanwhile */
+        const uint8_t *data = binlog->pending;
+        size_t size = binlog->pending_size;
+        pthread_mutex_unlock(&binlog->mutex);
+        int error = (binlog_write_data(binlog, data, size) == -1) ? errno : 0;
+        pthread_mutex_lock(&binlog->mutex);
+        if (binlog->error == 0) {
+            binlog->error = error;
+        }
+
+        ++binlog->num_committed;
+        pthread_cond_broadcast(&binlog->committed);
+    }
+
+    pthread_mutex_unlock(&binlog->mutex);
+    return NULL;
+}
+
+binlog_error_handler_t *
+binlog_set_error_handler(binlog_error_handler_t *handler)
+{
+    binlog_error_handler_t *previous_handler = error_handler;
+    error_handler = handler;
+    return previous_handler;
+}
+
+void
+binlog_set_iteration(binlog_t *restrict binlog, uint64_t iteration)
+{
+    binlog->iteration = iteration;
+}
+
+uint64_t
+binlog_submit(binlog_t *restrict binlog)
+{
+    /* Wait for the writer thread to be done with the other buffer, which the
+       records go into next */
+    pthread_mutex_lock(&binlog->mutex);
+    while (binlog->num_committed < binlog->num_submitted) {
+        pthread_cond_wait(&binlog->committed, &binlog->mutex);
+    }
+
+    if (binlog->size > 0) {
+        binlog->pending = binlog->buffers[binlog->buffer_num];
+        binlog->pending_size = binlog->size;
+        ++binlog->num_submitted;
+        pthread_cond_signal(&binlog->submitted);
+        binlog->buffer_num = (binlog->buffer_num + 1) % NUM_BUFFERS;
+        binlog->size = 0;
+    }
+
+    uint64_t num_submitted = binlog->num_submitted;
+    pthread_mutex_unlock(&binlog->mutex);
+    return num_submitted;
+}
+
+int
+binlog_sync(binlog_t *restrict binlog)
+{
+    /* Commit the records buffered so far, and wait until they are on the
+       disk */
+    uint64_t num_submitted = binlog_submit(binlog);
+    pthread_mutex_lock(&binlog->mutex);
+    while (binlog->num_committed < num_submitted) {
+        pthread_cond_wait(&binlog->committed, &binlog->mutex);
+    }
+
+    int error = binlog->error;
+    binlog->error = 0;
+    pthread_mutex_unlock(&binlog->mutex);
+    if (error != 0) {
+        errno = error;
+        binlog_error(binlog, 0, errno, __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+void
+binlog_write(binlog_t *restrict binlog, const char *restrict format, va_list ap)
+{
+    /* Intern the keys and the string values first, so that their records
+       come before the record that refers to them. The table is cleared
+       beforehand if they might not fit. */
+    size_t num_fields = strnlen(format, MAX_FIELDS);
+    if (binlog->num_strings + 2 * num_fields >= MAX_STRINGS / 2) {
+        binlog_clear_strings(binlog);
+    }
+
+    uint16_t key_ids[MAX_FIELDS];
+    uint64_t values[MAX_FIELDS];
+    for (size_t i = 0; i < num_fields; ++i) {
+        key_ids[i] = binlog_intern(binlog, va_arg(ap, const char *));
+        switch (format[i]) {
+        case 'c':
+        case 'd':
+            values[i] = (uint32_t)va_arg(ap, int);
+            break;
+
+        case 'f': {
+            double number = va_arg(ap, double);
+            memcpy(&values[i], &number, sizeof(number));
+            break;
+        }
+
+        case 'o':
+        case 'u':
+        case 'x':
+            values[i] = va_arg(ap, unsigned int);
+            break;
+
+        case 'p':
+            values[i] = (uintptr_t)va_arg(ap, void *);
+            break;
+
+        case 'h':
+        case 'q':
+            values[i] = va_arg(ap, unsigned long long int);
+            break;
+
+        case 's':
+            values[i] = binlog_intern(binlog, va_arg(ap, const char *));
+            break;
+
+        case 'z':
+            values[i] = va_arg(ap, size_t);
+            break;
+
+        default:
+            abort();
+        }
+    }
+
+    /* Pack the fields, with only as many bytes of each value as its type
+       has */
+    size_t max_size = sizeof(struct record_header) + num_fields * MAX_FIELD_SIZE;
+    uint8_t *record = binlog_reserve(binlog, max_size);
+    size_t size = sizeof(struct record_header);
+    for (size_t i = 0; i < num_fields; ++i) {
+        memcpy(record + size, &key_ids[i], sizeof(key_ids[i]));
+        record[size + sizeof(key_ids[i])] = format[i];
+        size += FIELD_HEADER_SIZE;
+        size_t value_size = binlog_get_value_size(format[i]);
+        memcpy(record + size, &values[i], value_size);
+        size += value_size;
+    }
+
+    binlog->size -= max_size - size;
+    binlog_write_header(binlog, record, RECORD_LOG, num_fields, size);
+}
+
+int
+binlog_write_data(binlog_t *restrict binlog, const uint8_t *data, size_t size)
+{
+    /* Write and sync the data in a single system call, unless the file
+       doesn't support it (e.g., a pipe) */
+    while (size > 0) {
+        struct iovec iov = { (void *)data, size };
+        ssize_t result = pwritev2(binlog->fd, &iov, 1, -1, binlog->is_dsync ? RWF_DSYNC : 0);
+        if (result == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (binlog->is_dsync && (errno == EOPNOTSUPP || errno == EINVAL || errno == ENOSYS)) {
+                binlog->is_dsync = false;
+                continue;
+            }
+
+            return -1;
+        }
+
+        data += result;
+        size -= result;
+    }
+
+    /* A pipe or a terminal can't be synced */
+    if (!binlog->is_dsync && fdatasync(binlog->fd) == -1 && errno != EINVAL) {
+        return -1;
+    }
+
+    return 0;
+}
+
+void
+binlog_write_header(binlog_t *restrict binlog, uint8_t *record, uint8_t type, size_t num_fields, size_t size)
+{
+    struct record_header header = { 0 };
+    header.type = type;
+    header.num_fields = num_fields;
+    header.size = size;
+    header.ticks = deadline_get_ticks();
+    header.iteration = binlog->iteration;
+    memcpy(record, &header, sizeof(header));
+}
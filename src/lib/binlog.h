@@ -0,0 +1,92 @@
+/** @file */
+
+#ifndef BINLOG_H
+#define BINLOG_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef struct _binlog binlog_t; /**< Binary log. */
+
+typedef void binlog_error_handler_t(int status, int error, const char *restrict format, va_list ap);
+
+/**
+ * Creates a binary log. Each record is a type tag, a timestamp in ticks of the
+ * clock of the deadlines, the iteration, and the packed fields. The records
+ * are buffered, and handed to a writer thread when the buffer is full or the
+ * binary log is synced, so that the caller doesn't wait for the disk unless it
+ * syncs. A clock record, which converts the timestamps to
+ * wall-clock time, is written first, so that binary logs can be appended to
+ * the same file.
+ *
+ * @param [in] stream Stream to write the records to.
+ * @return A binary log.
+ */
+binlog_t *binlog_create(FILE *stream);
+
+/**
+ * Destroys the binary log, after syncing it.
+ *
+ * @param [in] binlog Binary log.
+ */
+void binlog_destroy(binlog_t *restrict binlog);
+
+/**
+ * Converts the binary logs in a stream to JSON, a line per record.
+ *
+ * @param [in] in Stream to read the binary logs from. A truncated last record
+ *   (e.g., of a run that was brought down) is ignored.
+ * @param [in] out Stream to write the JSON to.
+ * @return Returns zero on success; otherwise, returns -1 on failure.
+ */
+int binlog_dump(FILE *restrict in, FILE *restrict out);
+
+/**
+ * Sets the error handler for the binary logs.
+ *
+ * @param [in] handler Error handler.
+ * @return Previous error handler.
+ */
+binlog_error_handler_t *binlog_set_error_handler(binlog_error_handler_t *handler);
+
+/**
+ * Sets the iteration of the records written after it.
+ *
+ * @param [in] binlog Binary log.
+ * @param [in] iteration Iteration.
+ */
+void binlog_set_iteration(binlog_t *restrict binlog, uint64_t iteration);
+
+/**
+ * Commits the buffered records: waits until they, and the records before
+ * them, are written to the stream and synced to the disk. The records buffered
+ * since the last commit are written and synced together (i.e., a group
+ * commit), so that the cost of a sync is shared by all of them.
+ *
+ * @param [in] binlog Binary log.
+ * @return Returns zero on success; otherwise, returns -1 on failure.
+ */
+int binlog_sync(binlog_t *restrict binlog);
+
+/**
+ * Writes a record to the binary log.
+ *
+ * @param [in] binlog Binary log.
+ * @param [in] format Format of the fields (i.e., a character per field, as for
+ *   the log handler of the ATA fuzzer, where h is the hash of a blob).
+ * @param [in] ap Key and value of each field. The keys and the string values
+ *   are interned by address, so they must be constant for the life of the
+ *   binary log (e.g., string literals).
+ */
+void binlog_write(binlog_t *restrict binlog, const char *restrict format, va_list ap);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BINLOG_H */
@@ -0,0 +1,330 @@
+/** @file */
+
+#include "blob_store.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* The hashes of the blobs known to be in the store are kept in an
+   open-addressing table, which is grown before it is half full, so that a
+   blob put again costs no system call */
+#define MIN_HASHES 4096
+/* Primes of the hash, which mixes 64-bit words by multiplying them into 128
+   bits and folding the halves (as wyhash does) */
+#define PRIME0 0xa0761d6478bd642fULL
+#define PRIME1 0xe7037ed1a0b428dbULL
+#define PRIME2 0x8ebc6af09c88c6e3ULL
+#define PRIME3 0x589965cc75374cc3ULL
+/* Name of a blob, and of the temporary file that it is written to */
+#define NAME_SIZE sizeof("0123456789abcdef.tmp")
+
+struct _blob_store {
+    int dir_fd;
+    uint64_t *hashes;
+    size_t num_hashes;
+    size_t max_hashes;
+    /* Whether a blob has been renamed into the directory since the last
+       sync */
+    bool is_dirty;
+};
+
+static blob_store_error_handler_t *error_handler = NULL;
+
+void blob_store_error(blob_store_t *restrict blob_store, int status, int error, const char *restrict format, ...);
+uint64_t *blob_store_find(uint64_t *hashes, size_t max_hashes, uint64_t hash);
+int blob_store_insert(blob_store_t *restrict blob_store, uint64_t hash);
+uint64_t blob_store_mix(uint64_t a, uint64_t b);
+uint64_t blob_store_read32(const uint8_t *p);
+uint64_t blob_store_read64(const uint8_t *p);
+int blob_store_write_blob(blob_store_t *restrict blob_store, const char *name, const void *data, size_t size);
+
+blob_store_t *
+blob_store_create(const char *path)
+{
+    blob_store_t *blob_store = (blob_store_t *)calloc(1, sizeof(*blob_store));
+    if (blob_store == NULL) {
+        blob_store_error(blob_store, 0, errno, __func__);
+        return NULL;
+    }
+
+    blob_store->max_hashes = MIN_HASHES;
+    blob_store->hashes = (uint64_t *)calloc(blob_store->max_hashes, sizeof(*blob_store->hashes));
+    if (blob_store->hashes == NULL) {
+        blob_store_error(blob_store, 0, errno, __func__);
+        goto err;
+    }
+
+    if (mkdir(path, 0777) == -1 && errno != EEXIST) {
+        blob_store_error(blob_store, 0, errno, __func__);
+        goto err_free;
+    }
+
+    blob_store->dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (blob_store->dir_fd == -1) {
+        blob_store_error(blob_store, 0, errno, __func__);
+        goto err_free;
+    }
+
+    return blob_store;
+
+err_free:
+    free(blob_store->hashes);
+
+err:
+    free(blob_store);
+    return NULL;
+}
+
+void
+blob_store_destroy(blob_store_t *restrict blob_store)
+{
+    if (blob_store == NULL) {
+        return;
+    }
+
+    blob_store_sync(blob_store);
+    close(blob_store->dir_fd);
+    free(blob_store->hashes);
+    free(blob_store);
+}
+
+void
+blob_store_error(blob_store_t *restrict blob_store, int status, int error, const char *restrict format, ...)
+{
+    if (error_handler == NULL) {
+        return;
+    }
+
+    va_list ap;
+    va_start(ap, format);
+    (*error_handler)(status, error, format, ap);
+    va_end(ap);
+}
+
+uint64_t *
+blob_store_find(uint64_t *hashes, size_t max_hashes, uint64_t hash)
+{
+    /* The hashes are uniform, so their low bits are the slot */
+    size_t slot = hash & (max_hashes - 1);
+    while (hashes[slot] != 0 && hashes[slot] != hash) {
+        slot = (slot + 1) & (max_hashes - 1);
+    }
+
+    return &hashes[slot];
+}
+
+uint64_t
+blob_store_hash(const void *data, size_t size)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    uint64_t seed = blob_store_mix(PRIME0, PRIME1);
+    uint64_t a;
+    uint64_t b;
+    if (size <= 16) {
+        if (size >= 4) {
+            size_t middle = (size >> 3) << 2;
+            a = (blob_store_read32(p) << 32) | blob_store_read32(p + middle);
+            b = (blob_store_read32(p + size - 4) << 32) | blob_store_read32(p + size - 4 - middle);
+        } else if (size > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[size >> 1] << 8) | p[size - 1];
+            b = 0;
+        } else {
+            a = 0;
+            b = 0;
+        }
+    } else {
+        /* Mix three independent lanes of 16 bytes each, so that the
+           multiplications overlap */
+        size_t remaining = size;
+        if (remaining > 48) {
+            uint64_t seed1 = seed;
+            uint64_t seed2 = seed;
+            do {
+                seed = blob_store_mix(blob_store_read64(p) ^ PRIME1, blob_store_read64(p + 8) ^ seed);
+                seed1 = blob_store_mix(blob_store_read64(p + 16) ^ PRIME2, blob_store_read64(p + 24) ^ seed1);
+                seed2 = blob_store_mix(blob_store_read64(p + 32) ^ PRIME3, blob_store_read64(p + 40) ^ seed2);
+                p += 48;
+                remaining -= 48;
+            } while (remaining > 48);
+
+            seed ^= seed1 ^ seed2;
+        }
+
+        while (remaining > 16) {
+            seed = blob_store_mix(blob_store_read64(p) ^ PRIME1, blob_store_read64(p + 8) ^ seed);
+            p += 16;
+            remaining -= 16;
+        }
+
+        /* The last 16 bytes, which may overlap the ones mixed already */
+        a = blob_store_read64(p + remaining - 16);
+        b = blob_store_read64(p + remaining - 8);
+    }
+
+    uint64_t hash = blob_store_mix(PRIME1 ^ size, blob_store_mix(a ^ PRIME1, b ^ seed));
+    /* Zero marks an empty slot */
+    return (hash != 0) ? hash : 1;
+}
+
+int
+blob_store_insert(blob_store_t *restrict blob_store, uint64_t hash)
+{
+    if (2 * (blob_store->num_hashes + 1) > blob_store->max_hashes) {
+        size_t max_hashes = 2 * blob_store->max_hashes;
+        uint64_t *hashes = (uint64_t *)calloc(max_hashes, sizeof(*hashes));
+        if (hashes == NULL) {
+            blob_store_error(blob_store, 0, errno, __func__);
+            return -1;
+        }
+
+        for (size_t i = 0; i < blob_store->max_hashes; ++i) {
+            if (blob_store->hashes[i] != 0) {
+                *blob_store_find(hashes, max_hashes, blob_store->hashes[i]) = blob_store->hashes[i];
+            }
+        }
+
+        free(blob_store->hashes);
+        blob_store->hashes = hashes;
+        blob_store->max_hashes = max_hashes;
+    }
+
+    *blob_store_find(blob_store->hashes, blob_store->max_hashes, hash) = hash;
+    ++blob_store->num_hashes;
+    return 0;
+}
+
+uint64_t
+blob_store_mix(uint64_t a, uint64_t b)
+{
+    __uint128_t product = (__uint128_t)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+uint64_t
+blob_store_put(blob_store_t *restrict blob_store, const void *data, size_t size)
+{
+    uint64_t hash = blob_store_hash(data, size);
+    if (*blob_store_find(blob_store->hashes, blob_store->max_hashes, hash) == hash) {
+        return hash;
+    }
+
+    /* A blob that is already in the directory (e.g., of a previous run) is
+       not written again */
+    char name[NAME_SIZE];
+    snprintf(name, sizeof(name), "%016llx", (unsigned long long int)hash);
+    if (faccessat(blob_store->dir_fd, name, F_OK, 0) == -1) {
+        if (errno != ENOENT || blob_store_write_blob(blob_store, name, data, size) == -1) {
+            blob_store_error(blob_store, 0, errno, __func__);
+            return 0;
+        }
+    }
+
+    if (blob_store_insert(blob_store, hash) == -1) {
+        return 0;
+    }
+
+    return hash;
+}
+
+uint64_t
+blob_store_read32(const uint8_t *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+uint64_t
+blob_store_read64(const uint8_t *p)
+{
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+blob_store_error_handler_t *
+blob_store_set_error_handler(blob_store_error_handler_t *handler)
+{
+    blob_store_error_handler_t *previous_handler = error_handler;
+    error_handler = handler;
+    return previous_handler;
+}
+
+int
+blob_store_sync(blob_store_t *restrict blob_store)
+{
+    if (!blob_store->is_dirty) {
+        return 0;
+    }
+
+    /* The blobs are synced as they are written, so only their directory
+       entries are left */
+    if (fsync(blob_store->dir_fd) == -1) {
+        blob_store_error(blob_store, 0, errno, __func__);
+        return -1;
+    }
+
+    blob_store->is_dirty = false;
+    return 0;
+}
+
+int
+blob_store_write_blob(blob_store_t *restrict blob_store, const char *name, const void *data, size_t size)
+{
+    /* Write and sync the blob under a temporary name, and rename it once
+       complete, so that a blob cut short (e.g., by a crash) is never taken
+       for a stored one */
+    char tmp_name[NAME_SIZE];
+    snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", name);
+    int fd = openat(blob_store->dir_fd, tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd == -1) {
+        return -1;
+    }
+
+    const uint8_t *p = (const uint8_t *)data;
+    int error = 0;
+    while (size > 0) {
+        ssize_t result = write(fd, p, size);
+        if (result == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            error = errno;
+            break;
+        }
+
+        p += result;
+        size -= result;
+    }
+
+    if (error == 0 && fdatasync(fd) == -1) {
+        error = errno;
+    }
+
+    if (close(fd) == -1 && error == 0) {
+        error = errno;
+    }
+
+    if (error == 0 && renameat(blob_store->dir_fd, tmp_name, blob_store->dir_fd, name) == -1) {
+        error = errno;
+    }
+
+    if (error != 0) {
+        unlinkat(blob_store->dir_fd, tmp_name, 0);
+        errno = error;
+        return -1;
+    }
+
+    blob_store->is_dirty = true;
+    return 0;
+}
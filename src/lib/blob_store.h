@@ -0,0 +1,77 @@
+/** @file */
+
+#ifndef BLOB_STORE_H
+#define BLOB_STORE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct _blob_store blob_store_t; /**< Blob store. */
+
+typedef void blob_store_error_handler_t(int status, int error, const char *restrict format, va_list ap);
+
+/**
+ * Creates a content-addressed blob store: a directory where each blob is a
+ * file named by the hash of its contents (i.e., 16 hexadecimal digits), so
+ * that a blob is stored once however many times it is put. The directory is
+ * created if it doesn't exist, and the blobs already in it are kept (e.g., of
+ * the previous runs of a campaign).
+ *
+ * @param [in] path Path of the directory.
+ * @return A blob store.
+ */
+blob_store_t *blob_store_create(const char *path);
+
+/**
+ * Destroys the blob store, after syncing it.
+ *
+ * @param [in] blob_store Blob store.
+ */
+void blob_store_destroy(blob_store_t *restrict blob_store);
+
+/**
+ * Hashes data as the blob store does.
+ *
+ * @param [in] data Data.
+ * @param [in] size Size of the data, in bytes.
+ * @return Hash, which is never zero.
+ */
+uint64_t blob_store_hash(const void *data, size_t size);
+
+/**
+ * Puts a blob into the blob store, unless it is already there.
+ *
+ * @param [in] blob_store Blob store.
+ * @param [in] data Contents of the blob.
+ * @param [in] size Size of the blob, in bytes.
+ * @return Hash of the blob, or zero on failure.
+ */
+uint64_t blob_store_put(blob_store_t *restrict blob_store, const void *data, size_t size);
+
+/**
+ * Sets the error handler for the blob stores.
+ *
+ * @param [in] handler Error handler.
+ * @return Previous error handler.
+ */
+blob_store_error_handler_t *blob_store_set_error_handler(blob_store_error_handler_t *handler);
+
+/**
+ * Syncs the blobs put so far to the disk. Each blob is synced as it is
+ * written, so only the directory is synced.
+ *
+ * @param [in] blob_store Blob store.
+ * @return Returns zero on success; otherwise, returns -1 on failure.
+ */
+int blob_store_sync(blob_store_t *restrict blob_store);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BLOB_STORE_H */
@@ -25,6 +25,10 @@ enum
     BM_IDE_PRDT1 = 12,
 };
 
+/* The Bus Master IDE registers of the secondary channel follow those of the
+   primary channel. */
+#define BM_IDE_CHANNEL_OFFSET(bus_num) ((bus_num) * (BM_IDE_COMMAND1 - BM_IDE_COMMAND0))
+
 /** Bus Master IDE Command Register */
 enum
 {
@@ -43,6 +47,12 @@ enum
     BM_IDE_SIMPLEX = (1 << 7),
 };
 
+/** Physical Region Descriptor (PRD) Reserved field */
+enum
+{
+    BM_IDE_PRD_EOT = (1 << 15), /**< End of table. */
+};
+
 /** Physical Region Descriptor (PRD) */
 struct prd {
     uint32_t address;
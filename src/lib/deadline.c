@@ -0,0 +1,162 @@
+/** @file */
+
+#include "deadline.h"
+
+#include "tsc.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <cpuid.h>
+
+/* Duration of the fast spin */
+#define SPIN_NS 20000ULL
+/* Shortest and longest sleeps of the backoff */
+#define MIN_SLEEP_NS 1000ULL
+#define MAX_SLEEP_NS 1000000ULL
+/* Duration of the TSC calibration */
+#define CALIBRATION_NS 10000000ULL
+
+static bool is_calibrated = false;
+static bool is_tsc = false;
+/* Ticks per second */
+static uint64_t frequency = DEADLINE_NS_PER_SEC;
+
+uint64_t deadline_get_monotonic(void);
+uint64_t deadline_ns_to_ticks(uint64_t ns);
+
+void
+deadline_calibrate(void)
+{
+    if (is_calibrated) {
+        return;
+    }
+
+    is_calibrated = true;
+    /* Is the TSC invariant (i.e., does it run at a constant rate in all
+       ACPI P-, C-, and T-states)? */
+    unsigned int eax;
+    unsigned int ebx;
+    unsigned int ecx;
+    unsigned int edx;
+    if (__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) == 0 || eax < 0x80000007) {
+        return;
+    }
+
+    __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+    if ((edx & (1 << 8)) == 0) {
+        return;
+    }
+
+    /* Measure the TSC against the monotonic clock */
+    uint64_t start = deadline_get_monotonic();
+    uint64_t tsc_start = tsc_read();
+    uint64_t end;
+    do {
+        end = deadline_get_monotonic();
+    } while (end - start < CALIBRATION_NS);
+    uint64_t tsc_end = tsc_read();
+    if (tsc_end <= tsc_start) {
+        return;
+    }
+
+    frequency = (uint64_t)((double)(tsc_end - tsc_start) * DEADLINE_NS_PER_SEC / (end - start));
+    is_tsc = true;
+}
+
+void
+deadline_extend(deadline_t *restrict deadline, uint64_t ns)
+{
+    /* Shift the whole wait, so that the time elapsed excludes the other work
+       too */
+    uint64_t ticks = deadline_ns_to_ticks(ns);
+    deadline->start += ticks;
+    deadline->end += ticks;
+    deadline->spin_end += ticks;
+}
+
+uint64_t
+deadline_get_elapsed(const deadline_t *restrict deadline)
+{
+    return (uint64_t)((double)(deadline_get_ticks() - deadline->start) * DEADLINE_NS_PER_SEC / frequency);
+}
+
+uint64_t
+deadline_get_frequency(void)
+{
+    return frequency;
+}
+
+uint64_t
+deadline_get_monotonic(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * DEADLINE_NS_PER_SEC + ts.tv_nsec;
+}
+
+uint64_t
+deadline_get_remaining(const deadline_t *restrict deadline)
+{
+    uint64_t now = deadline_get_ticks();
+    if (now >= deadline->end) {
+        return 0;
+    }
+
+    return (uint64_t)((double)(deadline->end - now) * DEADLINE_NS_PER_SEC / frequency);
+}
+
+uint64_t
+deadline_get_ticks(void)
+{
+    return is_tsc ? tsc_read() : deadline_get_monotonic();
+}
+
+bool
+deadline_is_expired(const deadline_t *restrict deadline)
+{
+    return deadline_get_ticks() >= deadline->end;
+}
+
+uint64_t
+deadline_ns_to_ticks(uint64_t ns)
+{
+    return (uint64_t)((double)ns * frequency / DEADLINE_NS_PER_SEC);
+}
+
+void
+deadline_start(deadline_t *restrict deadline, uint64_t timeout)
+{
+    deadline_calibrate();
+    deadline->start = deadline_get_ticks();
+    deadline->end = deadline->start + deadline_ns_to_ticks(timeout);
+    deadline->spin_end = deadline->start + deadline_ns_to_ticks(SPIN_NS);
+    deadline->sleep_ns = MIN_SLEEP_NS;
+}
+
+bool
+deadline_wait(deadline_t *restrict deadline)
+{
+    uint64_t now = deadline_get_ticks();
+    if (now >= deadline->end) {
+        return false;
+    }
+
+    /* Spin while the operation may still complete quickly */
+    if (now < deadline->spin_end) {
+        __builtin_ia32_pause();
+        return true;
+    }
+
+    /* Back off, but don't sleep past the deadline */
+    uint64_t remaining = deadline_get_remaining(deadline);
+    uint64_t sleep_ns = (deadline->sleep_ns < remaining) ? deadline->sleep_ns : remaining;
+    struct timespec ts = { .tv_sec = sleep_ns / DEADLINE_NS_PER_SEC, .tv_nsec = sleep_ns % DEADLINE_NS_PER_SEC };
+    nanosleep(&ts, NULL);
+    if (deadline->sleep_ns < MAX_SLEEP_NS) {
+        deadline->sleep_ns *= 2;
+    }
+
+    return true;
+}
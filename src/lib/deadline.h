@@ -0,0 +1,104 @@
+/** @file */
+
+#ifndef DEADLINE_H
+#define DEADLINE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define DEADLINE_NS_PER_SEC 1000000000ULL
+
+/** Deadline of a wait */
+typedef struct deadline {
+    uint64_t start; /**< Start, in ticks. */
+    uint64_t end; /**< End, in ticks. */
+    uint64_t spin_end; /**< End of the fast spin, in ticks. */
+    uint64_t sleep_ns; /**< Next sleep, in nanoseconds. */
+} deadline_t;
+
+/**
+ * Calibrates the clock of the deadlines. The invariant time-stamp counter (TSC)
+ * is used if the CPU has one; otherwise, the monotonic clock is used.
+ *
+ * The clock is calibrated by the first deadline_start() if this function has
+ * not been called.
+ */
+void deadline_calibrate(void);
+
+/**
+ * Extends the deadline (e.g., by time spent on other work while waiting). The
+ * extension isn't counted in the time elapsed.
+ *
+ * @param [in,out] deadline Deadline.
+ * @param [in] ns Extension, in nanoseconds.
+ */
+void deadline_extend(deadline_t *restrict deadline, uint64_t ns);
+
+/**
+ * Returns whether the deadline has expired.
+ *
+ * @param [in] deadline Deadline.
+ * @return Whether the deadline has expired.
+ */
+bool deadline_is_expired(const deadline_t *restrict deadline);
+
+/**
+ * Returns the time elapsed since the deadline was started.
+ *
+ * @param [in] deadline Deadline.
+ * @return Time elapsed, in nanoseconds.
+ */
+uint64_t deadline_get_elapsed(const deadline_t *restrict deadline);
+
+/**
+ * Returns the frequency of the clock of the deadlines, as calibrated by
+ * deadline_calibrate().
+ *
+ * @return Ticks per second.
+ */
+uint64_t deadline_get_frequency(void);
+
+/**
+ * Returns the time remaining until the deadline expires.
+ *
+ * @param [in] deadline Deadline.
+ * @return Time remaining, in nanoseconds, or zero if the deadline has expired.
+ */
+uint64_t deadline_get_remaining(const deadline_t *restrict deadline);
+
+/**
+ * Returns the current time of the clock of the deadlines, as calibrated by
+ * deadline_calibrate() (i.e., the TSC if it is invariant).
+ *
+ * @return Current time, in ticks.
+ */
+uint64_t deadline_get_ticks(void);
+
+/**
+ * Starts a deadline.
+ *
+ * @param [out] deadline Deadline.
+ * @param [in] timeout Timeout, in nanoseconds.
+ */
+void deadline_start(deadline_t *restrict deadline, uint64_t timeout);
+
+/**
+ * Waits before the next poll. The caller spins with PAUSE for the first few
+ * microseconds so that fast operations complete with a low latency; then, it
+ * sleeps with an exponential backoff so that slow operations don't burn the
+ * CPU (and VM exits) on status polls.
+ *
+ * @param [in,out] deadline Deadline.
+ * @return false if the deadline has expired; otherwise, returns true.
+ */
+bool deadline_wait(deadline_t *restrict deadline);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DEADLINE_H */
@@ -15,84 +15,247 @@
 #include <sys/mman.h>
 #include <unistd.h>
 
-static int buffer_num = -1;
-static const int num_buffers = 7;
+#include <immintrin.h>
 
-struct _dma_buffer {
+/* The DMA buffers are blocks of a buddy allocator over the regions of DMA
+   memory. A block of order k is 2^k bytes long and aligned on a 2^k-byte
+   physical boundary, so a block of up to 64K never crosses a 64K boundary. */
+#define MIN_ORDER 12
+#define MAX_ORDER 30
+#define MAX_REGIONS 8
+
+/* Without u-dma-buf, the regions are locked 2M hugepages, which are
+   physically contiguous. The hugepages above 4G can't be used, since the PRD
+   address is 32-bit. */
+#define HUGEPAGE_SIZE 0x200000
+#define NUM_HUGEPAGES 2
+#define MAX_HUGEPAGE_ATTEMPTS 16
+#define PAGEMAP_PRESENT (1ULL << 63)
+#define PAGEMAP_PFN_MASK ((1ULL << 55) - 1)
+
+/* A DMA buffer with canary zones has a page of the canary on both sides of
+   its payload, where a transfer past either end of the payload lands. After
+   the transfer, only a zone-sized stretch of the payload is checked, since an
+   overrun runs on from the end of the transfer. */
+#define CANARY 0xd3adb10cc0ffee5aULL
+#define CANARY_ZONE_SIZE (1 << MIN_ORDER)
+
+/* Region of DMA memory (i.e., a u-dma-buf or a hugepage), which is mapped
+   once */
+struct region {
     int fd;
     size_t size;
     uint64_t phys_addr;
+    uint8_t *addr;
+    /* Whether the region is a hugepage, whose mapping can't be split to
+       change the protection of part of it */
+    bool is_hugepage;
+    /* Order of the free block that starts at each page, or -1 */
+    int8_t *free_orders;
+};
+
+struct _dma_buffer {
+    struct region *region;
+    /* Offset and order of the block */
+    size_t offset;
+    int order;
+    /* Size of each canary zone, or zero if none */
+    size_t zone_size;
+    /* Size of the payload, between the canary zones */
+    size_t size;
 };
 
+static struct region regions[MAX_REGIONS];
+static int num_regions = 0;
+static int num_dma_buffers = 0;
+
 static dma_buffer_error_handler_t *error_handler = NULL;
+static size_t (*find_corruption)(const uint8_t *data, size_t offset, size_t size) = NULL;
 
+int dma_buffer_alloc(dma_buffer_t *restrict dma_buffer, int order);
+void dma_buffer_close_region(struct region *restrict region);
+void dma_buffer_close_regions();
+dma_buffer_t *dma_buffer_create_with_zones(size_t size, size_t zone_size);
 void dma_buffer_error(dma_buffer_t *restrict dma_buffer, int status, int error, const char *restrict format, ...);
+void dma_buffer_fill_canary(uint8_t *data, size_t size);
+size_t dma_buffer_find_corruption(const uint8_t *data, size_t offset, size_t size);
+size_t dma_buffer_find_corruption_avx2(const uint8_t *data, size_t offset, size_t size);
+size_t dma_buffer_find_corruption_sse2(const uint8_t *data, size_t offset, size_t size);
+void dma_buffer_free(dma_buffer_t *restrict dma_buffer);
+int dma_buffer_get_max_free_order();
+int dma_buffer_get_order(size_t size);
+uint8_t *dma_buffer_get_payload(dma_buffer_t *restrict dma_buffer);
+int dma_buffer_init_region(struct region *restrict region);
+int dma_buffer_map_hugepage(struct region *restrict region);
+int dma_buffer_open_hugepage_region(struct region *restrict region);
+int dma_buffer_open_region(struct region *restrict region, int region_num);
+int dma_buffer_open_regions();
 
-dma_buffer_t *
-dma_buffer_create(size_t size)
+int
+dma_buffer_alloc(dma_buffer_t *restrict dma_buffer, int order)
 {
-    dma_buffer_t *dma_buffer = (dma_buffer_t *)calloc(1, sizeof(*dma_buffer));
-    if (dma_buffer == NULL) {
-        dma_buffer_error(dma_buffer, 0, errno, __func__);
-        return NULL;
+    /* Find the smallest free block that fits, first fit within an order */
+    for (int region_num = 0; region_num < num_regions; ++region_num) {
+        struct region *region = &regions[region_num];
+        size_t num_pages = region->size >> MIN_ORDER;
+        for (int k = order; k <= MAX_ORDER; ++k) {
+            for (size_t page = 0; page < num_pages; ++page) {
+                if (region->free_orders[page] != k) {
+                    continue;
+                }
+
+                /* Split the block down to the requested order, freeing the
+                   upper halves */
+                region->free_orders[page] = -1;
+                while (k > order) {
+                    --k;
+                    region->free_orders[page + ((size_t)1 << (k - MIN_ORDER))] = k;
+                }
+
+                dma_buffer->region = region;
+                dma_buffer->offset = page << MIN_ORDER;
+                dma_buffer->order = order;
+                return 0;
+            }
+        }
     }
 
-    ++buffer_num;
-    if (buffer_num > num_buffers) {
-        errno = ENOMEM;
-        dma_buffer_error(dma_buffer, 0, errno, __func__);
-        goto err;
+    errno = ENOMEM;
+    return -1;
+}
+
+bool
+dma_buffer_check_canary(dma_buffer_t *restrict dma_buffer, size_t offset, ptrdiff_t *restrict corrupted_offset)
+{
+    if (dma_buffer->zone_size == 0) {
+        return true;
     }
 
-    char path[PATH_MAX];
-    sprintf(path, "/dev/udmabuf%d", buffer_num);
-    dma_buffer->fd = open(path, O_RDWR);
-    if (dma_buffer->fd == -1) {
-        errno = ENOMEM;
-        dma_buffer_error(dma_buffer, 0, errno, __func__);
+    /* Check the leading zone, the stretch of the payload after the offset,
+       and the trailing zone */
+    uint8_t *payload = dma_buffer_get_payload(dma_buffer);
+    size_t zone_size = dma_buffer->zone_size;
+    size_t start = (offset + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+    start = (start < dma_buffer->size) ? start : dma_buffer->size;
+    size_t end = (start + zone_size < dma_buffer->size) ? start + zone_size : dma_buffer->size;
+    size_t i = (*find_corruption)(payload - zone_size, 0, zone_size);
+    if (i < zone_size) {
+        *corrupted_offset = (ptrdiff_t)i - (ptrdiff_t)zone_size;
         goto err;
     }
 
-    sprintf(path, "/sys/class/u-dma-buf/udmabuf%d/size", buffer_num);
-    int fd = open(path, O_RDONLY);
-    if (fd == -1) {
-        dma_buffer_error(dma_buffer, 0, errno, __func__);
+    i = (*find_corruption)(payload, start, end);
+    if (i < end) {
+        *corrupted_offset = i;
         goto err;
     }
 
-    char buf[1024] = {0};
-    ssize_t nbytes = read(fd, buf, sizeof(buf));
-    if (nbytes == -1) {
-        dma_buffer_error(dma_buffer, 0, errno, __func__);
-        close(fd);
+    i = (*find_corruption)(payload, dma_buffer->size, dma_buffer->size + zone_size);
+    if (i < dma_buffer->size + zone_size) {
+        *corrupted_offset = i;
         goto err;
     }
 
-    close(fd);
-    sscanf(buf, "%zd", &dma_buffer->size);
-    if (dma_buffer->size < size) {
-        errno = ENOMEM;
+    return true;
+
+err:
+    /* Plant the canary again for the next transfer */
+    dma_buffer_fill_canary(payload - zone_size, zone_size);
+    dma_buffer_fill_canary(payload + start, end - start);
+    dma_buffer_fill_canary(payload + dma_buffer->size, zone_size);
+    return false;
+}
+
+void
+dma_buffer_close_region(struct region *restrict region)
+{
+    if (region->addr != NULL) {
+        munmap(region->addr, region->size);
+    }
+
+    if (region->fd != -1) {
+        close(region->fd);
+    }
+
+    free(region->free_orders);
+    memset(region, 0, sizeof(*region));
+}
+
+void
+dma_buffer_close_regions()
+{
+    for (int region_num = 0; region_num < num_regions; ++region_num) {
+        dma_buffer_close_region(&regions[region_num]);
+    }
+
+    num_regions = 0;
+}
+
+dma_buffer_t *
+dma_buffer_create(size_t size)
+{
+    return dma_buffer_create_with_zones(size, 0);
+}
+
+dma_buffer_t *
+dma_buffer_create_with_canary(size_t size)
+{
+    return dma_buffer_create_with_zones(size, CANARY_ZONE_SIZE);
+}
+
+dma_buffer_t *
+dma_buffer_create_with_zones(size_t size, size_t zone_size)
+{
+    dma_buffer_t *dma_buffer = (dma_buffer_t *)calloc(1, sizeof(*dma_buffer));
+    if (dma_buffer == NULL) {
         dma_buffer_error(dma_buffer, 0, errno, __func__);
-        goto err;
+        return NULL;
     }
 
-    sprintf(path, "/sys/class/u-dma-buf/udmabuf%d/phys_addr", buffer_num);
-    fd = open(path, O_RDONLY);
-    if (fd == -1) {
+    /* Map the regions once, when the first DMA buffer is created */
+    if (num_dma_buffers == 0 && dma_buffer_open_regions() == -1) {
         dma_buffer_error(dma_buffer, 0, errno, __func__);
         goto err;
     }
 
-    memset(buf, 0, sizeof(buf));
-    nbytes = read(fd, buf, sizeof(buf));
-    if (nbytes == -1) {
+    ++num_dma_buffers;
+    /* Do without the canary zones if no block is free for them, too (e.g.,
+       with u-dma-bufs only as large as the payload), rather than fail */
+    int order = dma_buffer_get_order(size + 2 * zone_size);
+    if (zone_size > 0 && (order == -1 || order > dma_buffer_get_max_free_order())) {
+        zone_size = 0;
+        order = dma_buffer_get_order(size);
+    }
+
+    if (order == -1 || dma_buffer_alloc(dma_buffer, order) == -1) {
+        errno = ENOMEM;
         dma_buffer_error(dma_buffer, 0, errno, __func__);
-        close(fd);
         goto err;
     }
 
-    close(fd);
-    sscanf(buf, "%lx", &dma_buffer->phys_addr);
+    /* The payload takes the rest of the block */
+    dma_buffer->zone_size = zone_size;
+    dma_buffer->size = ((size_t)1 << order) - 2 * zone_size;
+    if (zone_size > 0) {
+        /* Check the canary with AVX2 if the CPU has it */
+        if (find_corruption == NULL) {
+            __builtin_cpu_init();
+            find_corruption = __builtin_cpu_supports("avx2") ? dma_buffer_find_corruption_avx2
+                                                             : dma_buffer_find_corruption_sse2;
+        }
+
+        /* The block may have been unmapped by a previous DMA buffer */
+        uint8_t *payload = dma_buffer_get_payload(dma_buffer);
+        if (!dma_buffer->region->is_hugepage
+                && mprotect(payload - zone_size, (size_t)1 << order, PROT_READ | PROT_WRITE) == -1) {
+            dma_buffer_error(dma_buffer, 0, errno, __func__);
+            goto err;
+        }
+
+        dma_buffer_fill_canary(payload - zone_size, zone_size);
+        dma_buffer_fill_canary(payload + dma_buffer->size, zone_size);
+    }
+
     return dma_buffer;
 
 err:
@@ -107,8 +270,15 @@ dma_buffer_destroy(dma_buffer_t *restrict dma_buffer)
         return;
     }
 
-    close(dma_buffer->fd);
-    --buffer_num;
+    if (dma_buffer->region != NULL) {
+        dma_buffer_free(dma_buffer);
+    }
+
+    /* Unmap the regions with the last DMA buffer */
+    if (num_dma_buffers > 0 && --num_dma_buffers == 0) {
+        dma_buffer_close_regions();
+    }
+
     free(dma_buffer);
 }
 
@@ -125,35 +295,416 @@ dma_buffer_error(dma_buffer_t *restrict dma_buffer, int status, int error, const
     va_end(ap);
 }
 
+void
+dma_buffer_fill_canary(uint8_t *data, size_t size)
+{
+    uint64_t *words = (uint64_t *)data;
+    for (size_t i = 0; i < size / sizeof(uint64_t); ++i) {
+        words[i] = CANARY;
+    }
+}
+
 size_t
-dma_buffer_get_size(dma_buffer_t *restrict dma_buffer)
+dma_buffer_find_corruption(const uint8_t *data, size_t offset, size_t size)
 {
-    return dma_buffer->size;
+    for (; offset < size; offset += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data + offset, sizeof(word));
+        if (word != CANARY) {
+            /* The first corrupted byte is the lowest one that differs */
+            return offset + (size_t)__builtin_ctzll(word ^ CANARY) / CHAR_BIT;
+        }
+    }
+
+    return size;
+}
+
+__attribute__((target("avx2"))) size_t
+dma_buffer_find_corruption_avx2(const uint8_t *data, size_t offset, size_t size)
+{
+    /* Compare 128 bytes at a time, and find the first corrupted byte of a
+       mismatch one word at a time */
+    const __m256i canary = _mm256_set1_epi64x(CANARY);
+    for (; offset + 4 * sizeof(__m256i) <= size; offset += 4 * sizeof(__m256i)) {
+        const __m256i *vectors = (const __m256i *)(data + offset);
+        __m256i is_equal = _mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256(vectors), canary),
+                                                    _mm256_cmpeq_epi8(_mm256_loadu_si256(vectors + 1), canary)),
+                _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256(vectors + 2), canary),
+                        _mm256_cmpeq_epi8(_mm256_loadu_si256(vectors + 3), canary)));
+        if ((uint32_t)_mm256_movemask_epi8(is_equal) != UINT32_MAX) {
+            break;
+        }
+    }
+
+    return dma_buffer_find_corruption(data, offset, size);
+}
+
+size_t
+dma_buffer_find_corruption_sse2(const uint8_t *data, size_t offset, size_t size)
+{
+    /* The same as dma_buffer_find_corruption_avx2, 64 bytes at a time */
+    const __m128i canary = _mm_set1_epi64x(CANARY);
+    for (; offset + 4 * sizeof(__m128i) <= size; offset += 4 * sizeof(__m128i)) {
+        const __m128i *vectors = (const __m128i *)(data + offset);
+        __m128i is_equal = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128(vectors), canary),
+                                                 _mm_cmpeq_epi8(_mm_loadu_si128(vectors + 1), canary)),
+                _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128(vectors + 2), canary),
+                        _mm_cmpeq_epi8(_mm_loadu_si128(vectors + 3), canary)));
+        if (_mm_movemask_epi8(is_equal) != 0xffff) {
+            break;
+        }
+    }
+
+    return dma_buffer_find_corruption(data, offset, size);
+}
+
+void
+dma_buffer_free(dma_buffer_t *restrict dma_buffer)
+{
+    /* Coalesce the block with its buddy as long as the buddy is free */
+    struct region *region = dma_buffer->region;
+    size_t num_pages = region->size >> MIN_ORDER;
+    size_t page = dma_buffer->offset >> MIN_ORDER;
+    int k = dma_buffer->order;
+    while (k < MAX_ORDER) {
+        uint64_t phys_addr = region->phys_addr + ((uint64_t)page << MIN_ORDER);
+        uint64_t buddy_phys_addr = phys_addr ^ ((uint64_t)1 << k);
+        if (buddy_phys_addr < region->phys_addr) {
+            break;
+        }
+
+        size_t buddy_page = (buddy_phys_addr - region->phys_addr) >> MIN_ORDER;
+        if (buddy_page >= num_pages || region->free_orders[buddy_page] != k) {
+            break;
+        }
+
+        region->free_orders[buddy_page] = -1;
+        page = (buddy_page < page) ? buddy_page : page;
+        ++k;
+    }
+
+    region->free_orders[page] = k;
+}
+
+int
+dma_buffer_get_max_free_order()
+{
+    int max_order = -1;
+    for (int region_num = 0; region_num < num_regions; ++region_num) {
+        struct region *region = &regions[region_num];
+        size_t num_pages = region->size >> MIN_ORDER;
+        for (size_t page = 0; page < num_pages; ++page) {
+            if (region->free_orders[page] > max_order) {
+                max_order = region->free_orders[page];
+            }
+        }
+    }
+
+    return max_order;
+}
+
+size_t
+dma_buffer_get_max_free_size()
+{
+    /* The regions aren't mapped before the first DMA buffer is created */
+    if (num_dma_buffers == 0) {
+        return 0;
+    }
+
+    int max_order = dma_buffer_get_max_free_order();
+    return (max_order == -1) ? 0 : ((size_t)1 << max_order);
+}
+
+int
+dma_buffer_get_order(size_t size)
+{
+    int order = MIN_ORDER;
+    while (((size_t)1 << order) < size) {
+        if (++order > MAX_ORDER) {
+            return -1;
+        }
+    }
+
+    return order;
+}
+
+uint8_t *
+dma_buffer_get_payload(dma_buffer_t *restrict dma_buffer)
+{
+    return dma_buffer->region->addr + dma_buffer->offset + dma_buffer->zone_size;
 }
 
 uint64_t
 dma_buffer_get_phys_addr(dma_buffer_t *restrict dma_buffer)
 {
-    return dma_buffer->phys_addr;
+    return dma_buffer->region->phys_addr + dma_buffer->offset + dma_buffer->zone_size;
+}
+
+size_t
+dma_buffer_get_size(dma_buffer_t *restrict dma_buffer)
+{
+    return dma_buffer->size;
+}
+
+int
+dma_buffer_init_region(struct region *restrict region)
+{
+    size_t num_pages = region->size >> MIN_ORDER;
+    region->free_orders = (int8_t *)malloc(num_pages);
+    if (num_pages > 0 && region->free_orders == NULL) {
+        return -1;
+    }
+
+    /* Carve the region into the largest naturally aligned free blocks */
+    memset(region->free_orders, -1, num_pages);
+    size_t page = 0;
+    while (page < num_pages) {
+        uint64_t phys_addr = region->phys_addr + ((uint64_t)page << MIN_ORDER);
+        int k = MIN_ORDER;
+        while (k < MAX_ORDER && (phys_addr & (((uint64_t)1 << (k + 1)) - 1)) == 0
+                && page + ((size_t)1 << (k + 1 - MIN_ORDER)) <= num_pages) {
+            ++k;
+        }
+
+        region->free_orders[page] = k;
+        page += (size_t)1 << (k - MIN_ORDER);
+    }
+
+    return 0;
 }
 
 bool
 dma_buffer_is_enabled()
 {
-    return (access("/dev/udmabuf0", F_OK) == 0);
+    if (num_regions > 0 || access("/dev/udmabuf0", F_OK) == 0) {
+        return true;
+    }
+
+    /* Are there free hugepages, and can their physical addresses be
+       resolved? */
+    FILE *stream = fopen("/sys/kernel/mm/hugepages/hugepages-2048kB/free_hugepages", "r");
+    if (stream == NULL) {
+        return false;
+    }
+
+    unsigned long free_hugepages = 0;
+    if (fscanf(stream, "%lu", &free_hugepages) != 1) {
+        free_hugepages = 0;
+    }
+
+    fclose(stream);
+    return (free_hugepages > 0 && access("/proc/self/pagemap", R_OK) == 0);
 }
 
 void *
 dma_buffer_map(dma_buffer_t *restrict dma_buffer, int prot)
 {
-    void *addr = mmap(NULL, dma_buffer->size, prot, MAP_FILE | MAP_SHARED, dma_buffer->fd, 0);
-    if (addr == MAP_FAILED) {
+    /* The region is already mapped; only the protection of the payload
+       changes, unless the region is a hugepage, which stays readable and
+       writable */
+    void *addr = dma_buffer_get_payload(dma_buffer);
+    if (!dma_buffer->region->is_hugepage && mprotect(addr, dma_buffer->size, prot) == -1) {
         return NULL;
     }
 
     return addr;
 }
 
+int
+dma_buffer_map_hugepage(struct region *restrict region)
+{
+    region->addr = mmap(NULL, HUGEPAGE_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_LOCKED | MAP_POPULATE, -1, 0);
+    if (region->addr == MAP_FAILED) {
+        region->addr = NULL;
+        return -1;
+    }
+
+    region->size = HUGEPAGE_SIZE;
+    region->is_hugepage = true;
+    if (mlock(region->addr, region->size) == -1) {
+        return -1;
+    }
+
+    /* Resolve the physical address of each page, and check that the pages
+       are contiguous */
+    int fd = open("/proc/self/pagemap", O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+
+    long page_size = sysconf(_SC_PAGESIZE);
+    for (size_t offset = 0; offset < region->size; offset += page_size) {
+        uint64_t entry;
+        off_t pagemap_offset = ((uintptr_t)(region->addr + offset) / page_size) * sizeof(entry);
+        if (pread(fd, &entry, sizeof(entry), pagemap_offset) != sizeof(entry)) {
+            close(fd);
+            return -1;
+        }
+
+        /* The PFN reads as zero without CAP_SYS_ADMIN */
+        uint64_t phys_addr = (entry & PAGEMAP_PFN_MASK) * page_size;
+        if (!(entry & PAGEMAP_PRESENT) || phys_addr == 0) {
+            close(fd);
+            errno = EPERM;
+            return -1;
+        }
+
+        if (offset == 0) {
+            region->phys_addr = phys_addr;
+        } else if (phys_addr != region->phys_addr + offset) {
+            close(fd);
+            errno = EFAULT;
+            return -1;
+        }
+    }
+
+    close(fd);
+    return 0;
+}
+
+int
+dma_buffer_open_hugepage_region(struct region *restrict region)
+{
+    /* Keep the hugepages above 4G mapped until one below 4G is found, so
+       that the same hugepage isn't handed out again */
+    struct region rejected_regions[MAX_HUGEPAGE_ATTEMPTS];
+    int num_rejected_regions = 0;
+    int result = -1;
+    region->fd = -1;
+    while (num_rejected_regions < MAX_HUGEPAGE_ATTEMPTS) {
+        if (dma_buffer_map_hugepage(region) == -1) {
+            break;
+        }
+
+        if (region->phys_addr + region->size <= 0x100000000ULL) {
+            result = dma_buffer_init_region(region);
+            break;
+        }
+
+        rejected_regions[num_rejected_regions++] = *region;
+        region->addr = NULL;
+    }
+
+    for (int i = 0; i < num_rejected_regions; ++i) {
+        munmap(rejected_regions[i].addr, rejected_regions[i].size);
+    }
+
+    if (result == -1 && num_rejected_regions == MAX_HUGEPAGE_ATTEMPTS) {
+        errno = ENOMEM;
+    }
+
+    return result;
+}
+
+int
+dma_buffer_open_region(struct region *restrict region, int region_num)
+{
+    region->fd = -1;
+    char path[PATH_MAX];
+    sprintf(path, "/dev/udmabuf%d", region_num);
+    region->fd = open(path, O_RDWR);
+    if (region->fd == -1) {
+        return -1;
+    }
+
+    sprintf(path, "/sys/class/u-dma-buf/udmabuf%d/size", region_num);
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+
+    char buf[1024] = {0};
+    ssize_t nbytes = read(fd, buf, sizeof(buf));
+    close(fd);
+    if (nbytes == -1) {
+        return -1;
+    }
+
+    sscanf(buf, "%zd", &region->size);
+    sprintf(path, "/sys/class/u-dma-buf/udmabuf%d/phys_addr", region_num);
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+
+    memset(buf, 0, sizeof(buf));
+    nbytes = read(fd, buf, sizeof(buf));
+    close(fd);
+    if (nbytes == -1) {
+        return -1;
+    }
+
+    sscanf(buf, "%lx", &region->phys_addr);
+    region->addr = mmap(NULL, region->size, PROT_READ | PROT_WRITE, MAP_FILE | MAP_SHARED, region->fd, 0);
+    if (region->addr == MAP_FAILED) {
+        region->addr = NULL;
+        return -1;
+    }
+
+    return dma_buffer_init_region(region);
+}
+
+int
+dma_buffer_open_regions()
+{
+    /* Usually a single large u-dma-buf, but smaller ones are pooled too */
+    for (int region_num = 0; region_num < MAX_REGIONS; ++region_num) {
+        char path[PATH_MAX];
+        sprintf(path, "/dev/udmabuf%d", region_num);
+        if (access(path, F_OK) == -1) {
+            break;
+        }
+
+        if (dma_buffer_open_region(&regions[region_num], region_num) == -1) {
+            int error = errno;
+            dma_buffer_close_region(&regions[region_num]);
+            dma_buffer_close_regions();
+            errno = error;
+            return -1;
+        }
+
+        ++num_regions;
+    }
+
+    if (num_regions > 0) {
+        return 0;
+    }
+
+    /* Otherwise, fall back to hugepages, of which at least one is needed */
+    while (num_regions < NUM_HUGEPAGES) {
+        if (dma_buffer_open_hugepage_region(&regions[num_regions]) == -1) {
+            int error = errno;
+            dma_buffer_close_region(&regions[num_regions]);
+            if (num_regions > 0) {
+                break;
+            }
+
+            errno = error;
+            return -1;
+        }
+
+        ++num_regions;
+    }
+
+    return 0;
+}
+
+void
+dma_buffer_plant_canary(dma_buffer_t *restrict dma_buffer, size_t offset)
+{
+    if (dma_buffer->zone_size == 0) {
+        return;
+    }
+
+    size_t start = (offset + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+    if (start < dma_buffer->size) {
+        size_t size = dma_buffer->size - start;
+        dma_buffer_fill_canary(dma_buffer_get_payload(dma_buffer) + start,
+                (size < dma_buffer->zone_size) ? size : dma_buffer->zone_size);
+    }
+}
+
 dma_buffer_error_handler_t *
 dma_buffer_set_error_handler(dma_buffer_error_handler_t *handler)
 {
@@ -169,5 +720,9 @@ dma_buffer_unmap(dma_buffer_t *restrict dma_buffer, void *addr)
         return;
     }
 
-    munmap(addr, dma_buffer->size);
+    /* The region stays mapped until its last DMA buffer is destroyed, but the
+       payload can't be accessed anymore (except in a hugepage) */
+    if (!dma_buffer->region->is_hugepage) {
+        mprotect(addr, dma_buffer->size, PROT_NONE);
+    }
 }
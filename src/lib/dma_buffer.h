@@ -16,13 +16,45 @@ typedef struct _dma_buffer dma_buffer_t; /**< DMA buffer. */
 
 typedef void dma_buffer_error_handler_t(int status, int error, const char *restrict format, va_list ap);
 /**
- * Creates an DMA buffer.
+ * Creates an DMA buffer. The DMA buffers are allocated from the u-dma-buf
+ * regions or, without u-dma-buf, from locked hugepages below 4G. The regions
+ * are mapped when the first DMA buffer is created. A DMA buffer
+ * is aligned on a physical boundary of its size rounded up to a power of two
+ * (at least 4K).
  *
  * @param [in] size Size.
  * @return A DMA buffer.
  */
 dma_buffer_t *dma_buffer_create(size_t size);
 
+/**
+ * Creates a DMA buffer with canary zones: a page of a known pattern on both
+ * sides of the payload, which a transfer past either end of the payload
+ * overwrites. Unlike the DMA buffers created by dma_buffer_create, the payload
+ * is only aligned on a page boundary, and may cross a 64K boundary. The
+ * canary zones round the block up to the next power of two (e.g., 128K for a
+ * 64K payload); if no such block is free, the DMA buffer is created without
+ * them, as by dma_buffer_create, and its canary is never checked.
+ *
+ * @param [in] size Size of the payload.
+ * @return A DMA buffer.
+ */
+dma_buffer_t *dma_buffer_create_with_canary(size_t size);
+
+/**
+ * Checks the canary of the DMA buffer after a transfer into it: the canary
+ * zones, and the stretch of the payload after the transfer, up to the size of
+ * a canary zone. The canary is planted again if it has been overwritten.
+ *
+ * @param [in] dma_buffer DMA buffer.
+ * @param [in] offset Offset of the end of the transfer in the payload.
+ * @param [out] corrupted_offset Offset of the first overwritten byte, relative
+ *   to the payload (i.e., negative in the leading canary zone).
+ * @return Returns true if the canary is intact or the DMA buffer has no canary
+ *   zones; otherwise, returns false if the canary has been overwritten.
+ */
+bool dma_buffer_check_canary(dma_buffer_t *restrict dma_buffer, size_t offset, ptrdiff_t *restrict corrupted_offset);
+
 /**
  * Destroys the DMA buffer.
  *
@@ -31,7 +63,8 @@ dma_buffer_t *dma_buffer_create(size_t size);
 void dma_buffer_destroy(dma_buffer_t *restrict dma_buffer);
 
 /**
- * Returns the size of the DMA buffer.
+ * Returns the size of the DMA buffer (i.e., of the payload between the canary
+ * zones), which may be larger than requested.
  *
  * @param [in] dma_buffer DMA buffer.
  * @return Size.
@@ -39,7 +72,15 @@ void dma_buffer_destroy(dma_buffer_t *restrict dma_buffer);
 size_t dma_buffer_get_size(dma_buffer_t *restrict dma_buffer);
 
 /**
- * Returns the physical address of the DMA buffer.
+ * Returns the size of the largest DMA buffer that can still be created (with
+ * canary zones only if it is smaller).
+ *
+ * @return Size, or zero if no DMA buffer has been created yet.
+ */
+size_t dma_buffer_get_max_free_size();
+
+/**
+ * Returns the physical address of the DMA buffer (i.e., of the payload).
  *
  * @param [in] dma_buffer DMA buffer.
  * @return Physical address.
@@ -47,7 +88,9 @@ size_t dma_buffer_get_size(dma_buffer_t *restrict dma_buffer);
 uint64_t dma_buffer_get_phys_addr(dma_buffer_t *restrict dma_buffer);
 
 /**
- * Returns whether the DMA buffer is enabled.
+ * Returns whether the DMA buffer is enabled, i.e., whether u-dma-buf is
+ * loaded or there are free 2M hugepages whose physical addresses can be
+ * resolved.
  *
  * @return Returns true if the DMA buffer is enabled; otherwise, returns false
  *   if the DMA buffer is not enabled.
@@ -55,7 +98,9 @@ uint64_t dma_buffer_get_phys_addr(dma_buffer_t *restrict dma_buffer);
 bool dma_buffer_is_enabled();
 
 /**
- * Maps the DMA buffer into memory.
+ * Maps the DMA buffer into memory. The DMA buffer is a view of the already
+ * mapped region, with the given protection (except in a hugepage, which is
+ * always readable and writable).
  *
  * @param [in] dma_buffer DMA buffer.
  * @param [in] prot Protection flags.
@@ -63,6 +108,16 @@ bool dma_buffer_is_enabled();
  */
 void *dma_buffer_map(dma_buffer_t *restrict dma_buffer, int prot);
 
+/**
+ * Plants the canary in the stretch of the payload after a transfer, up to the
+ * size of a canary zone, before the transfer into the DMA buffer. The canary
+ * zones are planted when the DMA buffer is created.
+ *
+ * @param [in] dma_buffer DMA buffer.
+ * @param [in] offset Offset of the end of the transfer in the payload.
+ */
+void dma_buffer_plant_canary(dma_buffer_t *restrict dma_buffer, size_t offset);
+
 /**
  * Sets the error handler for the DMA buffer.
  *
@@ -0,0 +1,170 @@
+/** @file */
+
+#include "guard_buffer.h"
+
+#include <errno.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+struct _guard_buffer {
+    guard_buffer_t *next;
+    uint8_t *addr;
+    size_t size;
+    size_t page_size;
+    void *data;
+};
+
+static guard_buffer_error_handler_t *error_handler = NULL;
+/* The guard buffers, which the SIGSEGV handler walks */
+static guard_buffer_t *volatile guard_buffers = NULL;
+static struct sigaction previous_action;
+static sigjmp_buf *volatile recovery = NULL;
+static void *volatile fault_addr = NULL;
+
+void guard_buffer_error(guard_buffer_t *restrict guard_buffer, int status, int error, const char *restrict format, ...);
+void guard_buffer_handle_fault(int signum, siginfo_t *info, void *context);
+bool guard_buffer_is_guard(guard_buffer_t *restrict guard_buffer, const uint8_t *addr);
+
+guard_buffer_t *
+guard_buffer_create(size_t size)
+{
+    guard_buffer_t *guard_buffer = (guard_buffer_t *)calloc(1, sizeof(*guard_buffer));
+    if (guard_buffer == NULL) {
+        guard_buffer_error(guard_buffer, 0, errno, __func__);
+        return NULL;
+    }
+
+    /* Map the data pages with a guard page on both sides */
+    guard_buffer->page_size = sysconf(_SC_PAGESIZE);
+    size_t data_size = (size + guard_buffer->page_size - 1) & ~(guard_buffer->page_size - 1);
+    guard_buffer->size = data_size + 2 * guard_buffer->page_size;
+    guard_buffer->addr = mmap(NULL, guard_buffer->size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (guard_buffer->addr == MAP_FAILED) {
+        guard_buffer_error(guard_buffer, 0, errno, __func__);
+        goto err;
+    }
+
+    if (mprotect(guard_buffer->addr + guard_buffer->page_size, data_size, PROT_READ | PROT_WRITE) == -1) {
+        guard_buffer_error(guard_buffer, 0, errno, __func__);
+        goto err_munmap;
+    }
+
+    /* End the data at the upper guard page */
+    guard_buffer->data = guard_buffer->addr + guard_buffer->page_size + ((data_size - size) & ~(size_t)1);
+    /* Install the SIGSEGV handler for the first guard buffer */
+    if (guard_buffers == NULL) {
+        struct sigaction action = { 0 };
+        action.sa_sigaction = guard_buffer_handle_fault;
+        action.sa_flags = SA_SIGINFO;
+        sigemptyset(&action.sa_mask);
+        if (sigaction(SIGSEGV, &action, &previous_action) == -1) {
+            guard_buffer_error(guard_buffer, 0, errno, __func__);
+            goto err_munmap;
+        }
+    }
+
+    guard_buffer->next = guard_buffers;
+    guard_buffers = guard_buffer;
+    return guard_buffer;
+
+err_munmap:
+    munmap(guard_buffer->addr, guard_buffer->size);
+
+err:
+    free(guard_buffer);
+    return NULL;
+}
+
+void
+guard_buffer_destroy(guard_buffer_t *restrict guard_buffer)
+{
+    if (guard_buffer == NULL) {
+        return;
+    }
+
+    for (guard_buffer_t *volatile *p = &guard_buffers; *p != NULL; p = &(*p)->next) {
+        if (*p == guard_buffer) {
+            *p = guard_buffer->next;
+            break;
+        }
+    }
+
+    /* Uninstall the SIGSEGV handler with the last guard buffer */
+    if (guard_buffers == NULL) {
+        sigaction(SIGSEGV, &previous_action, NULL);
+    }
+
+    munmap(guard_buffer->addr, guard_buffer->size);
+    free(guard_buffer);
+}
+
+void
+guard_buffer_error(guard_buffer_t *restrict guard_buffer, int status, int error, const char *restrict format, ...)
+{
+    if (error_handler == NULL) {
+        return;
+    }
+
+    va_list ap;
+    va_start(ap, format);
+    (*error_handler)(status, error, format, ap);
+    va_end(ap);
+}
+
+void *
+guard_buffer_get_data(guard_buffer_t *restrict guard_buffer)
+{
+    return guard_buffer->data;
+}
+
+void *
+guard_buffer_get_fault_addr()
+{
+    return fault_addr;
+}
+
+void
+guard_buffer_handle_fault(int signum, siginfo_t *info, void *context)
+{
+    /* Recover from a fault in a guard page. Otherwise, let the previous
+       handler handle the fault when the access is restarted. */
+    for (guard_buffer_t *guard_buffer = guard_buffers; guard_buffer != NULL; guard_buffer = guard_buffer->next) {
+        if (guard_buffer_is_guard(guard_buffer, (const uint8_t *)info->si_addr) && recovery != NULL) {
+            fault_addr = info->si_addr;
+            siglongjmp(*recovery, 1);
+        }
+    }
+
+    sigaction(SIGSEGV, &previous_action, NULL);
+}
+
+bool
+guard_buffer_is_guard(guard_buffer_t *restrict guard_buffer, const uint8_t *addr)
+{
+    return (addr >= guard_buffer->addr && addr < guard_buffer->addr + guard_buffer->page_size)
+           || (addr >= guard_buffer->addr + guard_buffer->size - guard_buffer->page_size
+                   && addr < guard_buffer->addr + guard_buffer->size);
+}
+
+guard_buffer_error_handler_t *
+guard_buffer_set_error_handler(guard_buffer_error_handler_t *handler)
+{
+    guard_buffer_error_handler_t *previous_handler = error_handler;
+    error_handler = handler;
+    return previous_handler;
+}
+
+sigjmp_buf *
+guard_buffer_set_recovery(sigjmp_buf *env)
+{
+    sigjmp_buf *previous_env = recovery;
+    recovery = env;
+    return previous_env;
+}
@@ -0,0 +1,75 @@
+/** @file */
+
+#ifndef GUARD_BUFFER_H
+#define GUARD_BUFFER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+
+typedef struct _guard_buffer guard_buffer_t; /**< Guard buffer. */
+
+typedef void guard_buffer_error_handler_t(int status, int error, const char *restrict format, va_list ap);
+
+/**
+ * Creates a guard buffer: a page-aligned mapping between two inaccessible
+ * guard pages. The data ends right at the upper guard page, so that an access
+ * past either end of the data faults. The SIGSEGV handler is installed when
+ * the first guard buffer is created, and uninstalled when the last one is
+ * destroyed.
+ *
+ * @param [in] size Size of the data, in bytes.
+ * @return A guard buffer.
+ */
+guard_buffer_t *guard_buffer_create(size_t size);
+
+/**
+ * Destroys the guard buffer.
+ *
+ * @param [in] guard_buffer Guard buffer.
+ */
+void guard_buffer_destroy(guard_buffer_t *restrict guard_buffer);
+
+/**
+ * Returns the data of the guard buffer.
+ *
+ * @param [in] guard_buffer Guard buffer.
+ * @return Data, aligned to 2 bytes.
+ */
+void *guard_buffer_get_data(guard_buffer_t *restrict guard_buffer);
+
+/**
+ * Returns the address of the last fault in a guard page.
+ *
+ * @return Address of the fault, or NULL if none.
+ */
+void *guard_buffer_get_fault_addr();
+
+/**
+ * Sets the error handler for the guard buffers.
+ *
+ * @param [in] handler Error handler.
+ * @return Previous error handler.
+ */
+guard_buffer_error_handler_t *guard_buffer_set_error_handler(guard_buffer_error_handler_t *handler);
+
+/**
+ * Sets where to jump (i.e., siglongjmp with a value of 1) when an access
+ * faults in a guard page. Without it, the fault is handled by the previous
+ * SIGSEGV handler (e.g., the process is terminated).
+ *
+ * @param [in] env Environment saved by sigsetjmp with a nonzero savemask, or
+ *   NULL to not recover.
+ * @return Previous environment.
+ */
+sigjmp_buf *guard_buffer_set_recovery(sigjmp_buf *env);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* GUARD_BUFFER_H */
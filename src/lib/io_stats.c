@@ -0,0 +1,214 @@
+/** @file */
+
+#include "io_stats.h"
+
+#include "tsc.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The command codes, and no command (e.g., if the execution ended before the
+   command was sent) */
+#define MAX_COMMANDS (UINT8_MAX + 2)
+
+struct _io_stats {
+    int command;
+    int phase;
+    uint64_t tsc;
+    uint64_t current[IO_STATS_MAX_PHASES][IO_STATS_MAX_COUNTERS];
+    uint64_t execs[MAX_COMMANDS];
+    uint64_t counters[MAX_COMMANDS][IO_STATS_MAX_PHASES][IO_STATS_MAX_COUNTERS];
+};
+
+static io_stats_error_handler_t *error_handler = NULL;
+
+static const char *counter_names[] = { "reads", "writes", "polls", "data", "cycles" };
+static const char *phase_names[] = { "reset", "setup", "command", "poll", "data", "completion" };
+
+void io_stats_error(io_stats_t *restrict io_stats, int status, int error, const char *restrict format, ...);
+
+void
+io_stats_commit(io_stats_t *restrict io_stats)
+{
+    if (io_stats == NULL) {
+        return;
+    }
+
+    io_stats_set_phase(io_stats, IO_STATS_MAX_PHASES);
+    size_t command = (io_stats->command == IO_STATS_NO_COMMAND) ? (MAX_COMMANDS - 1) : (size_t)io_stats->command;
+    ++io_stats->execs[command];
+    for (size_t i = 0; i < IO_STATS_MAX_PHASES; ++i) {
+        for (size_t j = 0; j < IO_STATS_MAX_COUNTERS; ++j) {
+            io_stats->counters[command][i][j] += io_stats->current[i][j];
+        }
+    }
+
+    memset(io_stats->current, 0, sizeof(io_stats->current));
+    io_stats->command = IO_STATS_NO_COMMAND;
+}
+
+void
+io_stats_count(io_stats_t *restrict io_stats, int counter, uint64_t count)
+{
+    if (io_stats == NULL || io_stats->phase == IO_STATS_MAX_PHASES) {
+        return;
+    }
+
+    io_stats->current[io_stats->phase][counter] += count;
+}
+
+io_stats_t *
+io_stats_create(void)
+{
+    io_stats_t *io_stats = (io_stats_t *)calloc(1, sizeof(*io_stats));
+    if (io_stats == NULL) {
+        io_stats_error(io_stats, 0, errno, __func__);
+        return NULL;
+    }
+
+    io_stats->command = IO_STATS_NO_COMMAND;
+    /* Nothing is counted until the first phase is set */
+    io_stats->phase = IO_STATS_MAX_PHASES;
+    return io_stats;
+}
+
+void
+io_stats_destroy(io_stats_t *restrict io_stats)
+{
+    if (io_stats == NULL) {
+        return;
+    }
+
+    free(io_stats);
+}
+
+void
+io_stats_dump(io_stats_t *restrict io_stats, FILE *restrict stream)
+{
+    fprintf(stream, "{ \"commands\": [");
+    for (size_t i = 0, n = 0; i < MAX_COMMANDS; ++i) {
+        if (io_stats->execs[i] == 0) {
+            continue;
+        }
+
+        fprintf(stream, "%s { \"code\": ", (n++ == 0) ? "" : ",");
+        if (i == MAX_COMMANDS - 1) {
+            fprintf(stream, "null");
+        } else {
+            fprintf(stream, "%zu", i);
+        }
+
+        fprintf(stream, ", \"execs\": %llu, \"phases\": {", (unsigned long long int)io_stats->execs[i]);
+        for (size_t j = 0; j < IO_STATS_MAX_PHASES; ++j) {
+            fprintf(stream, "%s \"%s\": {", (j == 0) ? "" : ",", phase_names[j]);
+            for (size_t k = 0; k < IO_STATS_MAX_COUNTERS; ++k) {
+                fprintf(stream, "%s \"%s\": %llu", (k == 0) ? "" : ",", counter_names[k],
+                        (unsigned long long int)io_stats->counters[i][j][k]);
+            }
+
+            fprintf(stream, " }");
+        }
+
+        fprintf(stream, " } }");
+    }
+
+    fprintf(stream, " ] }\n");
+    fflush(stream);
+}
+
+void
+io_stats_error(io_stats_t *restrict io_stats, int status, int error, const char *restrict format, ...)
+{
+    if (error_handler == NULL) {
+        return;
+    }
+
+    va_list ap;
+    va_start(ap, format);
+    (*error_handler)(status, error, format, ap);
+    va_end(ap);
+}
+
+void
+io_stats_print(io_stats_t *restrict io_stats, FILE *restrict stream)
+{
+    /* Everything is per execution of the command */
+    fprintf(stream, "%-12s %10s %10s %10s %10s %10s %10s %14s\n", "command", "execs", "exits", "reads", "writes",
+            "polls", "data", "cycles");
+    for (size_t i = 0; i < MAX_COMMANDS; ++i) {
+        if (io_stats->execs[i] == 0) {
+            continue;
+        }
+
+        double execs = io_stats->execs[i];
+        uint64_t totals[IO_STATS_MAX_COUNTERS] = { 0 };
+        for (size_t j = 0; j < IO_STATS_MAX_PHASES; ++j) {
+            for (size_t k = 0; k < IO_STATS_MAX_COUNTERS; ++k) {
+                totals[k] += io_stats->counters[i][j][k];
+            }
+        }
+
+        char name[8];
+        if (i == MAX_COMMANDS - 1) {
+            snprintf(name, sizeof(name), "none");
+        } else {
+            snprintf(name, sizeof(name), "0x%02zx", i);
+        }
+
+        fprintf(stream, "%-12s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f %14.0f\n", name,
+                (unsigned long long int)io_stats->execs[i], (totals[IO_STATS_READS] + totals[IO_STATS_WRITES]) / execs,
+                totals[IO_STATS_READS] / execs, totals[IO_STATS_WRITES] / execs, totals[IO_STATS_POLLS] / execs,
+                totals[IO_STATS_DATA] / execs, totals[IO_STATS_CYCLES] / execs);
+        for (size_t j = 0; j < IO_STATS_MAX_PHASES; ++j) {
+            uint64_t *counters = io_stats->counters[i][j];
+            if (counters[IO_STATS_READS] == 0 && counters[IO_STATS_WRITES] == 0) {
+                continue;
+            }
+
+            fprintf(stream, "  %-10s %10s %10.1f %10.1f %10.1f %10.1f %10.1f %14.0f\n", phase_names[j], "",
+                    (counters[IO_STATS_READS] + counters[IO_STATS_WRITES]) / execs, counters[IO_STATS_READS] / execs,
+                    counters[IO_STATS_WRITES] / execs, counters[IO_STATS_POLLS] / execs,
+                    counters[IO_STATS_DATA] / execs, counters[IO_STATS_CYCLES] / execs);
+        }
+    }
+
+    fflush(stream);
+}
+
+void
+io_stats_set_command(io_stats_t *restrict io_stats, uint8_t command)
+{
+    if (io_stats == NULL) {
+        return;
+    }
+
+    io_stats->command = command;
+}
+
+io_stats_error_handler_t *
+io_stats_set_error_handler(io_stats_error_handler_t *handler)
+{
+    io_stats_error_handler_t *previous_handler = error_handler;
+    error_handler = handler;
+    return previous_handler;
+}
+
+void
+io_stats_set_phase(io_stats_t *restrict io_stats, int phase)
+{
+    if (io_stats == NULL || io_stats->phase == phase) {
+        return;
+    }
+
+    uint64_t tsc = tsc_read();
+    if (io_stats->phase != IO_STATS_MAX_PHASES) {
+        io_stats->current[io_stats->phase][IO_STATS_CYCLES] += tsc - io_stats->tsc;
+    }
+
+    io_stats->phase = phase;
+    io_stats->tsc = tsc;
+}
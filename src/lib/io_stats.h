@@ -0,0 +1,120 @@
+/** @file */
+
+#ifndef IO_STATS_H
+#define IO_STATS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define IO_STATS_NO_COMMAND -1
+
+typedef struct _io_stats io_stats_t; /**< I/O statistics. */
+
+typedef void io_stats_error_handler_t(int status, int error, const char *restrict format, va_list ap);
+
+/** Counters */
+enum
+{
+    IO_STATS_READS, /**< Register reads (i.e., VM exits). */
+    IO_STATS_WRITES, /**< Register writes (i.e., VM exits). */
+    IO_STATS_POLLS, /**< Status polls. */
+    IO_STATS_DATA, /**< Data port accesses. */
+    IO_STATS_CYCLES, /**< Time-stamp counter cycles. */
+    IO_STATS_MAX_COUNTERS,
+};
+
+/** Phases of a command */
+enum
+{
+    IO_STATS_PHASE_RESET, /**< Software reset and device selection. */
+    IO_STATS_PHASE_SETUP, /**< Taskfile and bus master setup. */
+    IO_STATS_PHASE_COMMAND, /**< Command register write. */
+    IO_STATS_PHASE_POLL, /**< Status polling. */
+    IO_STATS_PHASE_DATA, /**< Data transfer. */
+    IO_STATS_PHASE_COMPLETION, /**< Error and bus master completion. */
+    IO_STATS_MAX_PHASES,
+};
+
+/**
+ * Creates I/O statistics.
+ *
+ * @return I/O statistics.
+ */
+io_stats_t *io_stats_create(void);
+
+/**
+ * Destroys the I/O statistics.
+ *
+ * @param [in] io_stats I/O statistics.
+ */
+void io_stats_destroy(io_stats_t *restrict io_stats);
+
+/**
+ * Adds the counts of the current execution to its command, and starts the next
+ * execution.
+ *
+ * @param [in] io_stats I/O statistics, or NULL.
+ */
+void io_stats_commit(io_stats_t *restrict io_stats);
+
+/**
+ * Adds to a counter of the current phase of the current execution.
+ *
+ * @param [in] io_stats I/O statistics, or NULL.
+ * @param [in] counter Counter (i.e., IO_STATS_READS, IO_STATS_WRITES,
+ *   IO_STATS_POLLS, or IO_STATS_DATA).
+ * @param [in] count Count.
+ */
+void io_stats_count(io_stats_t *restrict io_stats, int counter, uint64_t count);
+
+/**
+ * Writes the I/O statistics as JSON.
+ *
+ * @param [in] io_stats I/O statistics.
+ * @param [in] stream Stream.
+ */
+void io_stats_dump(io_stats_t *restrict io_stats, FILE *restrict stream);
+
+/**
+ * Writes a summary of the I/O statistics.
+ *
+ * @param [in] io_stats I/O statistics.
+ * @param [in] stream Stream.
+ */
+void io_stats_print(io_stats_t *restrict io_stats, FILE *restrict stream);
+
+/**
+ * Sets the command code of the current execution.
+ *
+ * @param [in] io_stats I/O statistics, or NULL.
+ * @param [in] command Command code.
+ */
+void io_stats_set_command(io_stats_t *restrict io_stats, uint8_t command);
+
+/**
+ * Sets the error handler for the I/O statistics.
+ *
+ * @param [in] handler Error handler.
+ * @return Previous error handler.
+ */
+io_stats_error_handler_t *io_stats_set_error_handler(io_stats_error_handler_t *handler);
+
+/**
+ * Sets the current phase of the current execution. The cycles since the last
+ * phase change are added to the previous phase.
+ *
+ * @param [in] io_stats I/O statistics, or NULL.
+ * @param [in] phase Phase (i.e., IO_STATS_PHASE_*).
+ */
+void io_stats_set_phase(io_stats_t *restrict io_stats, int phase);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* IO_STATS_H */
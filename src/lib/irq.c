@@ -0,0 +1,163 @@
+/** @file */
+
+#include "irq.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+
+struct _irq {
+    int fd;
+    int epoll_fd;
+};
+
+static irq_error_handler_t *error_handler = NULL;
+
+void irq_error(irq_t *restrict irq, int status, int error, const char *restrict format, ...);
+
+irq_t *
+irq_create(int bus, int device, int function)
+{
+    irq_t *irq = (irq_t *)calloc(1, sizeof(*irq));
+    if (irq == NULL) {
+        irq_error(irq, 0, errno, __func__);
+        return NULL;
+    }
+
+    irq->fd = -1;
+    irq->epoll_fd = -1;
+    /* Find the UIO device of the PCI device */
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "/sys/bus/pci/devices/0000:%02x:%02x.%x/uio", bus, device, function);
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        irq_error(irq, 0, errno, "%s: %s", __func__, path);
+        goto err;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, "uio", 3) == 0) {
+            snprintf(path, sizeof(path), "/dev/%s", entry->d_name);
+            break;
+        }
+    }
+
+    closedir(dir);
+    if (entry == NULL) {
+        errno = ENODEV;
+        irq_error(irq, 0, errno, __func__);
+        goto err;
+    }
+
+    irq->fd = open(path, O_RDWR | O_CLOEXEC);
+    if (irq->fd == -1) {
+        irq_error(irq, 0, errno, "%s: %s", __func__, path);
+        goto err;
+    }
+
+    irq->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (irq->epoll_fd == -1) {
+        irq_error(irq, 0, errno, __func__);
+        goto err;
+    }
+
+    struct epoll_event event = { .events = EPOLLIN, .data.fd = irq->fd };
+    if (epoll_ctl(irq->epoll_fd, EPOLL_CTL_ADD, irq->fd, &event) == -1) {
+        irq_error(irq, 0, errno, __func__);
+        goto err;
+    }
+
+    return irq;
+
+err:
+    irq_destroy(irq);
+    return NULL;
+}
+
+void
+irq_destroy(irq_t *restrict irq)
+{
+    if (irq == NULL) {
+        return;
+    }
+
+    if (irq->epoll_fd != -1) {
+        close(irq->epoll_fd);
+    }
+
+    if (irq->fd != -1) {
+        close(irq->fd);
+    }
+
+    free(irq);
+}
+
+void
+irq_error(irq_t *restrict irq, int status, int error, const char *restrict format, ...)
+{
+    if (error_handler == NULL) {
+        return;
+    }
+
+    va_list ap;
+    va_start(ap, format);
+    (*error_handler)(status, error, format, ap);
+    va_end(ap);
+}
+
+irq_error_handler_t *
+irq_set_error_handler(irq_error_handler_t *handler)
+{
+    irq_error_handler_t *previous_handler = error_handler;
+    error_handler = handler;
+    return previous_handler;
+}
+
+int
+irq_wait(irq_t *restrict irq, uint64_t timeout)
+{
+    /* Unmask the interrupt */
+    int32_t enable = 1;
+    if (write(irq->fd, &enable, sizeof(enable)) != sizeof(enable)) {
+        irq_error(irq, 0, errno, __func__);
+        return -1;
+    }
+
+    /* Round the timeout up to milliseconds */
+    uint64_t timeout_ms = (timeout + 999999) / 1000000;
+    struct epoll_event event;
+    int n = epoll_wait(irq->epoll_fd, &event, 1, (timeout_ms > INT_MAX) ? INT_MAX : (int)timeout_ms);
+    if (n == -1) {
+        /* The caller polls the status and waits again */
+        if (errno == EINTR) {
+            return 0;
+        }
+
+        irq_error(irq, 0, errno, __func__);
+        return -1;
+    }
+
+    if (n == 0) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+
+    /* Consume the interrupt count */
+    uint32_t count;
+    if (read(irq->fd, &count, sizeof(count)) != sizeof(count)) {
+        irq_error(irq, 0, errno, __func__);
+        return -1;
+    }
+
+    return 0;
+}
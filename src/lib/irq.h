@@ -0,0 +1,61 @@
+/** @file */
+
+#ifndef IRQ_H
+#define IRQ_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdarg.h>
+#include <stdint.h>
+
+typedef struct _irq irq_t; /**< Interrupt of a PCI device. */
+
+typedef void irq_error_handler_t(int status, int error, const char *restrict format, va_list ap);
+
+/**
+ * Creates an interrupt of a PCI device. The PCI device must be bound to a UIO
+ * driver that supports masking the interrupt (e.g., uio_pci_generic).
+ *
+ * @param [in] bus Bus number.
+ * @param [in] device Device number.
+ * @param [in] function Function number.
+ * @return Interrupt.
+ */
+irq_t *irq_create(int bus, int device, int function);
+
+/**
+ * Destroys the interrupt.
+ *
+ * @param [in] irq Interrupt.
+ */
+void irq_destroy(irq_t *restrict irq);
+
+/**
+ * Sets the error handler for the interrupts.
+ *
+ * @param [in] handler Error handler.
+ * @return Previous error handler.
+ */
+irq_error_handler_t *irq_set_error_handler(irq_error_handler_t *handler);
+
+/**
+ * Unmasks the interrupt, and waits until it's raised. The interrupt is masked
+ * again by the UIO driver when it's raised. An interrupt that is already
+ * pending when it is unmasked isn't lost.
+ *
+ * A timeout isn't reported to the error handler.
+ *
+ * @param [in] irq Interrupt.
+ * @param [in] timeout Timeout, in nanoseconds.
+ * @return Zero if the interrupt has been raised or the wait has been
+ *   interrupted by a signal; otherwise, returns -1 (e.g., ETIMEDOUT).
+ */
+int irq_wait(irq_t *restrict irq, uint64_t timeout);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* IRQ_H */
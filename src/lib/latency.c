@@ -0,0 +1,180 @@
+/** @file */
+
+#include "latency.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* The size classes are zero sectors, and 2^0 to 2^16 sectors */
+#define MAX_SIZE_CLASSES 18
+/* Each power of two is split into four buckets (i.e., about 19% apart) */
+#define BUCKET_BITS 2
+#define BUCKETS_PER_POWER (1 << BUCKET_BITS)
+/* Shorter latencies have a bucket each */
+#define MIN_SPLIT_LATENCY (2 * BUCKETS_PER_POWER)
+#define MAX_BUCKETS (64 * BUCKETS_PER_POWER)
+/* Fewer latencies don't tell the 99.9th percentile apart from the maximum */
+#define MIN_SAMPLES 100
+
+struct _latency {
+    double factor;
+    uint64_t floor;
+    uint64_t ceiling;
+    struct histogram {
+        uint64_t samples;
+        bool is_dirty;
+        uint64_t timeout;
+        uint32_t buckets[MAX_BUCKETS];
+    } histograms[UINT8_MAX + 1][MAX_SIZE_CLASSES];
+};
+
+static latency_error_handler_t *error_handler = NULL;
+
+size_t latency_bucket(uint64_t ns);
+uint64_t latency_bucket_limit(size_t bucket);
+void latency_error(latency_t *restrict latency, int status, int error, const char *restrict format, ...);
+size_t latency_size_class(uint32_t sectors);
+
+void
+latency_add(latency_t *restrict latency, uint8_t command, uint32_t sectors, uint64_t ns)
+{
+    if (latency == NULL) {
+        return;
+    }
+
+    struct histogram *histogram = &latency->histograms[command][latency_size_class(sectors)];
+    ++histogram->samples;
+    ++histogram->buckets[latency_bucket(ns)];
+    histogram->is_dirty = true;
+}
+
+size_t
+latency_bucket(uint64_t ns)
+{
+    if (ns < MIN_SPLIT_LATENCY) {
+        return ns;
+    }
+
+    /* The power of two, and the bits below the most significant bit */
+    size_t msb = 63 - __builtin_clzll(ns);
+    return msb * BUCKETS_PER_POWER + ((ns >> (msb - BUCKET_BITS)) & (BUCKETS_PER_POWER - 1));
+}
+
+uint64_t
+latency_bucket_limit(size_t bucket)
+{
+    /* The shortest latency of the next bucket */
+    ++bucket;
+    size_t msb = bucket / BUCKETS_PER_POWER;
+    if (msb <= BUCKET_BITS) {
+        return (bucket < MIN_SPLIT_LATENCY) ? bucket : MIN_SPLIT_LATENCY;
+    }
+
+    if (msb >= 64) {
+        return UINT64_MAX;
+    }
+
+    return ((uint64_t)(BUCKETS_PER_POWER + bucket % BUCKETS_PER_POWER)) << (msb - BUCKET_BITS);
+}
+
+latency_t *
+latency_create(double factor, uint64_t floor, uint64_t ceiling)
+{
+    latency_t *latency = (latency_t *)calloc(1, sizeof(*latency));
+    if (latency == NULL) {
+        latency_error(latency, 0, errno, __func__);
+        return NULL;
+    }
+
+    if (factor <= 0 || floor > ceiling) {
+        errno = EINVAL;
+        latency_error(latency, 0, errno, __func__);
+        goto err;
+    }
+
+    latency->factor = factor;
+    latency->floor = floor;
+    latency->ceiling = ceiling;
+    return latency;
+
+err:
+    latency_destroy(latency);
+    return NULL;
+}
+
+void
+latency_destroy(latency_t *restrict latency)
+{
+    free(latency);
+}
+
+void
+latency_error(latency_t *restrict latency, int status, int error, const char *restrict format, ...)
+{
+    if (error_handler == NULL) {
+        return;
+    }
+
+    va_list ap;
+    va_start(ap, format);
+    (*error_handler)(status, error, format, ap);
+    va_end(ap);
+}
+
+uint64_t
+latency_get_timeout(latency_t *restrict latency, uint8_t command, uint32_t sectors)
+{
+    struct histogram *histogram = &latency->histograms[command][latency_size_class(sectors)];
+    if (histogram->samples < MIN_SAMPLES) {
+        return latency->ceiling;
+    }
+
+    if (!histogram->is_dirty) {
+        return histogram->timeout;
+    }
+
+    /* Find the bucket of the 99.9th percentile, and use its upper limit */
+    uint64_t rank = histogram->samples - histogram->samples / 1000;
+    uint64_t count = 0;
+    size_t bucket = 0;
+    for (; bucket < MAX_BUCKETS - 1; ++bucket) {
+        count += histogram->buckets[bucket];
+        if (count >= rank) {
+            break;
+        }
+    }
+
+    double timeout = latency->factor * latency_bucket_limit(bucket);
+    if (timeout < latency->floor) {
+        histogram->timeout = latency->floor;
+    } else if (timeout > latency->ceiling) {
+        histogram->timeout = latency->ceiling;
+    } else {
+        histogram->timeout = (uint64_t)timeout;
+    }
+
+    histogram->is_dirty = false;
+    return histogram->timeout;
+}
+
+latency_error_handler_t *
+latency_set_error_handler(latency_error_handler_t *handler)
+{
+    latency_error_handler_t *previous_handler = error_handler;
+    error_handler = handler;
+    return previous_handler;
+}
+
+size_t
+latency_size_class(uint32_t sectors)
+{
+    if (sectors == 0) {
+        return 0;
+    }
+
+    size_t size_class = 1 + (31 - __builtin_clz(sectors));
+    return (size_class < MAX_SIZE_CLASSES) ? size_class : (MAX_SIZE_CLASSES - 1);
+}
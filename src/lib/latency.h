@@ -0,0 +1,70 @@
+/** @file */
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdarg.h>
+#include <stdint.h>
+
+typedef struct _latency latency_t; /**< Latency model of the commands. */
+
+typedef void latency_error_handler_t(int status, int error, const char *restrict format, va_list ap);
+
+/**
+ * Creates a latency model. The timeout of a command is its 99.9th percentile
+ * latency, multiplied by a factor and clamped to the floor and the ceiling.
+ * The latencies are tracked per command code and per size class (i.e., the
+ * number of sectors rounded down to a power of two).
+ *
+ * @param [in] factor Factor of the 99.9th percentile latency.
+ * @param [in] floor Shortest timeout, in nanoseconds.
+ * @param [in] ceiling Longest timeout, in nanoseconds. It's also the timeout
+ *   of a command until enough of its latencies have been observed.
+ * @return Latency model.
+ */
+latency_t *latency_create(double factor, uint64_t floor, uint64_t ceiling);
+
+/**
+ * Destroys the latency model.
+ *
+ * @param [in] latency Latency model.
+ */
+void latency_destroy(latency_t *restrict latency);
+
+/**
+ * Adds an observed latency of a command that completed before its timeout.
+ *
+ * @param [in] latency Latency model, or NULL.
+ * @param [in] command Command code.
+ * @param [in] sectors Number of sectors.
+ * @param [in] ns Latency, in nanoseconds.
+ */
+void latency_add(latency_t *restrict latency, uint8_t command, uint32_t sectors, uint64_t ns);
+
+/**
+ * Returns the timeout of a command.
+ *
+ * @param [in] latency Latency model.
+ * @param [in] command Command code.
+ * @param [in] sectors Number of sectors.
+ * @return Timeout, in nanoseconds.
+ */
+uint64_t latency_get_timeout(latency_t *restrict latency, uint8_t command, uint32_t sectors);
+
+/**
+ * Sets the error handler for the latency models.
+ *
+ * @param [in] handler Error handler.
+ * @return Previous error handler.
+ */
+latency_error_handler_t *latency_set_error_handler(latency_error_handler_t *handler);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LATENCY_H */
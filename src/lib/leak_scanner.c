@@ -0,0 +1,383 @@
+/** @file */
+
+#include "leak_scanner.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <immintrin.h>
+
+/* The user-space pointers of the host are shaped like 0x0000_55xx_xxxx_xxxx
+   or 0x0000_56xx_xxxx_xxxx (heap of a PIE), or 0x0000_7fxx_xxxx_xxxx (stack
+   and mappings) */
+#define HEAP_TOP0 0x55
+#define HEAP_TOP1 0x56
+#define STACK_TOP 0x7f
+#define TOP_SHIFT 40
+/* The kernel-space pointers have the 17 top bits set, but aren't a small
+   negative number */
+#define KERNEL_TOP 0x1ffff
+#define KERNEL_SHIFT 47
+#define NEGATIVE_SHIFT 12
+/* A block of random data has about half of the high bits set, and about one
+   byte in 256 equal to the byte 1, 2, 4, or 8 bytes after it (i.e., about 1 of
+   the 241 pairs). Zeroes, text, and patterns fail either. */
+#define MIN_HIGH_BITS 16
+#define MAX_HIGH_BITS 48
+#define MAX_EQUAL_PAIRS 4
+#define MAX_PAIR_DISTANCE 8
+
+struct _leak_scanner {
+    uint64_t canary;
+};
+
+static leak_scanner_error_handler_t *error_handler = NULL;
+static size_t (*find_word)(const leak_scanner_t *restrict leak_scanner, const uint8_t *data, size_t offset,
+        size_t size, int checks) = NULL;
+static bool (*is_random_block)(const uint8_t *block, size_t size) = NULL;
+static const char *const kind_names[] = {
+    [LEAK_SCANNER_HIT_CANARY] = "CANARY",
+    [LEAK_SCANNER_HIT_USER_POINTER] = "USER POINTER",
+    [LEAK_SCANNER_HIT_KERNEL_POINTER] = "KERNEL POINTER",
+    [LEAK_SCANNER_HIT_ENTROPY] = "ENTROPY",
+};
+
+void leak_scanner_add_hit(leak_scanner_hit_t *restrict hits, size_t max_hits, size_t *restrict num_hits, int kind,
+        size_t offset, uint64_t value);
+int leak_scanner_classify_word(const leak_scanner_t *restrict leak_scanner, uint64_t word, int checks);
+__m128i leak_scanner_cmpeq64_sse2(__m128i a, __m128i b);
+void leak_scanner_error(leak_scanner_t *restrict leak_scanner, int status, int error, const char *restrict format, ...);
+size_t leak_scanner_find_word(
+        const leak_scanner_t *restrict leak_scanner, const uint8_t *data, size_t offset, size_t size, int checks);
+size_t leak_scanner_find_word_avx2(
+        const leak_scanner_t *restrict leak_scanner, const uint8_t *data, size_t offset, size_t size, int checks);
+size_t leak_scanner_find_word_sse2(
+        const leak_scanner_t *restrict leak_scanner, const uint8_t *data, size_t offset, size_t size, int checks);
+bool leak_scanner_is_random_block(const uint8_t *block, size_t size);
+bool leak_scanner_is_random_block_avx2(const uint8_t *block, size_t size);
+bool leak_scanner_is_random_block_sse2(const uint8_t *block, size_t size);
+
+void
+leak_scanner_add_hit(leak_scanner_hit_t *restrict hits, size_t max_hits, size_t *restrict num_hits, int kind,
+        size_t offset, uint64_t value)
+{
+    if (*num_hits < max_hits) {
+        hits[*num_hits].kind = kind;
+        hits[*num_hits].offset = offset;
+        hits[*num_hits].value = value;
+    }
+
+    ++*num_hits;
+}
+
+int
+leak_scanner_classify_word(const leak_scanner_t *restrict leak_scanner, uint64_t word, int checks)
+{
+    if ((checks & LEAK_SCANNER_CANARY) && leak_scanner->canary != 0 && word == leak_scanner->canary) {
+        return LEAK_SCANNER_HIT_CANARY;
+    }
+
+    if (checks & LEAK_SCANNER_POINTERS) {
+        uint64_t top = word >> TOP_SHIFT;
+        if (top == HEAP_TOP0 || top == HEAP_TOP1 || top == STACK_TOP) {
+            return LEAK_SCANNER_HIT_USER_POINTER;
+        }
+
+        if ((word >> KERNEL_SHIFT) == KERNEL_TOP && (word >> NEGATIVE_SHIFT) != (UINT64_MAX >> NEGATIVE_SHIFT)) {
+            return LEAK_SCANNER_HIT_KERNEL_POINTER;
+        }
+    }
+
+    return -1;
+}
+
+__m128i
+leak_scanner_cmpeq64_sse2(__m128i a, __m128i b)
+{
+    /* SSE2 has no 64-bit compare: both 32-bit halves have to be equal */
+    __m128i is_equal = _mm_cmpeq_epi32(a, b);
+    return _mm_and_si128(is_equal, _mm_shuffle_epi32(is_equal, _MM_SHUFFLE(2, 3, 0, 1)));
+}
+
+leak_scanner_t *
+leak_scanner_create(uint64_t canary)
+{
+    leak_scanner_t *leak_scanner = (leak_scanner_t *)calloc(1, sizeof(*leak_scanner));
+    if (leak_scanner == NULL) {
+        leak_scanner_error(leak_scanner, 0, errno, __func__);
+        return NULL;
+    }
+
+    /* Scan 32 bytes at a time if the CPU has AVX2, or else 16 bytes at a time
+       with SSE2 */
+    if (find_word == NULL) {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            find_word = leak_scanner_find_word_avx2;
+            is_random_block = leak_scanner_is_random_block_avx2;
+        } else {
+            find_word = leak_scanner_find_word_sse2;
+            is_random_block = leak_scanner_is_random_block_sse2;
+        }
+    }
+
+    leak_scanner->canary = canary;
+    return leak_scanner;
+}
+
+void
+leak_scanner_destroy(leak_scanner_t *restrict leak_scanner)
+{
+    if (leak_scanner == NULL) {
+        return;
+    }
+
+    free(leak_scanner);
+}
+
+void
+leak_scanner_error(leak_scanner_t *restrict leak_scanner, int status, int error, const char *restrict format, ...)
+{
+    if (error_handler == NULL) {
+        return;
+    }
+
+    va_list ap;
+    va_start(ap, format);
+    (*error_handler)(status, error, format, ap);
+    va_end(ap);
+}
+
+size_t
+leak_scanner_find_word(
+        const leak_scanner_t *restrict leak_scanner, const uint8_t *data, size_t offset, size_t size, int checks)
+{
+    for (; offset + sizeof(uint64_t) <= size; offset += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data + offset, sizeof(word));
+        if (leak_scanner_classify_word(leak_scanner, word, checks) != -1) {
+            return offset;
+        }
+    }
+
+    return size;
+}
+
+__attribute__((target("avx2"))) size_t
+leak_scanner_find_word_avx2(
+        const leak_scanner_t *restrict leak_scanner, const uint8_t *data, size_t offset, size_t size, int checks)
+{
+    /* Compare four words at a time, and only classify the words that hit */
+    const __m256i canary = _mm256_set1_epi64x(leak_scanner->canary);
+    const __m256i is_canary_checked = _mm256_set1_epi64x(
+            ((checks & LEAK_SCANNER_CANARY) && leak_scanner->canary != 0) ? -1 : 0);
+    const __m256i is_pointer_checked = _mm256_set1_epi64x((checks & LEAK_SCANNER_POINTERS) ? -1 : 0);
+    const __m256i heap_top0 = _mm256_set1_epi64x(HEAP_TOP0);
+    const __m256i heap_top1 = _mm256_set1_epi64x(HEAP_TOP1);
+    const __m256i stack_top = _mm256_set1_epi64x(STACK_TOP);
+    const __m256i kernel_top = _mm256_set1_epi64x(KERNEL_TOP);
+    const __m256i negative = _mm256_set1_epi64x(UINT64_MAX >> NEGATIVE_SHIFT);
+    for (; offset + sizeof(__m256i) <= size; offset += sizeof(__m256i)) {
+        __m256i words = _mm256_loadu_si256((const __m256i *)(data + offset));
+        __m256i top = _mm256_srli_epi64(words, TOP_SHIFT);
+        __m256i is_user = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi64(top, heap_top0),
+                                                  _mm256_cmpeq_epi64(top, heap_top1)),
+                _mm256_cmpeq_epi64(top, stack_top));
+        __m256i is_kernel = _mm256_andnot_si256(
+                _mm256_cmpeq_epi64(_mm256_srli_epi64(words, NEGATIVE_SHIFT), negative),
+                _mm256_cmpeq_epi64(_mm256_srli_epi64(words, KERNEL_SHIFT), kernel_top));
+        __m256i is_hit = _mm256_or_si256(_mm256_and_si256(is_canary_checked, _mm256_cmpeq_epi64(words, canary)),
+                _mm256_and_si256(is_pointer_checked, _mm256_or_si256(is_user, is_kernel)));
+        int mask = _mm256_movemask_pd(_mm256_castsi256_pd(is_hit));
+        if (mask != 0) {
+            return offset + (size_t)__builtin_ctz(mask) * sizeof(uint64_t);
+        }
+    }
+
+    return leak_scanner_find_word(leak_scanner, data, offset, size, checks);
+}
+
+size_t
+leak_scanner_find_word_sse2(
+        const leak_scanner_t *restrict leak_scanner, const uint8_t *data, size_t offset, size_t size, int checks)
+{
+    /* The same as leak_scanner_find_word_avx2, two words at a time */
+    const __m128i canary = _mm_set1_epi64x(leak_scanner->canary);
+    const __m128i is_canary_checked = _mm_set1_epi64x(
+            ((checks & LEAK_SCANNER_CANARY) && leak_scanner->canary != 0) ? -1 : 0);
+    const __m128i is_pointer_checked = _mm_set1_epi64x((checks & LEAK_SCANNER_POINTERS) ? -1 : 0);
+    const __m128i heap_top0 = _mm_set1_epi64x(HEAP_TOP0);
+    const __m128i heap_top1 = _mm_set1_epi64x(HEAP_TOP1);
+    const __m128i stack_top = _mm_set1_epi64x(STACK_TOP);
+    const __m128i kernel_top = _mm_set1_epi64x(KERNEL_TOP);
+    const __m128i negative = _mm_set1_epi64x(UINT64_MAX >> NEGATIVE_SHIFT);
+    for (; offset + sizeof(__m128i) <= size; offset += sizeof(__m128i)) {
+        __m128i words = _mm_loadu_si128((const __m128i *)(data + offset));
+        __m128i top = _mm_srli_epi64(words, TOP_SHIFT);
+        __m128i is_user = _mm_or_si128(_mm_or_si128(leak_scanner_cmpeq64_sse2(top, heap_top0),
+                                               leak_scanner_cmpeq64_sse2(top, heap_top1)),
+                leak_scanner_cmpeq64_sse2(top, stack_top));
+        __m128i is_kernel
+                = _mm_andnot_si128(leak_scanner_cmpeq64_sse2(_mm_srli_epi64(words, NEGATIVE_SHIFT), negative),
+                        leak_scanner_cmpeq64_sse2(_mm_srli_epi64(words, KERNEL_SHIFT), kernel_top));
+        __m128i is_hit = _mm_or_si128(_mm_and_si128(is_canary_checked, leak_scanner_cmpeq64_sse2(words, canary)),
+                _mm_and_si128(is_pointer_checked, _mm_or_si128(is_user, is_kernel)));
+        int mask = _mm_movemask_pd(_mm_castsi128_pd(is_hit));
+        if (mask != 0) {
+            return offset + (size_t)__builtin_ctz(mask) * sizeof(uint64_t);
+        }
+    }
+
+    return leak_scanner_find_word(leak_scanner, data, offset, size, checks);
+}
+
+uint64_t
+leak_scanner_get_canary(leak_scanner_t *restrict leak_scanner)
+{
+    return leak_scanner->canary;
+}
+
+const char *
+leak_scanner_get_kind_name(int kind)
+{
+    if (kind < 0 || (size_t)kind >= sizeof(kind_names) / sizeof(kind_names[0])) {
+        return "UNKNOWN";
+    }
+
+    return kind_names[kind];
+}
+
+bool
+leak_scanner_is_random_block(const uint8_t *block, size_t size)
+{
+    int high_bits = 0;
+    int equal_pairs = 0;
+    for (size_t i = 0; i < LEAK_SCANNER_BLOCK_SIZE; ++i) {
+        high_bits += block[i] >> 7;
+        for (size_t distance = 1; distance <= MAX_PAIR_DISTANCE; distance *= 2) {
+            if (i + distance < LEAK_SCANNER_BLOCK_SIZE && block[i] == block[i + distance]) {
+                ++equal_pairs;
+            }
+        }
+    }
+
+    return high_bits >= MIN_HIGH_BITS && high_bits <= MAX_HIGH_BITS && equal_pairs <= MAX_EQUAL_PAIRS;
+}
+
+__attribute__((target("avx2,popcnt"))) bool
+leak_scanner_is_random_block_avx2(const uint8_t *block, size_t size)
+{
+    /* The pairs are compared with the unaligned loads after the bytes, which
+       may read past the block but not past the data */
+    if (size < LEAK_SCANNER_BLOCK_SIZE + MAX_PAIR_DISTANCE) {
+        return leak_scanner_is_random_block(block, size);
+    }
+
+    __m256i low = _mm256_loadu_si256((const __m256i *)block);
+    __m256i high = _mm256_loadu_si256((const __m256i *)(block + sizeof(__m256i)));
+    int high_bits = __builtin_popcount(_mm256_movemask_epi8(low)) + __builtin_popcount(_mm256_movemask_epi8(high));
+    int equal_pairs = 0;
+    for (size_t distance = 1; distance <= MAX_PAIR_DISTANCE; distance *= 2) {
+        uint32_t low_mask = _mm256_movemask_epi8(
+                _mm256_cmpeq_epi8(low, _mm256_loadu_si256((const __m256i *)(block + distance))));
+        uint32_t high_mask = _mm256_movemask_epi8(
+                _mm256_cmpeq_epi8(high, _mm256_loadu_si256((const __m256i *)(block + sizeof(__m256i) + distance))));
+        /* Don't count the pairs with the bytes past the block */
+        high_mask &= UINT32_MAX >> distance;
+        equal_pairs += __builtin_popcount(low_mask) + __builtin_popcount(high_mask);
+    }
+
+    return high_bits >= MIN_HIGH_BITS && high_bits <= MAX_HIGH_BITS && equal_pairs <= MAX_EQUAL_PAIRS;
+}
+
+bool
+leak_scanner_is_random_block_sse2(const uint8_t *block, size_t size)
+{
+    /* The same as leak_scanner_is_random_block_avx2, 16 bytes at a time */
+    if (size < LEAK_SCANNER_BLOCK_SIZE + MAX_PAIR_DISTANCE) {
+        return leak_scanner_is_random_block(block, size);
+    }
+
+    int high_bits = 0;
+    int equal_pairs = 0;
+    for (size_t i = 0; i < LEAK_SCANNER_BLOCK_SIZE; i += sizeof(__m128i)) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(block + i));
+        high_bits += __builtin_popcount(_mm_movemask_epi8(bytes));
+        for (size_t distance = 1; distance <= MAX_PAIR_DISTANCE; distance *= 2) {
+            uint32_t mask = _mm_movemask_epi8(
+                    _mm_cmpeq_epi8(bytes, _mm_loadu_si128((const __m128i *)(block + i + distance))));
+            if (i + sizeof(__m128i) == LEAK_SCANNER_BLOCK_SIZE) {
+                mask &= UINT16_MAX >> distance;
+            }
+
+            equal_pairs += __builtin_popcount(mask);
+        }
+    }
+
+    return high_bits >= MIN_HIGH_BITS && high_bits <= MAX_HIGH_BITS && equal_pairs <= MAX_EQUAL_PAIRS;
+}
+
+void
+leak_scanner_plant(leak_scanner_t *restrict leak_scanner, void *data, size_t size)
+{
+    uint8_t *bytes = (uint8_t *)data;
+    for (size_t offset = 0; offset < size; offset += sizeof(uint64_t)) {
+        size_t length = (size - offset < sizeof(uint64_t)) ? size - offset : sizeof(uint64_t);
+        memcpy(bytes + offset, &leak_scanner->canary, length);
+    }
+}
+
+size_t
+leak_scanner_scan(leak_scanner_t *restrict leak_scanner, const void *data, size_t size, int checks,
+        leak_scanner_hit_t *restrict hits, size_t max_hits)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+    size_t num_hits = 0;
+    /* Most data has no hits, so only the vector compares run */
+    for (size_t offset = (*find_word)(leak_scanner, bytes, 0, size, checks); offset < size;
+            offset = (*find_word)(leak_scanner, bytes, offset + sizeof(uint64_t), size, checks)) {
+        uint64_t word;
+        memcpy(&word, bytes + offset, sizeof(word));
+        leak_scanner_add_hit(
+                hits, max_hits, &num_hits, leak_scanner_classify_word(leak_scanner, word, checks), offset, word);
+    }
+
+    /* Report each run of random blocks once */
+    if (checks & LEAK_SCANNER_ENTROPY) {
+        size_t run_offset = 0;
+        size_t run_size = 0;
+        for (size_t offset = 0; offset + LEAK_SCANNER_BLOCK_SIZE <= size; offset += LEAK_SCANNER_BLOCK_SIZE) {
+            if ((*is_random_block)(bytes + offset, size - offset)) {
+                if (run_size == 0) {
+                    run_offset = offset;
+                }
+
+                run_size += LEAK_SCANNER_BLOCK_SIZE;
+                continue;
+            }
+
+            if (run_size != 0) {
+                leak_scanner_add_hit(hits, max_hits, &num_hits, LEAK_SCANNER_HIT_ENTROPY, run_offset, run_size);
+                run_size = 0;
+            }
+        }
+
+        if (run_size != 0) {
+            leak_scanner_add_hit(hits, max_hits, &num_hits, LEAK_SCANNER_HIT_ENTROPY, run_offset, run_size);
+        }
+    }
+
+    return num_hits;
+}
+
+leak_scanner_error_handler_t *
+leak_scanner_set_error_handler(leak_scanner_error_handler_t *handler)
+{
+    leak_scanner_error_handler_t *previous_handler = error_handler;
+    error_handler = handler;
+    return previous_handler;
+}
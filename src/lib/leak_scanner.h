@@ -0,0 +1,112 @@
+/** @file */
+
+#ifndef LEAK_SCANNER_H
+#define LEAK_SCANNER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Checks of a scan */
+#define LEAK_SCANNER_CANARY 0x1 /**< 64-bit words equal to the canary (i.e., data not transferred). */
+#define LEAK_SCANNER_POINTERS 0x2 /**< Host-pointer-shaped 64-bit words. */
+#define LEAK_SCANNER_ENTROPY 0x4 /**< High-entropy runs in data expected to be zero or patterned. */
+
+#define LEAK_SCANNER_BLOCK_SIZE 64 /**< Size of a block checked for entropy, in bytes */
+
+typedef struct _leak_scanner leak_scanner_t; /**< Leak scanner. */
+
+typedef void leak_scanner_error_handler_t(int status, int error, const char *restrict format, va_list ap);
+
+/** Kinds of hits */
+enum
+{
+    LEAK_SCANNER_HIT_CANARY, /**< 64-bit word equal to the canary. */
+    LEAK_SCANNER_HIT_USER_POINTER, /**< 64-bit word shaped like a user-space pointer. */
+    LEAK_SCANNER_HIT_KERNEL_POINTER, /**< 64-bit word shaped like a kernel-space pointer. */
+    LEAK_SCANNER_HIT_ENTROPY, /**< Run of high-entropy blocks. */
+};
+
+/** Hit of a scan. */
+typedef struct {
+    int kind;       /**< Kind of the hit (e.g., LEAK_SCANNER_HIT_CANARY). */
+    size_t offset;  /**< Offset of the 64-bit word or the run, in bytes. */
+    uint64_t value; /**< 64-bit word, or length of the run in bytes. */
+} leak_scanner_hit_t;
+
+/**
+ * Creates a leak scanner.
+ *
+ * @param [in] canary Canary planted in the data before the device returns it,
+ *   or zero for none.
+ * @return Leak scanner.
+ */
+leak_scanner_t *leak_scanner_create(uint64_t canary);
+
+/**
+ * Destroys the leak scanner.
+ *
+ * @param [in] leak_scanner Leak scanner.
+ */
+void leak_scanner_destroy(leak_scanner_t *restrict leak_scanner);
+
+/**
+ * Returns the canary of the leak scanner.
+ *
+ * @param [in] leak_scanner Leak scanner.
+ * @return Canary.
+ */
+uint64_t leak_scanner_get_canary(leak_scanner_t *restrict leak_scanner);
+
+/**
+ * Returns the name of a kind of hits.
+ *
+ * @param [in] kind Kind of hits (e.g., LEAK_SCANNER_HIT_CANARY).
+ * @return Name of the kind of hits (e.g., "CANARY").
+ */
+const char *leak_scanner_get_kind_name(int kind);
+
+/**
+ * Fills the data with the canary, so that the parts the device doesn't
+ * transfer are found by the scan.
+ *
+ * @param [in] leak_scanner Leak scanner.
+ * @param [in] data Data, aligned to 8 bytes.
+ * @param [in] size Size of the data, in bytes.
+ */
+void leak_scanner_plant(leak_scanner_t *restrict leak_scanner, void *data, size_t size);
+
+/**
+ * Scans the data returned by the device. The 64-bit words are checked at the
+ * offsets aligned to 8 bytes, and the entropy of each block of
+ * LEAK_SCANNER_BLOCK_SIZE bytes.
+ *
+ * @param [in] leak_scanner Leak scanner.
+ * @param [in] data Data, aligned to 8 bytes.
+ * @param [in] size Size of the data, in bytes.
+ * @param [in] checks Checks (i.e., one or more of LEAK_SCANNER_CANARY,
+ *   LEAK_SCANNER_POINTERS, and LEAK_SCANNER_ENTROPY).
+ * @param [out] hits First hits.
+ * @param [in] max_hits Maximum number of hits to return.
+ * @return Total number of hits, which may be more than max_hits.
+ */
+size_t leak_scanner_scan(leak_scanner_t *restrict leak_scanner, const void *data, size_t size, int checks,
+        leak_scanner_hit_t *restrict hits, size_t max_hits);
+
+/**
+ * Sets the error handler for the leak scanners.
+ *
+ * @param [in] handler Error handler.
+ * @return Previous error handler.
+ */
+leak_scanner_error_handler_t *leak_scanner_set_error_handler(leak_scanner_error_handler_t *handler);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LEAK_SCANNER_H */
@@ -0,0 +1,1155 @@
+/** @file */
+
+#include "pci_backend.h"
+
+#include "io.h"
+#include "pci.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define ECAM_SIZE 0x1000
+#define MAX_REGIONS 6
+
+struct pci_backend_ops {
+    uint16_t (*config_read16)(pci_backend_t *restrict pci_backend, size_t offset);
+    uint32_t (*config_read32)(pci_backend_t *restrict pci_backend, size_t offset);
+    uint8_t (*config_read8)(pci_backend_t *restrict pci_backend, size_t offset);
+    void (*config_write16)(pci_backend_t *restrict pci_backend, size_t offset, uint16_t value);
+    void (*config_write32)(pci_backend_t *restrict pci_backend, size_t offset, uint32_t value);
+    void (*config_write8)(pci_backend_t *restrict pci_backend, size_t offset, uint8_t value);
+    int (*region_attach)(pci_backend_t *restrict pci_backend, size_t region_num);
+    void (*region_detach)(pci_backend_t *restrict pci_backend, size_t region_num);
+    uint16_t (*region_read16)(pci_backend_t *restrict pci_backend, size_t region_num, size_t offset);
+    uint32_t (*region_read32)(pci_backend_t *restrict pci_backend, size_t region_num, size_t offset);
+    uint8_t (*region_read8)(pci_backend_t *restrict pci_backend, size_t region_num, size_t offset);
+    void (*region_read_string16)(
+            pci_backend_t *restrict pci_backend, size_t region_num, size_t offset, uint16_t *string, size_t count);
+    void (*region_read_string32)(
+            pci_backend_t *restrict pci_backend, size_t region_num, size_t offset, uint32_t *string, size_t count);
+    void (*region_read_string8)(
+            pci_backend_t *restrict pci_backend, size_t region_num, size_t offset, uint8_t *string, size_t count);
+    void (*region_write16)(pci_backend_t *restrict pci_backend, size_t region_num, size_t offset, uint16_t value);
+    void (*region_write32)(pci_backend_t *restrict pci_backend, size_t region_num, size_t offset, uint32_t value);
+    void (*region_write8)(pci_backend_t *restrict pci_backend, size_t region_num, size_t offset, uint8_t value);
+    void (*region_write_string16)(pci_backend_t *restrict pci_backend, size_t region_num, size_t offset,
+            const uint16_t *string, size_t count);
+    void (*region_write_string32)(pci_backend_t *restrict pci_backend, size_t region_num, size_t offset,
+            const uint32_t *string, size_t count);
+    void (*region_write_string8)(
+            pci_backend_t *restrict pci_backend, size_t region_num, size_t offset, const uint8_t *string, size_t count);
+};
+
+struct _pci_backend {
+    const struct pci_backend_ops *ops;
+    int bus;
+    int device;
+    int function;
+    void *config_map;
+    int config_fd;
+    int port_fd;
+    pci_backend_t *pci_backend;
+    FILE *stream;
+    struct region {
+        uint64_t base_address;
+        uint64_t size;
+        bool is_io;
+        void *map;
+        size_t map_size;
+        size_t map_offset;
+        int fd;
+        /* Offset of the base address in the resource file, which is negative
+           if the region starts before the resource */
+        int64_t fd_offset;
+    } regions[MAX_REGIONS];
+    bool is_resources_loaded;
+    struct resource {
+        bool is_known;
+        uint64_t base_address;
+        uint64_t size;
+        bool is_io;
+    } resources[MAX_REGIONS];
+};
+
+static pci_backend_error_handler_t *error_handler = NULL;
+
+pci_backend_t *pci_backend_create(const struct pci_backend_ops *ops, int bus, int device, int function);
+void pci_backend_error(pci_backend_t *restrict pci_backend, int status, int error, const char *restrict format, ...);
+int pci_backend_io_map_config(pci_backend_t *restrict pci_backend);
+int pci_backend_map(pci_backend_t *restrict pci_backend, size_t region_num, int fd, uint64_t offset);
+uint16_t pci_backend_sysfs_config_read16(pci_backend_t *restrict pci_backend, size_t offset);
+uint32_t pci_backend_sysfs_config_read32(pci_backend_t *restrict pci_backend, size_t offset);
+uint8_t pci_backend_sysfs_config_read8(pci_backend_t *restrict pci_backend, size_t offset);
+void pci_backend_sysfs_config_write16(pci_backend_t *restrict pci_backend, size_t offset, uint16_t value);
+void pci_backend_sysfs_config_write32(pci_backend_t *restrict pci_backend, size_t offset, uint32_t value);
+void pci_backend_sysfs_config_write8(pci_backend_t *restrict pci_backend, size_t offset, uint8_t value);
+int pci_backend_sysfs_load_resources(pci_backend_t *restrict pci_backend);
+int pci_backend_sysfs_open(pci_backend_t *restrict pci_backend, const char *restrict name, int flags);
+int pci_backend_sysfs_open_resource(pci_backend_t *restrict pci_backend, size_t region_num);
+int pci_backend_sysfs_map_resource(pci_backend_t *restrict pci_backend, size_t region_num);
+int pci_backend_sysfs_resource_start(pci_backend_t *restrict pci_backend, size_t region_num, uint64_t *start);
+
+pci_backend_t *
+pci_backend_create(const struct pci_backend_ops *ops, int bus, int device, int function)
+{
+    pci_backend_t *pci_backend = (pci_backend_t *)calloc(1, sizeof(*pci_backend));
+    if (pci_backend == NULL) {
+        pci_backend_error(pci_backend, 0, errno, __func__);
+        return NULL;
+    }
+
+    pci_backend->config_map = MAP_FAILED;
+    pci_backend->config_fd = -1;
+    pci_backend->port_fd = -1;
+    for (size_t i = 0; i < MAX_REGIONS; ++i) {
+        pci_backend->regions[i].map = MAP_FAILED;
+        pci_backend->regions[i].fd = -1;
+    }
+
+    if (bus < 0 || bus > 255) {
+        errno = EINVAL;
+        pci_backend_error(pci_backend, 0, errno, __func__);
+        goto err;
+    }
+
+    if (device < 0 || device > 31) {
+        errno = EINVAL;
+        pci_backend_error(pci_backend, 0, errno, __func__);
+        goto err;
+    }
+
+    if (function < 0 || function > 7) {
+        errno = EINVAL;
+        pci_backend_error(pci_backend, 0, errno, __func__);
+        goto err;
+    }
+
+    pci_backend->ops = ops;
+    pci_backend->bus = bus;
+    pci_backend->device = device;
+    pci_backend->function = function;
+    return pci_backend;
+
+err:
+    pci_backend_destroy(pci_backend);
+    return NULL;
+}
+
+void
+pci_backend_destroy(pci_backend_t *restrict pci_backend)
+{
+    if (pci_backend == NULL) {
+        return;
+    }
+
+    if (pci_backend->ops != NULL) {
+        for (size_t i = 0; i < MAX_REGIONS; ++i) {
+            pci_backend_region_detach(pci_backend, i);
+        }
+    }
+
+    if (pci_backend->port_fd != -1) {
+        close(pci_backend->port_fd);
+    }
+
+    if (pci_backend->config_fd != -1) {
+        close(pci_backend->config_fd);
+    }
+
+    if (pci_backend->config_map != MAP_FAILED) {
+        munmap(pci_backend->config_map, ECAM_SIZE);
+    }
+
+    free(pci_backend);
+}
+
+void
+pci_backend_error(pci_backend_t *restrict pci_backend, int status, int error, const char *restrict format, ...)
+{
+    if (error_handler == NULL) {
+        return;
+    }
+
+    va_list ap;
+    va_start(ap, format);
+    (*error_handler)(status, error, format, ap);
+    va_end(ap);
+}
+
+int
+pci_backend_get_bus(pci_backend_t *restrict pci_backend)
+{
+    return pci_backend->bus;
+}
+
+int
+pci_backend_get_device(pci_backend_t *restrict pci_backend)
+{
+    return pci_backend->device;
+}
+
+int
+pci_backend_get_function(pci_backend_t *restrict pci_backend)
+{
+    return pci_backend->function;
+}
+
+int
+pci_backend_load_resources(pci_backend_t *restrict pci_backend, FILE *restrict stream)
+{
+    /* The resources are only valid for the same device with the same base
+       address registers (BARs). Like resources saved for another device,
+       malformed resources are discarded without calling the error handler. */
+    uint32_t id;
+    uint32_t bars[MAX_REGIONS];
+    if (fscanf(stream, "%" SCNx32, &id) != 1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (size_t i = 0; i < MAX_REGIONS; ++i) {
+        if (fscanf(stream, "%" SCNx32, &bars[i]) != 1) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    if (id != pci_backend_config_read32(pci_backend, 0)) {
+        errno = ESTALE;
+        return -1;
+    }
+
+    for (size_t i = 0; i < MAX_REGIONS; ++i) {
+        if (bars[i] != pci_backend_config_read32(pci_backend, 16 + (i * 4))) {
+            errno = ESTALE;
+            return -1;
+        }
+    }
+
+    /* Each line is the region number, base address, size, and whether the
+       region is I/O */
+    struct resource resources[MAX_REGIONS] = { 0 };
+    size_t region_num;
+    uint64_t base_address;
+    uint64_t size;
+    int is_io;
+    while (fscanf(stream, "%zu %" SCNx64 " %" SCNx64 " %d", &region_num, &base_address, &size, &is_io) == 4) {
+        if (region_num >= MAX_REGIONS) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        resources[region_num].is_known = true;
+        resources[region_num].base_address = base_address;
+        resources[region_num].size = size;
+        resources[region_num].is_io = is_io;
+    }
+
+    memcpy(pci_backend->resources, resources, sizeof(resources));
+    pci_backend->is_resources_loaded = true;
+    return 0;
+}
+
+int
+pci_backend_map(pci_backend_t *restrict pci_backend, size_t region_num, int fd, uint64_t offset)
+{
+    /* The region is only guaranteed to be aligned to its size, which may be
+       smaller than a page, so map the enclosing pages and keep the offset of
+       the region within them. */
+    struct region *region = &pci_backend->regions[region_num];
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    region->map_offset = offset & (page_size - 1);
+    region->map_size = (region->map_offset + region->size + page_size - 1) & ~(page_size - 1);
+    region->map = mmap(NULL, region->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset - region->map_offset);
+    if (region->map == MAP_FAILED) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+pci_backend_region_attach(
+        pci_backend_t *restrict pci_backend, size_t region_num, uint64_t base_address, uint64_t size, bool is_io)
+{
+    if (region_num >= MAX_REGIONS || size == 0) {
+        errno = EINVAL;
+        pci_backend_error(pci_backend, 0, errno, __func__);
+        return -1;
+    }
+
+    pci_backend_region_detach(pci_backend, region_num);
+    pci_backend->regions[region_num].base_address = base_address;
+    pci_backend->regions[region_num].size = size;
+    pci_backend->regions[region_num].is_io = is_io;
+    if ((*pci_backend->ops->region_attach)(pci_backend, region_num) == -1) {
+        pci_backend_region_detach(pci_backend, region_num);
+        return -1;
+    }
+
+    return 0;
+}
+
+void
+pci_backend_region_detach(pci_backend_t *restrict pci_backend, size_t region_num)
+{
+    if (region_num >= MAX_REGIONS || pci_backend->regions[region_num].size == 0) {
+        return;
+    }
+
+    struct region *region = &pci_backend->regions[region_num];
+    if (pci_backend->ops->region_detach != NULL) {
+        (*pci_backend->ops->region_detach)(pci_backend, region_num);
+    }
+
+    if (region->map != MAP_FAILED) {
+        munmap(region->map, region->map_size);
+        region->map = MAP_FAILED;
+    }
+
+    if (region->fd != -1) {
+        close(region->fd);
+        region->fd = -1;
+    }
+
+    region->size = 0;
+}
+
+int
+pci_backend_region_get_resource(
+        pci_backend_t *restrict pci_backend, size_t region_num, uint64_t *base_address, uint64_t *size, bool *is_io)
+{
+    /* A recording PCI backend uses the resources of the PCI backend it
+       forwards the accesses to. */
+    if (pci_backend->pci_backend != NULL) {
+        return pci_backend_region_get_resource(pci_backend->pci_backend, region_num, base_address, size, is_io);
+    }
+
+    if (region_num >= MAX_REGIONS) {
+        errno = EINVAL;
+        pci_backend_error(pci_backend, 0, errno, __func__);
+        return -1;
+    }
+
+    /* The sysfs resource file is read once, unless the resources have been
+       loaded. */
+    if (!pci_backend->is_resources_loaded) {
+        pci_backend_sysfs_load_resources(pci_backend);
+        pci_backend->is_resources_loaded = true;
+    }
+
+    struct resource *resource = &pci_backend->resources[region_num];
+    if (!resource->is_known) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    *base_address = resource->base_address;
+    *size = resource->size;
+    *is_io = resource->is_io;
+    return 0;
+}
+
+void
+pci_backend_region_set_resource(
+        pci_backend_t *restrict pci_backend, size_t region_num, uint64_t base_address, uint64_t size, bool is_io)
+{
+    /* A recording PCI backend uses the resources of the PCI backend it
+       forwards the accesses to. */
+    if (pci_backend->pci_backend != NULL) {
+        pci_backend_region_set_resource(pci_backend->pci_backend, region_num, base_address, size, is_io);
+        return;
+    }
+
+    if (region_num >= MAX_REGIONS) {
+        errno = EINVAL;
+        pci_backend_error(pci_backend, 0, errno, __func__);
+        return;
+    }
+
+    struct resource *resource = &pci_backend->resources[region_num];
+    resource->is_known = true;
+    resource->base_address = base_address;
+    resource->size = size;
+    resource->is_io = is_io;
+}
+
+/* The configuration space and memory regions that are mapped are accessed
+   directly, and everything else goes through the operations of the PCI
+   backend. */
+#define _pci_backend_define(size, type) \
+    type pci_backend_config_read##size(pci_backend_t *restrict pci_backend, size_t offset) \
+    { \
+        if (pci_backend->config_map != MAP_FAILED) { \
+            return *(volatile type *)((volatile uint8_t *)pci_backend->config_map + offset); \
+        } \
+\
+        return (*pci_backend->ops->config_read##size)(pci_backend, offset); \
+    } \
+\
+    void pci_backend_config_write##size(pci_backend_t *restrict pci_backend, size_t offset, type value) \
+    { \
+        if (pci_backend->config_map != MAP_FAILED) { \
+            *(volatile type *)((volatile uint8_t *)pci_backend->config_map + offset) = value; \
+            return; \
+        } \
+\
+        (*pci_backend->ops->config_write##size)(pci_backend, offset, value); \
+    } \
+\
+    type pci_backend_region_read##size(pci_backend_t *restrict pci_backend, size_t region_num, size_t offset) \
+    { \
+        struct region *region = &pci_backend->regions[region_num]; \
+        if (region->map != MAP_FAILED) { \
+            return *(volatile type *)((volatile uint8_t *)region->map + region->map_offset + offset); \
+        } \
+\
+        return (*pci_backend->ops->region_read##size)(pci_backend, region_num, offset); \
+    } \
+\
+    void pci_backend_region_read_string##size( \
+            pci_backend_t *restrict pci_backend, size_t region_num, size_t offset, type *string, size_t count) \
+    { \
+        struct region *region = &pci_backend->regions[region_num]; \
+        if (region->map != MAP_FAILED) { \
+            for (size_t i = 0; i < count; ++i) { \
+                string[i] = *(volatile type *)((volatile uint8_t *)region->map + region->map_offset + offset); \
+            } \
+\
+            return; \
+        } \
+\
+        (*pci_backend->ops->region_read_string##size)(pci_backend, region_num, offset, string, count); \
+    } \
+\
+    void pci_backend_region_write##size( \
+            pci_backend_t *restrict pci_backend, size_t region_num, size_t offset, type value) \
+    { \
+        struct region *region = &pci_backend->regions[region_num]; \
+        if (region->map != MAP_FAILED) { \
+            *(volatile type *)((volatile uint8_t *)region->map + region->map_offset + offset) = value; \
+            return; \
+        } \
+\
+        (*pci_backend->ops->region_write##size)(pci_backend, region_num, offset, value); \
+    } \
+\
+    void pci_backend_region_write_string##size( \
+            pci_backend_t *restrict pci_backend, size_t region_num, size_t offset, const type *string, size_t count) \
+    { \
+        struct region *region = &pci_backend->regions[region_num]; \
+        if (region->map != MAP_FAILED) { \
+            for (size_t i = 0; i < count; ++i) { \
+                *(volatile type *)((volatile uint8_t *)region->map + region->map_offset + offset) = string[i]; \
+            } \
+\
+            return; \
+        } \
+\
+        (*pci_backend->ops->region_write_string##size)(pci_backend, region_num, offset, string, count); \
+    }
+
+_pci_backend_define(16, uint16_t)
+_pci_backend_define(32, uint32_t)
+_pci_backend_define(8, uint8_t)
+#undef _pci_backend_define
+
+int
+pci_backend_save_resources(pci_backend_t *restrict pci_backend, FILE *restrict stream)
+{
+    fprintf(stream, "%08" PRIx32, pci_backend_config_read32(pci_backend, 0));
+    for (size_t i = 0; i < MAX_REGIONS; ++i) {
+        fprintf(stream, " %08" PRIx32, pci_backend_config_read32(pci_backend, 16 + (i * 4)));
+    }
+
+    fprintf(stream, "\n");
+    for (size_t i = 0; i < MAX_REGIONS; ++i) {
+        struct resource *resource = &pci_backend->resources[i];
+        if (!resource->is_known) {
+            continue;
+        }
+
+        fprintf(stream, "%zu %#" PRIx64 " %#" PRIx64 " %d\n", i, resource->base_address, resource->size,
+                resource->is_io);
+    }
+
+    if (fflush(stream) == EOF || ferror(stream)) {
+        pci_backend_error(pci_backend, 0, errno, __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+pci_backend_error_handler_t *
+pci_backend_set_error_handler(pci_backend_error_handler_t *handler)
+{
+    pci_backend_error_handler_t *previous_handler = error_handler;
+    error_handler = handler;
+    return previous_handler;
+}
+
+int
+pci_backend_sysfs_load_resources(pci_backend_t *restrict pci_backend)
+{
+    int fd = pci_backend_sysfs_open(pci_backend, "resource", O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+
+    FILE *stream = fdopen(fd, "r");
+    if (stream == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    /* Each line is the start, end, and flags of a resource. A resource whose
+       start and end are zero isn't implemented. */
+    for (size_t i = 0; i < MAX_REGIONS; ++i) {
+        uint64_t start;
+        uint64_t end;
+        uint64_t flags;
+        if (fscanf(stream, "%" SCNx64 " %" SCNx64 " %" SCNx64, &start, &end, &flags) != 3) {
+            break;
+        }
+
+        struct resource *resource = &pci_backend->resources[i];
+        resource->is_known = true;
+        resource->base_address = start;
+        resource->size = ((start == 0 && end == 0) ? 0 : (end - start + 1));
+        /* IORESOURCE_IO */
+        resource->is_io = (flags & 0x100);
+    }
+
+    fclose(stream);
+    return 0;
+}
+
+int
+pci_backend_sysfs_open(pci_backend_t *restrict pci_backend, const char *restrict name, int flags)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "/sys/bus/pci/devices/0000:%02x:%02x.%x/%s", pci_backend->bus, pci_backend->device,
+            pci_backend->function, name);
+    return open(path, flags | O_CLOEXEC);
+}
+
+int
+pci_backend_sysfs_open_resource(pci_backend_t *restrict pci_backend, size_t region_num)
+{
+    /* The resource file of an I/O region starts at the start of the resource,
+       which isn't necessarily the base address of the region (e.g., the
+       Control Block registers of a channel in compatibility mode are at 0x3f4
+       or 0x374, but the kernel's resource starts at 0x3f6 or 0x376). Only the
+       accesses before the start of the resource fail. */
+    uint64_t start;
+    if (pci_backend_sysfs_resource_start(pci_backend, region_num, &start) == -1) {
+        return -1;
+    }
+
+    struct region *region = &pci_backend->regions[region_num];
+
+    char name[16];
+    snprintf(name, sizeof(name), "resource%zu", region_num);
+    region->fd = pci_backend_sysfs_open(pci_backend, name, O_RDWR);
+    if (region->fd == -1) {
+        return -1;
+    }
+
+    region->fd_offset = (int64_t)(region->base_address - start);
+    return 0;
+}
+
+int
+pci_backend_sysfs_map_resource(pci_backend_t *restrict pci_backend, size_t region_num)
+{
+    uint64_t start;
+    if (pci_backend_sysfs_resource_start(pci_backend, region_num, &start) == -1) {
+        return -1;
+    }
+
+    char name[16];
+    snprintf(name, sizeof(name), "resource%zu", region_num);
+    int fd = pci_backend_sysfs_open(pci_backend, name, O_RDWR | O_SYNC);
+    if (fd == -1) {
+        return -1;
+    }
+
+    /* The mapping of a resource file starts at the page that contains the
+       start of the resource. */
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    int result = pci_backend_map(
+            pci_backend, region_num, fd, pci_backend->regions[region_num].base_address - (start & ~(page_size - 1)));
+    close(fd);
+    return result;
+}
+
+int
+pci_backend_sysfs_resource_start(pci_backend_t *restrict pci_backend, size_t region_num, uint64_t *start)
+{
+    int fd = pci_backend_sysfs_open(pci_backend, "resource", O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+
+    FILE *stream = fdopen(fd, "r");
+    if (stream == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    /* Each line is the start, end, and flags of a resource */
+    uint64_t end;
+    uint64_t flags;
+    for (size_t i = 0; i <= region_num; ++i) {
+        if (fscanf(stream, "%" SCNx64 " %" SCNx64 " %" SCNx64, start, &end, &flags) != 3) {
+            fclose(stream);
+            errno = ENXIO;
+            return -1;
+        }
+    }
+
+    fclose(stream);
+    if (*start == 0 && end == 0) {
+        errno = ENXIO;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* I/O port instructions */
+#define _pci_backend_io_define(size, type) \
+    type pci_backend_io_config_read##size(pci_backend_t *restrict pci_backend, size_t offset) \
+    { \
+        if (pci_backend->config_fd != -1) { \
+            return pci_backend_sysfs_config_read##size(pci_backend, offset); \
+        } \
+\
+        return pci_config_read##size(pci_backend->bus, pci_backend->device, pci_backend->function, offset); \
+    } \
+\
+    void pci_backend_io_config_write##size(pci_backend_t *restrict pci_backend, size_t offset, type value) \
+    { \
+        if (pci_backend->config_fd != -1) { \
+            pci_backend_sysfs_config_write##size(pci_backend, offset, value); \
+            return; \
+        } \
+\
+        pci_config_write##size(pci_backend->bus, pci_backend->device, pci_backend->function, offset, value); \
+    } \
+\
+    type pci_backend_io_region_read##size(pci_backend_t *restrict pci_backend, size_t region_num, size_t offset) \
+    { \
+        return io_read##size(pci_backend->regions[region_num].base_address + offset); \
+    } \
+\
+    void pci_backend_io_region_read_string##size( \
+            pci_backend_t *restrict pci_backend, size_t region_num, size_t offset, type *string, size_t count) \
+    { \
+        io_read_string##size(pci_backend->regions[region_num].base_address + offset, string, count); \
+    } \
+\
+    void pci_backend_io_region_write##size( \
+            pci_backend_t *restrict pci_backend, size_t region_num, size_t offset, type value) \
+    { \
+        io_write##size(pci_backend->regions[region_num].base_address + offset, value); \
+    } \
+\
+    void pci_backend_io_region_write_string##size( \
+            pci_backend_t *restrict pci_backend, size_t region_num, size_t offset, const type *string, size_t count) \
+    { \
+        io_write_string##size(pci_backend->regions[region_num].base_address + offset, string, count); \
+    }
+
+_pci_backend_io_define(16, uint16_t)
+_pci_backend_io_define(32, uint32_t)
+_pci_backend_io_define(8, uint8_t)
+#undef _pci_backend_io_define
+
+int
+pci_backend_io_map_config(pci_backend_t *restrict pci_backend)
+{
+    /* The MCFG table describes the enhanced configuration access mechanism
+       (ECAM) areas. */
+    int fd = open("/sys/firmware/acpi/tables/MCFG", O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+
+    uint8_t table[4096];
+    ssize_t length = read(fd, table, sizeof(table));
+    close(fd);
+    if (length == -1) {
+        return -1;
+    }
+
+    /* The allocations (of 16 bytes each) follow the header (of 36 bytes) and
+       the reserved field (of 8 bytes). */
+    for (size_t i = 44; i + 16 <= (size_t)length; i += 16) {
+        uint64_t base_address;
+        uint16_t segment;
+        memcpy(&base_address, &table[i], sizeof(base_address));
+        memcpy(&segment, &table[i + 8], sizeof(segment));
+        uint8_t start_bus = table[i + 10];
+        uint8_t end_bus = table[i + 11];
+        if (segment != 0 || pci_backend->bus < start_bus || pci_backend->bus > end_bus) {
+            continue;
+        }
+
+        fd = open("/dev/mem", O_RDWR | O_SYNC | O_CLOEXEC);
+        if (fd == -1) {
+            return -1;
+        }
+
+        /* Each function has 4 KiB of configuration space */
+        pci_backend->config_map = mmap(NULL, ECAM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                base_address + (((uint64_t)(pci_backend->bus - start_bus) << 20) | (pci_backend->device << 15)
+                        | (pci_backend->function << 12)));
+        close(fd);
+        return (pci_backend->config_map == MAP_FAILED) ? -1 : 0;
+    }
+
+    errno = ENOENT;
+    return -1;
+}
+
+int
+pci_backend_io_region_attach(pci_backend_t *restrict pci_backend, size_t region_num)
+{
+    if (pci_backend->regions[region_num].is_io) {
+        return 0;
+    }
+
+    /* Map the (memory) region */
+    int fd = open("/dev/mem", O_RDWR | O_SYNC | O_CLOEXEC);
+    if (fd == -1) {
+        pci_backend_error(pci_backend, 0, errno, __func__);
+        return -1;
+    }
+
+    int result = pci_backend_map(pci_backend, region_num, fd, pci_backend->regions[region_num].base_address);
+    close(fd);
+    return result;
+}
+
+static const struct pci_backend_ops pci_backend_io_ops = {
+    .config_read16 = pci_backend_io_config_read16,
+    .config_read32 = pci_backend_io_config_read32,
+    .config_read8 = pci_backend_io_config_read8,
+    .config_write16 = pci_backend_io_config_write16,
+    .config_write32 = pci_backend_io_config_write32,
+    .config_write8 = pci_backend_io_config_write8,
+    .region_attach = pci_backend_io_region_attach,
+    .region_read16 = pci_backend_io_region_read16,
+    .region_read32 = pci_backend_io_region_read32,
+    .region_read8 = pci_backend_io_region_read8,
+    .region_read_string16 = pci_backend_io_region_read_string16,
+    .region_read_string32 = pci_backend_io_region_read_string32,
+    .region_read_string8 = pci_backend_io_region_read_string8,
+    .region_write16 = pci_backend_io_region_write16,
+    .region_write32 = pci_backend_io_region_write32,
+    .region_write8 = pci_backend_io_region_write8,
+    .region_write_string16 = pci_backend_io_region_write_string16,
+    .region_write_string32 = pci_backend_io_region_write_string32,
+    .region_write_string8 = pci_backend_io_region_write_string8,
+};
+
+pci_backend_t *
+pci_backend_create_io(int bus, int device, int function)
+{
+    pci_backend_t *pci_backend = pci_backend_create(&pci_backend_io_ops, bus, device, function);
+    if (pci_backend == NULL) {
+        return NULL;
+    }
+
+    /* Prefer the memory-mapped configuration space (ECAM), then the sysfs
+       config file, over the configuration mechanism #1 (i.e., 0xcf8/0xcfc),
+       which takes two port accesses per configuration space access, and
+       isn't atomic against other users. */
+    if (pci_backend_io_map_config(pci_backend) == -1) {
+        pci_backend->config_fd = pci_backend_sysfs_open(pci_backend, "config", O_RDWR);
+    }
+
+    return pci_backend;
+}
+
+/* sysfs config and resource files */
+#define _pci_backend_sysfs_define(size, type) \
+    type pci_backend_sysfs_config_read##size(pci_backend_t *restrict pci_backend, size_t offset) \
+    { \
+        type value; \
+        if (pread(pci_backend->config_fd, &value, sizeof(value), offset) != sizeof(value)) { \
+            pci_backend_error(pci_backend, 0, errno, __func__); \
+            return (type)-1; \
+        } \
+\
+        return value; \
+    } \
+\
+    void pci_backend_sysfs_config_write##size(pci_backend_t *restrict pci_backend, size_t offset, type value) \
+    { \
+        if (pwrite(pci_backend->config_fd, &value, sizeof(value), offset) != sizeof(value)) { \
+            pci_backend_error(pci_backend, 0, errno, __func__); \
+        } \
+    } \
+\
+    type pci_backend_sysfs_region_read##size(pci_backend_t *restrict pci_backend, size_t region_num, size_t offset) \
+    { \
+        struct region *region = &pci_backend->regions[region_num]; \
+        int64_t fd_offset = region->fd_offset + (int64_t)offset; \
+        type value; \
+        if (fd_offset < 0) { \
+            errno = ENXIO; \
+            pci_backend_error(pci_backend, 0, errno, __func__); \
+            return (type)-1; \
+        } \
+\
+        if (pread(region->fd, &value, sizeof(value), fd_offset) != sizeof(value)) { \
+            pci_backend_error(pci_backend, 0, errno, __func__); \
+            return (type)-1; \
+        } \
+\
+        return value; \
+    } \
+\
+    void pci_backend_sysfs_region_read_string##size( \
+            pci_backend_t *restrict pci_backend, size_t region_num, size_t offset, type *string, size_t count) \
+    { \
+        for (size_t i = 0; i < count; ++i) { \
+            string[i] = pci_backend_sysfs_region_read##size(pci_backend, region_num, offset); \
+        } \
+    } \
+\
+    void pci_backend_sysfs_region_write##size( \
+            pci_backend_t *restrict pci_backend, size_t region_num, size_t offset, type value) \
+    { \
+        struct region *region = &pci_backend->regions[region_num]; \
+        int64_t fd_offset = region->fd_offset + (int64_t)offset; \
+        if (fd_offset < 0) { \
+            errno = ENXIO; \
+            pci_backend_error(pci_backend, 0, errno, __func__); \
+            return; \
+        } \
+\
+        if (pwrite(region->fd, &value, sizeof(value), fd_offset) != sizeof(value)) { \
+            pci_backend_error(pci_backend, 0, errno, __func__); \
+        } \
+    } \
+\
+    void pci_backend_sysfs_region_write_string##size( \
+            pci_backend_t *restrict pci_backend, size_t region_num, size_t offset, const type *string, size_t count) \
+    { \
+        for (size_t i = 0; i < count; ++i) { \
+            pci_backend_sysfs_region_write##size(pci_backend, region_num, offset, string[i]); \
+        } \
+    }
+
+_pci_backend_sysfs_define(16, uint16_t)
+_pci_backend_sysfs_define(32, uint32_t)
+_pci_backend_sysfs_define(8, uint8_t)
+#undef _pci_backend_sysfs_define
+
+int
+pci_backend_sysfs_region_attach(pci_backend_t *restrict pci_backend, size_t region_num)
+{
+    if (pci_backend->regions[region_num].is_io) {
+        return pci_backend_sysfs_open_resource(pci_backend, region_num);
+    }
+
+    return pci_backend_sysfs_map_resource(pci_backend, region_num);
+}
+
+static const struct pci_backend_ops pci_backend_sysfs_ops = {
+    .config_read16 = pci_backend_sysfs_config_read16,
+    .config_read32 = pci_backend_sysfs_config_read32,
+    .config_read8 = pci_backend_sysfs_config_read8,
+    .config_write16 = pci_backend_sysfs_config_write16,
+    .config_write32 = pci_backend_sysfs_config_write32,
+    .config_write8 = pci_backend_sysfs_config_write8,
+    .region_attach = pci_backend_sysfs_region_attach,
+    .region_read16 = pci_backend_sysfs_region_read16,
+    .region_read32 = pci_backend_sysfs_region_read32,
+    .region_read8 = pci_backend_sysfs_region_read8,
+    .region_read_string16 = pci_backend_sysfs_region_read_string16,
+    .region_read_string32 = pci_backend_sysfs_region_read_string32,
+    .region_read_string8 = pci_backend_sysfs_region_read_string8,
+    .region_write16 = pci_backend_sysfs_region_write16,
+    .region_write32 = pci_backend_sysfs_region_write32,
+    .region_write8 = pci_backend_sysfs_region_write8,
+    .region_write_string16 = pci_backend_sysfs_region_write_string16,
+    .region_write_string32 = pci_backend_sysfs_region_write_string32,
+    .region_write_string8 = pci_backend_sysfs_region_write_string8,
+};
+
+pci_backend_t *
+pci_backend_create_sysfs(int bus, int device, int function)
+{
+    pci_backend_t *pci_backend = pci_backend_create(&pci_backend_sysfs_ops, bus, device, function);
+    if (pci_backend == NULL) {
+        return NULL;
+    }
+
+    pci_backend->config_fd = pci_backend_sysfs_open(pci_backend, "config", O_RDWR);
+    if (pci_backend->config_fd == -1) {
+        pci_backend_error(pci_backend, 0, errno, __func__);
+        goto err;
+    }
+
+    return pci_backend;
+
+err:
+    pci_backend_destroy(pci_backend);
+    return NULL;
+}
+
+/* /dev/port */
+#define _pci_backend_dev_port_define(size, type) \
+    type pci_backend_dev_port_region_read##size(pci_backend_t *restrict pci_backend, size_t region_num, size_t offset) \
+    { \
+        struct region *region = &pci_backend->regions[region_num]; \
+        if (region->fd != -1) { \
+            return pci_backend_sysfs_region_read##size(pci_backend, region_num, offset); \
+        } \
+\
+        /* /dev/port splits wider accesses into 8-bit accesses to consecutive \
+           ports. */ \
+        if (sizeof(type) != 1) { \
+            errno = EOPNOTSUPP; \
+            pci_backend_error(pci_backend, 0, errno, __func__); \
+            return (type)-1; \
+        } \
+\
+        type value; \
+        if (pread(pci_backend->port_fd, &value, sizeof(value), region->base_address + offset) != sizeof(value)) { \
+            pci_backend_error(pci_backend, 0, errno, __func__); \
+            return (type)-1; \
+        } \
+\
+        return value; \
+    } \
+\
+    void pci_backend_dev_port_region_read_string##size( \
+            pci_backend_t *restrict pci_backend, size_t region_num, size_t offset, type *string, size_t count) \
+    { \
+        for (size_t i = 0; i < count; ++i) { \
+            string[i] = pci_backend_dev_port_region_read##size(pci_backend, region_num, offset); \
+        } \
+    } \
+\
+    void pci_backend_dev_port_region_write##size( \
+            pci_backend_t *restrict pci_backend, size_t region_num, size_t offset, type value) \
+    { \
+        struct region *region = &pci_backend->regions[region_num]; \
+        if (region->fd != -1) { \
+            pci_backend_sysfs_region_write##size(pci_backend, region_num, offset, value); \
+            return; \
+        } \
+\
+        if (sizeof(type) != 1) { \
+            errno = EOPNOTSUPP; \
+            pci_backend_error(pci_backend, 0, errno, __func__); \
+            return; \
+        } \
+\
+        if (pwrite(pci_backend->port_fd, &value, sizeof(value), region->base_address + offset) != sizeof(value)) { \
+            pci_backend_error(pci_backend, 0, errno, __func__); \
+        } \
+    } \
+\
+    void pci_backend_dev_port_region_write_string##size( \
+            pci_backend_t *restrict pci_backend, size_t region_num, size_t offset, const type *string, size_t count) \
+    { \
+        for (size_t i = 0; i < count; ++i) { \
+            pci_backend_dev_port_region_write##size(pci_backend, region_num, offset, string[i]); \
+        } \
+    }
+
+_pci_backend_dev_port_define(16, uint16_t)
+_pci_backend_dev_port_define(32, uint32_t)
+_pci_backend_dev_port_define(8, uint8_t)
+#undef _pci_backend_dev_port_define
+
+int
+pci_backend_dev_port_region_attach(pci_backend_t *restrict pci_backend, size_t region_num)
+{
+    if (pci_backend->regions[region_num].is_io) {
+        /* The resource file is only required for 16-bit and 32-bit accesses */
+        pci_backend_sysfs_open_resource(pci_backend, region_num);
+        return 0;
+    }
+
+    return pci_backend_sysfs_map_resource(pci_backend, region_num);
+}
+
+static const struct pci_backend_ops pci_backend_dev_port_ops = {
+    .config_read16 = pci_backend_sysfs_config_read16,
+    .config_read32 = pci_backend_sysfs_config_read32,
+    .config_read8 = pci_backend_sysfs_config_read8,
+    .config_write16 = pci_backend_sysfs_config_write16,
+    .config_write32 = pci_backend_sysfs_config_write32,
+    .config_write8 = pci_backend_sysfs_config_write8,
+    .region_attach = pci_backend_dev_port_region_attach,
+    .region_read16 = pci_backend_dev_port_region_read16,
+    .region_read32 = pci_backend_dev_port_region_read32,
+    .region_read8 = pci_backend_dev_port_region_read8,
+    .region_read_string16 = pci_backend_dev_port_region_read_string16,
+    .region_read_string32 = pci_backend_dev_port_region_read_string32,
+    .region_read_string8 = pci_backend_dev_port_region_read_string8,
+    .region_write16 = pci_backend_dev_port_region_write16,
+    .region_write32 = pci_backend_dev_port_region_write32,
+    .region_write8 = pci_backend_dev_port_region_write8,
+    .region_write_string16 = pci_backend_dev_port_region_write_string16,
+    .region_write_string32 = pci_backend_dev_port_region_write_string32,
+    .region_write_string8 = pci_backend_dev_port_region_write_string8,
+};
+
+pci_backend_t *
+pci_backend_create_dev_port(int bus, int device, int function)
+{
+    pci_backend_t *pci_backend = pci_backend_create(&pci_backend_dev_port_ops, bus, device, function);
+    if (pci_backend == NULL) {
+        return NULL;
+    }
+
+    pci_backend->config_fd = pci_backend_sysfs_open(pci_backend, "config", O_RDWR);
+    if (pci_backend->config_fd == -1) {
+        pci_backend_error(pci_backend, 0, errno, __func__);
+        goto err;
+    }
+
+    pci_backend->port_fd = open("/dev/port", O_RDWR | O_CLOEXEC);
+    if (pci_backend->port_fd == -1) {
+        pci_backend_error(pci_backend, 0, errno, __func__);
+        goto err;
+    }
+
+    return pci_backend;
+
+err:
+    pci_backend_destroy(pci_backend);
+    return NULL;
+}
+
+/* Recording */
+#define _pci_backend_record_define(size, type) \
+    type pci_backend_record_config_read##size(pci_backend_t *restrict pci_backend, size_t offset) \
+    { \
+        type value = pci_backend_config_read##size(pci_backend->pci_backend, offset); \
+        fprintf(pci_backend->stream, "config_read" #size " %#zx %#x\n", offset, (unsigned int)value); \
+        return value; \
+    } \
+\
+    void pci_backend_record_config_write##size(pci_backend_t *restrict pci_backend, size_t offset, type value) \
+    { \
+        fprintf(pci_backend->stream, "config_write" #size " %#zx %#x\n", offset, (unsigned int)value); \
+        pci_backend_config_write##size(pci_backend->pci_backend, offset, value); \
+    } \
+\
+    type pci_backend_record_region_read##size(pci_backend_t *restrict pci_backend, size_t region_num, size_t offset) \
+    { \
+        type value = pci_backend_region_read##size(pci_backend->pci_backend, region_num, offset); \
+        fprintf(pci_backend->stream, "read" #size " %zu %#zx %#x\n", region_num, offset, (unsigned int)value); \
+        return value; \
+    } \
+\
+    void pci_backend_record_region_read_string##size( \
+            pci_backend_t *restrict pci_backend, size_t region_num, size_t offset, type *string, size_t count) \
+    { \
+        pci_backend_region_read_string##size(pci_backend->pci_backend, region_num, offset, string, count); \
+        fprintf(pci_backend->stream, "read_string" #size " %zu %#zx %zu", region_num, offset, count); \
+        for (size_t i = 0; i < count; ++i) { \
+            fprintf(pci_backend->stream, " %#x", (unsigned int)string[i]); \
+        } \
+\
+        fputc('\n', pci_backend->stream); \
+    } \
+\
+    void pci_backend_record_region_write##size( \
+            pci_backend_t *restrict pci_backend, size_t region_num, size_t offset, type value) \
+    { \
+        fprintf(pci_backend->stream, "write" #size " %zu %#zx %#x\n", region_num, offset, (unsigned int)value); \
+        pci_backend_region_write##size(pci_backend->pci_backend, region_num, offset, value); \
+    } \
+\
+    void pci_backend_record_region_write_string##size( \
+            pci_backend_t *restrict pci_backend, size_t region_num, size_t offset, const type *string, size_t count) \
+    { \
+        fprintf(pci_backend->stream, "write_string" #size " %zu %#zx %zu", region_num, offset, count); \
+        for (size_t i = 0; i < count; ++i) { \
+            fprintf(pci_backend->stream, " %#x", (unsigned int)string[i]); \
+        } \
+\
+        fputc('\n', pci_backend->stream); \
+        pci_backend_region_write_string##size(pci_backend->pci_backend, region_num, offset, string, count); \
+    }
+
+_pci_backend_record_define(16, uint16_t)
+_pci_backend_record_define(32, uint32_t)
+_pci_backend_record_define(8, uint8_t)
+#undef _pci_backend_record_define
+
+int
+pci_backend_record_region_attach(pci_backend_t *restrict pci_backend, size_t region_num)
+{
+    struct region *region = &pci_backend->regions[region_num];
+    fprintf(pci_backend->stream, "attach %zu %#" PRIx64 " %#" PRIx64 " %s\n", region_num, region->base_address,
+            region->size, region->is_io ? "io" : "memory");
+    return pci_backend_region_attach(
+            pci_backend->pci_backend, region_num, region->base_address, region->size, region->is_io);
+}
+
+void
+pci_backend_record_region_detach(pci_backend_t *restrict pci_backend, size_t region_num)
+{
+    fprintf(pci_backend->stream, "detach %zu\n", region_num);
+    pci_backend_region_detach(pci_backend->pci_backend, region_num);
+}
+
+static const struct pci_backend_ops pci_backend_record_ops = {
+    .config_read16 = pci_backend_record_config_read16,
+    .config_read32 = pci_backend_record_config_read32,
+    .config_read8 = pci_backend_record_config_read8,
+    .config_write16 = pci_backend_record_config_write16,
+    .config_write32 = pci_backend_record_config_write32,
+    .config_write8 = pci_backend_record_config_write8,
+    .region_attach = pci_backend_record_region_attach,
+    .region_detach = pci_backend_record_region_detach,
+    .region_read16 = pci_backend_record_region_read16,
+    .region_read32 = pci_backend_record_region_read32,
+    .region_read8 = pci_backend_record_region_read8,
+    .region_read_string16 = pci_backend_record_region_read_string16,
+    .region_read_string32 = pci_backend_record_region_read_string32,
+    .region_read_string8 = pci_backend_record_region_read_string8,
+    .region_write16 = pci_backend_record_region_write16,
+    .region_write32 = pci_backend_record_region_write32,
+    .region_write8 = pci_backend_record_region_write8,
+    .region_write_string16 = pci_backend_record_region_write_string16,
+    .region_write_string32 = pci_backend_record_region_write_string32,
+    .region_write_string8 = pci_backend_record_region_write_string8,
+};
+
+pci_backend_t *
+pci_backend_create_record(pci_backend_t *pci_backend, FILE *stream)
+{
+    pci_backend_t *record = pci_backend_create(&pci_backend_record_ops, pci_backend->bus, pci_backend->device,
+            pci_backend->function);
+    if (record == NULL) {
+        return NULL;
+    }
+
+    record->pci_backend = pci_backend;
+    record->stream = stream;
+    return record;
+}
@@ -0,0 +1,374 @@
+/** @file */
+
+#ifndef PCI_BACKEND_H
+#define PCI_BACKEND_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef struct _pci_backend pci_backend_t; /**< PCI backend. */
+
+typedef void pci_backend_error_handler_t(int status, int error, const char *restrict format, va_list ap);
+
+/**
+ * Creates a PCI backend that uses the I/O port instructions for the I/O regions,
+ * and /dev/mem for the memory regions. The configuration space is accessed
+ * through the memory-mapped configuration space (ECAM) if the MCFG table
+ * describes it, or else through the sysfs config file if there is one, or else
+ * through the I/O port instructions.
+ *
+ * @param [in] bus PCI bus number.
+ * @param [in] device PCI device number.
+ * @param [in] function PCI function number.
+ * @return A PCI backend.
+ * @note The I/O privilege level must be raised (i.e., iopl(3)) before using
+ *   the PCI backend.
+ */
+pci_backend_t *pci_backend_create_io(int bus, int device, int function);
+
+/**
+ * Creates a PCI backend that uses /dev/port for the I/O regions, and sysfs for
+ * the configuration space and the memory regions.
+ *
+ * @param [in] bus PCI bus number.
+ * @param [in] device PCI device number.
+ * @param [in] function PCI function number.
+ * @return A PCI backend.
+ * @note /dev/port only performs 8-bit accesses. 16-bit and 32-bit accesses to
+ *   an I/O region use the sysfs resource file of the region, and fail if the
+ *   region has none.
+ */
+pci_backend_t *pci_backend_create_dev_port(int bus, int device, int function);
+
+/**
+ * Creates a PCI backend that uses the sysfs config and resource files of the
+ * PCI device.
+ *
+ * @param [in] bus PCI bus number.
+ * @param [in] device PCI device number.
+ * @param [in] function PCI function number.
+ * @return A PCI backend.
+ */
+pci_backend_t *pci_backend_create_sysfs(int bus, int device, int function);
+
+/**
+ * Creates a PCI backend that records every access to a stream (with the value
+ * of each word of a string transfer), and forwards it to another PCI backend.
+ *
+ * @param [in] pci_backend PCI backend to forward the accesses to.
+ * @param [in] stream Record stream.
+ * @return A PCI backend.
+ * @note The PCI backend to forward the accesses to isn't destroyed with the
+ *   recording PCI backend.
+ */
+pci_backend_t *pci_backend_create_record(pci_backend_t *pci_backend, FILE *stream);
+
+/**
+ * Destroys the PCI backend.
+ *
+ * @param [in] pci_backend PCI backend.
+ */
+void pci_backend_destroy(pci_backend_t *restrict pci_backend);
+
+/**
+ * Returns the PCI bus number of the PCI backend.
+ *
+ * @param [in] pci_backend PCI backend.
+ * @return PCI bus number.
+ */
+int pci_backend_get_bus(pci_backend_t *restrict pci_backend);
+
+/**
+ * Returns the PCI device number of the PCI backend.
+ *
+ * @param [in] pci_backend PCI backend.
+ * @return PCI device number.
+ */
+int pci_backend_get_device(pci_backend_t *restrict pci_backend);
+
+/**
+ * Returns the PCI function number of the PCI backend.
+ *
+ * @param [in] pci_backend PCI backend.
+ * @return PCI function number.
+ */
+int pci_backend_get_function(pci_backend_t *restrict pci_backend);
+
+/**
+ * Reads a 16-bit value from the configuration space.
+ *
+ * @param [in] pci_backend PCI backend.
+ * @param [in] offset Configuration space offset, in bytes.
+ * @return Value.
+ */
+uint16_t pci_backend_config_read16(pci_backend_t *restrict pci_backend, size_t offset);
+
+/**
+ * Reads a 32-bit value from the configuration space.
+ *
+ * @param [in] pci_backend PCI backend.
+ * @param [in] offset Configuration space offset, in bytes.
+ * @return Value.
+ */
+uint32_t pci_backend_config_read32(pci_backend_t *restrict pci_backend, size_t offset);
+
+/**
+ * Reads an 8-bit value from the configuration space.
+ *
+ * @param [in] pci_backend PCI backend.
+ * @param [in] offset Configuration space offset, in bytes.
+ * @return Value.
+ */
+uint8_t pci_backend_config_read8(pci_backend_t *restrict pci_backend, size_t offset);
+
+/**
+ * Writes a 16-bit value to the configuration space.
+ *
+ * @param [in] pci_backend PCI backend.
+ * @param [in] offset Configuration space offset, in bytes.
+ * @param [in] value Value.
+ */
+void pci_backend_config_write16(pci_backend_t *restrict pci_backend, size_t offset, uint16_t value);
+
+/**
+ * Writes a 32-bit value to the configuration space.
+ *
+ * @param [in] pci_backend PCI backend.
+ * @param [in] offset Configuration space offset, in bytes.
+ * @param [in] value Value.
+ */
+void pci_backend_config_write32(pci_backend_t *restrict pci_backend, size_t offset, uint32_t value);
+
+/**
+ * Writes an 8-bit value to the configuration space.
+ *
+ * @param [in] pci_backend PCI backend.
+ * @param [in] offset Configuration space offset, in bytes.
+ * @param [in] value Value.
+ */
+void pci_backend_config_write8(pci_backend_t *restrict pci_backend, size_t offset, uint8_t value);
+
+/**
+ * Loads the resources of the regions (e.g., saved by a previous run), instead
+ * of reading them from the sysfs resource file.
+ *
+ * @param [in] pci_backend PCI backend.
+ * @param [in] stream Stream to load the resources from.
+ * @return Returns zero on success; otherwise, returns -1 on failure. errno is
+ *   set to ESTALE if the resources were saved for another device or other base
+ *   address registers (BARs).
+ */
+int pci_backend_load_resources(pci_backend_t *restrict pci_backend, FILE *restrict stream);
+
+/**
+ * Makes a region accessible through the PCI backend.
+ *
+ * @param [in] pci_backend PCI backend.
+ * @param [in] region_num Region number.
+ * @param [in] base_address Base address.
+ * @param [in] size Size.
+ * @param [in] is_io Whether the region is I/O.
+ * @return Returns zero on success; otherwise, returns -1 on failure.
+ */
+int pci_backend_region_attach(
+        pci_backend_t *restrict pci_backend, size_t region_num, uint64_t base_address, uint64_t size, bool is_io);
+
+/**
+ * Makes a region no longer accessible through the PCI backend.
+ *
+ * @param [in] pci_backend PCI backend.
+ * @param [in] region_num Region number.
+ */
+void pci_backend_region_detach(pci_backend_t *restrict pci_backend, size_t region_num);
+
+/**
+ * Returns the resource (i.e., base address, size, and whether it is I/O) of the
+ * region, as known from the loaded resources, the sysfs resource file, or a
+ * previous call to pci_backend_region_set_resource().
+ *
+ * @param [in] pci_backend PCI backend.
+ * @param [in] region_num Region number.
+ * @param [out] base_address Base address.
+ * @param [out] size Size. A size of zero specifies the region isn't
+ *   implemented.
+ * @param [out] is_io Whether the region is I/O.
+ * @return Returns zero on success; otherwise, returns -1 on failure. errno is
+ *   set to ENOENT if the resource of the region isn't known.
+ */
+int pci_backend_region_get_resource(
+        pci_backend_t *restrict pci_backend, size_t region_num, uint64_t *base_address, uint64_t *size, bool *is_io);
+
+/**
+ * Reads a 16-bit value from the region.
+ *
+ * @param [in] pci_backend PCI backend.
+ * @param [in] region_num Region number.
+ * @param [in] offset Region offset, in bytes.
+ * @return Value.
+ */
+uint16_t pci_backend_region_read16(pci_backend_t *restrict pci_backend, size_t region_num, size_t offset);
+
+/**
+ * Reads a 32-bit value from the region.
+ *
+ * @param [in] pci_backend PCI backend.
+ * @param [in] region_num Region number.
+ * @param [in] offset Region offset, in bytes.
+ * @return Value.
+ */
+uint32_t pci_backend_region_read32(pci_backend_t *restrict pci_backend, size_t region_num, size_t offset);
+
+/**
+ * Reads an 8-bit value from the region.
+ *
+ * @param [in] pci_backend PCI backend.
+ * @param [in] region_num Region number.
+ * @param [in] offset Region offset, in bytes.
+ * @return Value.
+ */
+uint8_t pci_backend_region_read8(pci_backend_t *restrict pci_backend, size_t region_num, size_t offset);
+
+/**
+ * Reads a string of 16-bit values from the same offset of the region.
+ *
+ * @param [in] pci_backend PCI backend.
+ * @param [in] region_num Region number.
+ * @param [in] offset Region offset, in bytes.
+ * @param [out] string String of 16-bit values.
+ * @param [in] count Number of 16-bit values.
+ */
+void pci_backend_region_read_string16(
+        pci_backend_t *restrict pci_backend, size_t region_num, size_t offset, uint16_t *string, size_t count);
+
+/**
+ * Reads a string of 32-bit values from the same offset of the region.
+ *
+ * @param [in] pci_backend PCI backend.
+ * @param [in] region_num Region number.
+ * @param [in] offset Region offset, in bytes.
+ * @param [out] string String of 32-bit values.
+ * @param [in] count Number of 32-bit values.
+ */
+void pci_backend_region_read_string32(
+        pci_backend_t *restrict pci_backend, size_t region_num, size_t offset, uint32_t *string, size_t count);
+
+/**
+ * Reads a string of 8-bit values from the same offset of the region.
+ *
+ * @param [in] pci_backend PCI backend.
+ * @param [in] region_num Region number.
+ * @param [in] offset Region offset, in bytes.
+ * @param [out] string String of 8-bit values.
+ * @param [in] count Number of 8-bit values.
+ */
+void pci_backend_region_read_string8(
+        pci_backend_t *restrict pci_backend, size_t region_num, size_t offset, uint8_t *string, size_t count);
+
+/**
+ * Sets the resource of the region (e.g., after sizing its base address
+ * register), so it can be saved.
+ *
+ * @param [in] pci_backend PCI backend.
+ * @param [in] region_num Region number.
+ * @param [in] base_address Base address.
+ * @param [in] size Size.
+ * @param [in] is_io Whether the region is I/O.
+ */
+void pci_backend_region_set_resource(
+        pci_backend_t *restrict pci_backend, size_t region_num, uint64_t base_address, uint64_t size, bool is_io);
+
+/**
+ * Writes a 16-bit value to the region.
+ *
+ * @param [in] pci_backend PCI backend.
+ * @param [in] region_num Region number.
+ * @param [in] offset Region offset, in bytes.
+ * @param [in] value Value.
+ */
+void pci_backend_region_write16(pci_backend_t *restrict pci_backend, size_t region_num, size_t offset, uint16_t value);
+
+/**
+ * Writes a 32-bit value to the region.
+ *
+ * @param [in] pci_backend PCI backend.
+ * @param [in] region_num Region number.
+ * @param [in] offset Region offset, in bytes.
+ * @param [in] value Value.
+ */
+void pci_backend_region_write32(pci_backend_t *restrict pci_backend, size_t region_num, size_t offset, uint32_t value);
+
+/**
+ * Writes an 8-bit value to the region.
+ *
+ * @param [in] pci_backend PCI backend.
+ * @param [in] region_num Region number.
+ * @param [in] offset Region offset, in bytes.
+ * @param [in] value Value.
+ */
+void pci_backend_region_write8(pci_backend_t *restrict pci_backend, size_t region_num, size_t offset, uint8_t value);
+
+/**
+ * Writes a string of 16-bit values to the same offset of the region.
+ *
+ * @param [in] pci_backend PCI backend.
+ * @param [in] region_num Region number.
+ * @param [in] offset Region offset, in bytes.
+ * @param [in] string String of 16-bit values.
+ * @param [in] count Number of 16-bit values.
+ */
+void pci_backend_region_write_string16(
+        pci_backend_t *restrict pci_backend, size_t region_num, size_t offset, const uint16_t *string, size_t count);
+
+/**
+ * Writes a string of 32-bit values to the same offset of the region.
+ *
+ * @param [in] pci_backend PCI backend.
+ * @param [in] region_num Region number.
+ * @param [in] offset Region offset, in bytes.
+ * @param [in] string String of 32-bit values.
+ * @param [in] count Number of 32-bit values.
+ */
+void pci_backend_region_write_string32(
+        pci_backend_t *restrict pci_backend, size_t region_num, size_t offset, const uint32_t *string, size_t count);
+
+/**
+ * Writes a string of 8-bit values to the same offset of the region.
+ *
+ * @param [in] pci_backend PCI backend.
+ * @param [in] region_num Region number.
+ * @param [in] offset Region offset, in bytes.
+ * @param [in] string String of 8-bit values.
+ * @param [in] count Number of 8-bit values.
+ */
+void pci_backend_region_write_string8(
+        pci_backend_t *restrict pci_backend, size_t region_num, size_t offset, const uint8_t *string, size_t count);
+
+/**
+ * Saves the resources of the regions, so they can be loaded by a later run.
+ *
+ * @param [in] pci_backend PCI backend.
+ * @param [in] stream Stream to save the resources to.
+ * @return Returns zero on success; otherwise, returns -1 on failure.
+ */
+int pci_backend_save_resources(pci_backend_t *restrict pci_backend, FILE *restrict stream);
+
+/**
+ * Sets the error handler for the PCI backend.
+ *
+ * @param [in] handler Error handler.
+ * @return Previous error handler.
+ */
+pci_backend_error_handler_t *pci_backend_set_error_handler(pci_backend_error_handler_t *handler);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PCI_BACKEND_H */
@@ -2,25 +2,22 @@
 
 #include "pci_device.h"
 
-#include "io.h"
-#include "pci.h"
+#include "io_stats.h"
+#include "pci_backend.h"
 
 #include <errno.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
-
-#include <fcntl.h>
-#include <sys/mman.h>
-#include <unistd.h>
+#include <string.h>
 
 #define MAX_REGIONS 6
+#define MAX_SHADOW 16
 
 struct _pci_device {
-    int bus;
-    int device;
-    int function;
+    pci_backend_t *pci_backend;
+    io_stats_t *io_stats;
     uint16_t vendor_id;
     uint16_t device_id;
     uint32_t class_code;
@@ -29,20 +26,25 @@ struct _pci_device {
     struct region {
         uint64_t base_address;
         uint64_t size;
-        void *map;
         bool is_io;
         bool is_64;
+        bool is_mapped;
+        uint16_t shadowed;
+        uint16_t shadow_valid;
+        uint8_t shadow[MAX_SHADOW];
     } regions[MAX_REGIONS];
 };
 
 static pci_device_error_handler_t *error_handler = NULL;
 
 void pci_device_error(pci_device_t *restrict pci_device, int status, int error, const char *restrict format, ...);
+uint16_t pci_device_region_get_shadow_mask(size_t offset, size_t size);
+void pci_device_region_size(pci_device_t *restrict pci_device, size_t region_num);
 int pci_device_regions_map(pci_device_t *restrict pci_device);
 int pci_device_regions_unmap(pci_device_t *restrict pci_device);
 
 pci_device_t *
-pci_device_create(int bus, int device, int function)
+pci_device_create(pci_backend_t *pci_backend)
 {
     pci_device_t *pci_device = (pci_device_t *)calloc(1, sizeof(*pci_device));
     if (pci_device == NULL) {
@@ -50,41 +52,21 @@ pci_device_create(int bus, int device, int function)
         return NULL;
     }
 
-    if (bus < 0 || bus > 255) {
-        errno = EINVAL;
-        pci_device_error(pci_device, 0, errno, __func__);
-        goto err;
-    }
-
-    if (device < 0 || device > 31) {
-        errno = EINVAL;
-        pci_device_error(pci_device, 0, errno, __func__);
-        goto err;
-    }
-
-    if (function < 0 || function > 7) {
-        errno = EINVAL;
-        pci_device_error(pci_device, 0, errno, __func__);
-        goto err;
-    }
-
-    pci_device->bus = bus;
-    pci_device->device = device;
-    pci_device->function = function;
-    pci_device->vendor_id = pci_config_read16(pci_device->bus, pci_device->device, pci_device->function, 0);
+    pci_device->pci_backend = pci_backend;
+    pci_device->vendor_id = pci_backend_config_read16(pci_device->pci_backend, 0);
     if (pci_device->vendor_id == 0xffff) {
         pci_device_error(pci_device, 0, 0, "%s: Invalid device.\n", __func__);
         goto err;
     }
 
-    pci_device->device_id = pci_config_read16(pci_device->bus, pci_device->device, pci_device->function, 2);
-    pci_device->class_code = pci_config_read32(pci_device->bus, pci_device->device, pci_device->function, 8) >> 8;
+    pci_device->device_id = pci_backend_config_read16(pci_device->pci_backend, 2);
+    pci_device->class_code = pci_backend_config_read32(pci_device->pci_backend, 8) >> 8;
     /* The first part of the predefined header (i.e., the first 16 bytes) are
        defined the same for all types of devices. The the second part of the
        predefined header may have different layouts depending on the base
        function that the device supports. The Header Type field (at offset 14)
        specifies what layout is provided. */
-    pci_device->header_type = pci_config_read8(pci_device->bus, pci_device->device, pci_device->function, 14);
+    pci_device->header_type = pci_backend_config_read8(pci_device->pci_backend, 14);
     /* Bits 0 to 6 identify the layout of the second part of the predefined
        header. */
     switch (pci_device->header_type & 0x7f) {
@@ -149,6 +131,13 @@ pci_device_get_num_regions(pci_device_t *restrict pci_device)
     return pci_device->num_regions;
 }
 
+bool
+pci_device_is_ata_channel_native(pci_device_t *restrict pci_device, int channel_num)
+{
+    /* Bit 0 (primary) or 2 (secondary) of the programming interface */
+    return (pci_device->class_code & (0x01 << (channel_num * 2))) != 0;
+}
+
 bool
 pci_device_is_ata_controller(pci_device_t *restrict pci_device)
 {
@@ -203,55 +192,223 @@ pci_device_region_is_mapped(pci_device_t *restrict pci_device, size_t region_num
         return (uint64_t)-1;
     }
 
-    return (!pci_device->regions[region_num].is_io && (pci_device->regions[region_num].map != MAP_FAILED));
+    return (!pci_device->regions[region_num].is_io && pci_device->regions[region_num].is_mapped);
+}
+
+uint16_t
+pci_device_region_get_shadow_mask(size_t offset, size_t size)
+{
+    if (offset + size > MAX_SHADOW) {
+        return 0;
+    }
+
+    return ((1 << size) - 1) << offset;
+}
+
+void
+pci_device_region_invalidate(pci_device_t *restrict pci_device, size_t region_num)
+{
+    if (region_num >= pci_device->num_regions) {
+        errno = EINVAL;
+        pci_device_error(pci_device, 0, errno, __func__);
+        return;
+    }
+
+    pci_device->regions[region_num].shadow_valid = 0;
+}
+
+bool
+pci_device_region_is_shadowed(pci_device_t *restrict pci_device, size_t region_num, size_t offset)
+{
+    if (region_num >= pci_device->num_regions) {
+        errno = EINVAL;
+        pci_device_error(pci_device, 0, errno, __func__);
+        return false;
+    }
+
+    uint16_t mask = pci_device_region_get_shadow_mask(offset, 1);
+    return (mask != 0 && (pci_device->regions[region_num].shadowed & mask));
+}
+
+void
+pci_device_region_set_shadowed(pci_device_t *restrict pci_device, size_t region_num, size_t offset, bool shadowed)
+{
+    uint16_t mask = pci_device_region_get_shadow_mask(offset, 1);
+    if (region_num >= pci_device->num_regions || mask == 0) {
+        errno = EINVAL;
+        pci_device_error(pci_device, 0, errno, __func__);
+        return;
+    }
+
+    /* The shadow is filled by the next write to the register */
+    pci_device->regions[region_num].shadow_valid &= ~mask;
+    if (shadowed) {
+        pci_device->regions[region_num].shadowed |= mask;
+    } else {
+        pci_device->regions[region_num].shadowed &= ~mask;
+    }
+}
+
+void
+pci_device_region_size(pci_device_t *restrict pci_device, size_t region_num)
+{
+    struct region *region = &pci_device->regions[region_num];
+    size_t offset = 16 + (region_num * 4);
+    /* Disable (I/O and memory) decoding in the command register before sizing
+       the base address register (BAR). */
+    uint16_t command = pci_backend_config_read16(pci_device->pci_backend, 4);
+    pci_backend_config_write16(pci_device->pci_backend, 4, command & ~0x03);
+    /* Save the original value of the BAR */
+    uint64_t base_address = pci_backend_config_read32(pci_device->pci_backend, offset);
+    /* Write 0xffffffff to the register, then read it back */
+    pci_backend_config_write32(pci_device->pci_backend, offset, 0xffffffff);
+    uint64_t size = pci_backend_config_read32(pci_device->pci_backend, offset);
+    /* Restore the original value of the BAR */
+    pci_backend_config_write32(pci_device->pci_backend, offset, base_address);
+    if (region->is_64) {
+        /* Extend the base address and the size with the next BAR */
+        base_address |= ((uint64_t)pci_backend_config_read32(pci_device->pci_backend, offset + 4) << 32);
+        pci_backend_config_write32(pci_device->pci_backend, offset + 4, 0xffffffff);
+        size |= ((uint64_t)pci_backend_config_read32(pci_device->pci_backend, offset + 4) << 32);
+        pci_backend_config_write32(pci_device->pci_backend, offset + 4, base_address >> 32);
+    } else {
+        size |= ((uint64_t)0xffffffff << 32);
+    }
+
+    /* Re-enable decoding in the command register */
+    pci_backend_config_write16(pci_device->pci_backend, 4, command);
+    /* Is the BAR implemented? */
+    if ((size & 0xffffffff) == 0) {
+        region->size = 0;
+        return;
+    }
+
+    if (region->is_io) {
+        /* Clear encoding information bits (i.e., bit 0 for I/O) */
+        base_address &= ~0x01;
+        size &= ~0x01;
+        /* Only the lower 16 bits are decoded for I/O */
+        size |= ~(uint64_t)0xffff;
+    } else {
+        /* Clear encoding information bits (i.e., bits 0 to 3 for memory) */
+        base_address &= ~0x0f;
+        size &= ~0x0f;
+    }
+
+    region->base_address = base_address;
+    /* Invert all bits (i.e., logical NOT), then increment by 1 */
+    region->size = (~size + 1);
 }
 
 #define _pci_device_region_define(_size, type) \
     type pci_device_region_read##_size(pci_device_t *restrict pci_device, size_t region_num, size_t offset) \
     { \
-        if (region_num >= pci_device->num_regions || offset >= pci_device->regions[region_num].size) { \
+        if (region_num >= pci_device->num_regions || pci_device->regions[region_num].size < sizeof(type) \
+                || offset > pci_device->regions[region_num].size - sizeof(type)) { \
             errno = EINVAL; \
             pci_device_error(pci_device, 0, errno, __func__); \
             return (type)-1; \
         } \
 \
-        if (!pci_device->regions[region_num].is_io && (pci_device->regions[region_num].map == MAP_FAILED)) { \
+        if (!pci_device->regions[region_num].is_mapped) { \
             errno = EINVAL; \
             pci_device_error(pci_device, 0, errno, __func__); \
             return (type)-1; \
         } \
 \
-        type value; \
-        if (pci_device->regions[region_num].is_io) { \
-            value = io_read##_size(pci_device->regions[region_num].base_address + offset); \
+        /* Is the value in the shadow? */ \
+        struct region *region = &pci_device->regions[region_num]; \
+        uint16_t mask = pci_device_region_get_shadow_mask(offset, sizeof(type)); \
+        if (mask != 0 && (region->shadowed & region->shadow_valid & mask) == mask) { \
+            type value; \
+            memcpy(&value, &region->shadow[offset], sizeof(value)); \
             return value; \
         } \
 \
-        value = ((type *)pci_device->regions[region_num].map)[offset]; \
-        return value; \
+        io_stats_count(pci_device->io_stats, IO_STATS_READS, 1); \
+        return pci_backend_region_read##_size(pci_device->pci_backend, region_num, offset); \
+    } \
+\
+    void pci_device_region_read_string##_size( \
+            pci_device_t *restrict pci_device, size_t region_num, size_t offset, type *string, size_t count) \
+    { \
+        if (region_num >= pci_device->num_regions || pci_device->regions[region_num].size < sizeof(type) \
+                || offset > pci_device->regions[region_num].size - sizeof(type)) { \
+            errno = EINVAL; \
+            pci_device_error(pci_device, 0, errno, __func__); \
+            return; \
+        } \
+\
+        if (!pci_device->regions[region_num].is_mapped) { \
+            errno = EINVAL; \
+            pci_device_error(pci_device, 0, errno, __func__); \
+            return; \
+        } \
+\
+        io_stats_count(pci_device->io_stats, IO_STATS_READS, count); \
+        pci_backend_region_read_string##_size(pci_device->pci_backend, region_num, offset, string, count); \
     } \
 \
     void pci_device_region_write##_size( \
             pci_device_t *restrict pci_device, size_t region_num, size_t offset, type value) \
     { \
-        if (region_num >= pci_device->num_regions || offset >= pci_device->regions[region_num].size) { \
+        if (region_num >= pci_device->num_regions || pci_device->regions[region_num].size < sizeof(type) \
+                || offset > pci_device->regions[region_num].size - sizeof(type)) { \
             errno = EINVAL; \
             pci_device_error(pci_device, 0, errno, __func__); \
             return; \
         } \
 \
-        if (!pci_device->regions[region_num].is_io && (pci_device->regions[region_num].map == MAP_FAILED)) { \
+        if (!pci_device->regions[region_num].is_mapped) { \
+            errno = EINVAL; \
+            pci_device_error(pci_device, 0, errno, __func__); \
+            return; \
+        } \
+\
+        /* Write through the shadow */ \
+        struct region *region = &pci_device->regions[region_num]; \
+        uint16_t mask = pci_device_region_get_shadow_mask(offset, sizeof(type)) & region->shadowed; \
+        if (mask != 0) { \
+            for (size_t i = 0; i < sizeof(type); ++i) { \
+                region->shadow[offset + i] = (value >> (8 * i)) & 0xff; \
+            } \
+\
+            region->shadow_valid |= mask; \
+        } \
+\
+        io_stats_count(pci_device->io_stats, IO_STATS_WRITES, 1); \
+        pci_backend_region_write##_size(pci_device->pci_backend, region_num, offset, value); \
+    } \
+\
+    void pci_device_region_write_string##_size( \
+            pci_device_t *restrict pci_device, size_t region_num, size_t offset, const type *string, size_t count) \
+    { \
+        if (region_num >= pci_device->num_regions || pci_device->regions[region_num].size < sizeof(type) \
+                || offset > pci_device->regions[region_num].size - sizeof(type)) { \
             errno = EINVAL; \
             pci_device_error(pci_device, 0, errno, __func__); \
             return; \
         } \
 \
-        if (pci_device->regions[region_num].is_io) { \
-            io_write##_size(pci_device->regions[region_num].base_address + offset, value); \
+        if (!pci_device->regions[region_num].is_mapped) { \
+            errno = EINVAL; \
+            pci_device_error(pci_device, 0, errno, __func__); \
             return; \
         } \
 \
-        ((type *)pci_device->regions[region_num].map)[offset] = value; \
+        /* Write through the shadow */ \
+        struct region *region = &pci_device->regions[region_num]; \
+        uint16_t mask = pci_device_region_get_shadow_mask(offset, sizeof(type)) & region->shadowed; \
+        if (mask != 0 && count > 0) { \
+            for (size_t i = 0; i < sizeof(type); ++i) { \
+                region->shadow[offset + i] = (string[count - 1] >> (8 * i)) & 0xff; \
+            } \
+\
+            region->shadow_valid |= mask; \
+        } \
+\
+        io_stats_count(pci_device->io_stats, IO_STATS_WRITES, count); \
+        pci_backend_region_write_string##_size(pci_device->pci_backend, region_num, offset, string, count); \
     }
 
 _pci_device_region_define(16, uint16_t)
@@ -262,113 +419,71 @@ _pci_device_region_define(8, uint8_t)
 int
 pci_device_regions_map(pci_device_t *restrict pci_device)
 {
-    for (size_t i = 0, j = 16; i < pci_device->num_regions; ++i, j += 4) {
-        /* Size the 32-bit base address register (BAR) */
-        /* Disable (I/O and memory) decoding in the command register before
-           sizing the BAR. */
-        uint16_t command = pci_config_read16(pci_device->bus, pci_device->device, pci_device->function, 2);
-        pci_config_write16(pci_device->bus, pci_device->device, pci_device->function, 2, command & ~0x03);
-        /* Save the original value of the BAR */
-        uint64_t base_address = pci_config_read32(pci_device->bus, pci_device->device, pci_device->function, j);
-        /* Write 0xffffffff to the register, then read it back */
-        pci_config_write32(pci_device->bus, pci_device->device, pci_device->function, j, 0xffffffff);
-        uint64_t size = pci_config_read32(pci_device->bus, pci_device->device, pci_device->function, j);
-        size |= ((uint64_t)0xffffffff << 32);
-        /* Restore the original value of the BAR before re-enabling decoding in
-           the command register. */
-        pci_config_write32(pci_device->bus, pci_device->device, pci_device->function, j, base_address);
-        /* Re-enable decoding in the command register */
-        pci_config_write16(pci_device->bus, pci_device->device, pci_device->function, 2, command);
+    for (size_t i = 0; i < pci_device->num_regions; ++i) {
+        size_t region_num = i;
+        struct region *region = &pci_device->regions[region_num];
+        /* Read the base address register (BAR). Reading it doesn't disturb the
+           device, unlike sizing it. */
+        uint32_t bar = pci_backend_config_read32(pci_device->pci_backend, 16 + (region_num * 4));
         /* @todo Investigate why some ATA/IDE controllers in compatibility mode
            don't specify the ATA I/O addresses in BAR0 to BAR3. */
-        if (pci_device_is_ata_controller(pci_device)) {
-            /* Is in compatibility mode? */
-            if ((pci_device->class_code & 0x05) == 0) {
-                if (base_address == 0) {
-                    switch (j) {
-                    case 16:
-                        base_address = 0x1f0 | 0x01;
-                        size = ~0x07;
-                        break;
-                    case 20:
-                        base_address = 0x3f0 | 0x01;
-                        size = ~0x03;
-                        break;
-                    case 24:
-                        base_address = 0x170 | 0x01;
-                        size = ~0x07;
-                        break;
-                    case 28:
-                        base_address = 0x370 | 0x01;
-                        size = ~0x03;
-                        break;
-                    }
-                }
-            }
-        }
-
-        /* Is an I/O address space? */
-        if (base_address & 0x01) {
-            pci_device->regions[i].is_io = true;
-            /* Clear encoding information bits (i.e., bit 0 for I/O) */
-            base_address &= ~0x01;
-            size &= ~0x01;
-            /* Invert all bits (i.e., logical NOT), then increment by 1 */
-            size = (~size + 1);
+        if (pci_device_is_ata_controller(pci_device) && (pci_device->class_code & 0x05) == 0 && bar == 0
+                && region_num < 4) {
+            /* The Control Block registers of a channel in compatibility mode
+               are at 0x3f6 and 0x376, which is offset 2 of the equivalent
+               native-mode BAR. */
+            static const uint64_t base_addresses[] = { 0x1f0, 0x3f4, 0x170, 0x374 };
+            static const uint64_t sizes[] = { 8, 4, 8, 4 };
+            region->base_address = base_addresses[region_num];
+            region->size = sizes[region_num];
+            region->is_io = true;
         } else {
+            region->is_io = (bar & 0x01);
             /* Is within a 64-bit address space? */
-            if (base_address & 0x04) {
-                /* Size the 64-bit BAR */
-                pci_device->regions[i].is_64 = true;
-                /* Disable (I/O and memory) decoding in the command register
-                   before sizing the BAR. */
-                pci_config_write16(pci_device->bus, pci_device->device, pci_device->function, 2, command & ~0x03);
-                /* Save the original value of the BAR, and extend the current
-                   base address with the value of the next BAR. */
-                base_address |= ((uint64_t)pci_config_read32(
-                                         pci_device->bus, pci_device->device, pci_device->function, j += 4)
-                                 << 32);
-                /* Write 0xffffffff to the register, then read it back, and
-                   extend the current size. */
-                pci_config_write32(pci_device->bus, pci_device->device, pci_device->function, j, 0xffffffff);
-                size |= ((uint64_t)pci_config_read32(pci_device->bus, pci_device->device, pci_device->function, j)
-                         << 32);
-                /* Restore the original value of the BAR before re-enabling
-                   decoding in the command register. */
-                pci_config_write32(pci_device->bus, pci_device->device, pci_device->function, j, base_address >> 32);
-                /* Re-enable decoding in the command register */
-                pci_config_write16(pci_device->bus, pci_device->device, pci_device->function, 2, command);
+            region->is_64 = (!region->is_io && (bar & 0x06) == 0x04);
+            /* Use the resources known by the PCI backend (e.g., from sysfs),
+               and only size the BAR if there are none. */
+            if (pci_backend_region_get_resource(
+                        pci_device->pci_backend, region_num, &region->base_address, &region->size, &region->is_io)
+                    == -1) {
+                pci_device_region_size(pci_device, region_num);
+                pci_backend_region_set_resource(
+                        pci_device->pci_backend, region_num, region->base_address, region->size, region->is_io);
             }
 
-            /* Clear encoding information bits (i.e., bits 0 to 3 for memory) */
-            base_address &= ~0x0f;
-            size &= ~0x0f;
-            /* Invert all bits (i.e., logical NOT), then increment by 1 */
-            size = (~size + 1);
+            /* The upper half of a 64-bit BAR isn't a region of its own, but
+               keep the region numbers equal to the BAR numbers. */
+            if (region->is_64) {
+                ++i;
+            }
         }
 
-        pci_device->regions[i].base_address = base_address;
-        pci_device->regions[i].size = size;
-        if (pci_device->regions[i].is_io) {
+        /* Is the BAR implemented? */
+        if (region->size == 0) {
             continue;
         }
 
-        /* Map the (memory) region */
-        int fd = open("/dev/mem", O_RDWR | O_CLOEXEC);
-        if (fd == -1) {
-            pci_device_error(pci_device, 0, errno, __func__);
-            goto err;
+        /* A memory region without an assigned base address isn't
+           accessible. */
+        if (!region->is_io && region->base_address == 0) {
+            continue;
         }
 
-        pci_device->regions[i].map = mmap(NULL, pci_device->regions[i].size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
-                pci_device->regions[i].base_address);
-        if ((pci_device->regions[i].map == MAP_FAILED) && (errno != EPERM)) {
-            close(fd);
-            pci_device_error(pci_device, 0, errno, __func__);
-            goto err;
+        /* Make the region accessible through the PCI backend. Memory regions
+           may not be mappable (e.g., if /dev/mem is restricted), in which case
+           they remain inaccessible. */
+        if (pci_backend_region_attach(
+                    pci_device->pci_backend, region_num, region->base_address, region->size, region->is_io)
+                == -1) {
+            if (region->is_io) {
+                pci_device_error(pci_device, 0, errno, __func__);
+                goto err;
+            }
+
+            continue;
         }
 
-        close(fd);
+        region->is_mapped = true;
     }
 
     return 0;
@@ -381,19 +496,12 @@ int
 pci_device_regions_unmap(pci_device_t *restrict pci_device)
 {
     for (size_t i = 0; i < pci_device->num_regions; ++i) {
-        if (pci_device->regions[i].is_io) {
-            continue;
-        }
-
-        if (!pci_device->regions[i].is_io && (pci_device->regions[i].map == MAP_FAILED)) {
+        if (!pci_device->regions[i].is_mapped) {
             continue;
         }
 
-        /* Unmap the (memory) region */
-        if (munmap((void *)pci_device->regions[i].base_address, pci_device->regions[i].size) == -1) {
-            pci_device_error(pci_device, 0, errno, __func__);
-            return -1;
-        }
+        pci_backend_region_detach(pci_device->pci_backend, i);
+        pci_device->regions[i].is_mapped = false;
     }
 
     return 0;
@@ -406,3 +514,9 @@ pci_device_set_error_handler(pci_device_error_handler_t *handler)
     error_handler = handler;
     return previous_handler;
 }
+
+void
+pci_device_set_io_stats(pci_device_t *restrict pci_device, io_stats_t *io_stats)
+{
+    pci_device->io_stats = io_stats;
+}
@@ -7,6 +7,9 @@
 extern "C" {
 #endif
 
+#include "io_stats.h"
+#include "pci_backend.h"
+
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -19,12 +22,10 @@ typedef void pci_device_error_handler_t(int status, int error, const char *restr
 /**
  * Creates a PCI device.
  *
- * @param [in] bus PCI bus number.
- * @param [in] device PCI device number.
- * @param [in] function PCI function number.
+ * @param [in] pci_backend PCI backend used to access the PCI device.
  * @return A PCI device.
  */
-pci_device_t *pci_device_create(int bus, int device, int function);
+pci_device_t *pci_device_create(pci_backend_t *pci_backend);
 
 /**
  * Destroys the PCI device.
@@ -50,6 +51,19 @@ size_t pci_device_get_num_regions(pci_device_t *restrict pci_device);
  */
 bool pci_device_is_ata_controller(pci_device_t *restrict pci_device);
 
+/**
+ * Returns whether a channel of the ATA/IDE controller is in native-PCI mode,
+ * where it interrupts through the PCI interrupt pin (INTx). In compatibility
+ * mode, it interrupts on ISA IRQ 14 (primary) or 15 (secondary) instead.
+ *
+ * @param [in] pci_device PCI device.
+ * @param [in] channel_num Channel number. Use 0 for the primary channel, or 1
+ *   for the secondary channel.
+ * @return Returns true if the channel is in native-PCI mode; otherwise,
+ *   returns false if the channel is in compatibility mode.
+ */
+bool pci_device_is_ata_channel_native(pci_device_t *restrict pci_device, int channel_num);
+
 /**
  * Returns the base address register (BAR) of the PCI device region.
  *
@@ -88,12 +102,47 @@ bool pci_device_region_is_io(pci_device_t *restrict pci_device, size_t region_nu
  */
 bool pci_device_region_is_mapped(pci_device_t *restrict pci_device, size_t region_num);
 
+/**
+ * Invalidates the shadow of the registers of the PCI device region (e.g.,
+ * after the device has been reset).
+ *
+ * @param [in] pci_device PCI device.
+ * @param [in] region_num Region number.
+ */
+void pci_device_region_invalidate(pci_device_t *restrict pci_device, size_t region_num);
+
+/**
+ * Returns whether the register of the PCI device region is shadowed.
+ *
+ * @param [in] pci_device PCI device.
+ * @param [in] region_num Region number.
+ * @param [in] offset Register offset, in bytes.
+ * @return Returns true if the register is shadowed; otherwise, returns false if
+ *   the register is not shadowed.
+ */
+bool pci_device_region_is_shadowed(pci_device_t *restrict pci_device, size_t region_num, size_t offset);
+
+/**
+ * Sets whether the 8-bit register of the PCI device region is shadowed.
+ *
+ * Writes to a shadowed register are written through to the shadow, and reads
+ * of a shadowed register are served from the shadow once it has been written.
+ * Only the registers in the first 16 bytes of a region can be shadowed, and
+ * only registers that read back what was written to them should be.
+ *
+ * @param [in] pci_device PCI device.
+ * @param [in] region_num Region number.
+ * @param [in] offset Register offset, in bytes.
+ * @param [in] shadowed Whether the register is shadowed.
+ */
+void pci_device_region_set_shadowed(pci_device_t *restrict pci_device, size_t region_num, size_t offset, bool shadowed);
+
 /**
  * Reads a 16-bit value from the PCI device region.
  *
  * @param [in] pci_device PCI device.
  * @param [in] region_num Region number.
- * @param [in] offset Region offset.
+ * @param [in] offset Region offset, in bytes.
  * @return Value.
  */
 uint16_t pci_device_region_read16(pci_device_t *restrict pci_device, size_t region_num, size_t offset);
@@ -103,7 +152,7 @@ uint16_t pci_device_region_read16(pci_device_t *restrict pci_device, size_t regi
  *
  * @param [in] pci_device PCI device.
  * @param [in] region_num Region number.
- * @param [in] offset Region offset.
+ * @param [in] offset Region offset, in bytes.
  * @return Value.
  */
 uint32_t pci_device_region_read32(pci_device_t *restrict pci_device, size_t region_num, size_t offset);
@@ -113,17 +162,56 @@ uint32_t pci_device_region_read32(pci_device_t *restrict pci_device, size_t regi
  *
  * @param [in] pci_device PCI device.
  * @param [in] region_num Region number.
- * @param [in] offset Region offset.
+ * @param [in] offset Region offset, in bytes.
  * @return Value.
  */
 uint8_t pci_device_region_read8(pci_device_t *restrict pci_device, size_t region_num, size_t offset);
 
+/**
+ * Reads a string of 16-bit values from the same offset of the PCI device
+ * region.
+ *
+ * @param [in] pci_device PCI device.
+ * @param [in] region_num Region number.
+ * @param [in] offset Region offset, in bytes.
+ * @param [out] string String of 16-bit values.
+ * @param [in] count Number of 16-bit values.
+ */
+void pci_device_region_read_string16(
+        pci_device_t *restrict pci_device, size_t region_num, size_t offset, uint16_t *string, size_t count);
+
+/**
+ * Reads a string of 32-bit values from the same offset of the PCI device
+ * region.
+ *
+ * @param [in] pci_device PCI device.
+ * @param [in] region_num Region number.
+ * @param [in] offset Region offset, in bytes.
+ * @param [out] string String of 32-bit values.
+ * @param [in] count Number of 32-bit values.
+ */
+void pci_device_region_read_string32(
+        pci_device_t *restrict pci_device, size_t region_num, size_t offset, uint32_t *string, size_t count);
+
+/**
+ * Reads a string of 8-bit values from the same offset of the PCI device
+ * region.
+ *
+ * @param [in] pci_device PCI device.
+ * @param [in] region_num Region number.
+ * @param [in] offset Region offset, in bytes.
+ * @param [out] string String of 8-bit values.
+ * @param [in] count Number of 8-bit values.
+ */
+void pci_device_region_read_string8(
+        pci_device_t *restrict pci_device, size_t region_num, size_t offset, uint8_t *string, size_t count);
+
 /**
  * Writes a 16-bit value to the PCI device region.
  *
  * @param [in] pci_device PCI device.
  * @param [in] region_num Region number.
- * @param [in] offset Region offset.
+ * @param [in] offset Region offset, in bytes.
  * @param [in] value Value.
  */
 void pci_device_region_write16(pci_device_t *restrict pci_device, size_t region_num, size_t offset, uint16_t value);
@@ -133,7 +221,7 @@ void pci_device_region_write16(pci_device_t *restrict pci_device, size_t region_
  *
  * @param [in] pci_device PCI device.
  * @param [in] region_num Region number.
- * @param [in] offset Region offset.
+ * @param [in] offset Region offset, in bytes.
  * @param [in] value Value.
  */
 void pci_device_region_write32(pci_device_t *restrict pci_device, size_t region_num, size_t offset, uint32_t value);
@@ -143,11 +231,50 @@ void pci_device_region_write32(pci_device_t *restrict pci_device, size_t region_
  *
  * @param [in] pci_device PCI device.
  * @param [in] region_num Region number.
- * @param [in] offset Region offset.
+ * @param [in] offset Region offset, in bytes.
  * @param [in] value Value.
  */
 void pci_device_region_write8(pci_device_t *restrict pci_device, size_t region_num, size_t offset, uint8_t value);
 
+/**
+ * Writes a string of 16-bit values to the same offset of the PCI device
+ * region.
+ *
+ * @param [in] pci_device PCI device.
+ * @param [in] region_num Region number.
+ * @param [in] offset Region offset, in bytes.
+ * @param [in] string String of 16-bit values.
+ * @param [in] count Number of 16-bit values.
+ */
+void pci_device_region_write_string16(
+        pci_device_t *restrict pci_device, size_t region_num, size_t offset, const uint16_t *string, size_t count);
+
+/**
+ * Writes a string of 32-bit values to the same offset of the PCI device
+ * region.
+ *
+ * @param [in] pci_device PCI device.
+ * @param [in] region_num Region number.
+ * @param [in] offset Region offset, in bytes.
+ * @param [in] string String of 32-bit values.
+ * @param [in] count Number of 32-bit values.
+ */
+void pci_device_region_write_string32(
+        pci_device_t *restrict pci_device, size_t region_num, size_t offset, const uint32_t *string, size_t count);
+
+/**
+ * Writes a string of 8-bit values to the same offset of the PCI device
+ * region.
+ *
+ * @param [in] pci_device PCI device.
+ * @param [in] region_num Region number.
+ * @param [in] offset Region offset, in bytes.
+ * @param [in] string String of 8-bit values.
+ * @param [in] count Number of 8-bit values.
+ */
+void pci_device_region_write_string8(
+        pci_device_t *restrict pci_device, size_t region_num, size_t offset, const uint8_t *string, size_t count);
+
 /**
  * Sets the error handler for the PCI device.
  *
@@ -156,6 +283,15 @@ void pci_device_region_write8(pci_device_t *restrict pci_device, size_t region_n
  */
 pci_device_error_handler_t *pci_device_set_error_handler(pci_device_error_handler_t *handler);
 
+/**
+ * Sets the I/O statistics that count the register accesses (i.e., the accesses
+ * that aren't served from the shadow).
+ *
+ * @param [in] pci_device PCI device.
+ * @param [in] io_stats I/O statistics, or NULL.
+ */
+void pci_device_set_io_stats(pci_device_t *restrict pci_device, io_stats_t *io_stats);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,243 @@
+/** @file */
+
+#include "shadow_disk.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <nmmintrin.h>
+
+/* A 48-bit LBA is split into three 13-bit indexes of the nodes, and a 9-bit
+   index of the leaf (i.e., a leaf covers 512 sectors). */
+#define LBA_MASK ((1ULL << 48) - 1)
+#define LEAF_BITS 9
+#define NODE_BITS 13
+#define NUM_LEVELS 3
+/* Each entry of a leaf is the 56-bit hash of the sector and the command code
+   of its last writer, or zero if the contents of the sector are unknown */
+#define WRITER_MASK 0xffULL
+/* CRC-32C (Castagnoli) polynomial, reversed */
+#define CRC32C_POLY 0x82f63b78
+
+struct leaf {
+    uint64_t entries[1 << LEAF_BITS];
+};
+
+struct node {
+    void *children[1 << NODE_BITS];
+};
+
+struct _shadow_disk {
+    struct node *root;
+};
+
+static shadow_disk_error_handler_t *error_handler = NULL;
+static uint64_t (*hash)(const void *sector) = NULL;
+static uint32_t crc32c_table[256];
+
+void shadow_disk_error(shadow_disk_t *restrict shadow_disk, int status, int error, const char *restrict format, ...);
+void shadow_disk_free_node(void *node, int level);
+uint64_t shadow_disk_hash(const void *sector);
+uint64_t shadow_disk_hash_crc32c(const void *sector);
+uint64_t shadow_disk_hash_sse42(const void *sector);
+uint64_t *shadow_disk_lookup(shadow_disk_t *restrict shadow_disk, uint64_t lba, bool is_created);
+
+bool
+shadow_disk_check(shadow_disk_t *restrict shadow_disk, uint64_t lba, const void *data, uint32_t sectors,
+        uint64_t *restrict mismatch_lba, uint8_t *restrict writer)
+{
+    for (uint32_t i = 0; i < sectors; ++i) {
+        uint64_t *entry = shadow_disk_lookup(shadow_disk, lba + i, false);
+        if (entry == NULL || *entry == 0) {
+            continue;
+        }
+
+        const uint8_t *sector = (const uint8_t *)data + (size_t)i * SHADOW_DISK_SECTOR_SIZE;
+        if ((*entry & ~WRITER_MASK) != shadow_disk_hash(sector)) {
+            *mismatch_lba = (lba + i) & LBA_MASK;
+            *writer = *entry & WRITER_MASK;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void
+shadow_disk_clear(shadow_disk_t *restrict shadow_disk)
+{
+    shadow_disk_free_node(shadow_disk->root, 0);
+    shadow_disk->root = NULL;
+}
+
+shadow_disk_t *
+shadow_disk_create()
+{
+    shadow_disk_t *shadow_disk = (shadow_disk_t *)calloc(1, sizeof(*shadow_disk));
+    if (shadow_disk == NULL) {
+        shadow_disk_error(shadow_disk, 0, errno, __func__);
+        return NULL;
+    }
+
+    /* Hash with the CRC32 instruction of SSE4.2 if the CPU has it */
+    if (hash == NULL) {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; ++bit) {
+                crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+            }
+
+            crc32c_table[i] = crc;
+        }
+
+        __builtin_cpu_init();
+        hash = __builtin_cpu_supports("sse4.2") ? shadow_disk_hash_sse42 : shadow_disk_hash_crc32c;
+    }
+
+    return shadow_disk;
+}
+
+void
+shadow_disk_destroy(shadow_disk_t *restrict shadow_disk)
+{
+    if (shadow_disk == NULL) {
+        return;
+    }
+
+    shadow_disk_clear(shadow_disk);
+    free(shadow_disk);
+}
+
+void
+shadow_disk_error(shadow_disk_t *restrict shadow_disk, int status, int error, const char *restrict format, ...)
+{
+    if (error_handler == NULL) {
+        return;
+    }
+
+    va_list ap;
+    va_start(ap, format);
+    (*error_handler)(status, error, format, ap);
+    va_end(ap);
+}
+
+void
+shadow_disk_forget(shadow_disk_t *restrict shadow_disk, uint64_t lba, uint32_t sectors)
+{
+    for (uint32_t i = 0; i < sectors; ++i) {
+        uint64_t *entry = shadow_disk_lookup(shadow_disk, lba + i, false);
+        if (entry != NULL) {
+            *entry = 0;
+        }
+    }
+}
+
+void
+shadow_disk_free_node(void *node, int level)
+{
+    if (node == NULL) {
+        return;
+    }
+
+    if (level < NUM_LEVELS) {
+        for (size_t i = 0; i < (1 << NODE_BITS); ++i) {
+            shadow_disk_free_node(((struct node *)node)->children[i], level + 1);
+        }
+    }
+
+    free(node);
+}
+
+uint64_t
+shadow_disk_hash(const void *sector)
+{
+    /* The hash is never zero, and leaves room for the writer */
+    uint64_t result = (*hash)(sector) & ~WRITER_MASK;
+    return result ? result : (WRITER_MASK + 1);
+}
+
+uint64_t
+shadow_disk_hash_crc32c(const void *sector)
+{
+    /* The same hash as shadow_disk_hash_sse42, a byte at a time */
+    const uint8_t *bytes = (const uint8_t *)sector;
+    uint32_t crc[2] = { UINT32_MAX, UINT32_MAX };
+    for (size_t i = 0; i < SHADOW_DISK_SECTOR_SIZE; ++i) {
+        uint32_t *lane = &crc[(i / sizeof(uint64_t)) % 2];
+        *lane = crc32c_table[(*lane ^ bytes[i]) & 0xff] ^ (*lane >> 8);
+    }
+
+    return ((uint64_t)crc[0] << 32) | crc[1];
+}
+
+__attribute__((target("sse4.2"))) uint64_t
+shadow_disk_hash_sse42(const void *sector)
+{
+    /* Two independent CRC-32C lanes over the even and odd 64-bit words, so
+       the CRC32 instructions overlap in the pipeline */
+    const uint64_t *words = (const uint64_t *)sector;
+    uint64_t crc0 = UINT32_MAX;
+    uint64_t crc1 = UINT32_MAX;
+    for (size_t i = 0; i < SHADOW_DISK_SECTOR_SIZE / sizeof(uint64_t); i += 2) {
+        crc0 = _mm_crc32_u64(crc0, words[i]);
+        crc1 = _mm_crc32_u64(crc1, words[i + 1]);
+    }
+
+    return (crc0 << 32) | crc1;
+}
+
+uint64_t *
+shadow_disk_lookup(shadow_disk_t *restrict shadow_disk, uint64_t lba, bool is_created)
+{
+    lba &= LBA_MASK;
+    void **child = (void **)&shadow_disk->root;
+    for (int level = 0; level <= NUM_LEVELS; ++level) {
+        if (*child == NULL) {
+            if (!is_created) {
+                return NULL;
+            }
+
+            /* The last level is the leaf */
+            *child = calloc(1, (level < NUM_LEVELS) ? sizeof(struct node) : sizeof(struct leaf));
+            if (*child == NULL) {
+                shadow_disk_error(shadow_disk, 0, errno, __func__);
+                return NULL;
+            }
+        }
+
+        if (level < NUM_LEVELS) {
+            int shift = LEAF_BITS + (NUM_LEVELS - 1 - level) * NODE_BITS;
+            child = &((struct node *)*child)->children[(lba >> shift) & ((1 << NODE_BITS) - 1)];
+        }
+    }
+
+    return &((struct leaf *)*child)->entries[lba & ((1 << LEAF_BITS) - 1)];
+}
+
+shadow_disk_error_handler_t *
+shadow_disk_set_error_handler(shadow_disk_error_handler_t *handler)
+{
+    shadow_disk_error_handler_t *previous_handler = error_handler;
+    error_handler = handler;
+    return previous_handler;
+}
+
+int
+shadow_disk_write(
+        shadow_disk_t *restrict shadow_disk, uint64_t lba, const void *data, uint32_t sectors, uint8_t writer)
+{
+    for (uint32_t i = 0; i < sectors; ++i) {
+        uint64_t *entry = shadow_disk_lookup(shadow_disk, lba + i, true);
+        if (entry == NULL) {
+            return -1;
+        }
+
+        const uint8_t *sector = (const uint8_t *)data + (size_t)i * SHADOW_DISK_SECTOR_SIZE;
+        *entry = shadow_disk_hash(sector) | writer;
+    }
+
+    return 0;
+}
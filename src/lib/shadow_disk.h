@@ -0,0 +1,94 @@
+/** @file */
+
+#ifndef SHADOW_DISK_H
+#define SHADOW_DISK_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SHADOW_DISK_SECTOR_SIZE 512 /**< Size of a sector, in bytes */
+
+typedef struct _shadow_disk shadow_disk_t; /**< Shadow disk. */
+
+typedef void shadow_disk_error_handler_t(int status, int error, const char *restrict format, va_list ap);
+
+/**
+ * Checks that the data read from the sectors matches what was last written to
+ * them. The sectors that haven't been written (or whose contents are unknown)
+ * aren't checked.
+ *
+ * @param [in] shadow_disk Shadow disk.
+ * @param [in] lba Logical block address (LBA) of the first sector.
+ * @param [in] data Data read.
+ * @param [in] sectors Number of sectors.
+ * @param [out] mismatch_lba LBA of the first sector that doesn't match.
+ * @param [out] writer Command code that last wrote the sector that doesn't
+ *   match.
+ * @return Returns true if the data matches; otherwise, returns false.
+ */
+bool shadow_disk_check(shadow_disk_t *restrict shadow_disk, uint64_t lba, const void *data, uint32_t sectors,
+        uint64_t *restrict mismatch_lba, uint8_t *restrict writer);
+
+/**
+ * Forgets the contents of all the sectors (e.g., after a command that may have
+ * written anywhere).
+ *
+ * @param [in] shadow_disk Shadow disk.
+ */
+void shadow_disk_clear(shadow_disk_t *restrict shadow_disk);
+
+/**
+ * Creates a shadow disk, which keeps a 64-bit hash of each written sector in a
+ * sparse radix tree keyed by the LBA.
+ *
+ * @return Shadow disk.
+ */
+shadow_disk_t *shadow_disk_create();
+
+/**
+ * Destroys the shadow disk.
+ *
+ * @param [in] shadow_disk Shadow disk.
+ */
+void shadow_disk_destroy(shadow_disk_t *restrict shadow_disk);
+
+/**
+ * Forgets the contents of the sectors (e.g., after a write that failed).
+ *
+ * @param [in] shadow_disk Shadow disk.
+ * @param [in] lba Logical block address (LBA) of the first sector.
+ * @param [in] sectors Number of sectors.
+ */
+void shadow_disk_forget(shadow_disk_t *restrict shadow_disk, uint64_t lba, uint32_t sectors);
+
+/**
+ * Sets the error handler for the shadow disks.
+ *
+ * @param [in] handler Error handler.
+ * @return Previous error handler.
+ */
+shadow_disk_error_handler_t *shadow_disk_set_error_handler(shadow_disk_error_handler_t *handler);
+
+/**
+ * Records the data written to the sectors.
+ *
+ * @param [in] shadow_disk Shadow disk.
+ * @param [in] lba Logical block address (LBA) of the first sector.
+ * @param [in] data Data written.
+ * @param [in] sectors Number of sectors.
+ * @param [in] writer Command code that wrote the sectors.
+ * @return Returns zero on success; otherwise, returns -1 on failure.
+ */
+int shadow_disk_write(
+        shadow_disk_t *restrict shadow_disk, uint64_t lba, const void *data, uint32_t sectors, uint8_t writer);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SHADOW_DISK_H */
@@ -0,0 +1,30 @@
+/** @file */
+
+#ifndef TSC_H
+#define TSC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/**
+ * Reads the time-stamp counter (TSC).
+ *
+ * @return Time-stamp counter, in cycles.
+ */
+static inline uint64_t
+tsc_read(void)
+{
+    uint32_t low;
+    uint32_t high;
+    asm volatile("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TSC_H */
@@ -0,0 +1,120 @@
+/** @file */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "lib/binlog.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define usage() \
+    fprintf(stderr, \
+            "Usage: %s [OPTION]... [FILE]...\n" \
+            "Convert the binary logs of atafuzzer in FILE(s) to JSON, a line per record.\n" \
+            "With no FILE, or when FILE is -, read the standard input.\n" \
+            "Options:\n" \
+            "  -h, --help            Display help information and exit.\n" \
+            "  -o, --output=FILE     Specify the output file name.\n" \
+            "      --version         Display version information and exit.\n", \
+            "atafuzzer-logdump")
+
+#define version() fprintf(stderr, "%s\n", PACKAGE_STRING)
+
+void
+default_error_handler(int status, int error, const char *restrict format, va_list ap)
+{
+    fflush(stdout);
+    vfprintf(stderr, format, ap);
+    if (error != 0) {
+        fprintf(stderr, ": %s\n", strerror(error));
+    }
+
+    fflush(stderr);
+}
+
+int
+main(int argc, char *argv[])
+{
+    int c = 0;
+    enum
+    {
+        OPT_VERSION = CHAR_MAX + 1,
+    };
+    /* clang-format off */
+    static struct option longopts[] = {
+        {"help",    no_argument,       NULL, 'h'         },
+        {"output",  required_argument, NULL, 'o'         },
+        {"version", no_argument,       NULL, OPT_VERSION },
+        {NULL,      0,                 NULL, 0           }
+    };
+    /* clang-format on */
+    static int longindex = 0;
+    char *output = NULL;
+    while ((c = getopt_long(argc, argv, "ho:", longopts, &longindex)) != -1) {
+        switch (c) {
+        case 'h':
+            usage();
+            exit(EXIT_FAILURE);
+
+        case 'o':
+            output = optarg;
+            break;
+
+        case OPT_VERSION:
+            version();
+            exit(EXIT_FAILURE);
+
+        default:
+            usage();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    FILE *out = stdout;
+    if (output != NULL) {
+        out = fopen(output, "w");
+        if (out == NULL) {
+            perror("fopen");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    binlog_set_error_handler(default_error_handler);
+    int status = EXIT_SUCCESS;
+    int i = optind;
+    do {
+        const char *input = (i < argc) ? argv[i] : "-";
+        FILE *in = stdin;
+        if (strcmp(input, "-") != 0) {
+            in = fopen(input, "r");
+            if (in == NULL) {
+                perror("fopen");
+                status = EXIT_FAILURE;
+                continue;
+            }
+        }
+
+        if (binlog_dump(in, out) == -1) {
+            fprintf(stderr, "%s: Invalid binary log.\n", input);
+            status = EXIT_FAILURE;
+        }
+
+        if (in != stdin) {
+            fclose(in);
+        }
+    } while (++i < argc);
+
+    if (fclose(out) == EOF) {
+        perror("fclose");
+        exit(EXIT_FAILURE);
+    }
+
+    exit(status);
+}
@@ -7,16 +7,25 @@
 #include "../lib/error.h"
 #include "lib/ata_controller.h"
 #include "lib/ata_fuzzer.h"
+#include "lib/binlog.h"
+#include "lib/blob_store.h"
+#include "lib/io_stats.h"
+#include "lib/irq.h"
+#include "lib/latency.h"
+#include "lib/leak_scanner.h"
+#include "lib/pci_backend.h"
+#include "lib/shadow_disk.h"
 
 #include <errno.h>
 #include <getopt.h>
 #include <limits.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
 
 #include <sys/io.h>
 #include <unistd.h>
@@ -35,11 +44,34 @@
             "                        secondary. (The default is 0.)\n" \
             "      --device-num=NUM  Specify the ATA device number. Use 0 for Device 0, or 1\n" \
             "                        for Device 1. (The default is 0.)\n" \
+            "      --backend=NAME    Specify the backend used to access the ATA/IDE\n" \
+            "                        controller. Use io for the I/O port instructions, port\n" \
+            "                        for /dev/port, or sysfs for the sysfs resource files.\n" \
+            "                        (The default is io.)\n" \
+            "      --record=FILE     Record every access to the ATA/IDE controller to FILE.\n" \
+            "      --no-shadow=NAME  Read the register from the device instead of from the\n" \
+            "                        shadow. Use device for the Device register, or\n" \
+            "                        bm-command for the Bus Master IDE Command register.\n" \
+            "      --resources=FILE  Load the regions of the ATA/IDE controller from FILE if\n" \
+            "                        saved for the same device, or else save them to FILE.\n" \
+            "      --stats=FILE      Count the register accesses of each command, write a\n" \
+            "                        summary to the standard error, and write them to FILE\n" \
+            "                        as JSON on exit.\n" \
+            "      --irq             Wait for the interrupts of the ATA/IDE controller\n" \
+            "                        through its UIO device (e.g., uio_pci_generic)\n" \
+            "                        instead of polling the status. The ATA channel\n" \
+            "                        must be in native-PCI mode.\n" \
+            "      --adaptive-timeout=NUM\n" \
+            "                        Learn the timeout of each command and transfer size\n" \
+            "                        as NUM times its 99.9th percentile latency, between\n" \
+            "                        1 ms and the timeout.\n" \
             "  -d, --debug           Enable debug mode.\n" \
             "  -g, --generate        Use the pseudorandom number generator (i.e., random())\n" \
             "                        for input generation.\n" \
             "  -h, --help            Display help information and exit.\n" \
-            "  -o, --output=FILE     Specify the output file name.\n" \
+            "  -o, --output=FILE     Specify the output file name. The log is binary; use\n" \
+            "                        atafuzzer-logdump to convert it to JSON. The payloads\n" \
+            "                        written are stored in FILE.blobs, by hash.\n" \
             "  -q, --quiet           Enable quiet mode.\n" \
             "  -s, --seed=NUM        Specify the seed for the pseudorandom number generator.\n" \
             "                        (The default is 1.)\n" \
@@ -51,6 +83,38 @@
 
 #define version() fprintf(stderr, "%s\n", PACKAGE_STRING)
 
+/* Shortest adaptive timeout, in nanoseconds */
+#define MIN_TIMEOUT 1000000
+/* Canary planted in the data before the device returns it. It is fixed, so
+   that the findings can be reproduced. */
+#define LEAK_CANARY 0xcafef00dd15ea5e5ULL
+
+volatile sig_atomic_t is_interrupted = 0;
+/* Binary log that default_log_handler writes to */
+binlog_t *binlog = NULL;
+/* Blob store of the payloads that the binary log refers to, next to it */
+blob_store_t *blob_store = NULL;
+
+/* Input of the next iteration, which is generated while the device is busy */
+struct next_input {
+    uint8_t *buf;
+    size_t size;
+    bool is_generated;
+};
+
+void random_buf(void *buf, size_t size);
+
+void
+default_commit_handler(FILE *restrict stream)
+{
+    /* Sync the payloads first, so that the log never refers to a lost one */
+    if (blob_store != NULL) {
+        blob_store_sync(blob_store);
+    }
+
+    binlog_sync(binlog);
+}
+
 void
 default_error_handler(int status, int error, const char *restrict format, va_list ap)
 {
@@ -67,65 +131,32 @@ default_error_handler(int status, int error, const char *restrict format, va_lis
 void
 default_log_handler(FILE *restrict stream, const char *restrict format, va_list ap)
 {
-    flockfile(stream);
-    fprintf(stream, "{ ");
-    fprintf(stream, "\"time\": %d,", (unsigned int)time(NULL));
-    for (size_t i = 0; format[i] != '\0'; ++i) {
-        if (i > 0) {
-            fprintf(stream, ", ");
-        }
-
-        fprintf(stream, "\"%s\": ", va_arg(ap, char *));
-        switch (format[i]) {
-        case 'c':
-            fprintf(stream, "\"%c\"", va_arg(ap, int));
-            break;
-
-        case 'd':
-            fprintf(stream, "%d", va_arg(ap, int));
-            break;
-
-        case 'f':
-            fprintf(stream, "%f", va_arg(ap, double));
-            break;
-
-        case 'o':
-            fprintf(stream, "%o", va_arg(ap, unsigned int));
-            break;
-
-        case 'p':
-            fprintf(stream, "%p", va_arg(ap, void *));
-            break;
-
-        case 'q':
-            fprintf(stream, "%llu", va_arg(ap, unsigned long long int));
-            break;
-
-        case 's':
-            fprintf(stream, "\"%s\"", va_arg(ap, char *));
-            break;
-
-        case 'u':
-            fprintf(stream, "%u", va_arg(ap, unsigned int));
-            break;
-
-        case 'x':
-            fprintf(stream, "%x", va_arg(ap, unsigned int));
-            break;
-
-        case 'z':
-            fprintf(stream, "%zu", va_arg(ap, size_t));
-            break;
+    /* Sync a finding at once, since the next command may bring down the
+       machine */
+    va_list aq;
+    va_copy(aq, ap);
+    bool is_finding = (format[0] != '\0' && strcmp(va_arg(aq, const char *), "finding") == 0);
+    va_end(aq);
+    binlog_write(binlog, format, ap);
+    if (is_finding) {
+        default_commit_handler(stream);
+    }
+}
 
-        default:
-            abort();
-        }
+void
+generate_next_input(void *arg)
+{
+    struct next_input *next_input = (struct next_input *)arg;
+    if (!next_input->is_generated) {
+        random_buf(next_input->buf, next_input->size);
+        next_input->is_generated = true;
     }
+}
 
-    fprintf(stream, " }\n");
-    fflush(stream);
-    fsync(fileno(stream));
-    funlockfile(stream);
+void
+interrupt_handler(int signum)
+{
+    is_interrupted = 1;
 }
 
 void
@@ -150,22 +181,38 @@ main(int argc, char *argv[])
         OPT_VERSION = CHAR_MAX + 1,
         OPT_BUS_NUM,
         OPT_DEVICE_NUM,
+        OPT_BACKEND,
+        OPT_RECORD,
+        OPT_NO_SHADOW,
+        OPT_RESOURCES,
+        OPT_STATS,
+        OPT_IRQ,
+        OPT_ADAPTIVE_TIMEOUT,
     };
     /* clang-format off */
     static struct option longopts[] = {
-        {"bus",         required_argument, NULL, 'B'             },
-        {"device",      required_argument, NULL, 'D'             },
-        {"function",    required_argument, NULL, 'F'             },
-        {"debug",       no_argument,       NULL, 'd'             },
-        {"generate",    no_argument,       NULL, 'g'             },
-        {"help",        no_argument,       NULL, 'h'             },
-        {"output",      required_argument, NULL, 'o'             },
-        {"quiet",       no_argument,       NULL, 'q'             },
-        {"seed",        required_argument, NULL, 's'             },
-        {"timeout",     required_argument, NULL, 't'             },
-        {"verbose",     no_argument,       NULL, 'v'             },
-        {"version",     no_argument,       NULL, OPT_VERSION     },
-        {NULL,          0,                 NULL, 0               }
+        {"bus",              required_argument, NULL, 'B'                  },
+        {"device",           required_argument, NULL, 'D'                  },
+        {"function",         required_argument, NULL, 'F'                  },
+        {"debug",            no_argument,       NULL, 'd'                  },
+        {"generate",         no_argument,       NULL, 'g'                  },
+        {"help",             no_argument,       NULL, 'h'                  },
+        {"output",           required_argument, NULL, 'o'                  },
+        {"quiet",            no_argument,       NULL, 'q'                  },
+        {"seed",             required_argument, NULL, 's'                  },
+        {"timeout",          required_argument, NULL, 't'                  },
+        {"verbose",          no_argument,       NULL, 'v'                  },
+        {"version",          no_argument,       NULL, OPT_VERSION          },
+        {"bus-num",          required_argument, NULL, OPT_BUS_NUM          },
+        {"device-num",       required_argument, NULL, OPT_DEVICE_NUM       },
+        {"backend",          required_argument, NULL, OPT_BACKEND          },
+        {"record",           required_argument, NULL, OPT_RECORD           },
+        {"no-shadow",        required_argument, NULL, OPT_NO_SHADOW        },
+        {"resources",        required_argument, NULL, OPT_RESOURCES        },
+        {"stats",            required_argument, NULL, OPT_STATS            },
+        {"irq",              no_argument,       NULL, OPT_IRQ              },
+        {"adaptive-timeout", required_argument, NULL, OPT_ADAPTIVE_TIMEOUT },
+        {NULL,               0,                 NULL, 0                    }
     };
     /* clang-format on */
     static int longindex = 0;
@@ -174,6 +221,14 @@ main(int argc, char *argv[])
     unsigned long function = 0;
     unsigned long bus_num = 0;
     unsigned long device_num = 0;
+    char *backend = "io";
+    char *record = NULL;
+    char *resources = NULL;
+    char *stats = NULL;
+    int use_irq = 0;
+    double adaptive_timeout = 0;
+    int shadow_device = 1;
+    int shadow_bm_command = 1;
     int debug = 0;
     int generate = 0;
     char *input = NULL;
@@ -259,6 +314,58 @@ main(int argc, char *argv[])
 
             break;
 
+        case OPT_BACKEND:
+            if (strcmp(optarg, "io") != 0 && strcmp(optarg, "port") != 0 && strcmp(optarg, "sysfs") != 0) {
+                fprintf(stderr, "%s: Invalid backend.\n", __func__);
+                exit(EXIT_FAILURE);
+            }
+
+            backend = optarg;
+            break;
+
+        case OPT_RECORD:
+            record = optarg;
+            break;
+
+        case OPT_RESOURCES:
+            resources = optarg;
+            break;
+
+        case OPT_STATS:
+            stats = optarg;
+            break;
+
+        case OPT_IRQ:
+            use_irq = 1;
+            break;
+
+        case OPT_ADAPTIVE_TIMEOUT:
+            errno = 0;
+            adaptive_timeout = strtod(optarg, NULL);
+            if (errno != 0) {
+                perror("strtod");
+                exit(EXIT_FAILURE);
+            }
+
+            if (adaptive_timeout <= 0) {
+                fprintf(stderr, "%s: Invalid factor.\n", __func__);
+                exit(EXIT_FAILURE);
+            }
+
+            break;
+
+        case OPT_NO_SHADOW:
+            if (strcmp(optarg, "device") == 0) {
+                shadow_device = 0;
+            } else if (strcmp(optarg, "bm-command") == 0) {
+                shadow_bm_command = 0;
+            } else {
+                fprintf(stderr, "%s: Invalid register.\n", __func__);
+                exit(EXIT_FAILURE);
+            }
+
+            break;
+
         case 'd':
             debug = 1;
             break;
@@ -322,19 +429,81 @@ main(int argc, char *argv[])
         }
     }
 
-    if (iopl(3) == -1) {
-        perror("iopl");
+    pci_backend_set_error_handler(default_error_handler);
+    pci_backend_t *pci_backend = NULL;
+    if (strcmp(backend, "io") == 0) {
+        if (iopl(3) == -1) {
+            perror("iopl");
+            exit(EXIT_FAILURE);
+        }
+
+        pci_backend = pci_backend_create_io(bus, device, function);
+    } else if (strcmp(backend, "port") == 0) {
+        pci_backend = pci_backend_create_dev_port(bus, device, function);
+    } else {
+        pci_backend = pci_backend_create_sysfs(bus, device, function);
+    }
+
+    if (pci_backend == NULL) {
+        perror("pci_backend_create");
+        fclose(stream);
         exit(EXIT_FAILURE);
     }
 
+    /* Load the resources of the regions saved by a previous run, so they don't
+       have to be discovered again. */
+    int is_resources_loaded = 0;
+    if (resources != NULL) {
+        FILE *resources_stream = fopen(resources, "r");
+        if (resources_stream != NULL) {
+            is_resources_loaded = (pci_backend_load_resources(pci_backend, resources_stream) == 0);
+            fclose(resources_stream);
+        }
+    }
+
+    FILE *record_stream = NULL;
+    pci_backend_t *record_backend = NULL;
+    if (record != NULL) {
+        record_stream = fopen(record, "a+");
+        if (record_stream == NULL) {
+            perror("fopen");
+            exit(EXIT_FAILURE);
+        }
+
+        record_backend = pci_backend_create_record(pci_backend, record_stream);
+        if (record_backend == NULL) {
+            perror("pci_backend_create_record");
+            exit(EXIT_FAILURE);
+        }
+    }
+
     ata_controller_set_error_handler(default_error_handler);
-    ata_controller_t *ata_controller = ata_controller_create(bus, device, function, bus_num, timeout);
+    ata_controller_t *ata_controller
+            = ata_controller_create(record_backend != NULL ? record_backend : pci_backend, bus_num, timeout);
     if (ata_controller == NULL) {
         perror("ata_controller_create");
         fclose(stream);
         exit(EXIT_FAILURE);
     }
 
+    if (resources != NULL && !is_resources_loaded) {
+        FILE *resources_stream = fopen(resources, "w");
+        if (resources_stream != NULL) {
+            pci_backend_save_resources(pci_backend, resources_stream);
+            fclose(resources_stream);
+        } else {
+            perror("fopen");
+        }
+    }
+
+    ata_controller_set_register_shadowed(ata_controller, ATA_CONTROLLER_REGISTER_DEVICE, shadow_device);
+    ata_controller_set_register_shadowed(ata_controller, ATA_CONTROLLER_REGISTER_BM_IDE_COMMAND, shadow_bm_command);
+
+    io_stats_t *io_stats = NULL;
+    irq_t *irq = NULL;
+    latency_t *latency = NULL;
+    shadow_disk_t *shadow_disk = NULL;
+    leak_scanner_t *leak_scanner = NULL;
     ata_fuzzer_set_error_handler(default_error_handler);
     ata_fuzzer_t *ata_fuzzer = ata_fuzzer_create(ata_controller, device_num);
     if (ata_fuzzer == NULL) {
@@ -342,21 +511,123 @@ main(int argc, char *argv[])
         goto err;
     }
 
+    io_stats_set_error_handler(default_error_handler);
+    if (stats != NULL) {
+        io_stats = io_stats_create();
+        if (io_stats == NULL) {
+            perror("io_stats_create");
+            goto err;
+        }
+
+        ata_controller_set_io_stats(ata_controller, io_stats);
+    }
+
+    irq_set_error_handler(default_error_handler);
+    if (use_irq) {
+        /* The UIO driver delivers only the PCI interrupt (INTx), while a
+           channel in compatibility mode interrupts on ISA IRQ 14 or 15 */
+        if (!ata_controller_is_native(ata_controller)) {
+            fprintf(stderr, "%s: --irq requires the ATA channel to be in native-PCI mode.\n", __func__);
+            goto err;
+        }
+
+        irq = irq_create(bus, device, function);
+        if (irq == NULL) {
+            perror("irq_create");
+            goto err;
+        }
+
+        ata_controller_set_irq(ata_controller, irq);
+    }
+
+    latency_set_error_handler(default_error_handler);
+    if (adaptive_timeout > 0) {
+        latency = latency_create(adaptive_timeout, MIN_TIMEOUT, (uint64_t)timeout * 1000000000);
+        if (latency == NULL) {
+            perror("latency_create");
+            goto err;
+        }
+
+        ata_controller_set_latency(ata_controller, latency);
+    }
+
+    /* Check the sectors read against the sectors written */
+    shadow_disk_set_error_handler(default_error_handler);
+    shadow_disk = shadow_disk_create();
+    if (shadow_disk == NULL) {
+        perror("shadow_disk_create");
+        goto err;
+    }
+
+    ata_fuzzer_set_shadow_disk(ata_fuzzer, shadow_disk);
+    /* Scan the data returned by the device for leaks */
+    leak_scanner_set_error_handler(default_error_handler);
+    leak_scanner = leak_scanner_create(LEAK_CANARY);
+    if (leak_scanner == NULL) {
+        perror("leak_scanner_create");
+        goto err;
+    }
+
+    ata_fuzzer_set_leak_scanner(ata_fuzzer, leak_scanner);
+
+    /* Log in binary, to be converted by atafuzzer-logdump */
+    binlog_set_error_handler(default_error_handler);
+    binlog = binlog_create(stream);
+    if (binlog == NULL) {
+        perror("binlog_create");
+        goto err;
+    }
+
+    /* Store the payloads of the commands that write data, so that they can
+       be replayed */
+    if (output != NULL) {
+        char blobs[PATH_MAX];
+        snprintf(blobs, sizeof(blobs), "%s.blobs", output);
+        blob_store_set_error_handler(default_error_handler);
+        blob_store = blob_store_create(blobs);
+        if (blob_store == NULL) {
+            perror("blob_store_create");
+            goto err;
+        }
+
+        ata_fuzzer_set_blob_store(ata_fuzzer, blob_store);
+    }
+
     ata_fuzzer_set_log_handler(ata_fuzzer, default_log_handler);
     ata_fuzzer_set_log_stream(ata_fuzzer, stream);
+    ata_fuzzer_set_commit_handler(ata_fuzzer, default_commit_handler);
     if (generate) {
+        /* Finish the current iteration on the first interrupt, so the
+           statistics can be written. */
+        struct sigaction action = { 0 };
+        action.sa_handler = interrupt_handler;
+        action.sa_flags = SA_RESETHAND;
+        sigaction(SIGINT, &action, NULL);
+        sigaction(SIGTERM, &action, NULL);
         srandom(seed);
-        for (;;) {
-            uint8_t buf[ATA_FUZZER_MAX_INPUT];
-            random_buf(buf, sizeof(buf));
-            FILE *stream = fmemopen(buf, sizeof(buf), "r");
+        /* Alternate between two inputs: the next one is generated while the
+           device is busy with the current one */
+        static uint8_t bufs[2][ATA_FUZZER_MAX_INPUT];
+        int buf_num = 0;
+        struct next_input next_input = { bufs[buf_num], sizeof(bufs[buf_num]), false };
+        generate_next_input(&next_input);
+        ata_controller_set_idle_handler(ata_controller, generate_next_input, &next_input);
+        uint64_t iteration = 0;
+        while (!is_interrupted) {
+            next_input.buf = bufs[!buf_num];
+            next_input.is_generated = false;
+            FILE *stream = fmemopen(bufs[buf_num], sizeof(bufs[buf_num]), "r");
             if (stream == NULL) {
                 perror("fmemopen");
                 goto err;
             }
 
+            binlog_set_iteration(binlog, iteration++);
             ata_fuzzer_iterate(ata_fuzzer, stream);
+            io_stats_commit(io_stats);
             fclose(stream);
+            generate_next_input(&next_input);
+            buf_num = !buf_num;
         }
     } else {
         if (argv[optind] != NULL) {
@@ -373,17 +644,56 @@ main(int argc, char *argv[])
         }
 
         ata_fuzzer_iterate(ata_fuzzer, stream);
+        io_stats_commit(io_stats);
         fclose(stream);
     }
 
+    if (io_stats != NULL) {
+        io_stats_print(io_stats, stderr);
+        FILE *stats_stream = fopen(stats, "w");
+        if (stats_stream == NULL) {
+            perror("fopen");
+            goto err;
+        }
+
+        io_stats_dump(io_stats, stats_stream);
+        fclose(stats_stream);
+    }
+
     ata_fuzzer_destroy(ata_fuzzer);
+    io_stats_destroy(io_stats);
     ata_controller_destroy(ata_controller);
+    irq_destroy(irq);
+    latency_destroy(latency);
+    shadow_disk_destroy(shadow_disk);
+    leak_scanner_destroy(leak_scanner);
+    blob_store_destroy(blob_store);
+    binlog_destroy(binlog);
+    pci_backend_destroy(record_backend);
+    pci_backend_destroy(pci_backend);
+    if (record_stream != NULL) {
+        fclose(record_stream);
+    }
+
     fclose(stream);
     exit(EXIT_SUCCESS);
 
 err:
     ata_fuzzer_destroy(ata_fuzzer);
+    io_stats_destroy(io_stats);
     ata_controller_destroy(ata_controller);
+    irq_destroy(irq);
+    latency_destroy(latency);
+    shadow_disk_destroy(shadow_disk);
+    leak_scanner_destroy(leak_scanner);
+    blob_store_destroy(blob_store);
+    binlog_destroy(binlog);
+    pci_backend_destroy(record_backend);
+    pci_backend_destroy(pci_backend);
+    if (record_stream != NULL) {
+        fclose(record_stream);
+    }
+
     fclose(stream);
     exit(EXIT_FAILURE);
 }